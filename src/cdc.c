@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "structures.h"
+#include "fonctions.h"
+#include "crc32c.h"
+#include "dedup.h"
+#include "cdc.h"
+
+/*
+ * Decoupage en morceaux definis par le contenu (FastCDC). Une empreinte
+ * glissante « gear » (decalage d'un bit et ajout d'une valeur tiree au hasard
+ * par octet) coupe la ou ses bits de masque sont nuls : une insertion ne
+ * deplace que les coupures voisines, les morceaux suivants restent
+ * identiques. Le masque est plus exigeant avant CDC_AVG qu'apres
+ * (normalisation), ce qui resserre les tailles autour de CDC_AVG, et les
+ * CDC_MIN premiers octets d'un morceau ne sont pas examines.
+ */
+
+#define CDC_MASK_S 0x0003590703530000ULL   // 15 bits, avant CDC_AVG
+#define CDC_MASK_L 0x0000d90003530000ULL   // 11 bits, ensuite
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+//Table fixe (splitmix64) : les coupures ne dependent que du contenu
+static void gear_setup() {
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+//Longueur du premier morceau de src (len octets restants)
+uint32_t cdc_cut(const void *src, uint32_t len) {
+    pthread_once(&gear_once, gear_setup);
+    const uint8_t *o = src;
+    if (len <= CDC_MIN)
+        return len;
+    uint32_t fin = len < CDC_MAX ? len : CDC_MAX;
+    uint32_t normal = fin < CDC_AVG ? fin : CDC_AVG;
+    uint64_t fp = 0;
+    uint32_t i = CDC_MIN;
+    for (; i < normal; i++) {
+        fp = (fp << 1) + gear[o[i]];
+        if (!(fp & CDC_MASK_S))
+            return i + 1;
+    }
+    for (; i < fin; i++) {
+        fp = (fp << 1) + gear[o[i]];
+        if (!(fp & CDC_MASK_L))
+            return i + 1;
+    }
+    return fin;
+}
+
+/* --- Table des morceaux --- */
+
+static uint32_t map_home(const chunk_map *m, uint32_t key) {
+    return (key * 2654435761u) & (m->cap - 1);
+}
+
+static void map_put(chunk_map *m, uint32_t key, int32_t val) {
+    //Au plus 3/4 de cases prises
+    if ((uint64_t)(m->nb + 1) * 4 > (uint64_t)m->cap * 3) {
+        chunk_map ancienne = *m;
+        m->cap = m->cap ? m->cap * 2 : 1024;
+        m->keys = malloc(m->cap * sizeof(uint32_t));
+        m->vals = malloc(m->cap * sizeof(int32_t));
+        memset(m->vals, 0xFF, m->cap * sizeof(int32_t));
+        m->nb = 0;
+        for (uint32_t i = 0; i < ancienne.cap; i++) {
+            if (ancienne.vals[i] != -1)
+                map_put(m, ancienne.keys[i], ancienne.vals[i]);
+        }
+        free(ancienne.keys);
+        free(ancienne.vals);
+    }
+    uint32_t h = map_home(m, key);
+    while (m->vals[h] != -1)
+        h = (h + 1) & (m->cap - 1);
+    m->keys[h] = key;
+    m->vals[h] = val;
+    m->nb++;
+}
+
+//Retirer la paire (key, val), en remontant les suivantes (pas de cases mortes)
+static void map_del(chunk_map *m, uint32_t key, int32_t val) {
+    if (m->cap == 0)
+        return;
+    uint32_t masque = m->cap - 1, i = map_home(m, key);
+    while (m->vals[i] != -1 && (m->keys[i] != key || m->vals[i] != val))
+        i = (i + 1) & masque;
+    if (m->vals[i] == -1)
+        return;
+    m->nb--;
+    for (;;) {
+        m->vals[i] = -1;
+        uint32_t j = i;
+        for (;;) {
+            j = (j + 1) & masque;
+            if (m->vals[j] == -1)
+                return;
+            //L'element en j peut remonter en i si sa place d'origine n'est pas dans ]i, j]
+            uint32_t k = map_home(m, m->keys[j]);
+            if (j > i ? (k <= i || k > j) : (k <= i && k > j))
+                break;
+        }
+        m->keys[i] = m->keys[j];
+        m->vals[i] = m->vals[j];
+        i = j;
+    }
+}
+
+static uint32_t chunk_blocks(uint32_t len) {
+    return (len + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+}
+
+//Ajouter un morceau stocke d'un seul tenant a partir du bloc start
+void chunk_insert(filesystem *p, uint32_t crc, uint32_t len, uint32_t start) {
+    chunk_table *t = &p->chunks;
+    if (len == 0)
+        return;
+    //Le meme morceau peut etre ajoute par plusieurs recettes
+    for (uint32_t h = map_home(&t->by_crc, crc); t->by_crc.nb && t->by_crc.vals[h] != -1;
+         h = (h + 1) & (t->by_crc.cap - 1)) {
+        chunk_entry *e = &t->entries[t->by_crc.vals[h]];
+        if (t->by_crc.keys[h] == crc && e->len == len && e->start == start)
+            return;
+    }
+    uint32_t idx;
+    if (t->nb_libres > 0)
+        idx = t->libres[--t->nb_libres];
+    else {
+        if (t->nb_entries == t->cap_entries) {
+            t->cap_entries = t->cap_entries ? t->cap_entries * 2 : 256;
+            t->entries = realloc(t->entries, t->cap_entries * sizeof(chunk_entry));
+            t->libres = realloc(t->libres, t->cap_entries * sizeof(uint32_t));
+        }
+        idx = t->nb_entries++;
+    }
+    t->entries[idx].crc = crc;
+    t->entries[idx].len = len;
+    t->entries[idx].start = start;
+    map_put(&t->by_crc, crc, idx);
+    for (uint32_t b = 0; b < chunk_blocks(len); b++)
+        map_put(&t->by_block, start + b, idx);
+}
+
+static void chunk_remove(chunk_table *t, uint32_t idx) {
+    chunk_entry *e = &t->entries[idx];
+    map_del(&t->by_crc, e->crc, idx);
+    for (uint32_t b = 0; b < chunk_blocks(e->len); b++)
+        map_del(&t->by_block, e->start + b, idx);
+    e->len = 0;
+    t->libres[t->nb_libres++] = idx;
+}
+
+//Oublier les morceaux qui occupent le bloc no (il va etre libere)
+void chunk_forget(filesystem *p, uint32_t no) {
+    chunk_map *m = &p->chunks.by_block;
+    if (m->nb == 0)
+        return;
+    uint32_t h = map_home(m, no);
+    while (m->vals[h] != -1) {
+        if (m->keys[h] == no) {
+            //La suppression deplace les cases suivantes : on repart du debut
+            chunk_remove(&p->chunks, m->vals[h]);
+            h = map_home(m, no);
+            continue;
+        }
+        h = (h + 1) & (m->cap - 1);
+    }
+}
+
+/*
+ * Premier bloc d'un morceau deja stocke avec exactement le contenu data
+ * (len octets, somme crc), 0 si aucun. Les candidats sont relus et compares.
+ */
+uint32_t chunk_find(filesystem *p, uint32_t crc, uint32_t len, const void *data) {
+    chunk_table *t = &p->chunks;
+    if (t->by_crc.nb == 0 || !p->ref_table)
+        return 0;
+    char *tampon = NULL;
+    uint32_t trouve = 0;
+    for (uint32_t h = map_home(&t->by_crc, crc); t->by_crc.vals[h] != -1 && !trouve;
+         h = (h + 1) & (t->by_crc.cap - 1)) {
+        chunk_entry *e = &t->entries[t->by_crc.vals[h]];
+        if (t->by_crc.keys[h] != crc || e->len != len)
+            continue;
+        uint32_t nb = chunk_blocks(len), sature = 0;
+        for (uint32_t b = 0; b < nb && !sature; b++)
+            sature = ref_get(p, e->start + b) >= FS_REF_MAX - 1;
+        if (sature)
+            continue;
+        if (!tampon)
+            tampon = malloc((size_t)nb * FS_BLOCK_SIZE);
+        t->compares++;
+        if (read_blocks(p, e->start, nb, tampon) == 0 && memcmp(tampon, data, len) == 0)
+            trouve = e->start;
+        else
+            t->collisions++;
+    }
+    free(tampon);
+    return trouve;
+}
+
+void chunk_reset(filesystem *p) {
+    chunk_table *t = &p->chunks;
+    free(t->entries);
+    free(t->libres);
+    free(t->by_crc.keys);
+    free(t->by_crc.vals);
+    free(t->by_block.keys);
+    free(t->by_block.vals);
+    memset(t, 0, sizeof(chunk_table));
+}
+
+void chunk_stats(filesystem *p) {
+    chunk_table *t = &p->chunks;
+    if (!(p->flags & FS_MOUNT_CDC) && t->chunks == 0)
+        return;
+    printf("Morceaux (CDC) : %u en table, %llu ecrits (%.1f Kio en moyenne), %llu reutilises (%llu Kio), "
+           "%llu comparaisons, %llu collisions de somme\n", t->nb_entries - t->nb_libres,
+           (unsigned long long)t->chunks, t->chunks ? t->bytes / 1024.0 / t->chunks : 0.0,
+           (unsigned long long)t->reused, (unsigned long long)(t->bytes_reused / 1024),
+           (unsigned long long)t->compares, (unsigned long long)t->collisions);
+}
+
+/* --- Mesure --- */
+
+static double cdc_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//Lignes de journal pseudo-aleatoires (contenu sans motif aligne sur les blocs)
+static void cdc_fill(char *buf, size_t taille, uint32_t graine) {
+    static const char *mots[8] = { "GET", "POST", "/index.html", "/api/v1/items", "200", "404",
+                                   "utilisateur", "session" };
+    size_t pos = 0;
+    uint32_t x = graine;
+    while (pos < taille) {
+        char ligne[128];
+        x = x * 1103515245u + 12345u;
+        int n = snprintf(ligne, sizeof(ligne), "%u %s %s %u %s\n", x >> 8, mots[(x >> 4) & 7],
+                         mots[(x >> 12) & 7], (x >> 16) % 5000, mots[(x >> 20) & 7]);
+        size_t k = taille - pos < (size_t)n ? taille - pos : (size_t)n;
+        memcpy(buf + pos, ligne, k);
+        pos += k;
+    }
+}
+
+/*
+ * Mesure : debit du decoupage et tailles des morceaux, puis une nouvelle
+ * version d'un fichier de mio Mio (une ligne inseree au debut, quelques
+ * octets modifies au milieu) enregistree a cote de l'ancienne, puis a sa
+ * place, sans deduplication, avec la deduplication par blocs et avec le
+ * stockage par morceaux.
+ */
+void bench_cdc(int mio) {
+    if (mio < 1)
+        mio = 1;
+    size_t taille = (size_t)mio * 1024 * 1024;
+    char *v1 = malloc(taille), *v2 = malloc(taille + 64), *relu = malloc(taille + 64);
+    cdc_fill(v1, taille, 42);
+    const char *ligne = "0 PUT /nouvelle-ligne 201 utilisateur\n";
+    size_t l = strlen(ligne);
+    memcpy(v2, ligne, l);
+    memcpy(v2 + l, v1, taille);
+    size_t taille2 = taille + l;
+    memcpy(v2 + taille2 / 2, "MODIFIE", 7);
+
+    double t0 = cdc_now();
+    uint32_t nb = 0, plus_petit = UINT32_MAX, plus_grand = 0;
+    for (size_t off = 0; off < taille; nb++) {
+        uint32_t n = cdc_cut(v1 + off, taille - off > UINT32_MAX ? UINT32_MAX : taille - off);
+        if (off + n < taille && n < plus_petit)
+            plus_petit = n;
+        if (n > plus_grand)
+            plus_grand = n;
+        off += n;
+    }
+    double duree = cdc_now() - t0;
+    printf("Decoupage FastCDC : %.0f Mio/s, %u morceaux, %.0f octets en moyenne (min %u, max %u)\n",
+           mio / (duree > 0 ? duree : 1e-9), nb, (double)taille / nb, plus_petit == UINT32_MAX ? 0 : plus_petit,
+           plus_grand);
+
+    char chemin[] = "/tmp/hebcfs-cdc-XXXXXX";
+    int fd = mkstemp(chemin);
+    if (fd == -1) {
+        perror("Erreur : image temporaire");
+        free(v1);
+        free(v2);
+        free(relu);
+        return;
+    }
+    close(fd);
+    const char *noms[3] = { "sans", "blocs (--dedup)", "morceaux (--cdc)" };
+    int flags[3] = { 0, FS_MOUNT_DEDUP, FS_MOUNT_CDC };
+    printf("%-18s %16s %16s %14s\n", "stockage", "v1 (blocs)", "v2 a cote", "v2 en place");
+    for (int m = 0; m < 3; m++) {
+        filesystem b;
+        disk_inode di[2];
+        uint32_t ino[2] = { 0, 0 };
+        memset(di, 0, sizeof(di));
+        for (int k = 0; k < 2; k++) {
+            di[k].type = FS_TYPE_FILE;
+            di[k].perms = 6;
+            di[k].links = 1;
+            di[k].parent = FS_ROOT_INODE;
+        }
+        int ok = mount_partition(&b, chemin, FS_MOUNT_SYNC_IO | FS_MOUNT_QUIET | flags[m]) >= 0 &&
+                 format_partition(&b, 3 * taille + taille / 2 + 16 * 1024 * 1024) == 0 &&
+                 (ino[0] = alloc_inode(&b)) != 0 && (ino[1] = alloc_inode(&b)) != 0;
+        uint32_t libres0 = b.sb.free_blocks, libres1 = 0, libres2 = 0;
+        double en_place = 0;
+        ok = ok && write_inode_data(&b, ino[0], &di[0], v1, taille) == 0 && write_inode(&b, ino[0], &di[0]) == 0;
+        libres1 = b.sb.free_blocks;
+        ok = ok && write_inode_data(&b, ino[1], &di[1], v2, taille2) == 0 && write_inode(&b, ino[1], &di[1]) == 0;
+        libres2 = b.sb.free_blocks;
+        if (ok) {
+            //Nouvelle version a la place de l'ancienne (l'autre copie est d'abord retiree)
+            inode_free_blocks(&b, &di[1]);
+            t0 = cdc_now();
+            ok = write_inode_data(&b, ino[0], &di[0], v2, taille2) == 0 && write_inode(&b, ino[0], &di[0]) == 0 &&
+                 sync_partition(&b) == 0;
+            en_place = cdc_now() - t0;
+        }
+        ok = ok && read_inode_data(&b, ino[0], &di[0], relu) == 0 && memcmp(relu, v2, taille2) == 0;
+        if (ok)
+            printf("%-18s %16u %16u %11.1f ms\n", noms[m], libres0 - libres1, libres1 - libres2, en_place * 1e3);
+        else
+            printf("%-18s %16s\n", noms[m], "(echec)");
+        pthread_mutex_lock(&b.lock);
+        unmount_partition(&b);
+        pthread_mutex_unlock(&b.lock);
+    }
+    unlink(chemin);
+    free(v1);
+    free(v2);
+    free(relu);
+}
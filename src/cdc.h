@@ -0,0 +1,13 @@
+uint32_t cdc_cut(const void *src, uint32_t len);
+
+void chunk_insert(filesystem *p, uint32_t crc, uint32_t len, uint32_t start);
+
+void chunk_forget(filesystem *p, uint32_t no);
+
+uint32_t chunk_find(filesystem *p, uint32_t crc, uint32_t len, const void *data);
+
+void chunk_reset(filesystem *p);
+
+void chunk_stats(filesystem *p);
+
+void bench_cdc(int mio);
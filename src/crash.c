@@ -0,0 +1,594 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "structures.h"
+#include "fonctions.h"
+#include "journal.h"
+#include "crash.h"
+#include "dedup.h"
+
+/*
+ * Banc d'essai de reprise apres coupure de courant. Une charge aleatoire
+ * (creations, reecritures, renommages, suppressions dans la racine) tourne
+ * sur la partition pendant que write_blocks et flush_device passent par la
+ * simulation (crash_sim). La coupure tombe sur un bloc ecrit au hasard ; les
+ * blocs ecrits depuis le dernier fsync sont gardes ou perdus au hasard. La
+ * partition est ensuite remontee (rejeu du journal) et verifiee : bitmaps
+ * egales aux blocs et inodes references, aucun bloc partage au-dela de ses
+ * references (deduplication), compteurs de libres exacts, et contenu
+ * identique a l'etat apres une operation k avec k au moins egal au nombre
+ * d'operations durables au moment de la coupure. Un tour de modes sur deux
+ * stocke les fichiers par morceaux (FS_MOUNT_CDC).
+ */
+
+#define CRASH_IMAGE_SIZE (8 * 1024 * 1024)
+#define CRASH_OPS 200
+#define CRASH_MAX_FILES 64
+#define CRASH_MAX_SIZE (3 * FS_BLOCK_SIZE + 100)
+
+/* --- Simulation --- */
+
+static int bloc_io(int fd, uint32_t no, void *buf, int ecriture) {
+    char *o = buf;
+    size_t reste = FS_BLOCK_SIZE;
+    off_t off = (off_t)no * FS_BLOCK_SIZE;
+    while (reste > 0) {
+        ssize_t n = ecriture ? pwrite(fd, o, reste, off) : pread(fd, o, reste, off);
+        if (n < 0)
+            return -1;
+        if (n == 0) {
+            memset(o, 0, reste); //Au-dela de la fin de l'image
+            return 0;
+        }
+        o += n;
+        off += n;
+        reste -= n;
+    }
+    return 0;
+}
+
+/*
+ * Ecriture pendant la simulation : l'ancien contenu de chaque bloc est garde
+ * jusqu'au prochain fsync. Apres la coupure, les ecritures sont ignorees.
+ */
+int crash_write(filesystem *p, uint32_t no, uint32_t nb, const void *buf) {
+    crash_sim *c = p->crash;
+    const char *src = buf;
+    for (uint32_t i = 0; i < nb && !c->cut; i++) {
+        c->writes++;
+        if (c->cut_at && c->writes >= c->cut_at) {
+            c->cut = 1;
+            break;
+        }
+        if (c->nb_undo == c->cap_undo) {
+            c->cap_undo = c->cap_undo ? c->cap_undo * 2 : 256;
+            c->undo_blocks = realloc(c->undo_blocks, c->cap_undo * sizeof(uint32_t));
+            c->undo_data = realloc(c->undo_data, (size_t)c->cap_undo * FS_BLOCK_SIZE);
+        }
+        char *ancien = c->undo_data + (size_t)c->nb_undo * FS_BLOCK_SIZE;
+        if (bloc_io(p->fd, no + i, ancien, 0) < 0 ||
+            bloc_io(p->fd, no + i, (void *)(src + (size_t)i * FS_BLOCK_SIZE), 1) < 0) {
+            perror("Erreur : ecriture simulee");
+            return -1;
+        }
+        c->undo_blocks[c->nb_undo++] = no + i;
+    }
+    return 0;
+}
+
+/*
+ * fsync simule : les blocs en attente deviennent durables (sans fsync reel).
+ * journal_commit avance ensuite durable_ops.
+ */
+int crash_flush(filesystem *p) {
+    crash_sim *c = p->crash;
+    if (c->cut)
+        return 0;
+    c->nb_undo = 0;
+    c->flushes++;
+    return 0;
+}
+
+static uint32_t crash_rand(uint32_t *etat) {
+    uint32_t x = *etat;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *etat = x ? x : 0x9E3779B9u;
+    return *etat;
+}
+
+/*
+ * Appliquer la coupure a l'image (apres sa fermeture) : chaque bloc en
+ * attente garde au hasard une de ses versions successives, ou son contenu
+ * d'avant le dernier fsync. Retourne le nombre d'ecritures perdues.
+ */
+int crash_power_off(crash_sim *c, const char *filename, uint32_t graine) {
+    int fd = open(filename, O_RDWR);
+    if (fd == -1) {
+        perror("Erreur : reouverture de l'image");
+        return -1;
+    }
+    uint32_t *gardes = malloc((c->nb_undo ? c->nb_undo : 1) * sizeof(uint32_t));
+    uint32_t nb_gardes = 0;
+    int perdues = 0;
+    //De la plus recente a la plus ancienne : une version gardee fixe le bloc
+    for (uint32_t i = c->nb_undo; i-- > 0; ) {
+        uint32_t no = c->undo_blocks[i];
+        int fixe = 0;
+        for (uint32_t k = 0; k < nb_gardes && !fixe; k++)
+            fixe = gardes[k] == no;
+        if (fixe)
+            continue;
+        if (crash_rand(&graine) & 1) {
+            gardes[nb_gardes++] = no;
+        } else {
+            bloc_io(fd, no, c->undo_data + (size_t)i * FS_BLOCK_SIZE, 1);
+            perdues++;
+        }
+    }
+    free(gardes);
+    close(fd);
+    c->nb_undo = 0;
+    return perdues;
+}
+
+void crash_sim_free(crash_sim *c) {
+    free(c->undo_blocks);
+    free(c->undo_data);
+    c->undo_blocks = NULL;
+    c->undo_data = NULL;
+    c->nb_undo = c->cap_undo = 0;
+}
+
+/* --- Charge aleatoire --- */
+
+typedef struct {
+    char name[16];
+    uint32_t ino;
+    uint64_t hash;                 // Empreinte du nom et du contenu
+} crash_file;
+
+typedef struct {
+    crash_file files[CRASH_MAX_FILES];
+    int nb;
+    uint32_t suivant;              // Pour nommer les fichiers
+} crash_model;
+
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t hash_bytes(const void *data, size_t len) {
+    const uint8_t *o = data;
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= o[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t file_hash(const char *name, const void *data, size_t len) {
+    return mix64(hash_bytes(name, strlen(name)) ^ mix64(hash_bytes(data, len) + len));
+}
+
+//Empreinte de l'etat : independante de l'ordre des fichiers
+static uint64_t model_hash(const crash_model *m) {
+    uint64_t h = 0;
+    for (int i = 0; i < m->nb; i++)
+        h += m->files[i].hash;
+    return h;
+}
+
+static int write_root(filesystem *p, const crash_model *m) {
+    disk_dirent entrees[CRASH_MAX_FILES];
+    memset(entrees, 0, sizeof(entrees));
+    for (int i = 0; i < m->nb; i++) {
+        entrees[i].inode = m->files[i].ino;
+        entrees[i].type = FS_TYPE_FILE;
+        entrees[i].name_len = strlen(m->files[i].name);
+        memcpy(entrees[i].name, m->files[i].name, entrees[i].name_len);
+    }
+    disk_inode racine;
+    if (read_inode(p, FS_ROOT_INODE, &racine) < 0 ||
+        write_inode_data(p, FS_ROOT_INODE, &racine, entrees, m->nb * sizeof(disk_dirent)) < 0)
+        return -1;
+    return write_inode(p, FS_ROOT_INODE, &racine);
+}
+
+static int write_content(filesystem *p, crash_file *f, uint32_t *rng, disk_inode *di) {
+    static char tampon[CRASH_MAX_SIZE];
+    size_t taille = crash_rand(rng) % (CRASH_MAX_SIZE + 1);
+    //Peu de motifs : des blocs identiques d'un fichier a l'autre sont partages
+    uint32_t motif = crash_rand(rng) % 8 * 0x01020304u;
+    for (size_t i = 0; i < taille; i++)
+        tampon[i] = (char)(motif >> (i % 4 * 8)) + (char)(i / 4);
+    f->hash = file_hash(f->name, tampon, taille);
+    if (write_inode_data(p, f->ino, di, tampon, taille) < 0)
+        return -1;
+    return write_inode(p, f->ino, di);
+}
+
+/*
+ * Une operation aleatoire sur la racine (p->lock tenu). Le compteur
+ * d'operations est avance avant sync_partition : un commit declenche par
+ * celle-ci rend l'operation durable.
+ */
+static int crash_op(filesystem *p, crash_model *m, uint32_t *rng) {
+    uint32_t choix = crash_rand(rng) % 10;
+    int ret = 0;
+    if (m->nb == 0 || (choix < 4 && m->nb < CRASH_MAX_FILES)) {
+        uint32_t ino = alloc_inode(p);
+        if (ino == 0)
+            return -1;
+        crash_file *f = &m->files[m->nb];
+        snprintf(f->name, sizeof(f->name), "f%u", m->suivant++);
+        f->ino = ino;
+        disk_inode di;
+        memset(&di, 0, sizeof(di));
+        di.type = FS_TYPE_FILE;
+        di.perms = 6;
+        di.links = 1;
+        di.parent = FS_ROOT_INODE;
+        m->nb++;
+        ret = write_content(p, f, rng, &di);
+        if (ret == 0)
+            ret = write_root(p, m);
+    } else {
+        int i = crash_rand(rng) % m->nb;
+        crash_file *f = &m->files[i];
+        disk_inode di;
+        if (read_inode(p, f->ino, &di) < 0)
+            return -1;
+        if (choix < 7) {
+            ret = write_content(p, f, rng, &di);
+        } else if (choix < 8) {
+            //Renommage : le contenu ne change pas, seule l'empreinte du nom
+            char *contenu = malloc(di.size + 1);
+            ret = read_inode_data(p, f->ino, &di, contenu);
+            snprintf(f->name, sizeof(f->name), "r%u", m->suivant++);
+            f->hash = file_hash(f->name, contenu, di.size);
+            free(contenu);
+            if (ret == 0)
+                ret = write_root(p, m);
+        } else {
+            uint32_t ino = f->ino;
+            m->files[i] = m->files[--m->nb];
+            ret = write_root(p, m);
+            inode_free_blocks(p, &di);
+            memset(&di, 0, sizeof(di));
+            if (ret == 0)
+                ret = write_inode(p, ino, &di);
+            free_inode(p, ino);
+        }
+    }
+    if (p->crash)
+        p->crash->ops++;
+    if (sync_partition(p) < 0)
+        ret = -1;
+    return ret;
+}
+
+/* --- Verification apres remontage --- */
+
+static int bit_lu(const uint8_t *bitmap, uint32_t i) {
+    return (bitmap[i / 8] >> (i % 8)) & 1;
+}
+
+//Marquer les blocs d'un inode ; les erreurs sont comptees dans *erreurs
+static void check_blocks(filesystem *p, uint32_t ino, const disk_inode *di, uint8_t *vus, int *erreurs) {
+    superblock *sb = &p->sb;
+    if (di->nb_extents > FS_INLINE_EXTENTS + FS_EXTENTS_PER_BLOCK) {
+        if ((*erreurs)++ < 5)
+            printf("    inode %u : %u extents\n", ino, di->nb_extents);
+        return;
+    }
+    disk_extent *ext = NULL;
+    int nb = inode_get_extents(p, di, &ext);
+    uint64_t capacite = 0;
+    for (int i = 0; i <= nb; i++) {
+        disk_extent e;
+        if (i == nb) {
+            //Le bloc d'extents est aussi un bloc de l'inode
+            if (!di->extent_block)
+                break;
+            e.start = di->extent_block;
+            e.len = 1;
+        } else {
+            e = ext[i];
+            capacite += (uint64_t)e.len * FS_BLOCK_SIZE;
+        }
+        if (e.start < sb->data_start || (uint64_t)e.start + e.len > sb->nb_blocks) {
+            if ((*erreurs)++ < 5)
+                printf("    inode %u : extent %u+%u hors de la zone de donnees\n", ino, e.start, e.len);
+            continue;
+        }
+        for (uint32_t b = e.start; b < e.start + e.len; b++) {
+            if (vus[b] > ref_get(p, b) && (*erreurs)++ < 5)
+                printf("    bloc %u partage (inode %u)\n", b, ino);
+            if (!bit_lu(p->block_bitmap, b) && (*erreurs)++ < 5)
+                printf("    bloc %u de l'inode %u libre dans la bitmap\n", b, ino);
+            if (vus[b] < 255)
+                vus[b]++;
+        }
+    }
+    if (di->size > capacite && (*erreurs)++ < 5)
+        printf("    inode %u : taille %llu > %llu octets alloues\n", ino,
+               (unsigned long long)di->size, (unsigned long long)capacite);
+    free(ext);
+}
+
+/*
+ * Verifier une partition montee. *etat recoit l'empreinte du contenu.
+ * Retourne le nombre d'incoherences.
+ */
+static int crash_check(filesystem *p, uint64_t *etat) {
+    superblock *sb = &p->sb;
+    int erreurs = 0;
+    uint8_t *vus = calloc(sb->nb_blocks, 1);
+    uint8_t *inodes_vus = calloc(sb->nb_inodes, 1);
+    *etat = 0;
+    disk_inode racine;
+    if (read_inode(p, FS_ROOT_INODE, &racine) < 0 || racine.type != FS_TYPE_DIR ||
+        racine.size % sizeof(disk_dirent) || racine.size > CRASH_MAX_FILES * sizeof(disk_dirent)) {
+        printf("    racine illisible ou invalide\n");
+        free(vus);
+        free(inodes_vus);
+        return 1;
+    }
+    check_blocks(p, FS_ROOT_INODE, &racine, vus, &erreurs);
+    inodes_vus[FS_ROOT_INODE] = 1;
+    disk_dirent entrees[CRASH_MAX_FILES];
+    int nb = racine.size / sizeof(disk_dirent);
+    if (erreurs == 0 && read_inode_data(p, FS_ROOT_INODE, &racine, entrees) < 0)
+        erreurs++;
+    for (int i = 0; i < nb && erreurs == 0; i++) {
+        uint32_t ino = entrees[i].inode;
+        disk_inode di;
+        if (ino <= FS_ROOT_INODE || ino >= sb->nb_inodes || inodes_vus[ino] ||
+            entrees[i].name_len > FS_NAME_MAX || read_inode(p, ino, &di) < 0) {
+            if (erreurs++ < 5)
+                printf("    entree %d : inode %u invalide ou deja reference\n", i, ino);
+            continue;
+        }
+        inodes_vus[ino] = 1;
+        if (!bit_lu(p->inode_bitmap, ino) && erreurs++ < 5)
+            printf("    inode %u libre dans la bitmap\n", ino);
+        if (di.type != FS_TYPE_FILE || di.links != 1) {
+            if (erreurs++ < 5)
+                printf("    inode %u : type %u, %u liens\n", ino, di.type, di.links);
+            continue;
+        }
+        check_blocks(p, ino, &di, vus, &erreurs);
+        if (erreurs)
+            break;
+        char nom[FS_NAME_MAX + 1];
+        memcpy(nom, entrees[i].name, entrees[i].name_len);
+        nom[entrees[i].name_len] = '\0';
+        char *contenu = malloc(di.size + 1);
+        if (read_inode_data(p, ino, &di, contenu) < 0)
+            erreurs++;
+        *etat += file_hash(nom, contenu, di.size);
+        free(contenu);
+    }
+    //Tout bloc ou inode alloue doit etre reference, et reciproquement
+    uint32_t libres = 0;
+    for (uint32_t b = 0; b < sb->nb_blocks; b++) {
+        int alloue = bit_lu(p->block_bitmap, b);
+        libres += !alloue;
+        if (b >= sb->data_start && alloue && !vus[b] && erreurs++ < 5)
+            printf("    bloc %u alloue mais non reference\n", b);
+        if (vus[b] && vus[b] != ref_get(p, b) + 1 && erreurs++ < 5)
+            printf("    bloc %u reference %u fois, compteur %u\n", b, vus[b], ref_get(p, b) + 1);
+    }
+    if (libres != sb->free_blocks && erreurs++ < 5)
+        printf("    %u blocs libres, superbloc : %u\n", libres, sb->free_blocks);
+    libres = 0;
+    for (uint32_t i = 0; i < sb->nb_inodes; i++) {
+        int alloue = bit_lu(p->inode_bitmap, i);
+        libres += !alloue;
+        if (i > FS_ROOT_INODE && alloue && !inodes_vus[i] && erreurs++ < 5)
+            printf("    inode %u alloue mais non reference\n", i);
+    }
+    if (libres != sb->free_inodes && erreurs++ < 5)
+        printf("    %u inodes libres, superbloc : %u\n", libres, sb->free_inodes);
+    free(vus);
+    free(inodes_vus);
+    return erreurs;
+}
+
+/* --- Bancs d'essai --- */
+
+static double crash_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//Creer, formater et monter une image vide avec le journal actif (et la deduplication, plus flags)
+static int crash_mkfs(filesystem *p, const char *chemin, size_t taille, int durabilite, int flags) {
+    int fd = open(chemin, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Erreur : creation de l'image d'essai");
+        return -1;
+    }
+    close(fd);
+    if (mount_partition(p, chemin, FS_MOUNT_SYNC_IO | FS_MOUNT_QUIET | FS_MOUNT_DEDUP | flags) < 0 ||
+        format_partition(p, taille) < 0)
+        return -1;
+    return journal_start(p, durabilite);
+}
+
+/*
+ * Coupures aleatoires : nb_essais charges de CRASH_OPS operations, chacune
+ * coupee sur un bloc ecrit tire au hasard, puis rejeu et verification.
+ */
+void bench_crash(int nb_essais, uint32_t graine) {
+    const char *modes[3] = { "sync", "group", "async" };
+    char chemin[] = "/tmp/hebcfs-crash-XXXXXX";
+    int fd = mkstemp(chemin);
+    if (fd == -1) {
+        perror("Erreur : image temporaire");
+        return;
+    }
+    close(fd);
+    uint64_t *etats = malloc((CRASH_OPS + 1) * sizeof(uint64_t));
+    uint64_t ecritures[3] = { 0, 0, 0 }; // Blocs ecrits par une charge entiere, par mode
+    int coherents = 0;
+    double rejeu_total = 0, rejeu_max = 0;
+    printf("%5s %6s %14s %9s %9s %9s %8s %11s\n", "essai", "mode", "coupure", "ops", "durables",
+           "retrouve", "rejeu", "duree");
+    for (int essai = 0; essai < nb_essais; essai++) {
+        uint32_t rng = graine + essai * 0x9E3779B9u;
+        if (rng == 0)
+            rng = 1;
+        int mode = essai % 3;
+        filesystem part;
+        if (crash_mkfs(&part, chemin, CRASH_IMAGE_SIZE, mode, (essai / 3) % 2 ? FS_MOUNT_CDC : 0) < 0) {
+            printf("Essai %d : impossible de preparer l'image.\n", essai);
+            break;
+        }
+        crash_sim sim;
+        memset(&sim, 0, sizeof(sim));
+        //Le premier essai de chaque mode mesure le nombre d'ecritures d'une charge entiere
+        sim.cut_at = ecritures[mode] ? 1 + crash_rand(&rng) % ecritures[mode] : 0;
+        pthread_mutex_lock(&part.lock);
+        part.crash = &sim;
+        pthread_mutex_unlock(&part.lock);
+        crash_model modele;
+        memset(&modele, 0, sizeof(modele));
+        etats[0] = 0;
+        int faites = 0;
+        while (faites < CRASH_OPS && !sim.cut) {
+            pthread_mutex_lock(&part.lock);
+            int ret = crash_op(&part, &modele, &rng);
+            pthread_mutex_unlock(&part.lock);
+            if (ret < 0 && !sim.cut) {
+                printf("Essai %d : echec d'une operation de la charge.\n", essai);
+                break;
+            }
+            etats[++faites] = model_hash(&modele);
+        }
+        //Coupure a la fin de la charge si elle n'a pas eu lieu avant
+        pthread_mutex_lock(&part.lock);
+        if (!sim.cut)
+            ecritures[mode] = sim.writes;
+        sim.cut = 1;
+        unmount_partition(&part);
+        pthread_mutex_unlock(&part.lock);
+        crash_power_off(&sim, chemin, crash_rand(&rng));
+
+        filesystem apres;
+        if (mount_partition(&apres, chemin, FS_MOUNT_SYNC_IO | FS_MOUNT_QUIET) != 0) {
+            printf("%5d %6s : remontage impossible\n", essai, modes[mode]);
+            crash_sim_free(&sim);
+            continue;
+        }
+        double rejeu = apres.journal.replay_time;
+        rejeu_total += rejeu;
+        if (rejeu > rejeu_max)
+            rejeu_max = rejeu;
+        uint64_t etat;
+        int erreurs = crash_check(&apres, &etat);
+        //L'etat retrouve doit etre celui d'apres une operation, pas avant la derniere durable
+        int retrouve = -1;
+        for (int k = faites; k >= (int)sim.durable_ops && retrouve < 0; k--) {
+            if (etats[k] == etat)
+                retrouve = k;
+        }
+        if (retrouve < 0)
+            erreurs++;
+        if (erreurs == 0)
+            coherents++;
+        char coupure[32];
+        snprintf(coupure, sizeof(coupure), "%llu/%llu", (unsigned long long)sim.writes,
+                 (unsigned long long)ecritures[mode]);
+        printf("%5d %6s %14s %9d %9llu %9d %5d tx %8.3f ms%s\n", essai, modes[mode], coupure, faites,
+               (unsigned long long)sim.durable_ops, retrouve, apres.journal.replayed, rejeu * 1e3,
+               erreurs ? "  INCOHERENT" : "");
+        pthread_mutex_lock(&apres.lock);
+        unmount_partition(&apres);
+        pthread_mutex_unlock(&apres.lock);
+        crash_sim_free(&sim);
+    }
+    printf("Coupures : %d/%d essais coherents (graine %u), rejeu moyen %.3f ms, max %.3f ms\n",
+           coherents, nb_essais, graine, nb_essais ? rejeu_total / nb_essais * 1e3 : 0.0, rejeu_max * 1e3);
+    free(etats);
+    unlink(chemin);
+}
+
+/*
+ * Duree du rejeu selon la taille de l'image : le journal est rempli de
+ * transactions validees (sans point de controle), puis le courant est coupe
+ * et l'image remontee. De 1000 inodes a max_inodes, par facteur 10.
+ */
+void bench_replay(uint32_t max_inodes) {
+    char chemin[] = "/tmp/hebcfs-replay-XXXXXX";
+    int fd = mkstemp(chemin);
+    if (fd == -1) {
+        perror("Erreur : image temporaire");
+        return;
+    }
+    close(fd);
+    printf("%10s %10s %12s %8s %12s %12s\n", "inodes", "image Mio", "journal Kio", "tx", "rejeu", "montage");
+    for (uint64_t nb_inodes = 1000; nb_inodes <= max_inodes; nb_inodes *= 10) {
+        //format_partition donne un inode pour 4 blocs
+        size_t taille = (size_t)nb_inodes * 4 * FS_BLOCK_SIZE;
+        filesystem part;
+        if (crash_mkfs(&part, chemin, taille, DURABILITY_SYNC, 0) < 0) {
+            printf("Impossible de preparer une image de %llu inodes.\n", (unsigned long long)nb_inodes);
+            break;
+        }
+        crash_sim sim;
+        memset(&sim, 0, sizeof(sim));
+        crash_model modele;
+        memset(&modele, 0, sizeof(modele));
+        uint32_t rng = 42;
+        pthread_mutex_lock(&part.lock);
+        part.crash = &sim;
+        uint64_t capacite = (uint64_t)(part.sb.journal_blocks - 1) * FS_BLOCK_SIZE;
+        //Le point de controle a lieu au-dela des trois quarts : on s'arrete avant
+        uint64_t avant = 0;
+        while (part.journal.offset < capacite * 2 / 3 && part.journal.offset >= avant) {
+            avant = part.journal.offset;
+            if (crash_op(&part, &modele, &rng) < 0)
+                break;
+        }
+        uint64_t journal = part.journal.offset;
+        sim.cut = 1;
+        unmount_partition(&part);
+        pthread_mutex_unlock(&part.lock);
+        crash_power_off(&sim, chemin, 1);
+        crash_sim_free(&sim);
+
+        filesystem apres;
+        double t0 = crash_now();
+        int ret = mount_partition(&apres, chemin, FS_MOUNT_SYNC_IO | FS_MOUNT_QUIET);
+        double montage = crash_now() - t0;
+        if (ret != 0) {
+            printf("Remontage impossible (%llu inodes).\n", (unsigned long long)nb_inodes);
+            break;
+        }
+        uint64_t etat;
+        int erreurs = crash_check(&apres, &etat);
+        printf("%10llu %10zu %12llu %8d %9.3f ms %9.3f ms%s\n", (unsigned long long)apres.sb.nb_inodes,
+               taille / (1024 * 1024), (unsigned long long)journal / 1024, apres.journal.replayed,
+               apres.journal.replay_time * 1e3, montage * 1e3, erreurs ? "  INCOHERENT" : "");
+        pthread_mutex_lock(&apres.lock);
+        unmount_partition(&apres);
+        pthread_mutex_unlock(&apres.lock);
+        if (nb_inodes > UINT32_MAX / 10)
+            break;
+    }
+    unlink(chemin);
+}
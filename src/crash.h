@@ -0,0 +1,11 @@
+int crash_write(filesystem *p, uint32_t no, uint32_t nb, const void *buf);
+
+int crash_flush(filesystem *p);
+
+int crash_power_off(crash_sim *c, const char *filename, uint32_t graine);
+
+void crash_sim_free(crash_sim *c);
+
+void bench_crash(int nb_essais, uint32_t graine);
+
+void bench_replay(uint32_t max_inodes);
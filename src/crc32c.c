@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "structures.h"
+#include "fonctions.h"
+#include "crc32c.h"
+
+/*
+ * CRC32C (polynome de Castagnoli, reflechi 0x82F63B78), celui des
+ * instructions crc32 de SSE4.2. Avec SSE4.2, un bloc est traite en trois
+ * flux entrelaces (l'instruction a une latence de 3 cycles pour un debit
+ * de 1), recombines par une table de decalage ; sinon, tables
+ * slicing-by-8 : 8 octets par tour avec 8 consultations independantes.
+ */
+
+#define CRC32C_POLY 0x82F63B78u
+#define CRC32C_LANE 1344           // Octets par flux (multiple de 8)
+
+static uint32_t crc_table[8][256];
+static uint32_t lane_shift[4][256]; // Registre apres CRC32C_LANE octets nuls
+static int crc_hw = 0;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+//Registre brut (sans inversions) apres les octets de data, un a la fois
+static uint32_t crc_bytes(uint32_t crc, const uint8_t *o, size_t len) {
+    while (len--)
+        crc = crc_table[0][(crc ^ *o++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static void crc32c_setup() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int t = 1; t < 8; t++)
+            crc_table[t][n] = (crc_table[t - 1][n] >> 8) ^ crc_table[0][crc_table[t - 1][n] & 0xFF];
+    }
+    //Le decalage est lineaire : un octet du registre a la fois
+    static const uint8_t zeros[CRC32C_LANE];
+    for (int k = 0; k < 4; k++) {
+        for (uint32_t v = 0; v < 256; v++)
+            lane_shift[k][v] = crc_bytes(v << (8 * k), zeros, CRC32C_LANE);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t shift_lane(uint32_t crc) {
+    return lane_shift[0][crc & 0xFF] ^ lane_shift[1][(crc >> 8) & 0xFF] ^
+           lane_shift[2][(crc >> 16) & 0xFF] ^ lane_shift[3][crc >> 24];
+}
+
+//Slicing-by-8 (registre brut)
+static uint32_t crc_slice8(uint32_t crc, const uint8_t *o, size_t len) {
+    while (len && ((uintptr_t)o & 7)) {
+        crc = crc_table[0][(crc ^ *o++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t mot;
+        memcpy(&mot, o, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        mot = __builtin_bswap64(mot);
+#endif
+        uint32_t bas = (uint32_t)mot ^ crc, haut = (uint32_t)(mot >> 32);
+        crc = crc_table[7][bas & 0xFF] ^ crc_table[6][(bas >> 8) & 0xFF] ^
+              crc_table[5][(bas >> 16) & 0xFF] ^ crc_table[4][bas >> 24] ^
+              crc_table[3][haut & 0xFF] ^ crc_table[2][(haut >> 8) & 0xFF] ^
+              crc_table[1][(haut >> 16) & 0xFF] ^ crc_table[0][haut >> 24];
+        o += 8;
+        len -= 8;
+    }
+    return crc_bytes(crc, o, len);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const uint8_t *o, size_t len) {
+    uint64_t c0 = crc;
+    while (len >= 3 * CRC32C_LANE) {
+        uint64_t c1 = 0, c2 = 0;
+        const uint8_t *o1 = o + CRC32C_LANE, *o2 = o + 2 * CRC32C_LANE;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t m0, m1, m2;
+            memcpy(&m0, o + i, 8);
+            memcpy(&m1, o1 + i, 8);
+            memcpy(&m2, o2 + i, 8);
+            c0 = __builtin_ia32_crc32di(c0, m0);
+            c1 = __builtin_ia32_crc32di(c1, m1);
+            c2 = __builtin_ia32_crc32di(c2, m2);
+        }
+        //crc(A.B) = decalage(crc(A)) ^ crc(B) pour le registre brut
+        c0 = shift_lane(shift_lane((uint32_t)c0) ^ (uint32_t)c1) ^ (uint32_t)c2;
+        o += 3 * CRC32C_LANE;
+        len -= 3 * CRC32C_LANE;
+    }
+    while (len >= 8) {
+        uint64_t m;
+        memcpy(&m, o, 8);
+        c0 = __builtin_ia32_crc32di(c0, m);
+        o += 8;
+        len -= 8;
+    }
+    uint32_t c = (uint32_t)c0;
+    while (len--)
+        c = __builtin_ia32_crc32qi(c, *o++);
+    return c;
+}
+#endif
+
+void crc32c_init() {
+    pthread_once(&crc_once, crc32c_setup);
+}
+
+int crc32c_hw_available() {
+    crc32c_init();
+    return crc_hw;
+}
+
+//CRC32C de data, a enchainer : crc32c(crc32c(0, a, n), b, m) = crc32c(0, a.b, n+m)
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    crc32c_init();
+#if defined(__x86_64__)
+    if (crc_hw)
+        return ~crc_sse42(~crc, data, len);
+#endif
+    return ~crc_slice8(~crc, data, len);
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len) {
+    crc32c_init();
+    return ~crc_slice8(~crc, data, len);
+}
+
+static uint32_t crc32c_bytewise(uint32_t crc, const void *data, size_t len) {
+    crc32c_init();
+    return ~crc_bytes(~crc, data, len);
+}
+
+static double crc_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * Mesure : debit des implementations sur des blocs de 4 Kio, puis lecture
+ * d'un fichier de mio Mio (image temporaire) avec et sans verification des
+ * sommes, par le chemin de lecture normal (read_inode_data).
+ */
+void bench_csum(int mio) {
+    crc32c_init();
+    if (mio < 1)
+        mio = 1;
+    size_t taille = (size_t)mio * 1024 * 1024;
+    char *tampon = malloc(taille);
+    for (size_t i = 0; i < taille; i++)
+        tampon[i] = (char)(i * 2654435761u >> 13);
+    //Verification sur le vecteur connu : CRC32C("123456789") = 0xE3069283
+    int ok = crc32c(0, "123456789", 9) == 0xE3069283u && crc32c_sw(0, "123456789", 9) == 0xE3069283u &&
+             crc32c(0, tampon, taille) == crc32c_sw(0, tampon, taille);
+    printf("CRC32C : %s, vecteurs de test %s\n", crc_hw ? "SSE4.2 (3 flux)" : "slicing-by-8", ok ? "OK" : "ERREUR");
+    const char *noms[3] = { "SSE4.2", "slicing-by-8", "octet par octet" };
+    uint32_t (*fonctions[3])(uint32_t, const void *, size_t) = { crc32c, crc32c_sw, crc32c_bytewise };
+    printf("%-16s %10s\n", "implementation", "Mio/s");
+    for (int m = crc_hw ? 0 : 1; m < 3; m++) {
+        volatile uint32_t puits = 0;
+        double t0 = crc_now();
+        for (size_t off = 0; off < taille; off += FS_BLOCK_SIZE)
+            puits ^= fonctions[m](0, tampon + off, FS_BLOCK_SIZE);
+        double duree = crc_now() - t0;
+        printf("%-16s %10.0f\n", noms[m], mio / (duree > 0 ? duree : 1e-9));
+    }
+
+    //Image temporaire contenant un seul fichier de mio Mio
+    char chemin[] = "/tmp/hebcfs-csum-XXXXXX";
+    int fd = mkstemp(chemin);
+    if (fd == -1) {
+        perror("Erreur : image temporaire");
+        free(tampon);
+        return;
+    }
+    close(fd);
+    filesystem b;
+    disk_inode di;
+    memset(&di, 0, sizeof(di));
+    di.type = FS_TYPE_FILE;
+    di.perms = 6;
+    di.links = 1;
+    di.parent = FS_ROOT_INODE;
+    uint32_t ino = FS_ROOT_INODE + 1;
+    if (mount_partition(&b, chemin, FS_MOUNT_SYNC_IO | FS_MOUNT_QUIET) < 0 ||
+        format_partition(&b, taille + taille / 4 + 16 * 1024 * 1024) < 0 ||
+        (ino = alloc_inode(&b)) == 0 || write_inode_data(&b, ino, &di, tampon, taille) < 0 ||
+        write_inode(&b, ino, &di) < 0) {
+        printf("Impossible de preparer l'image de mesure.\n");
+        unlink(chemin);
+        free(tampon);
+        return;
+    }
+    pthread_mutex_lock(&b.lock);
+    unmount_partition(&b);
+    pthread_mutex_unlock(&b.lock);
+
+    const char *modes[2] = { "sans sommes", "avec sommes" };
+    int flags[2] = { FS_MOUNT_NO_CSUM, 0 };
+    double debits[2] = { 0, 0 };
+    printf("%-12s %10s %10s\n", "lecture", "Mio", "Mio/s");
+    for (int m = 0; m < 2; m++) {
+        if (mount_partition(&b, chemin, FS_MOUNT_RDONLY | FS_MOUNT_SYNC_IO | FS_MOUNT_QUIET | flags[m]) != 0) {
+            printf("Impossible de remonter l'image de mesure.\n");
+            break;
+        }
+        //Meilleur de 5 passes, l'image etant dans le cache du noyau
+        double meilleure = 0;
+        int erreur = 0;
+        for (int passe = 0; passe < 5 && !erreur; passe++) {
+            double t0 = crc_now();
+            erreur = read_inode_data(&b, ino, &di, tampon) < 0;
+            double duree = crc_now() - t0;
+            if (passe == 0 || duree < meilleure)
+                meilleure = duree;
+        }
+        debits[m] = erreur ? 0 : mio / (meilleure > 0 ? meilleure : 1e-9);
+        printf("%-12s %10d %10.0f%s\n", modes[m], mio, debits[m], erreur ? "  (erreur de lecture)" : "");
+        pthread_mutex_lock(&b.lock);
+        unmount_partition(&b);
+        pthread_mutex_unlock(&b.lock);
+    }
+    if (debits[0] > 0 && debits[1] > 0)
+        printf("Surcout de la verification : %.1f %% du debit de lecture\n", (1 - debits[1] / debits[0]) * 100);
+    unlink(chemin);
+    free(tampon);
+}
@@ -0,0 +1,9 @@
+void crc32c_init();
+
+int crc32c_hw_available();
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len);
+
+void bench_csum(int mio);
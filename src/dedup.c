@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "structures.h"
+#include "fonctions.h"
+#include "crc32c.h"
+#include "dedup.h"
+
+/*
+ * Deduplication des blocs de fichiers. La table des references (apres la
+ * table des sommes) donne pour chaque bloc le nombre de references en plus
+ * du premier proprietaire : 0 partout sur une image qui n'a jamais
+ * deduplique. Ses blocs sont lus a la demande, scelles par un CRC32C et
+ * journalises comme ceux de la table des sommes. Liberer un bloc partage
+ * retire seulement une reference (free_extent) ; les blocs n'etant jamais
+ * reecrits en place, le partage ne demande rien d'autre.
+ *
+ * L'index (CRC32C -> bloc) est construit au montage avec FS_MOUNT_DEDUP, a
+ * partir des sommes des blocs occupes. Un bloc libere en sort aussitot, meme
+ * si la liberation n'est effective qu'au commit : il ne peut pas etre
+ * reutilise entre-temps. Toutes les fonctions sont appelees avec p->lock
+ * tenu.
+ */
+
+/* --- Table des references --- */
+
+static uint16_t *ref_slot(filesystem *p, uint32_t no) {
+    uint32_t t = no / FS_REFS_PER_BLOCK;
+    if (!p->ref_table || t >= p->sb.ref_blocks)
+        return NULL;
+    if (!p->ref_table[t]) {
+        uint16_t *bloc = malloc(FS_BLOCK_SIZE);
+        if (read_blocks(p, p->sb.ref_start + t, 1, bloc) < 0) {
+            free(bloc);
+            return NULL;
+        }
+        uint32_t somme;
+        memcpy(&somme, (char *)bloc + FS_REFS_PER_BLOCK * 2, 4);
+        int vierge = somme == 0;
+        for (uint32_t i = 0; i < FS_REFS_PER_BLOCK && vierge; i++)
+            vierge = bloc[i] == 0;
+        if (!vierge && somme != crc32c(0, bloc, FS_REFS_PER_BLOCK * 2)) {
+            //Compteurs inconnus : ces blocs ne seront plus jamais liberes
+            printf("Erreur : bloc %u de la table des references corrompu, ses blocs ne sont plus liberes "
+                   "(lancez fsck).\n", p->sb.ref_start + t);
+            p->csum_errors++;
+            for (uint32_t i = 0; i < FS_REFS_PER_BLOCK; i++)
+                bloc[i] = FS_REF_MAX;
+        }
+        p->ref_table[t] = bloc;
+    }
+    return &p->ref_table[t][no % FS_REFS_PER_BLOCK];
+}
+
+//References en plus du premier proprietaire (FS_REF_MAX : inconnu)
+uint32_t ref_get(filesystem *p, uint32_t no) {
+    uint16_t *case_ = ref_slot(p, no);
+    return case_ ? *case_ : 0;
+}
+
+static void ref_set(filesystem *p, uint32_t no, uint16_t *case_, uint16_t valeur) {
+    if (p->dedup.shared >= 0)
+        p->dedup.shared += (int64_t)valeur - *case_;
+    *case_ = valeur;
+    uint32_t t = no / FS_REFS_PER_BLOCK;
+    if (!p->ref_dirty[t]) {
+        p->ref_dirty[t] = 1;
+        p->ref_nb_dirty++;
+    }
+}
+
+/*
+ * Retirer une reference a un bloc. Retourne 1 si le bloc reste utilise par
+ * un autre proprietaire, 0 s'il peut etre libere.
+ */
+int ref_drop(filesystem *p, uint32_t no) {
+    uint16_t *case_ = ref_slot(p, no);
+    if (!case_ || *case_ == 0)
+        return 0;
+    if (*case_ < FS_REF_MAX)
+        ref_set(p, no, case_, *case_ - 1);
+    return 1;
+}
+
+//Bloc t de la table, scelle (ses 4 derniers octets) pour etre ecrit
+uint8_t *ref_block_ptr(filesystem *p, uint32_t t) {
+    uint16_t *bloc = p->ref_table[t];
+    uint32_t somme = crc32c(0, bloc, FS_REFS_PER_BLOCK * 2);
+    memcpy((char *)bloc + FS_REFS_PER_BLOCK * 2, &somme, 4);
+    return (uint8_t *)bloc;
+}
+
+void ref_clean(filesystem *p, uint32_t t) {
+    if (p->ref_dirty[t]) {
+        p->ref_dirty[t] = 0;
+        p->ref_nb_dirty--;
+    }
+}
+
+void ref_free_table(filesystem *p) {
+    if (p->ref_table) {
+        for (uint32_t t = 0; t < p->sb.ref_blocks; t++)
+            free(p->ref_table[t]);
+    }
+    free(p->ref_table);
+    free(p->ref_dirty);
+    p->ref_table = NULL;
+    p->ref_dirty = NULL;
+    p->ref_nb_dirty = 0;
+    p->dedup.shared = -1;
+}
+
+void ref_alloc_table(filesystem *p) {
+    ref_free_table(p);
+    if (!(p->sb.features & FS_FEATURE_DEDUP) || p->sb.ref_blocks == 0)
+        return;
+    p->ref_table = calloc(p->sb.ref_blocks, sizeof(uint16_t *));
+    p->ref_dirty = calloc(p->sb.ref_blocks, 1);
+}
+
+/* --- Index des blocs --- */
+
+static uint32_t dedup_hash(const dedup_index *d, uint32_t crc) {
+    return (crc * 2654435761u) & (d->cap - 1);
+}
+
+//Replacer les entrees vivantes dans une table de cap cases
+static void dedup_resize(dedup_index *d, uint32_t cap) {
+    dedup_entry *anciennes = d->cases;
+    uint32_t ancienne_cap = d->cap;
+    d->cases = calloc(cap, sizeof(dedup_entry));
+    d->cap = cap;
+    d->tombes = 0;
+    for (uint32_t i = 0; i < ancienne_cap; i++) {
+        if (anciennes[i].block == 0 || anciennes[i].block == DEDUP_TOMB)
+            continue;
+        uint32_t h = dedup_hash(d, anciennes[i].crc);
+        while (d->cases[h].block != 0)
+            h = (h + 1) & (cap - 1);
+        d->cases[h] = anciennes[i];
+    }
+    free(anciennes);
+}
+
+void dedup_insert(filesystem *p, uint32_t crc, uint32_t no) {
+    dedup_index *d = &p->dedup;
+    if (!d->cases || crc == 0)
+        return;
+    //Au plus 3/4 de cases prises, tombes comprises
+    if ((uint64_t)(d->nb + d->tombes + 1) * 4 > (uint64_t)d->cap * 3) {
+        uint32_t cap = 1024;
+        while (cap < (d->nb + 1) * 2)
+            cap *= 2;
+        dedup_resize(d, cap);
+    }
+    uint32_t h = dedup_hash(d, crc);
+    while (d->cases[h].block != 0 && d->cases[h].block != DEDUP_TOMB)
+        h = (h + 1) & (d->cap - 1);
+    if (d->cases[h].block == DEDUP_TOMB)
+        d->tombes--;
+    d->cases[h].crc = crc;
+    d->cases[h].block = no;
+    d->nb++;
+}
+
+/*
+ * Bloc deja present sur la partition avec exactement le contenu data (de
+ * somme crc), 0 si aucun. Les candidats de meme somme sont relus et
+ * compares octet par octet.
+ */
+uint32_t dedup_find(filesystem *p, uint32_t crc, const void *data) {
+    dedup_index *d = &p->dedup;
+    if (!d->cases || crc == 0)
+        return 0;
+    char bloc[FS_BLOCK_SIZE];
+    for (uint32_t h = dedup_hash(d, crc); d->cases[h].block != 0; h = (h + 1) & (d->cap - 1)) {
+        uint32_t no = d->cases[h].block;
+        if (no == DEDUP_TOMB || d->cases[h].crc != crc)
+            continue;
+        //Un compteur proche de la saturation n'est plus augmente
+        if (ref_get(p, no) >= FS_REF_MAX - 1)
+            continue;
+        d->compares++;
+        if (read_block(p, no, bloc) == 0 && memcmp(bloc, data, FS_BLOCK_SIZE) == 0) {
+            d->hits++;
+            return no;
+        }
+        d->collisions++;
+    }
+    return 0;
+}
+
+//Ajouter une reference au bloc no (trouve par dedup_find)
+void dedup_share(filesystem *p, uint32_t no) {
+    uint16_t *case_ = ref_slot(p, no);
+    if (case_)
+        ref_set(p, no, case_, *case_ + 1);
+}
+
+//Retirer de l'index un bloc qui va etre libere
+void dedup_forget(filesystem *p, uint32_t no) {
+    dedup_index *d = &p->dedup;
+    if (!d->cases || d->nb == 0)
+        return;
+    uint32_t crc = csum_get(p, no);
+    if (crc == 0) {
+        //Somme illisible : le bloc est cherche dans tout l'index
+        for (uint32_t h = 0; h < d->cap; h++) {
+            if (d->cases[h].block == no) {
+                d->cases[h].block = DEDUP_TOMB;
+                d->nb--;
+                d->tombes++;
+            }
+        }
+        return;
+    }
+    for (uint32_t h = dedup_hash(d, crc); d->cases[h].block != 0; h = (h + 1) & (d->cap - 1)) {
+        if (d->cases[h].block == no) {
+            d->cases[h].block = DEDUP_TOMB;
+            d->nb--;
+            d->tombes++;
+            return;
+        }
+    }
+}
+
+//Construire l'index a partir des sommes des blocs de donnees occupes
+int dedup_start(filesystem *p) {
+    dedup_stop(p);
+    if (!(p->sb.features & FS_FEATURE_DEDUP) || !p->csum_table || !p->ref_table) {
+        printf("Deduplication indisponible : image formatee avant l'ajout de la table des references.\n");
+        return -1;
+    }
+    p->dedup.cap = 1024;
+    p->dedup.cases = calloc(p->dedup.cap, sizeof(dedup_entry));
+    for (uint32_t b = p->sb.data_start; b < p->sb.nb_blocks; b++) {
+        if ((p->block_bitmap[b / 8] >> (b % 8)) & 1)
+            dedup_insert(p, csum_get(p, b), b);
+    }
+    return 0;
+}
+
+void dedup_stop(filesystem *p) {
+    free(p->dedup.cases);
+    p->dedup.cases = NULL;
+    p->dedup.cap = p->dedup.nb = p->dedup.tombes = 0;
+}
+
+/*
+ * Parcourir toute la table des references : blocs partages, references en
+ * plus au total et compteurs poses sur des blocs libres (incoherents).
+ */
+uint64_t dedup_count(filesystem *p, uint32_t *partages, uint32_t *incoherents) {
+    uint64_t refs = 0;
+    *partages = *incoherents = 0;
+    for (uint32_t b = p->sb.data_start; p->ref_table && b < p->sb.nb_blocks; b++) {
+        uint32_t r = ref_get(p, b);
+        if (r == 0)
+            continue;
+        (*partages)++;
+        refs += r;
+        if (!((p->block_bitmap[b / 8] >> (b % 8)) & 1))
+            (*incoherents)++;
+    }
+    p->dedup.shared = refs;
+    return refs;
+}
+
+//Blocs de donnees occupes et economises (references en plus)
+static void dedup_usage(filesystem *p, uint64_t *occupes, uint64_t *economises) {
+    uint32_t partages, incoherents;
+    if (p->dedup.shared < 0)
+        dedup_count(p, &partages, &incoherents);
+    *occupes = p->sb.nb_blocks - p->sb.data_start - p->sb.free_blocks;
+    *economises = p->dedup.shared;
+}
+
+//Taux de deduplication : blocs references par les fichiers / blocs occupes
+double dedup_ratio(filesystem *p, uint64_t *economises) {
+    uint64_t occupes;
+    dedup_usage(p, &occupes, economises);
+    return occupes ? (double)(occupes + *economises) / occupes : 1.0;
+}
+
+void dedup_stats(filesystem *p) {
+    if (!(p->sb.features & FS_FEATURE_DEDUP)) {
+        printf("Deduplication : indisponible (image formatee avant la table des references)\n");
+        return;
+    }
+    uint64_t economises;
+    double taux = dedup_ratio(p, &economises);
+    printf("Deduplication : %s, %u blocs indexes, %llu blocs ecrits, %llu partages, %llu comparaisons, "
+           "%llu collisions de somme, taux %.2f\n", p->dedup.cases ? "active" : "inactive", p->dedup.nb,
+           (unsigned long long)p->dedup.written, (unsigned long long)p->dedup.hits,
+           (unsigned long long)p->dedup.compares, (unsigned long long)p->dedup.collisions, taux);
+}
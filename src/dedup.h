@@ -0,0 +1,29 @@
+uint32_t ref_get(filesystem *p, uint32_t no);
+
+int ref_drop(filesystem *p, uint32_t no);
+
+uint8_t *ref_block_ptr(filesystem *p, uint32_t t);
+
+void ref_clean(filesystem *p, uint32_t t);
+
+void ref_free_table(filesystem *p);
+
+void ref_alloc_table(filesystem *p);
+
+void dedup_insert(filesystem *p, uint32_t crc, uint32_t no);
+
+uint32_t dedup_find(filesystem *p, uint32_t crc, const void *data);
+
+void dedup_share(filesystem *p, uint32_t no);
+
+void dedup_forget(filesystem *p, uint32_t no);
+
+int dedup_start(filesystem *p);
+
+void dedup_stop(filesystem *p);
+
+uint64_t dedup_count(filesystem *p, uint32_t *partages, uint32_t *incoherents);
+
+double dedup_ratio(filesystem *p, uint64_t *economises);
+
+void dedup_stats(filesystem *p);
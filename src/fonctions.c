@@ -5,9 +5,20 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <stddef.h>
 
 #include "structures.h"
 #include "fonctions.h"
+#include "journal.h"
+#include "io.h"
+#include "pcache.h"
+#include "crash.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "dedup.h"
+#include "cdc.h"
 
 //Ouvrir/Charger la partition DEJA CREE AU PREALABLE
 int open_partition(const char *filename) {
@@ -87,4 +98,2389 @@ void display_help(){
     printf(" rm <nom>       - Supprimer un fichier ou un répertoire\n");
     printf(" help           - Afficher l'aide aux commandes\n");
     printf(" exit           - Quitter l'invite de commandes\n");
-}
\ No newline at end of file
+}
+
+/* --- Partition sur disque --- */
+
+//Lecture/ecriture completes a une position donnee
+static int pread_full(int fd, void *buf, size_t len, off_t off) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, off);
+        if (n <= 0) {
+            if (n == 0)
+                memset(p, 0, len); //Au-dela de la fin de l'image : zeros
+            return n == 0 ? 0 : -1;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t off) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0)
+            return -1;
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//Verifier qu'une plage de blocs est dans l'image projetee
+static int map_range_ok(filesystem *p, uint32_t no, uint32_t nb) {
+    if ((size_t)(no + nb) * FS_BLOCK_SIZE > p->size) {
+        printf("Erreur : bloc %u hors de l'image.\n", no + nb - 1);
+        return 0;
+    }
+    return 1;
+}
+
+/* --- Sommes de controle CRC32C ---
+ *
+ * Une case de 32 bits par bloc dans la table (0 : somme inconnue, bloc non
+ * verifie). Les blocs de la table sont lus a la demande et se protegent
+ * eux-memes par leur derniere case ; ils sont journalises comme les
+ * bitmaps. Les blocs de donnees sont mis a jour a l'ecriture et verifies a
+ * la lecture ; les bitmaps au commit et au montage. Les inodes et le
+ * superbloc portent leur propre somme, le journal ses enregistrements.
+ */
+
+static uint32_t *csum_slot(filesystem *p, uint32_t no) {
+    uint32_t t = no / FS_CSUMS_PER_BLOCK;
+    if (t >= p->sb.csum_blocks)
+        return NULL;
+    if (!p->csum_table[t]) {
+        uint32_t *bloc = malloc(FS_BLOCK_SIZE);
+        if (read_blocks(p, p->sb.csum_start + t, 1, bloc) < 0) {
+            free(bloc);
+            return NULL;
+        }
+        //Un bloc entierement nul est une table vierge
+        int vierge = 1;
+        for (uint32_t i = 0; i <= FS_CSUMS_PER_BLOCK && vierge; i++)
+            vierge = bloc[i] == 0;
+        if (!vierge && bloc[FS_CSUMS_PER_BLOCK] != crc32c(0, bloc, FS_CSUMS_PER_BLOCK * 4)) {
+            printf("Erreur : bloc %u de la table des sommes corrompu, ses blocs ne sont plus verifies.\n",
+                   p->sb.csum_start + t);
+            p->csum_errors++;
+            memset(bloc, 0, FS_BLOCK_SIZE);
+        }
+        p->csum_table[t] = bloc;
+    }
+    return &p->csum_table[t][no % FS_CSUMS_PER_BLOCK];
+}
+
+static void csum_update(filesystem *p, uint32_t no, const void *data) {
+    uint32_t *case_ = csum_slot(p, no);
+    if (!case_)
+        return;
+    *case_ = crc32c(0, data, FS_BLOCK_SIZE);
+    uint32_t t = no / FS_CSUMS_PER_BLOCK;
+    if (!p->csum_dirty[t]) {
+        p->csum_dirty[t] = 1;
+        p->csum_nb_dirty++;
+    }
+}
+
+//Somme enregistree pour le bloc no (0 : inconnue)
+uint32_t csum_get(filesystem *p, uint32_t no) {
+    uint32_t *case_ = p->csum_table ? csum_slot(p, no) : NULL;
+    return case_ ? *case_ : 0;
+}
+
+//0 si le bloc est intact ou sans somme connue, -1 s'il ne correspond pas
+int csum_verify(filesystem *p, uint32_t no, const void *data) {
+    if (!p->csum_table || (p->flags & FS_MOUNT_NO_CSUM))
+        return 0;
+    uint32_t *case_ = csum_slot(p, no);
+    if (!case_ || *case_ == 0)
+        return 0;
+    p->csum_verified++;
+    if (crc32c(0, data, FS_BLOCK_SIZE) == *case_)
+        return 0;
+    p->csum_errors++;
+    printf("Erreur : somme de controle invalide pour le bloc %u.\n", no);
+    return -1;
+}
+
+//Lire d'avance toute la table : des lecteurs paralleles n'y ecrivent plus (fsck)
+void csum_load_table(filesystem *p) {
+    if (!p->csum_table || (p->flags & FS_MOUNT_NO_CSUM))
+        return;
+    for (uint32_t t = 0; t < p->sb.csum_blocks; t++)
+        csum_slot(p, t * FS_CSUMS_PER_BLOCK);
+}
+
+//Bloc t de la table, scelle (sa derniere case) pour etre ecrit
+uint8_t *csum_block_ptr(filesystem *p, uint32_t t) {
+    uint32_t *bloc = p->csum_table[t];
+    bloc[FS_CSUMS_PER_BLOCK] = crc32c(0, bloc, FS_CSUMS_PER_BLOCK * 4);
+    return (uint8_t *)bloc;
+}
+
+void csum_clean(filesystem *p, uint32_t t) {
+    if (p->csum_dirty[t]) {
+        p->csum_dirty[t] = 0;
+        p->csum_nb_dirty--;
+    }
+}
+
+//Sommes des blocs de bitmaps modifies, avant l'ecriture de la table
+void csum_seal_bitmaps(filesystem *p) {
+    if (!p->csum_table || !p->bitmaps_dirty)
+        return;
+    uint32_t nb = p->sb.inode_bitmap_blocks + p->sb.block_bitmap_blocks;
+    for (uint32_t b = 0; b < nb; b++) {
+        if (p->bitmap_blocks_dirty[b])
+            csum_update(p, p->sb.inode_bitmap_start + b, bitmap_block_ptr(p, b));
+    }
+}
+
+static void csum_free_table(filesystem *p) {
+    if (p->csum_table) {
+        for (uint32_t t = 0; t < p->sb.csum_blocks; t++)
+            free(p->csum_table[t]);
+    }
+    free(p->csum_table);
+    free(p->csum_dirty);
+    p->csum_table = NULL;
+    p->csum_dirty = NULL;
+    p->csum_nb_dirty = 0;
+}
+
+static void csum_alloc_table(filesystem *p) {
+    csum_free_table(p);
+    if (!(p->sb.features & FS_FEATURE_CSUM) || p->sb.csum_blocks == 0)
+        return;
+    p->csum_table = calloc(p->sb.csum_blocks, sizeof(uint32_t *));
+    p->csum_dirty = calloc(p->sb.csum_blocks, 1);
+}
+
+static uint32_t inode_checksum(uint32_t ino, const disk_inode *in) {
+    disk_inode copie = *in;
+    copie.checksum = 0;
+    return crc32c(crc32c(0, &ino, sizeof(ino)), &copie, sizeof(copie));
+}
+
+//1 si l'inode lu est intact, sans somme a verifier ou jamais ecrit (tout a zero)
+int inode_csum_ok(filesystem *p, uint32_t ino, const disk_inode *in) {
+    static const disk_inode vierge;
+    if (!(p->sb.features & FS_FEATURE_CSUM) || (p->flags & FS_MOUNT_NO_CSUM))
+        return 1;
+    return in->checksum == inode_checksum(ino, in) || memcmp(in, &vierge, sizeof(vierge)) == 0;
+}
+
+static int inode_verify(filesystem *p, uint32_t ino, const disk_inode *in) {
+    if (inode_csum_ok(p, ino, in))
+        return 0;
+    p->csum_errors++;
+    printf("Erreur : somme de controle invalide pour l'inode %u.\n", ino);
+    return -1;
+}
+
+//Les champs ajoutes apres checksum ne comptent que sur les images qui les ont
+static uint32_t superblock_checksum(const superblock *sb) {
+    superblock copie = *sb;
+    copie.checksum = 0;
+    uint32_t somme = crc32c(0, &copie, offsetof(superblock, ref_start));
+    if (sb->features & FS_FEATURE_DEDUP)
+        somme = crc32c(somme, &copie.ref_start, offsetof(superblock, scrub_cursor) - offsetof(superblock, ref_start));
+    if (sb->features & FS_FEATURE_SCRUB)
+        somme = crc32c(somme, &copie.scrub_cursor, offsetof(superblock, lazy_done) - offsetof(superblock, scrub_cursor));
+    if (sb->features & FS_FEATURE_LAZY_INIT)
+        somme = crc32c(somme, copie.lazy_done, sizeof(copie) - offsetof(superblock, lazy_done));
+    return somme;
+}
+
+//0 si le superbloc lu (bloc 0) est intact
+int superblock_verify(const superblock *sb) {
+    if (sb->magic != FS_MAGIC || sb->version != FS_VERSION || sb->block_size != FS_BLOCK_SIZE)
+        return -1;
+    if ((sb->features & FS_FEATURE_CSUM) && sb->checksum != superblock_checksum(sb))
+        return -1;
+    return 0;
+}
+
+void csum_stats(filesystem *p) {
+    if (!(p->sb.features & FS_FEATURE_CSUM)) {
+        printf("Sommes de controle : absentes (image formatee avant leur ajout)\n");
+        return;
+    }
+    uint32_t charges = 0;
+    for (uint32_t t = 0; t < p->sb.csum_blocks; t++)
+        charges += p->csum_table && p->csum_table[t];
+    printf("Sommes de controle : CRC32C %s%s, %u/%u blocs de table charges, "
+           "%llu blocs verifies, %llu erreurs\n", crc32c_hw_available() ? "SSE4.2" : "slicing-by-8",
+           (p->flags & FS_MOUNT_NO_CSUM) ? " (verification desactivee)" : "", charges, p->sb.csum_blocks,
+           (unsigned long long)p->csum_verified, (unsigned long long)p->csum_errors);
+}
+
+//Verifier les blocs de donnees lus (les metadonnees ont leurs propres sommes)
+static int verify_blocks(filesystem *p, uint32_t no, uint32_t nb, const void *buf) {
+    if (!p->csum_table || (p->flags & FS_MOUNT_NO_CSUM))
+        return 0;
+    int ret = 0;
+    for (uint32_t i = 0; i < nb; i++) {
+        if (no + i >= p->sb.data_start && csum_verify(p, no + i, (const char *)buf + (size_t)i * FS_BLOCK_SIZE) < 0)
+            ret = -1;
+    }
+    return ret;
+}
+
+/* --- Initialisation differee des tables (FS_FEATURE_LAZY_INIT) --- */
+
+/*
+ * Le formatage n'ecrit que le superbloc et les blocs qu'il remplit : le
+ * reste des bitmaps et des tables des inodes, des sommes et des references
+ * garde l'ancien contenu de l'image. Seuls les sb.lazy_done[k] premiers
+ * blocs de chaque table sont initialises, les suivants sont lus comme nuls.
+ * Une ecriture plus loin etend d'abord la partie initialisee, par
+ * LAZY_CHUNK blocs au moins ; le thread de lazyinit.c l'etend aussi en
+ * arriere-plan. Quand tout est initialise, la fonctionnalite est retiree.
+ */
+
+//Premier bloc et nombre de blocs de la table k (LAZY_*) ; les deux bitmaps se suivent
+static void lazy_table(const superblock *sb, int k, uint32_t *debut, uint32_t *nb) {
+    switch (k) {
+    case LAZY_BITMAPS:
+        *debut = sb->inode_bitmap_start;
+        *nb = sb->inode_bitmap_blocks + sb->block_bitmap_blocks;
+        break;
+    case LAZY_INODES:
+        *debut = sb->inode_table_start;
+        *nb = sb->inode_table_blocks;
+        break;
+    case LAZY_CSUMS:
+        *debut = sb->csum_start;
+        *nb = sb->csum_blocks;
+        break;
+    default:
+        *debut = sb->ref_start;
+        *nb = sb->ref_blocks;
+    }
+}
+
+//Mettre a zero dans buf (s'il n'est pas NULL) les blocs lus pas encore initialises ; retourne leur nombre
+static uint32_t lazy_mask(const superblock *sb, uint32_t no, uint32_t nb, void *buf) {
+    if (!(sb->features & FS_FEATURE_LAZY_INIT) || no >= sb->journal_start || no + nb <= sb->inode_bitmap_start)
+        return 0;
+    uint32_t nuls = 0;
+    for (int k = 0; k < LAZY_NB_TABLES; k++) {
+        uint32_t debut, taille;
+        lazy_table(sb, k, &debut, &taille);
+        //Intersection de [no, no + nb) et de la partie non initialisee de la table
+        uint32_t a = debut + sb->lazy_done[k], b = debut + taille;
+        if (a < no)
+            a = no;
+        if (b > no + nb)
+            b = no + nb;
+        if (a >= b)
+            continue;
+        if (buf)
+            memset((char *)buf + (size_t)(a - no) * FS_BLOCK_SIZE, 0, (size_t)(b - a) * FS_BLOCK_SIZE);
+        nuls += b - a;
+    }
+    return nuls;
+}
+
+//Lire des blocs sans verifier leurs sommes (l'appelant s'en charge)
+int read_blocks_raw(filesystem *p, uint32_t no, uint32_t nb, void *buf) {
+    //Blocs de tables pas encore initialises : nuls, sans lecture s'ils le sont tous
+    uint32_t nuls = lazy_mask(&p->sb, no, nb, NULL);
+    if (nuls == nb && nb > 0) {
+        memset(buf, 0, (size_t)nb * FS_BLOCK_SIZE);
+        return 0;
+    }
+    if (p->map) {
+        //Mode mmap : simple copie depuis la projection, sans appel systeme
+        if (!map_range_ok(p, no, nb))
+            return -1;
+        memcpy(buf, p->map + (size_t)no * FS_BLOCK_SIZE, (size_t)nb * FS_BLOCK_SIZE);
+    } else {
+        //Les ecritures en attente doivent etre faites avant de relire
+        if (p->io.nb_queue && io_drain(p) < 0)
+            return -1;
+        //Courant coupe (bench crash) : les blocs relus pourraient ne jamais avoir ete ecrits
+        if (p->crash && p->crash->cut)
+            return -1;
+        if (pread_full(p->fd, buf, (size_t)nb * FS_BLOCK_SIZE, (off_t)no * FS_BLOCK_SIZE) < 0) {
+            perror("Erreur : lecture de la partition");
+            return -1;
+        }
+    }
+    if (nuls)
+        lazy_mask(&p->sb, no, nb, buf);
+    return 0;
+}
+
+int read_blocks(filesystem *p, uint32_t no, uint32_t nb, void *buf) {
+    if (read_blocks_raw(p, no, nb, buf) < 0)
+        return -1;
+    return verify_blocks(p, no, nb, buf);
+}
+
+//Ecrire des blocs tels quels (ni somme ni initialisation des tables)
+static int write_blocks_raw(filesystem *p, uint32_t no, uint32_t nb, const void *buf) {
+    if (p->map) {
+        if (!map_range_ok(p, no, nb))
+            return -1;
+        size_t debut = (size_t)no * FS_BLOCK_SIZE, fin = debut + (size_t)nb * FS_BLOCK_SIZE;
+        memcpy(p->map + debut, buf, fin - debut);
+        //Plage a synchroniser au prochain sync_partition
+        if (p->dirty_hi == 0 || debut < p->dirty_lo)
+            p->dirty_lo = debut;
+        if (fin > p->dirty_hi)
+            p->dirty_hi = fin;
+        return 0;
+    }
+    if (p->crash)
+        return crash_write(p, no, nb, buf);
+    //Avec io_uring, les ecritures partent par lots (au plus tard au prochain fsync)
+    if (p->io.type == IO_BACKEND_URING)
+        return io_queue_write(p, (uint64_t)no * FS_BLOCK_SIZE, buf, (size_t)nb * FS_BLOCK_SIZE);
+    if (pwrite_full(p->fd, buf, (size_t)nb * FS_BLOCK_SIZE, (off_t)no * FS_BLOCK_SIZE) < 0) {
+        perror("Erreur : ecriture de la partition");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Etendre la partie initialisee de la table k jusqu'a son bloc fin (exclu).
+ * Les blocs sont mis a zero et rendus durables avant d'etre comptes : le
+ * superbloc n'en annonce jamais un qui garde l'ancien contenu de l'image.
+ */
+static int lazy_extend(filesystem *p, int k, uint32_t fin) {
+    superblock *sb = &p->sb;
+    uint32_t debut, taille;
+    lazy_table(sb, k, &debut, &taille);
+    if (fin > taille)
+        fin = taille;
+    if (fin <= sb->lazy_done[k])
+        return 0;
+    char *zeros = calloc(LAZY_CHUNK, FS_BLOCK_SIZE);
+    for (uint32_t b = sb->lazy_done[k]; b < fin; b += LAZY_CHUNK) {
+        uint32_t nb = fin - b < LAZY_CHUNK ? fin - b : LAZY_CHUNK;
+        if (write_blocks_raw(p, debut + b, nb, zeros) < 0) {
+            free(zeros);
+            return -1;
+        }
+    }
+    free(zeros);
+    if (flush_device(p) < 0)
+        return -1;
+    sb->lazy_done[k] = fin;
+    //Tout est initialise : les tables sont de nouveau lues sans masque
+    for (k = 0; k < LAZY_NB_TABLES; k++) {
+        lazy_table(sb, k, &debut, &taille);
+        if (sb->lazy_done[k] < taille)
+            return 0;
+    }
+    sb->features &= ~FS_FEATURE_LAZY_INIT;
+    return 0;
+}
+
+//Avant d'ecrire [no, no + nb) : initialiser les tables touchees jusque-la (LAZY_CHUNK blocs au moins)
+static int lazy_touch(filesystem *p, uint32_t no, uint32_t nb) {
+    superblock *sb = &p->sb;
+    for (int k = 0; k < LAZY_NB_TABLES && (sb->features & FS_FEATURE_LAZY_INIT); k++) {
+        uint32_t debut, taille;
+        lazy_table(sb, k, &debut, &taille);
+        if (no + nb <= debut || no >= debut + taille || no + nb - debut <= sb->lazy_done[k])
+            continue;
+        uint32_t fin = no + nb - debut;
+        if (fin < sb->lazy_done[k] + LAZY_CHUNK)
+            fin = sb->lazy_done[k] + LAZY_CHUNK;
+        if (lazy_extend(p, k, fin) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Initialiser les LAZY_CHUNK blocs suivants de la premiere table incomplete
+ * (thread d'initialisation, p->lock tenu). Retourne le nombre de blocs
+ * ecrits, 0 si tout est deja initialise, -1 en cas d'erreur.
+ */
+int lazy_init_step(filesystem *p) {
+    superblock *sb = &p->sb;
+    if (!(sb->features & FS_FEATURE_LAZY_INIT) || (p->flags & FS_MOUNT_RDONLY))
+        return 0;
+    for (int k = 0; k < LAZY_NB_TABLES; k++) {
+        uint32_t debut, taille, fait = sb->lazy_done[k];
+        lazy_table(sb, k, &debut, &taille);
+        if (fait >= taille)
+            continue;
+        if (lazy_extend(p, k, fait + LAZY_CHUNK) < 0)
+            return -1;
+        return sb->lazy_done[k] - fait;
+    }
+    return 0;
+}
+
+//Blocs des tables restant a initialiser
+uint32_t lazy_init_remaining(filesystem *p) {
+    superblock *sb = &p->sb;
+    if (!(sb->features & FS_FEATURE_LAZY_INIT))
+        return 0;
+    uint32_t reste = 0;
+    for (int k = 0; k < LAZY_NB_TABLES; k++) {
+        uint32_t debut, taille;
+        lazy_table(sb, k, &debut, &taille);
+        if (sb->lazy_done[k] < taille)
+            reste += taille - sb->lazy_done[k];
+    }
+    return reste;
+}
+
+int write_blocks(filesystem *p, uint32_t no, uint32_t nb, const void *buf) {
+    if ((p->sb.features & FS_FEATURE_LAZY_INIT) && lazy_touch(p, no, nb) < 0)
+        return -1;
+    //Les blocs de donnees recoivent leur somme, journalisee au prochain commit
+    if (p->csum_table) {
+        for (uint32_t i = 0; i < nb; i++) {
+            if (no + i >= p->sb.data_start)
+                csum_update(p, no + i, (const char *)buf + (size_t)i * FS_BLOCK_SIZE);
+        }
+    }
+    return write_blocks_raw(p, no, nb, buf);
+}
+
+int read_block(filesystem *p, uint32_t no, void *buf) {
+    return read_blocks(p, no, 1, buf);
+}
+
+int write_block(filesystem *p, uint32_t no, const void *buf) {
+    return write_blocks(p, no, 1, buf);
+}
+
+static int bit_test(const uint8_t *bitmap, uint32_t i) {
+    return (bitmap[i / 8] >> (i % 8)) & 1;
+}
+
+static void bit_set(uint8_t *bitmap, uint32_t i) {
+    bitmap[i / 8] |= (uint8_t)(1 << (i % 8));
+}
+
+static void bit_clear(uint8_t *bitmap, uint32_t i) {
+    bitmap[i / 8] &= (uint8_t)~(1 << (i % 8));
+}
+
+//Noter le bloc de bitmap contenant le bit i comme modifie
+static void bitmap_dirty(filesystem *p, const uint8_t *bitmap, uint32_t i) {
+    uint32_t bloc = i / (FS_BLOCK_SIZE * 8);
+    if (bitmap == p->block_bitmap)
+        bloc += p->sb.inode_bitmap_blocks;
+    p->bitmap_blocks_dirty[bloc] = 1;
+    p->bitmaps_dirty = 1;
+}
+
+//Bloc b des bitmaps (ceux des inodes d'abord, puis ceux des blocs)
+uint8_t *bitmap_block_ptr(filesystem *p, uint32_t b) {
+    if (b < p->sb.inode_bitmap_blocks)
+        return p->inode_bitmap + (size_t)b * FS_BLOCK_SIZE;
+    return p->block_bitmap + (size_t)(b - p->sb.inode_bitmap_blocks) * FS_BLOCK_SIZE;
+}
+
+/* --- Allocateur : recherche par mots de 64 bits --- */
+
+//Mot w d'une bitmap : son bit j est le bit w * 64 + j de la bitmap
+static inline uint64_t bitmap_word(const uint8_t *bitmap, uint32_t w) {
+    uint64_t v;
+    memcpy(&v, bitmap + (size_t)w * 8, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+//Compter les bits libres de chaque region (popcount sur des mots entiers)
+static uint32_t *count_regions(const uint8_t *bitmap, uint32_t nb_bits, uint32_t *libres) {
+    uint32_t nb_regions = (nb_bits + FS_ALLOC_REGION_BITS - 1) / FS_ALLOC_REGION_BITS;
+    uint32_t *regions = calloc(nb_regions ? nb_regions : 1, sizeof(uint32_t));
+    *libres = 0;
+    for (uint32_t w = 0; (uint64_t)w * 64 < nb_bits; w++) {
+        uint64_t occupes = bitmap_word(bitmap, w);
+        uint32_t valides = nb_bits - w * 64 < 64 ? nb_bits - w * 64 : 64;
+        if (valides < 64)
+            occupes |= ~0ULL << valides;
+        uint32_t n = 64 - __builtin_popcountll(occupes);
+        regions[w * 64 / FS_ALLOC_REGION_BITS] += n;
+        *libres += n;
+    }
+    return regions;
+}
+
+//Reconstruire les compteurs par region a partir des bitmaps
+static void init_regions(filesystem *p) {
+    uint32_t libres;
+    free(p->inode_region_free);
+    free(p->block_region_free);
+    p->inode_region_free = count_regions(p->inode_bitmap, p->sb.nb_inodes, &libres);
+    p->block_region_free = count_regions(p->block_bitmap, p->sb.nb_blocks, &libres);
+    p->run_echec = 0;
+}
+
+//Recompter les blocs et inodes libres (apres un arret brutal)
+void recount_free(filesystem *p) {
+    free(p->inode_region_free);
+    free(p->block_region_free);
+    p->inode_region_free = count_regions(p->inode_bitmap, p->sb.nb_inodes, &p->sb.free_inodes);
+    p->block_region_free = count_regions(p->block_bitmap, p->sb.nb_blocks, &p->sb.free_blocks);
+    p->run_echec = 0;
+}
+
+/*
+ * Premier bit libre de [from, to), ou to. Les regions sans bit libre sont
+ * sautees d'un coup ; ailleurs, 64 bits sont testes a la fois (ctz).
+ */
+static uint32_t bitmap_find_zero(const uint8_t *bitmap, const uint32_t *regions, uint32_t from, uint32_t to) {
+    uint32_t i = from;
+    while (i < to) {
+        uint32_t r = i / FS_ALLOC_REGION_BITS;
+        uint32_t fin = (r + 1) * FS_ALLOC_REGION_BITS;
+        if (regions[r] == 0) {
+            i = fin;
+            continue;
+        }
+        if (fin > to)
+            fin = to;
+        while (i < fin) {
+            uint64_t libres = ~bitmap_word(bitmap, i / 64) & (~0ULL << (i % 64));
+            if (libres) {
+                uint32_t b = (i & ~63u) + __builtin_ctzll(libres);
+                return b < to ? b : to;
+            }
+            i = (i & ~63u) + 64;
+        }
+    }
+    return to;
+}
+
+//Premier bit occupe de [from, to), ou to (fin d'un trou libre)
+static uint32_t bitmap_find_one(const uint8_t *bitmap, const uint32_t *regions, uint32_t from, uint32_t to) {
+    uint32_t i = from;
+    while (i < to) {
+        //Region entierement libre : rien a tester
+        if (i % FS_ALLOC_REGION_BITS == 0 && regions[i / FS_ALLOC_REGION_BITS] == FS_ALLOC_REGION_BITS) {
+            i += FS_ALLOC_REGION_BITS;
+            continue;
+        }
+        uint64_t occupes = bitmap_word(bitmap, i / 64) & (~0ULL << (i % 64));
+        if (occupes) {
+            uint32_t b = (i & ~63u) + __builtin_ctzll(occupes);
+            return b < to ? b : to;
+        }
+        i = (i & ~63u) + 64;
+    }
+    return to;
+}
+
+//Marquer occupes les bits [debut, debut + nb) supposes libres
+static void bitmap_set_range(filesystem *p, uint8_t *bitmap, uint32_t *regions, uint32_t debut, uint32_t nb) {
+    uint32_t i = debut, fin = debut + nb;
+    while (i < fin && i % 8) {
+        bit_set(bitmap, i);
+        i++;
+    }
+    if (fin - i >= 8) {
+        memset(bitmap + i / 8, 0xff, (fin - i) / 8);
+        i += (fin - i) / 8 * 8;
+    }
+    while (i < fin) {
+        bit_set(bitmap, i);
+        i++;
+    }
+    //Blocs de bitmap modifies et compteurs des regions touchees
+    uint32_t bits_par_bloc = FS_BLOCK_SIZE * 8;
+    for (uint32_t b = debut / bits_par_bloc; b <= (fin - 1) / bits_par_bloc; b++)
+        bitmap_dirty(p, bitmap, b * bits_par_bloc);
+    for (i = debut; i < fin; ) {
+        uint32_t r = i / FS_ALLOC_REGION_BITS;
+        uint32_t limite = (r + 1) * FS_ALLOC_REGION_BITS < fin ? (r + 1) * FS_ALLOC_REGION_BITS : fin;
+        regions[r] -= limite - i;
+        i = limite;
+    }
+}
+
+//Rendre durables toutes les ecritures faites jusqu'ici (fsync, ou msync en mode mmap)
+int flush_device(filesystem *p) {
+    if (p->map) {
+        if (p->dirty_hi > p->dirty_lo) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t debut = p->dirty_lo / page * page;
+            if (msync(p->map + debut, p->dirty_hi - debut, MS_SYNC) == -1) {
+                perror("Erreur : msync sur la partition");
+                return -1;
+            }
+        }
+        p->dirty_lo = p->dirty_hi = 0;
+        return 0;
+    }
+    if (io_drain(p) < 0)
+        return -1;
+    if (p->crash)
+        return crash_flush(p);
+    if (fsync(p->fd) == -1) {
+        perror("Erreur : fsync sur la partition");
+        return -1;
+    }
+    return 0;
+}
+
+//Formater la partition : superbloc, racine et bitmaps non nulles, le reste initialise a la demande
+int format_partition(filesystem *p, size_t size) {
+    if (size < 64 * FS_BLOCK_SIZE) {
+        printf("Partition trop petite (minimum %d octets).\n", 64 * FS_BLOCK_SIZE);
+        return -1;
+    }
+    if (!p->map && io_drain(p) < 0)
+        return -1;
+    if (ftruncate(p->fd, size) == -1) {
+        perror("Erreur : impossible de dimensionner la partition");
+        return -1;
+    }
+    if (p->flags & FS_MOUNT_MMAP) {
+        //La projection doit couvrir la nouvelle taille de l'image
+        if (p->map)
+            munmap(p->map, p->size);
+        p->map = NULL;
+        p->size = size;
+        if (map_partition(p) < 0)
+            return -1;
+    }
+    //Le formatage ecrit directement, sans passer par le journal
+    int journal_actif = p->journal.enabled;
+    if (journal_actif)
+        journal_discard(p);
+    p->journal.enabled = 0;
+    csum_free_table(p);
+    ref_free_table(p);
+    dedup_stop(p);
+    chunk_reset(p);
+    superblock *sb = &p->sb;
+    memset(sb, 0, sizeof(superblock));
+    sb->magic = FS_MAGIC;
+    sb->version = FS_VERSION;
+    sb->block_size = FS_BLOCK_SIZE;
+    sb->nb_blocks = size / FS_BLOCK_SIZE;
+    sb->nb_inodes = sb->nb_blocks / 4; //Un inode pour 16 Kio
+    uint32_t bits_par_bloc = FS_BLOCK_SIZE * 8;
+    sb->inode_bitmap_start = 1;
+    sb->inode_bitmap_blocks = (sb->nb_inodes + bits_par_bloc - 1) / bits_par_bloc;
+    sb->block_bitmap_start = sb->inode_bitmap_start + sb->inode_bitmap_blocks;
+    sb->block_bitmap_blocks = (sb->nb_blocks + bits_par_bloc - 1) / bits_par_bloc;
+    sb->inode_table_start = sb->block_bitmap_start + sb->block_bitmap_blocks;
+    sb->inode_table_blocks = (sb->nb_inodes + FS_INODES_PER_BLOCK - 1) / FS_INODES_PER_BLOCK;
+    sb->features = FS_FEATURE_CSUM | FS_FEATURE_DEDUP | FS_FEATURE_SCRUB | FS_FEATURE_LAZY_INIT;
+    sb->csum_start = sb->inode_table_start + sb->inode_table_blocks;
+    sb->csum_blocks = (sb->nb_blocks + FS_CSUMS_PER_BLOCK - 1) / FS_CSUMS_PER_BLOCK;
+    sb->ref_start = sb->csum_start + sb->csum_blocks;
+    sb->ref_blocks = (sb->nb_blocks + FS_REFS_PER_BLOCK - 1) / FS_REFS_PER_BLOCK;
+    sb->journal_start = sb->ref_start + sb->ref_blocks;
+    sb->journal_blocks = sb->nb_blocks / 32;
+    if (sb->journal_blocks < 64)
+        sb->journal_blocks = 64;
+    if (sb->journal_blocks > 8192)
+        sb->journal_blocks = 8192;
+    sb->data_start = sb->journal_start + sb->journal_blocks;
+    sb->root_inode = FS_ROOT_INODE;
+    sb->state = FS_STATE_MOUNTED;
+
+    free(p->inode_bitmap);
+    free(p->block_bitmap);
+    free(p->bitmap_blocks_dirty);
+    p->inode_bitmap = calloc(sb->inode_bitmap_blocks, FS_BLOCK_SIZE);
+    p->block_bitmap = calloc(sb->block_bitmap_blocks, FS_BLOCK_SIZE);
+    p->bitmap_blocks_dirty = calloc(sb->inode_bitmap_blocks + sb->block_bitmap_blocks, 1);
+    //Les blocs de metadonnees et les inodes 0 et racine sont occupes
+    for (uint32_t i = 0; i < sb->data_start; i++)
+        bit_set(p->block_bitmap, i);
+    bit_set(p->inode_bitmap, 0);
+    bit_set(p->inode_bitmap, FS_ROOT_INODE);
+    sb->free_blocks = sb->nb_blocks - sb->data_start;
+    sb->free_inodes = sb->nb_inodes - 2;
+    init_regions(p);
+    pcache_reset(p);
+    csum_alloc_table(p);
+    ref_alloc_table(p);
+    p->next_free_block = sb->data_start;
+    p->size = size;
+
+    disk_inode racine;
+    memset(&racine, 0, sizeof(racine));
+    racine.type = FS_TYPE_DIR;
+    racine.perms = 7;
+    racine.links = 1;
+    racine.parent = FS_ROOT_INODE;
+    if (write_inode(p, FS_ROOT_INODE, &racine) < 0 || journal_format(p) < 0)
+        return -1;
+    //Seuls les blocs de bitmaps non nuls sont ecrits, les tables restent a initialiser
+    bitmap_dirty(p, p->inode_bitmap, FS_ROOT_INODE);
+    for (uint32_t i = 0; i < sb->data_start; i += bits_par_bloc)
+        bitmap_dirty(p, p->block_bitmap, i);
+    int ret = sync_partition(p);
+    p->journal.enabled = journal_actif;
+    if (ret == 0 && (p->flags & FS_MOUNT_DEDUP))
+        dedup_start(p);
+    return ret;
+}
+
+//Projeter toute l'image en memoire (mode FS_MOUNT_MMAP)
+int map_partition(filesystem *p) {
+    if (p->size == 0)
+        return 0;
+    int prot = (p->flags & FS_MOUNT_RDONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *map = mmap(NULL, p->size, prot, MAP_SHARED, p->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Erreur : mmap de la partition");
+        return -1;
+    }
+    p->map = map;
+    p->dirty_lo = p->dirty_hi = 0;
+    return 0;
+}
+
+/*
+ * Monter la partition : 0 si montee, 1 si elle n'est pas formatee, -1 si erreur.
+ * flags : FS_MOUNT_MMAP pour lire/ecrire dans une projection de l'image,
+ * FS_MOUNT_RDONLY pour ouvrir sans rien modifier (mesures, verification).
+ */
+int mount_partition(filesystem *p, const char *filename, int flags) {
+    memset(p, 0, sizeof(filesystem));
+    pthread_mutex_init(&p->lock, NULL);
+    p->flags = flags;
+    if (flags & FS_MOUNT_RDONLY)
+        p->fd = open(filename, O_RDONLY);
+    else
+        p->fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (p->fd == -1) {
+        perror("Erreur 117 : Impossible d'ouvrir la partition");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(p->fd, &st) == -1) {
+        perror("Erreur : fstat sur la partition");
+        return -1;
+    }
+    p->size = st.st_size;
+    if ((flags & FS_MOUNT_MMAP) && map_partition(p) < 0)
+        return -1;
+    if (!(flags & FS_MOUNT_MMAP))
+        io_init(p, (flags & FS_MOUNT_SYNC_IO) ? IO_BACKEND_SYNC : IO_BACKEND_URING);
+    char bloc[FS_BLOCK_SIZE];
+    if (p->size < FS_BLOCK_SIZE || read_block(p, 0, bloc) < 0)
+        return 1;
+    memcpy(&p->sb, bloc, sizeof(superblock));
+    superblock *sb = &p->sb;
+    if (sb->magic != FS_MAGIC || sb->version != FS_VERSION || sb->block_size != FS_BLOCK_SIZE)
+        return 1;
+    if ((size_t)sb->nb_blocks * FS_BLOCK_SIZE > p->size) {
+        printf("Superbloc incoherent avec la taille de l'image.\n");
+        return -1;
+    }
+    if ((sb->features & FS_FEATURE_CSUM) && !(flags & FS_MOUNT_NO_CSUM) && sb->checksum != superblock_checksum(sb)) {
+        printf("Superbloc corrompu (somme de controle invalide).\n");
+        return -1;
+    }
+    int bavard = !(flags & FS_MOUNT_QUIET);
+    if (sb->state != FS_STATE_CLEAN && !(flags & FS_MOUNT_RDONLY) && bavard)
+        printf("Attention : la partition n'a pas ete demontee proprement.\n");
+    //Les transactions validees mais pas encore recopiees sont rejouees avant tout
+    if (sb->journal_blocks && !(flags & FS_MOUNT_RDONLY)) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int rejouees = journal_replay(p);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (rejouees < 0)
+            return -1;
+        p->journal.replayed = rejouees;
+        p->journal.replay_time = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        if (rejouees > 0 && bavard)
+            printf("Journal : %d transaction(s) rejouee(s) en %.2f ms.\n", rejouees, p->journal.replay_time * 1e3);
+    }
+    p->inode_bitmap = malloc((size_t)sb->inode_bitmap_blocks * FS_BLOCK_SIZE);
+    p->block_bitmap = malloc((size_t)sb->block_bitmap_blocks * FS_BLOCK_SIZE);
+    p->bitmap_blocks_dirty = calloc(sb->inode_bitmap_blocks + sb->block_bitmap_blocks, 1);
+    if (read_blocks(p, sb->inode_bitmap_start, sb->inode_bitmap_blocks, p->inode_bitmap) < 0 ||
+        read_blocks(p, sb->block_bitmap_start, sb->block_bitmap_blocks, p->block_bitmap) < 0)
+        return -1;
+    //Tables des sommes et des references apres le rejeu, qui a pu en reecrire des blocs
+    csum_alloc_table(p);
+    ref_alloc_table(p);
+    for (uint32_t b = 0; b < sb->inode_bitmap_blocks + sb->block_bitmap_blocks; b++) {
+        if (csum_verify(p, sb->inode_bitmap_start + b, bitmap_block_ptr(p, b)) < 0)
+            printf("Attention : bitmap corrompue, lancez fsck.\n");
+    }
+    if (sb->state != FS_STATE_CLEAN)
+        recount_free(p);
+    else
+        init_regions(p);
+    p->next_free_block = sb->data_start;
+    if (flags & FS_MOUNT_RDONLY)
+        return 0;
+    if ((flags & FS_MOUNT_DEDUP) && dedup_start(p) < 0)
+        p->flags &= ~FS_MOUNT_DEDUP;
+    if ((flags & FS_MOUNT_CDC) && !p->ref_table) {
+        //Les morceaux repris sont comptes dans la table des references
+        printf("Stockage par morceaux indisponible : image formatee avant l'ajout de la table des references.\n");
+        p->flags &= ~FS_MOUNT_CDC;
+    }
+    if (p->flags & FS_MOUNT_CDC)
+        chunk_index_files(p);
+    sb->state = FS_STATE_MOUNTED;
+    sb->mount_count++;
+    if (write_superblock(p) < 0)
+        return -1;
+    return 0;
+}
+
+int write_superblock(filesystem *p) {
+    char bloc[FS_BLOCK_SIZE];
+    memset(bloc, 0, sizeof(bloc));
+    p->sb.checksum = (p->sb.features & FS_FEATURE_CSUM) ? superblock_checksum(&p->sb) : 0;
+    memcpy(bloc, &p->sb, sizeof(superblock));
+    return write_block(p, 0, bloc);
+}
+
+/*
+ * Point de synchronisation apres une operation. Avec journal, l'operation
+ * est ajoutee a la transaction en cours (validee selon le mode de
+ * durabilite) ; sans journal, bitmaps et superbloc sont ecrits et forces.
+ */
+int sync_partition(filesystem *p) {
+    superblock *sb = &p->sb;
+    if (p->flags & FS_MOUNT_RDONLY)
+        return 0;
+    if (p->journal.enabled)
+        return journal_end_op(p);
+    csum_seal_bitmaps(p);
+    if (p->bitmaps_dirty) {
+        uint32_t nb = sb->inode_bitmap_blocks + sb->block_bitmap_blocks;
+        for (uint32_t b = 0; b < nb; b++) {
+            if (!p->bitmap_blocks_dirty[b])
+                continue;
+            if (write_block(p, sb->inode_bitmap_start + b, bitmap_block_ptr(p, b)) < 0)
+                return -1;
+            p->bitmap_blocks_dirty[b] = 0;
+        }
+        p->bitmaps_dirty = 0;
+    }
+    for (uint32_t t = 0; p->csum_nb_dirty && t < sb->csum_blocks; t++) {
+        if (!p->csum_dirty[t])
+            continue;
+        if (write_block(p, sb->csum_start + t, csum_block_ptr(p, t)) < 0)
+            return -1;
+        csum_clean(p, t);
+    }
+    for (uint32_t t = 0; p->ref_nb_dirty && t < sb->ref_blocks; t++) {
+        if (!p->ref_dirty[t])
+            continue;
+        if (write_block(p, sb->ref_start + t, ref_block_ptr(p, t)) < 0)
+            return -1;
+        ref_clean(p, t);
+    }
+    if (write_superblock(p) < 0)
+        return -1;
+    return flush_device(p);
+}
+
+//Demonter : tout ecrire, marquer la partition propre et fermer
+int unmount_partition(filesystem *p) {
+    int ret = 0;
+    if (p->journal.enabled) {
+        //Tout est valide et recopie, le journal est vide
+        pthread_mutex_unlock(&p->lock);
+        ret = journal_stop(p);
+        pthread_mutex_lock(&p->lock);
+    }
+    p->sb.state = FS_STATE_CLEAN;
+    if (sync_partition(p) < 0)
+        ret = -1;
+    if (p->map)
+        munmap(p->map, p->size);
+    p->map = NULL;
+    io_close(p);
+    pcache_close(p);
+    close(p->fd);
+    p->fd = -1;
+    free(p->inode_bitmap);
+    free(p->block_bitmap);
+    free(p->bitmap_blocks_dirty);
+    p->inode_bitmap = NULL;
+    p->block_bitmap = NULL;
+    p->bitmap_blocks_dirty = NULL;
+    free(p->inode_region_free);
+    free(p->block_region_free);
+    p->inode_region_free = NULL;
+    p->block_region_free = NULL;
+    csum_free_table(p);
+    ref_free_table(p);
+    dedup_stop(p);
+    chunk_reset(p);
+    return ret;
+}
+
+int read_inode(filesystem *p, uint32_t ino, disk_inode *out) {
+    if (ino == 0 || ino >= p->sb.nb_inodes) {
+        printf("Inode invalide : %u\n", ino);
+        return -1;
+    }
+    if (p->journal.enabled && journal_lookup_inode(p, ino, out))
+        return 0;
+    char bloc[FS_BLOCK_SIZE];
+    if (read_block(p, p->sb.inode_table_start + ino / FS_INODES_PER_BLOCK, bloc) < 0)
+        return -1;
+    memcpy(out, bloc + (ino % FS_INODES_PER_BLOCK) * sizeof(disk_inode), sizeof(disk_inode));
+    return inode_verify(p, ino, out);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Lire nb inodes d'un coup : chaque bloc de la table concerne n'est lu
+ * qu'une fois, et tous les blocs sont demandes dans un seul lot d'E/S.
+ */
+int read_inodes(filesystem *p, const uint32_t *inos, int nb, disk_inode *out) {
+    if (p->map || nb <= 1) {
+        for (int i = 0; i < nb; i++) {
+            if (read_inode(p, inos[i], &out[i]) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    uint32_t *blocs = malloc(nb * sizeof(uint32_t));
+    int nb_blocs = 0;
+    for (int i = 0; i < nb; i++) {
+        if (inos[i] == 0 || inos[i] >= p->sb.nb_inodes) {
+            printf("Inode invalide : %u\n", inos[i]);
+            free(blocs);
+            return -1;
+        }
+        blocs[nb_blocs++] = inos[i] / FS_INODES_PER_BLOCK;
+    }
+    qsort(blocs, nb_blocs, sizeof(uint32_t), cmp_u32);
+    int distincts = 0;
+    for (int i = 0; i < nb_blocs; i++) {
+        if (distincts == 0 || blocs[distincts - 1] != blocs[i])
+            blocs[distincts++] = blocs[i];
+    }
+    char *table = malloc((size_t)distincts * FS_BLOCK_SIZE);
+    io_request *reqs = malloc(distincts * sizeof(io_request));
+    for (int i = 0; i < distincts; i++) {
+        reqs[i].write = 0;
+        reqs[i].buf = table + (size_t)i * FS_BLOCK_SIZE;
+        reqs[i].len = FS_BLOCK_SIZE;
+        reqs[i].offset = (uint64_t)(p->sb.inode_table_start + blocs[i]) * FS_BLOCK_SIZE;
+    }
+    int ret = io_run(p, reqs, distincts);
+    for (int i = 0; ret == 0 && i < distincts; i++)
+        lazy_mask(&p->sb, p->sb.inode_table_start + blocs[i], 1, table + (size_t)i * FS_BLOCK_SIZE);
+    for (int i = 0; ret == 0 && i < nb; i++) {
+        if (p->journal.enabled && journal_lookup_inode(p, inos[i], &out[i]))
+            continue;
+        uint32_t b = inos[i] / FS_INODES_PER_BLOCK;
+        uint32_t *trouve = bsearch(&b, blocs, distincts, sizeof(uint32_t), cmp_u32);
+        memcpy(&out[i], table + (size_t)(trouve - blocs) * FS_BLOCK_SIZE + (inos[i] % FS_INODES_PER_BLOCK) * sizeof(disk_inode), sizeof(disk_inode));
+        if (inode_verify(p, inos[i], &out[i]) < 0)
+            ret = -1;
+    }
+    free(reqs);
+    free(table);
+    free(blocs);
+    return ret;
+}
+
+int write_inode(filesystem *p, uint32_t ino, const disk_inode *in) {
+    if (ino == 0 || ino >= p->sb.nb_inodes) {
+        printf("Inode invalide : %u\n", ino);
+        return -1;
+    }
+    disk_inode scelle = *in;
+    scelle.checksum = (p->sb.features & FS_FEATURE_CSUM) ? inode_checksum(ino, in) : 0;
+    //Avec journal, l'inode n'est recopie a sa place qu'apres le commit
+    if (p->journal.enabled)
+        return journal_log_inode(p, ino, &scelle);
+    char bloc[FS_BLOCK_SIZE];
+    uint32_t no = p->sb.inode_table_start + ino / FS_INODES_PER_BLOCK;
+    if (read_block(p, no, bloc) < 0)
+        return -1;
+    memcpy(bloc + (ino % FS_INODES_PER_BLOCK) * sizeof(disk_inode), &scelle, sizeof(disk_inode));
+    return write_block(p, no, bloc);
+}
+
+//Allouer un inode libre (0 si la table est pleine)
+uint32_t alloc_inode(filesystem *p) {
+    uint32_t i = bitmap_find_zero(p->inode_bitmap, p->inode_region_free, FS_ROOT_INODE + 1, p->sb.nb_inodes);
+    if (i < p->sb.nb_inodes) {
+        bit_set(p->inode_bitmap, i);
+        bitmap_dirty(p, p->inode_bitmap, i);
+        p->inode_region_free[i / FS_ALLOC_REGION_BITS]--;
+        p->sb.free_inodes--;
+        return i;
+    }
+    printf("Plus d'inode libre sur la partition.\n");
+    return 0;
+}
+
+void free_inode(filesystem *p, uint32_t ino) {
+    if (ino <= FS_ROOT_INODE || ino >= p->sb.nb_inodes || !bit_test(p->inode_bitmap, ino))
+        return;
+    pcache_invalidate(p, ino);
+    bit_clear(p->inode_bitmap, ino);
+    bitmap_dirty(p, p->inode_bitmap, ino);
+    p->inode_region_free[ino / FS_ALLOC_REGION_BITS]++;
+    p->sb.free_inodes++;
+}
+
+//Marquer occupe un inode utilise que la bitmap donne libre (reparation)
+void inode_mark_used(filesystem *p, uint32_t ino) {
+    if (ino >= p->sb.nb_inodes || bit_test(p->inode_bitmap, ino))
+        return;
+    bit_set(p->inode_bitmap, ino);
+    bitmap_dirty(p, p->inode_bitmap, ino);
+    p->inode_region_free[ino / FS_ALLOC_REGION_BITS]--;
+    p->sb.free_inodes--;
+}
+
+/*
+ * Chercher dans [from, to) un trou libre d'au moins nb blocs. Une region
+ * est sautee quand elle et celles qu'un trou partant d'elle couvrirait
+ * n'ont pas nb blocs libres a elles toutes.
+ */
+static int find_free_run(filesystem *p, uint32_t from, uint32_t to, uint32_t nb, uint32_t *debut) {
+    uint32_t nb_regions = (p->sb.nb_blocks + FS_ALLOC_REGION_BITS - 1) / FS_ALLOC_REGION_BITS;
+    uint32_t i = from;
+    while (i < to && to - i >= nb) {
+        uint32_t r = i / FS_ALLOC_REGION_BITS;
+        uint64_t derniere = ((uint64_t)(r + 1) * FS_ALLOC_REGION_BITS - 1 + nb - 1) / FS_ALLOC_REGION_BITS;
+        uint64_t libres = 0;
+        for (uint64_t k = r; k <= derniere && k < nb_regions && libres < nb; k++)
+            libres += p->block_region_free[k];
+        if (libres < nb) {
+            i = (r + 1) * FS_ALLOC_REGION_BITS;
+            continue;
+        }
+        i = bitmap_find_zero(p->block_bitmap, p->block_region_free, i, to);
+        if (i >= to || to - i < nb)
+            return 0;
+        uint32_t fin = bitmap_find_one(p->block_bitmap, p->block_region_free, i, i + nb);
+        if (fin - i == nb) {
+            *debut = i;
+            return 1;
+        }
+        i = fin;
+    }
+    return 0;
+}
+
+/*
+ * Allouer au plus nb blocs contigus. Pour plusieurs blocs, un trou assez
+ * long pour tout contenir est cherche d'abord ; a defaut, le premier trou
+ * libre apres next_free_block est pris (l'appelant completera). Une
+ * recherche qui echoue n'est pas refaite pour une longueur au moins egale
+ * tant qu'aucune liberation n'a pu creer un tel trou (run_echec).
+ * Retourne la longueur obtenue, 0 si la partition est pleine.
+ */
+uint32_t alloc_extent(filesystem *p, uint32_t nb, disk_extent *out) {
+    superblock *sb = &p->sb;
+    if (nb == 0 || sb->free_blocks == 0)
+        return 0;
+    uint32_t debut = p->next_free_block, len = 0;
+    if (debut < sb->data_start || debut >= sb->nb_blocks)
+        debut = sb->data_start;
+    uint32_t trouve;
+    if (nb > 1 && sb->free_blocks >= nb && (p->run_echec == 0 || nb < p->run_echec)) {
+        //Le second passage couvre aussi un trou a cheval sur le point de depart
+        uint32_t fin_tour = (uint64_t)debut + nb < sb->nb_blocks ? debut + nb : sb->nb_blocks;
+        if (find_free_run(p, debut, sb->nb_blocks, nb, &trouve) ||
+            find_free_run(p, sb->data_start, fin_tour, nb, &trouve))
+            len = nb;
+        else
+            p->run_echec = nb;
+    }
+    if (len == 0) {
+        trouve = bitmap_find_zero(p->block_bitmap, p->block_region_free, debut, sb->nb_blocks);
+        if (trouve >= sb->nb_blocks) {
+            trouve = bitmap_find_zero(p->block_bitmap, p->block_region_free, sb->data_start, debut);
+            if (trouve >= debut)
+                return 0;
+        }
+        uint32_t limite = nb < sb->nb_blocks - trouve ? trouve + nb : sb->nb_blocks;
+        len = bitmap_find_one(p->block_bitmap, p->block_region_free, trouve, limite) - trouve;
+    }
+    bitmap_set_range(p, p->block_bitmap, p->block_region_free, trouve, len);
+    out->start = trouve;
+    out->len = len;
+    sb->free_blocks -= len;
+    p->next_free_block = trouve + len;
+    return len;
+}
+
+//Marquer occupe un bloc utilise que la bitmap donne libre (reparation)
+void block_mark_used(filesystem *p, uint32_t no) {
+    if (no < p->sb.data_start || no >= p->sb.nb_blocks || bit_test(p->block_bitmap, no))
+        return;
+    bitmap_set_range(p, p->block_bitmap, p->block_region_free, no, 1);
+    p->sb.free_blocks--;
+}
+
+//Rendre immediatement des blocs libres dans la bitmap
+void release_extent(filesystem *p, const disk_extent *ext) {
+    for (uint32_t i = 0; i < ext->len; i++) {
+        uint32_t b = ext->start + i;
+        if (b < p->sb.data_start || b >= p->sb.nb_blocks || !bit_test(p->block_bitmap, b))
+            continue;
+        bit_clear(p->block_bitmap, b);
+        bitmap_dirty(p, p->block_bitmap, b);
+        p->block_region_free[b / FS_ALLOC_REGION_BITS]++;
+        p->sb.free_blocks++;
+    }
+    if (ext->start < p->next_free_block)
+        p->next_free_block = ext->start;
+    //Le trou fusionne avec ses voisins : assez long pour relancer la recherche ?
+    if (p->run_echec && ext->len && ext->start + ext->len <= p->sb.nb_blocks) {
+        uint32_t fin = ext->start + ext->len, avant = 0;
+        uint32_t limite = p->run_echec < p->sb.nb_blocks - fin ? fin + p->run_echec : p->sb.nb_blocks;
+        uint32_t apres = bitmap_find_one(p->block_bitmap, p->block_region_free, fin, limite) - fin;
+        while (avant < p->run_echec && ext->start - avant > p->sb.data_start &&
+               !bit_test(p->block_bitmap, ext->start - avant - 1))
+            avant++;
+        if ((uint64_t)avant + ext->len + apres >= p->run_echec)
+            p->run_echec = 0;
+    }
+}
+
+//Liberer des blocs non partages (differe jusqu'au commit si le journal est actif)
+static void free_run(filesystem *p, uint32_t debut, uint32_t len) {
+    if (len == 0)
+        return;
+    disk_extent ext = { debut, len };
+    for (uint32_t i = 0; p->dedup.cases && i < len; i++)
+        dedup_forget(p, debut + i);
+    for (uint32_t i = 0; p->chunks.by_block.nb && i < len; i++)
+        chunk_forget(p, debut + i);
+    if (p->journal.enabled)
+        journal_defer_free(p, &ext);
+    else
+        release_extent(p, &ext);
+}
+
+//Liberer des blocs ; un bloc partage (deduplique) perd seulement une reference
+void free_extent(filesystem *p, const disk_extent *ext) {
+    uint32_t debut = ext->start, fin = ext->start + ext->len;
+    for (uint32_t b = debut; p->ref_table && b < fin; b++) {
+        if (ref_drop(p, b)) {
+            free_run(p, debut, b - debut);
+            debut = b + 1;
+        }
+    }
+    free_run(p, debut, fin - debut);
+}
+
+//Lire la liste complete des extents d'un inode (tableau a liberer)
+int inode_get_extents(filesystem *p, const disk_inode *inode, disk_extent **out) {
+    uint32_t nb = inode->nb_extents;
+    *out = malloc((nb ? nb : 1) * sizeof(disk_extent));
+    uint32_t inline_nb = nb < FS_INLINE_EXTENTS ? nb : FS_INLINE_EXTENTS;
+    memcpy(*out, inode->extents, inline_nb * sizeof(disk_extent));
+    if (nb > FS_INLINE_EXTENTS) {
+        disk_extent bloc[FS_EXTENTS_PER_BLOCK];
+        if (read_block(p, inode->extent_block, bloc) < 0) {
+            free(*out);
+            *out = NULL;
+            return -1;
+        }
+        memcpy(*out + FS_INLINE_EXTENTS, bloc, (nb - FS_INLINE_EXTENTS) * sizeof(disk_extent));
+    }
+    return nb;
+}
+
+//Liberer tous les blocs de donnees d'un inode
+void inode_free_blocks(filesystem *p, disk_inode *inode) {
+    disk_extent *ext = NULL;
+    int nb = inode_get_extents(p, inode, &ext);
+    for (int i = 0; i < nb; i++)
+        free_extent(p, &ext[i]);
+    free(ext);
+    if (inode->extent_block) {
+        disk_extent bloc_ext = { inode->extent_block, 1 };
+        free_extent(p, &bloc_ext);
+    }
+    inode->nb_extents = 0;
+    inode->extent_block = 0;
+    memset(inode->extents, 0, sizeof(inode->extents));
+}
+
+/*
+ * Donner a un inode sans blocs la liste d'extents ext. Les extents au-dela
+ * de FS_INLINE_EXTENTS vont dans un bloc d'extents ; en cas d'echec, les
+ * blocs de la liste sont liberes.
+ */
+static int inode_set_extents(filesystem *p, disk_inode *inode, const disk_extent *ext, uint32_t nb_ext) {
+    inode->nb_extents = nb_ext;
+    uint32_t inline_nb = nb_ext < FS_INLINE_EXTENTS ? nb_ext : FS_INLINE_EXTENTS;
+    memcpy(inode->extents, ext, inline_nb * sizeof(disk_extent));
+    if (nb_ext > FS_INLINE_EXTENTS) {
+        disk_extent bloc_ext;
+        disk_extent bloc[FS_EXTENTS_PER_BLOCK];
+        memset(bloc, 0, sizeof(bloc));
+        memcpy(bloc, ext + FS_INLINE_EXTENTS, (nb_ext - FS_INLINE_EXTENTS) * sizeof(disk_extent));
+        if (alloc_extent(p, 1, &bloc_ext) == 0 || write_block(p, bloc_ext.start, bloc) < 0) {
+            for (uint32_t i = 0; i < nb_ext; i++)
+                free_extent(p, &ext[i]);
+            inode->nb_extents = 0;
+            return -1;
+        }
+        inode->extent_block = bloc_ext.start;
+    }
+    return 0;
+}
+
+//Allouer nb blocs a un inode sans blocs, en extents les plus longs possible
+int inode_alloc_blocks(filesystem *p, disk_inode *inode, uint32_t nb) {
+    disk_extent ext[FS_INLINE_EXTENTS + FS_EXTENTS_PER_BLOCK];
+    uint32_t nb_ext = 0, obtenus = 0;
+    uint32_t max_ext = FS_INLINE_EXTENTS + FS_EXTENTS_PER_BLOCK;
+    while (obtenus < nb) {
+        if (nb_ext == max_ext || alloc_extent(p, nb - obtenus, &ext[nb_ext]) == 0) {
+            printf("Plus assez de blocs libres sur la partition.\n");
+            for (uint32_t i = 0; i < nb_ext; i++)
+                free_extent(p, &ext[i]);
+            return -1;
+        }
+        obtenus += ext[nb_ext].len;
+        nb_ext++;
+    }
+    return inode_set_extents(p, inode, ext, nb_ext);
+}
+
+/* --- Compression des fichiers ---
+ *
+ * Un contenu compresse est decoupe en morceaux de FS_BLOCK_SIZE octets,
+ * compresses independamment (lz.c). Le flux stocke commence par une table
+ * de fins (uint32_t par morceau, position dans la suite du flux), puis les
+ * morceaux bout a bout ; un morceau qui ne gagne rien est stocke tel quel
+ * (sa longueur est alors celle de l'original). Lire un bloc du fichier ne
+ * demande que son entree de la table et son morceau.
+ */
+
+//Flux compresse de data, ou NULL s'il ne fait pas gagner au moins un bloc
+static char *compress_stream(const char *data, size_t size, uint32_t *stored) {
+    uint32_t nb = (size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    size_t entete = (size_t)nb * sizeof(uint32_t);
+    //Au pire, la table et tous les morceaux tels quels
+    char *flux = malloc(entete + size);
+    uint32_t *fins = (uint32_t *)flux;
+    char *morceaux = flux + entete;
+    uint32_t pos = 0;
+    for (uint32_t k = 0; k < nb; k++) {
+        size_t off = (size_t)k * FS_BLOCK_SIZE;
+        int len = size - off < FS_BLOCK_SIZE ? (int)(size - off) : FS_BLOCK_SIZE;
+        int n = lz_compress(data + off, len, morceaux + pos, len - 1);
+        if (n < 0) {
+            memcpy(morceaux + pos, data + off, len);
+            n = len;
+        }
+        pos += n;
+        fins[k] = pos;
+    }
+    uint64_t total = entete + pos;
+    if (total > UINT32_MAX || (total + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE >= nb) {
+        free(flux);
+        return NULL;
+    }
+    *stored = total;
+    return flux;
+}
+
+static int stream_corrupt() {
+    printf("Erreur : contenu compresse corrompu.\n");
+    return -1;
+}
+
+//Un morceau de len octets stockes vers out_len octets du fichier
+static int decompress_chunk(const char *morceau, uint32_t len, char *out, uint32_t out_len) {
+    if (len == out_len) {
+        memcpy(out, morceau, len);
+        return 0;
+    }
+    if (len > out_len || lz_decompress(morceau, len, out, out_len) != (int)out_len)
+        return stream_corrupt();
+    return 0;
+}
+
+static int decompress_stream(const char *flux, uint32_t stored, char *out, size_t size) {
+    uint32_t nb = (size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    size_t entete = (size_t)nb * sizeof(uint32_t);
+    if (entete > stored)
+        return stream_corrupt();
+    const uint32_t *fins = (const uint32_t *)flux;
+    uint32_t debut = 0;
+    for (uint32_t k = 0; k < nb; k++) {
+        size_t off = (size_t)k * FS_BLOCK_SIZE;
+        uint32_t len = size - off < FS_BLOCK_SIZE ? size - off : FS_BLOCK_SIZE;
+        if (fins[k] < debut || fins[k] > stored - entete)
+            return stream_corrupt();
+        if (decompress_chunk(flux + entete + debut, fins[k] - debut, out + off, len) < 0)
+            return -1;
+        debut = fins[k];
+    }
+    return 0;
+}
+
+//Ecrire size octets dans les blocs (deja liberes) de l'inode
+static int write_inode_blocks(filesystem *p, disk_inode *inode, const char *data, size_t size) {
+    uint32_t nb = (size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    if (nb == 0)
+        return 0;
+    if (inode_alloc_blocks(p, inode, nb) < 0)
+        return -1;
+    disk_extent *ext = NULL;
+    int nb_ext = inode_get_extents(p, inode, &ext);
+    const char *src = data;
+    size_t reste = size;
+    for (int i = 0; i < nb_ext && reste > 0; i++) {
+        size_t len = (size_t)ext[i].len * FS_BLOCK_SIZE;
+        int ret;
+        if (reste >= len) {
+            ret = write_blocks(p, ext[i].start, ext[i].len, src);
+        } else {
+            //Dernier extent : on complete le dernier bloc avec des zeros
+            char *tampon = calloc(ext[i].len, FS_BLOCK_SIZE);
+            memcpy(tampon, src, reste);
+            ret = write_blocks(p, ext[i].start, ext[i].len, tampon);
+            free(tampon);
+            len = reste;
+        }
+        if (ret < 0) {
+            free(ext);
+            return -1;
+        }
+        src += len;
+        reste -= len;
+    }
+    free(ext);
+    return 0;
+}
+
+//Bloc k du contenu (le dernier, complete par des zeros, est dans dernier)
+static const char *dedup_block(const char *data, const char *dernier, uint32_t nb, uint32_t k) {
+    return k == nb - 1 ? dernier : data + (size_t)k * FS_BLOCK_SIZE;
+}
+
+//Ajouter un bloc ou une suite de blocs a la liste, en prolongeant le dernier extent si possible
+static void extent_append(disk_extent *ext, uint32_t *nb_ext, uint32_t debut, uint32_t len) {
+    if (*nb_ext > 0 && ext[*nb_ext - 1].start + ext[*nb_ext - 1].len == debut) {
+        ext[*nb_ext - 1].len += len;
+        return;
+    }
+    ext[*nb_ext].start = debut;
+    ext[*nb_ext].len = len;
+    (*nb_ext)++;
+}
+
+static uint32_t suite_hash(uint32_t cap, uint32_t somme) {
+    return (somme * 2654435761u) & (cap - 1);
+}
+
+static void suite_add(uint32_t *suite, uint32_t cap, const uint32_t *sommes, uint32_t k) {
+    uint32_t h = suite_hash(cap, sommes[k]);
+    while (suite[h])
+        h = (h + 1) & (cap - 1);
+    suite[h] = k + 1;
+}
+
+/*
+ * Ecriture avec deduplication (fichiers, FS_MOUNT_DEDUP). Chaque bloc est
+ * cherche dans l'index : un bloc deja present gagne une reference, les
+ * autres sont alloues par suites de blocs nouveaux consecutifs. Une suite
+ * s'arrete aussi sur un bloc egal a l'un des siens, qui sera trouve dans
+ * l'index une fois la suite ecrite. Plus rien n'est partage quand la moitie
+ * des extents possibles est prise, pour toujours pouvoir finir le fichier.
+ */
+static int write_inode_blocks_dedup(filesystem *p, disk_inode *inode, const char *data, size_t size) {
+    uint32_t nb = (size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    if (nb == 0)
+        return 0;
+    uint32_t max_ext = FS_INLINE_EXTENTS + FS_EXTENTS_PER_BLOCK;
+    disk_extent *ext = malloc(max_ext * sizeof(disk_extent));
+    uint32_t *sommes = malloc(nb * sizeof(uint32_t));
+    char *dernier = calloc(1, FS_BLOCK_SIZE);
+    memcpy(dernier, data + (size_t)(nb - 1) * FS_BLOCK_SIZE, size - (size_t)(nb - 1) * FS_BLOCK_SIZE);
+    for (uint32_t k = 0; k < nb; k++)
+        sommes[k] = crc32c(0, dedup_block(data, dernier, nb, k), FS_BLOCK_SIZE);
+    //Blocs de la suite en cours par somme (indice + 1, 0 : case vide)
+    uint32_t cap = 16;
+    while (cap < nb * 2)
+        cap *= 2;
+    uint32_t *suite = calloc(cap, sizeof(uint32_t));
+
+    uint32_t nb_ext = 0, k = 0, doublon = 0;
+    int ret = 0;
+    while (k < nb && ret == 0) {
+        int partage = nb_ext < max_ext / 2;
+        uint32_t phys = doublon ? doublon : partage ? dedup_find(p, sommes[k], dedup_block(data, dernier, nb, k)) : 0;
+        doublon = 0;
+        if (phys) {
+            dedup_share(p, phys);
+            extent_append(ext, &nb_ext, phys, 1);
+            k++;
+            continue;
+        }
+        //Suite [k, fin) de blocs a ecrire
+        uint32_t fin = partage ? k + 1 : nb;
+        if (partage)
+            suite_add(suite, cap, sommes, k);
+        while (fin < nb) {
+            const char *bloc = dedup_block(data, dernier, nb, fin);
+            int interne = 0;
+            for (uint32_t h = suite_hash(cap, sommes[fin]); suite[h] && !interne; h = (h + 1) & (cap - 1)) {
+                uint32_t j = suite[h] - 1;
+                interne = sommes[j] == sommes[fin] && memcmp(dedup_block(data, dernier, nb, j), bloc, FS_BLOCK_SIZE) == 0;
+            }
+            if (interne || (doublon = dedup_find(p, sommes[fin], bloc)) != 0)
+                break;
+            suite_add(suite, cap, sommes, fin++);
+        }
+        //Vider les cases de la suite (seulement celles utilisees)
+        for (uint32_t i = k; partage && i < fin; i++) {
+            for (uint32_t h = suite_hash(cap, sommes[i]); suite[h]; h = (h + 1) & (cap - 1))
+                suite[h] = 0;
+        }
+        while (k < fin) {
+            disk_extent e;
+            if (nb_ext == max_ext || alloc_extent(p, fin - k, &e) == 0) {
+                printf("Plus assez de blocs libres sur la partition.\n");
+                ret = -1;
+                break;
+            }
+            uint32_t pleins = k + e.len == nb ? e.len - 1 : e.len;
+            if ((pleins && write_blocks(p, e.start, pleins, data + (size_t)k * FS_BLOCK_SIZE) < 0) ||
+                (pleins < e.len && write_block(p, e.start + pleins, dernier) < 0))
+                ret = -1;
+            for (uint32_t i = 0; i < e.len; i++)
+                dedup_insert(p, sommes[k + i], e.start + i);
+            extent_append(ext, &nb_ext, e.start, e.len);
+            p->dedup.written += e.len;
+            k += e.len;
+            if (ret < 0)
+                break;
+        }
+    }
+    if (ret == 0)
+        ret = inode_set_extents(p, inode, ext, nb_ext);
+    else {
+        for (uint32_t i = 0; i < nb_ext; i++)
+            free_extent(p, &ext[i]);
+    }
+    free(suite);
+    free(dernier);
+    free(sommes);
+    free(ext);
+    return ret;
+}
+
+//Octets [off, off + len[ du contenu stocke (len > 0)
+static int read_stored_range(filesystem *p, const disk_extent *ext, int nb_ext, uint64_t off, uint32_t len, char *out) {
+    char bloc[FS_BLOCK_SIZE];
+    uint64_t base = 0; //Premier octet couvert par l'extent i
+    int i = 0;
+    while (len > 0) {
+        while (i < nb_ext && off >= base + (uint64_t)ext[i].len * FS_BLOCK_SIZE) {
+            base += (uint64_t)ext[i].len * FS_BLOCK_SIZE;
+            i++;
+        }
+        if (i == nb_ext)
+            return -1;
+        uint32_t no = ext[i].start + (off - base) / FS_BLOCK_SIZE;
+        uint32_t dans = off % FS_BLOCK_SIZE;
+        uint32_t n = FS_BLOCK_SIZE - dans < len ? FS_BLOCK_SIZE - dans : len;
+        if (read_block(p, no, bloc) < 0)
+            return -1;
+        memcpy(out, bloc + dans, n);
+        out += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* --- Stockage par morceaux (FS_MOUNT_CDC) ---
+ *
+ * Le contenu est decoupe en morceaux definis par le contenu (cdc.c), chacun
+ * stocke sur des blocs entiers. Le flux stocke commence par la recette
+ * (cdc_recipe puis un cdc_ref par morceau, completee jusqu'a un bloc) et se
+ * poursuit par les morceaux, dans l'ordre. Un morceau deja present dans la
+ * table des morceaux (dont ceux de l'ancienne version du fichier) n'est pas
+ * reecrit : ses blocs gagnent une reference, comme en deduplication. Une
+ * nouvelle version qui ne differe que par une insertion ne stocke donc que
+ * les morceaux autour de l'insertion.
+ */
+
+typedef struct { uint32_t nb, reserved; } cdc_recipe;
+typedef struct { uint32_t len, crc; } cdc_ref;
+
+static uint32_t chunk_nblk(uint32_t len) {
+    return (len + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+}
+
+static uint32_t recipe_blocks(uint32_t nb) {
+    return (sizeof(cdc_recipe) + (uint64_t)nb * sizeof(cdc_ref) + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+}
+
+static int chunks_corrupt() {
+    printf("Erreur : contenu par morceaux corrompu.\n");
+    return -1;
+}
+
+//Recette d'un flux stocke par morceaux (tableau a liberer), ou NULL
+static cdc_ref *read_recipe(filesystem *p, const disk_extent *ext, int nb_ext, uint32_t stored, uint32_t *nb) {
+    cdc_recipe r;
+    if (stored < sizeof(r) || read_stored_range(p, ext, nb_ext, 0, sizeof(r), (char *)&r) < 0)
+        return NULL;
+    if ((uint64_t)recipe_blocks(r.nb) * FS_BLOCK_SIZE > stored) {
+        chunks_corrupt();
+        return NULL;
+    }
+    cdc_ref *refs = malloc((r.nb ? r.nb : 1) * sizeof(cdc_ref));
+    if (r.nb && read_stored_range(p, ext, nb_ext, sizeof(r), r.nb * sizeof(cdc_ref), (char *)refs) < 0) {
+        free(refs);
+        return NULL;
+    }
+    *nb = r.nb;
+    return refs;
+}
+
+//Bloc physique du bloc s du flux stocke (0 si hors des extents)
+static uint32_t stored_block(const disk_extent *ext, int nb_ext, uint32_t s) {
+    for (int i = 0; i < nb_ext; s -= ext[i].len, i++) {
+        if (s < ext[i].len)
+            return ext[i].start + s;
+    }
+    return 0;
+}
+
+//Ajouter a la table les morceaux (d'un seul tenant) de la version stockee d'un fichier
+static void index_chunks(filesystem *p, const disk_inode *inode) {
+    disk_extent *ext = NULL;
+    int nb_ext = inode_get_extents(p, inode, &ext);
+    uint32_t nb = 0;
+    cdc_ref *refs = nb_ext > 0 ? read_recipe(p, ext, nb_ext, inode->stored_size, &nb) : NULL;
+    uint32_t s = refs ? recipe_blocks(nb) : 0;
+    for (uint32_t j = 0; refs && j < nb; j++) {
+        uint32_t nblk = chunk_nblk(refs[j].len);
+        uint32_t debut = stored_block(ext, nb_ext, s), fin = stored_block(ext, nb_ext, s + nblk - 1);
+        if (nblk && debut && fin == debut + nblk - 1)
+            chunk_insert(p, refs[j].crc, refs[j].len, debut);
+        s += nblk;
+    }
+    free(refs);
+    free(ext);
+}
+
+//Construire la table des morceaux a partir des recettes de tous les fichiers stockes par morceaux
+void chunk_index_files(filesystem *p) {
+    uint32_t inos[256];
+    disk_inode inodes[256];
+    int nb = 0;
+    for (uint32_t ino = 1; ino < p->sb.nb_inodes; ino++) {
+        if (bit_test(p->inode_bitmap, ino))
+            inos[nb++] = ino;
+        if (nb == 0 || (nb < 256 && ino + 1 < p->sb.nb_inodes))
+            continue;
+        if (read_inodes(p, inos, nb, inodes) == 0) {
+            for (int i = 0; i < nb; i++) {
+                if (inodes[i].type == FS_TYPE_FILE && (inodes[i].flags & FS_INODE_CHUNKED))
+                    index_chunks(p, &inodes[i]);
+            }
+        }
+        nb = 0;
+    }
+}
+
+/*
+ * Ecrire nblk blocs de src sur des blocs neufs, ajoutes a la liste ext.
+ * *debut recoit le premier bloc s'ils sont d'un seul tenant, 0 sinon.
+ */
+static int write_new_run(filesystem *p, disk_extent *ext, uint32_t *nb_ext, uint32_t max_ext, const char *src,
+                         uint32_t nblk, uint32_t *debut) {
+    *debut = 0;
+    for (uint32_t fait = 0; fait < nblk; ) {
+        disk_extent e;
+        if (*nb_ext == max_ext || alloc_extent(p, nblk - fait, &e) == 0) {
+            printf("Plus assez de blocs libres sur la partition.\n");
+            return -1;
+        }
+        extent_append(ext, nb_ext, e.start, e.len);
+        if (write_blocks(p, e.start, e.len, src + (size_t)fait * FS_BLOCK_SIZE) < 0)
+            return -1;
+        if (fait == 0 && e.len == nblk)
+            *debut = e.start;
+        fait += e.len;
+    }
+    return 0;
+}
+
+/*
+ * Remplacer le contenu d'un fichier par son stockage en morceaux. Les
+ * morceaux deja stockes sont cherches avant de liberer l'ancienne version
+ * (qui est d'abord ajoutee a la table), puis les nouveaux sont ecrits.
+ * Comme en deduplication, plus rien n'est partage quand la moitie des
+ * extents possibles est prise. Retourne 1, sans rien modifier, si le flux
+ * ne tiendrait pas dans stored_size.
+ */
+static int write_inode_chunks(filesystem *p, disk_inode *inode, const char *data, size_t size) {
+    uint32_t cap = 64, nb = 0;
+    uint32_t *lens = malloc(cap * sizeof(uint32_t));
+    uint64_t blocs = 0;
+    for (size_t off = 0; off < size; nb++) {
+        if (nb == cap) {
+            cap *= 2;
+            lens = realloc(lens, cap * sizeof(uint32_t));
+        }
+        lens[nb] = cdc_cut(data + off, size - off > CDC_MAX ? CDC_MAX : size - off);
+        blocs += chunk_nblk(lens[nb]);
+        off += lens[nb];
+    }
+    uint32_t r = recipe_blocks(nb);
+    if ((blocs + r) * FS_BLOCK_SIZE > UINT32_MAX) {
+        free(lens);
+        return 1;
+    }
+    //Flux complet : recette puis morceaux completes par des zeros
+    char *flux = calloc(blocs + r, FS_BLOCK_SIZE);
+    cdc_recipe *recette = (cdc_recipe *)flux;
+    cdc_ref *refs = (cdc_ref *)(flux + sizeof(cdc_recipe));
+    uint32_t *places = malloc(nb * sizeof(uint32_t)); //Bloc du flux de chaque morceau
+    uint32_t *phys = calloc(nb ? nb : 1, sizeof(uint32_t)); //Morceau deja stocke, 0 sinon
+    recette->nb = nb;
+    size_t off = 0;
+    uint32_t s = r;
+    for (uint32_t j = 0; j < nb; j++) {
+        refs[j].len = lens[j];
+        refs[j].crc = crc32c(0, data + off, lens[j]);
+        places[j] = s;
+        memcpy(flux + (size_t)s * FS_BLOCK_SIZE, data + off, lens[j]);
+        s += chunk_nblk(lens[j]);
+        off += lens[j];
+    }
+
+    uint32_t max_ext = FS_INLINE_EXTENTS + FS_EXTENTS_PER_BLOCK;
+    if (inode->flags & FS_INODE_CHUNKED)
+        index_chunks(p, inode);
+    //Un morceau repris coupe au pire la suite des blocs neufs en deux extents
+    for (uint32_t j = 0, estimes = 1; j < nb && estimes + 2 <= max_ext / 2; j++) {
+        phys[j] = chunk_find(p, refs[j].crc, lens[j], flux + (size_t)places[j] * FS_BLOCK_SIZE);
+        for (uint32_t b = 0; phys[j] && b < chunk_nblk(lens[j]); b++)
+            dedup_share(p, phys[j] + b);
+        estimes += phys[j] ? 2 : 0;
+    }
+    inode_free_blocks(p, inode);
+    inode->size = size;
+    inode->stored_size = 0;
+    inode->flags &= ~FS_INODE_CHUNKED;
+
+    disk_extent *ext = malloc(max_ext * sizeof(disk_extent));
+    uint32_t nb_ext = 0, debut, j = 0;
+    int ret = write_new_run(p, ext, &nb_ext, max_ext, flux, r, &debut);
+    for (; j < nb && ret == 0; j++) {
+        uint32_t nblk = chunk_nblk(lens[j]);
+        const char *morceau = flux + (size_t)places[j] * FS_BLOCK_SIZE;
+        //Les morceaux deja ecrits plus haut dans le fichier sont aussi repris
+        if (!phys[j] && nb_ext < max_ext / 2 && (phys[j] = chunk_find(p, refs[j].crc, lens[j], morceau)) != 0) {
+            for (uint32_t b = 0; b < nblk; b++)
+                dedup_share(p, phys[j] + b);
+        }
+        if (phys[j]) {
+            extent_append(ext, &nb_ext, phys[j], nblk);
+            p->chunks.reused++;
+            p->chunks.bytes_reused += lens[j];
+            continue;
+        }
+        ret = write_new_run(p, ext, &nb_ext, max_ext, morceau, nblk, &debut);
+        if (ret == 0 && debut)
+            chunk_insert(p, refs[j].crc, lens[j], debut);
+        p->chunks.chunks++;
+        p->chunks.bytes += lens[j];
+    }
+    if (ret == 0)
+        ret = inode_set_extents(p, inode, ext, nb_ext);
+    else {
+        //Les blocs deja pris et les references posees sur les morceaux suivants sont rendus
+        for (uint32_t i = 0; i < nb_ext; i++)
+            free_extent(p, &ext[i]);
+        for (; j < nb; j++) {
+            disk_extent e = { phys[j], chunk_nblk(lens[j]) };
+            if (phys[j])
+                free_extent(p, &e);
+        }
+    }
+    if (ret == 0) {
+        inode->flags |= FS_INODE_CHUNKED;
+        inode->stored_size = (blocs + r) * FS_BLOCK_SIZE;
+    }
+    free(ext);
+    free(phys);
+    free(places);
+    free(flux);
+    free(lens);
+    return ret;
+}
+
+//Verifier un flux stocke par morceaux et le recopier dans out (size octets)
+static int unchunk_stream(const char *flux, uint32_t stored, char *out, size_t size) {
+    const cdc_recipe *recette = (const cdc_recipe *)flux;
+    if (stored < sizeof(cdc_recipe) || (uint64_t)recipe_blocks(recette->nb) * FS_BLOCK_SIZE > stored)
+        return chunks_corrupt();
+    const cdc_ref *refs = (const cdc_ref *)(flux + sizeof(cdc_recipe));
+    uint64_t pos = (uint64_t)recipe_blocks(recette->nb) * FS_BLOCK_SIZE;
+    size_t fait = 0;
+    for (uint32_t j = 0; j < recette->nb; j++) {
+        uint32_t len = refs[j].len;
+        if (len > size - fait || pos + len > stored || crc32c(0, flux + pos, len) != refs[j].crc)
+            return chunks_corrupt();
+        memcpy(out + fait, flux + pos, len);
+        fait += len;
+        pos += (uint64_t)chunk_nblk(len) * FS_BLOCK_SIZE;
+    }
+    return fait == size ? 0 : chunks_corrupt();
+}
+/*
+ * Remplacer tout le contenu d'un inode (les anciens blocs sont liberes).
+ * Avec FS_INODE_COMPRESSED, le contenu est stocke compresse ; l'indicateur
+ * est retire si la compression ne fait pas gagner au moins un bloc. Monte
+ * avec FS_MOUNT_CDC, un fichier non compresse est stocke par morceaux.
+ */
+int write_inode_data(filesystem *p, uint32_t ino, disk_inode *inode, const void *data, size_t size) {
+    pcache_invalidate(p, ino);
+    if ((p->flags & FS_MOUNT_CDC) && inode->type == FS_TYPE_FILE && !(inode->flags & FS_INODE_COMPRESSED) && size > 0) {
+        int ret = write_inode_chunks(p, inode, data, size);
+        if (ret <= 0)
+            return ret;
+    }
+    inode_free_blocks(p, inode);
+    inode->size = size;
+    inode->stored_size = 0;
+    inode->flags &= ~FS_INODE_CHUNKED;
+    //Les contenus des fichiers (compresses ou non) peuvent partager leurs blocs
+    int (*ecrire)(filesystem *, disk_inode *, const char *, size_t) = write_inode_blocks;
+    if (p->dedup.cases && inode->type == FS_TYPE_FILE)
+        ecrire = write_inode_blocks_dedup;
+    if (!(inode->flags & FS_INODE_COMPRESSED) || size == 0) {
+        inode->flags &= ~FS_INODE_COMPRESSED;
+        return ecrire(p, inode, data, size);
+    }
+    uint32_t stocke = 0;
+    char *flux = compress_stream(data, size, &stocke);
+    if (!flux) {
+        inode->flags &= ~FS_INODE_COMPRESSED;
+        return ecrire(p, inode, data, size);
+    }
+    inode->stored_size = stocke;
+    int ret = ecrire(p, inode, flux, stocke);
+    free(flux);
+    return ret;
+}
+
+//Mode mmap : contenu stocke d'un inode, extent par extent
+static int read_data_map(filesystem *p, const disk_inode *inode, void *buf) {
+    disk_extent *ext = NULL;
+    int nb_ext = inode_get_extents(p, inode, &ext);
+    if (nb_ext < 0)
+        return -1;
+    char *dst = buf;
+    size_t reste = inode->size;
+    char bloc[FS_BLOCK_SIZE];
+    for (int i = 0; i < nb_ext && reste > 0; i++) {
+        size_t len = (size_t)ext[i].len * FS_BLOCK_SIZE;
+        if (reste >= len) {
+            if (read_blocks(p, ext[i].start, ext[i].len, dst) < 0)
+                break;
+        } else {
+            //Dernier extent : lecture des blocs entiers, puis du reste
+            uint32_t pleins = reste / FS_BLOCK_SIZE;
+            if (pleins && read_blocks(p, ext[i].start, pleins, dst) < 0)
+                break;
+            if (reste % FS_BLOCK_SIZE) {
+                if (read_block(p, ext[i].start + pleins, bloc) < 0)
+                    break;
+                memcpy(dst + (size_t)pleins * FS_BLOCK_SIZE, bloc, reste % FS_BLOCK_SIZE);
+            }
+            len = reste;
+        }
+        dst += len;
+        reste -= len;
+    }
+    free(ext);
+    return reste == 0 ? 0 : -1;
+}
+
+/*
+ * Lire le contenu de nb inodes : les blocs presents dans le cache de pages
+ * sont recopies, les autres sont lus en un lot d'E/S, une requete par suite
+ * de blocs contigus (les fins de fichier passent par un tampon de bloc) puis
+ * verifies et ajoutes au cache. Le lot part par fenetres de FS_VERIFY_WINDOW
+ * blocs : un bloc est verifie juste apres sa lecture, sans etre relu depuis
+ * la memoire. bufs[i] recoit au moins inodes[i].size octets ; inos[i] a 0 lit
+ * sans passer par le cache.
+ */
+static int read_raw_batch(filesystem *p, const uint32_t *inos, const disk_inode *inodes, char **bufs, int nb) {
+    if (p->map) {
+        for (int k = 0; k < nb; k++) {
+            if (read_data_map(p, &inodes[k], bufs[k]) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    typedef struct { uint32_t ino, lblk, phys; char *src; int req; } manque;
+    int cap = 64, nb_reqs = 0, nb_fins = 0, ret = 0;
+    int cap_manques = 64, nb_manques = 0;
+    io_request *reqs = malloc(cap * sizeof(io_request));
+    manque *manques = malloc(cap_manques * sizeof(manque));
+    //Dernier bloc partiel de chaque fichier : lu dans fins, recopie ensuite
+    char *fins = malloc((size_t)(nb ? nb : 1) * FS_BLOCK_SIZE);
+    char **dest_fins = malloc((nb ? nb : 1) * sizeof(char *));
+    size_t *len_fins = malloc((nb ? nb : 1) * sizeof(size_t));
+    for (int k = 0; k < nb && ret == 0; k++) {
+        disk_extent *ext = NULL;
+        int nb_ext = inode_get_extents(p, &inodes[k], &ext);
+        if (nb_ext < 0) {
+            ret = -1;
+            break;
+        }
+        char *dst = bufs[k];
+        size_t reste = inodes[k].size;
+        uint32_t lblk = 0;
+        int suite = 0; //La requete precedente peut etre prolongee
+        for (int i = 0; i < nb_ext && reste > 0; i++) {
+            for (uint32_t j = 0; j < ext[i].len && reste > 0; j++, lblk++) {
+                uint32_t phys = ext[i].start + j;
+                size_t len = reste < FS_BLOCK_SIZE ? reste : FS_BLOCK_SIZE;
+                if (inos[k] && pcache_read(p, inos[k], lblk, phys, dst, len)) {
+                    suite = 0;
+                } else {
+                    if (nb_reqs + 1 > cap) {
+                        cap *= 2;
+                        reqs = realloc(reqs, cap * sizeof(io_request));
+                    }
+                    if (nb_manques == cap_manques) {
+                        cap_manques *= 2;
+                        manques = realloc(manques, cap_manques * sizeof(manque));
+                    }
+                    uint64_t off = (uint64_t)phys * FS_BLOCK_SIZE;
+                    char *src = dst;
+                    if (len < FS_BLOCK_SIZE) {
+                        src = fins + (size_t)nb_fins * FS_BLOCK_SIZE;
+                        io_request r = { 0, src, FS_BLOCK_SIZE, off, 0 };
+                        reqs[nb_reqs++] = r;
+                        dest_fins[nb_fins] = dst;
+                        len_fins[nb_fins] = len;
+                        nb_fins++;
+                        suite = 0;
+                    } else if (suite && reqs[nb_reqs - 1].offset + reqs[nb_reqs - 1].len == off &&
+                               reqs[nb_reqs - 1].len < FS_VERIFY_WINDOW * FS_BLOCK_SIZE) {
+                        reqs[nb_reqs - 1].len += FS_BLOCK_SIZE;
+                    } else {
+                        io_request r = { 0, dst, FS_BLOCK_SIZE, off, 0 };
+                        reqs[nb_reqs++] = r;
+                        suite = 1;
+                    }
+                    manque m = { inos[k], lblk, phys, src, nb_reqs - 1 };
+                    manques[nb_manques++] = m;
+                }
+                dst += len;
+                reste -= len;
+            }
+        }
+        free(ext);
+        if (reste > 0)
+            ret = -1;
+    }
+    //Chaque bloc lu est verifie avant d'etre recopie ou mis en cache
+    int m = 0;
+    for (int r0 = 0; ret == 0 && r0 < nb_reqs; ) {
+        int r1 = r0;
+        size_t octets = 0;
+        while (r1 < nb_reqs && (r1 == r0 || octets + reqs[r1].len <= FS_VERIFY_WINDOW * FS_BLOCK_SIZE))
+            octets += reqs[r1++].len;
+        ret = io_run(p, reqs + r0, r1 - r0);
+        for (; ret == 0 && m < nb_manques && manques[m].req < r1; m++) {
+            if (csum_verify(p, manques[m].phys, manques[m].src) < 0)
+                ret = -1;
+            else if (manques[m].ino)
+                pcache_insert(p, manques[m].ino, manques[m].lblk, manques[m].phys, manques[m].src);
+        }
+        r0 = r1;
+    }
+    for (int i = 0; ret == 0 && i < nb_fins; i++)
+        memcpy(dest_fins[i], fins + (size_t)i * FS_BLOCK_SIZE, len_fins[i]);
+    free(reqs);
+    free(manques);
+    free(fins);
+    free(dest_fins);
+    free(len_fins);
+    return ret;
+}
+
+/*
+ * Lire le contenu de nb inodes (voir read_raw_batch). Le flux des fichiers
+ * compresses ou stockes par morceaux est lu dans le meme lot, hors cache de
+ * pages, puis decompresse ou reassemble.
+ */
+int read_inode_data_batch(filesystem *p, const uint32_t *inos, const disk_inode *inodes, char **bufs, int nb) {
+    int compresses = 0;
+    for (int k = 0; k < nb; k++)
+        compresses += (inodes[k].flags & (FS_INODE_COMPRESSED | FS_INODE_CHUNKED)) != 0;
+    if (compresses == 0)
+        return read_raw_batch(p, inos, inodes, bufs, nb);
+    uint32_t *lus = malloc(nb * sizeof(uint32_t));
+    disk_inode *stockes = malloc(nb * sizeof(disk_inode));
+    char **dsts = malloc(nb * sizeof(char *));
+    for (int k = 0; k < nb; k++) {
+        lus[k] = inos[k];
+        stockes[k] = inodes[k];
+        dsts[k] = bufs[k];
+        if (inodes[k].flags & (FS_INODE_COMPRESSED | FS_INODE_CHUNKED)) {
+            lus[k] = 0;
+            stockes[k].size = inodes[k].stored_size;
+            dsts[k] = malloc(inodes[k].stored_size ? inodes[k].stored_size : 1);
+        }
+    }
+    int ret = read_raw_batch(p, lus, stockes, dsts, nb);
+    for (int k = 0; k < nb; k++) {
+        if (inodes[k].flags & FS_INODE_CHUNKED) {
+            if (ret == 0 && unchunk_stream(dsts[k], inodes[k].stored_size, bufs[k], inodes[k].size) < 0)
+                ret = -1;
+        } else if (!(inodes[k].flags & FS_INODE_COMPRESSED)) {
+            continue;
+        } else if (ret == 0 && decompress_stream(dsts[k], inodes[k].stored_size, bufs[k], inodes[k].size) < 0)
+            ret = -1;
+        free(dsts[k]);
+    }
+    free(lus);
+    free(stockes);
+    free(dsts);
+    return ret;
+}
+
+//Lire tout le contenu d'un inode dans buf (au moins inode->size octets)
+int read_inode_data(filesystem *p, uint32_t ino, const disk_inode *inode, void *buf) {
+    char *dst = buf;
+    return read_inode_data_batch(p, &ino, inode, &dst, 1);
+}
+
+//Octets [off, off + len[ d'un fichier stocke par morceaux, lus dans les morceaux qui les couvrent
+static int read_chunked_range(filesystem *p, const disk_inode *inode, const disk_extent *ext, int nb_ext,
+                              uint64_t off, uint32_t len, char *out) {
+    uint32_t nb = 0;
+    cdc_ref *refs = read_recipe(p, ext, nb_ext, inode->stored_size, &nb);
+    if (!refs)
+        return -1;
+    uint64_t debut = 0, pos = (uint64_t)recipe_blocks(nb) * FS_BLOCK_SIZE;
+    for (uint32_t j = 0; j < nb && len > 0; j++) {
+        uint64_t fin = debut + refs[j].len;
+        if (off < fin) {
+            uint32_t n = fin - off < len ? fin - off : len;
+            if (pos + refs[j].len > inode->stored_size) {
+                free(refs);
+                return chunks_corrupt();
+            }
+            if (read_stored_range(p, ext, nb_ext, pos + (off - debut), n, out) < 0)
+                break;
+            out += n;
+            off += n;
+            len -= n;
+        }
+        debut = fin;
+        pos += (uint64_t)chunk_nblk(refs[j].len) * FS_BLOCK_SIZE;
+    }
+    free(refs);
+    return len == 0 ? 0 : -1;
+}
+
+/*
+ * Lire le bloc k du fichier (acces au hasard) : pour un fichier compresse,
+ * seuls son entree de la table et son morceau sont lus et decompresses ;
+ * pour un fichier stocke par morceaux, la recette puis les morceaux utiles.
+ * Retourne le nombre d'octets du bloc, -1 en cas d'erreur.
+ */
+int read_inode_block(filesystem *p, const disk_inode *inode, uint32_t k, void *out) {
+    uint64_t off = (uint64_t)k * FS_BLOCK_SIZE;
+    if (off >= inode->size)
+        return -1;
+    uint32_t len = inode->size - off < FS_BLOCK_SIZE ? inode->size - off : FS_BLOCK_SIZE;
+    disk_extent *ext = NULL;
+    int nb_ext = inode_get_extents(p, inode, &ext);
+    if (nb_ext < 0)
+        return -1;
+    int ret = -1;
+    if (inode->flags & FS_INODE_CHUNKED) {
+        if (read_chunked_range(p, inode, ext, nb_ext, off, len, out) == 0)
+            ret = len;
+        free(ext);
+        return ret;
+    }
+    if (!(inode->flags & FS_INODE_COMPRESSED)) {
+        if (read_stored_range(p, ext, nb_ext, off, len, out) == 0)
+            ret = len;
+        free(ext);
+        return ret;
+    }
+    uint32_t nb = (inode->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    uint64_t entete = (uint64_t)nb * sizeof(uint32_t);
+    //Fin du morceau precedent (0 pour le premier) et fin de celui-ci
+    uint32_t bornes[2] = { 0, 0 };
+    int lu = k ? read_stored_range(p, ext, nb_ext, (uint64_t)(k - 1) * sizeof(uint32_t), 8, (char *)bornes)
+               : read_stored_range(p, ext, nb_ext, 0, 4, (char *)&bornes[1]);
+    if (lu == 0) {
+        uint32_t n = bornes[1] - bornes[0];
+        char morceau[FS_BLOCK_SIZE];
+        if (bornes[1] < bornes[0] || n > len || entete + bornes[1] > inode->stored_size)
+            stream_corrupt();
+        else if (read_stored_range(p, ext, nb_ext, entete + bornes[0], n, morceau) == 0 &&
+                 decompress_chunk(morceau, n, out, len) == 0)
+            ret = len;
+    }
+    free(ext);
+    return ret;
+}
+
+/* --- Defragmentation ---
+ *
+ * Un inode est deplace d'un coup : ses blocs sont recopies dans un trou
+ * assez long pour les contenir tous, puis l'inode est reecrit avec un seul
+ * extent et les anciens blocs liberes (au commit si le journal est actif).
+ * Une coupure avant le commit laisse l'ancien inode et ses blocs intacts.
+ * Les blocs partages (dedupliques) ne sont jamais deplaces : leurs autres
+ * proprietaires pointent encore dessus.
+ */
+
+//Trous libres de la zone de donnees : nombre, plus long et dernier bloc occupe
+void free_space_layout(filesystem *p, uint32_t *trous, uint32_t *plus_long, uint32_t *dernier) {
+    superblock *sb = &p->sb;
+    *trous = *plus_long = 0;
+    *dernier = sb->nb_blocks - 1;
+    uint32_t i = sb->data_start;
+    while (i < sb->nb_blocks) {
+        uint32_t debut = bitmap_find_zero(p->block_bitmap, p->block_region_free, i, sb->nb_blocks);
+        if (debut >= sb->nb_blocks)
+            break;
+        uint32_t fin = bitmap_find_one(p->block_bitmap, p->block_region_free, debut, sb->nb_blocks);
+        (*trous)++;
+        if (fin - debut > *plus_long)
+            *plus_long = fin - debut;
+        if (fin == sb->nb_blocks)
+            *dernier = debut - 1;
+        i = fin;
+    }
+}
+
+/*
+ * Regrouper les blocs de l'inode ino dans un seul extent, le plus pres
+ * possible du debut de la zone de donnees : un inode deja contigu n'est
+ * deplace que si un trou assez long existe avant lui. *nb_avant recoit son
+ * nombre d'extents. Retourne le nombre de blocs deplaces, 0 si rien a
+ * gagner (ou blocs partages), -1 en cas d'erreur.
+ */
+int inode_relocate(filesystem *p, uint32_t ino, uint32_t *nb_avant) {
+    superblock *sb = &p->sb;
+    disk_inode inode;
+    *nb_avant = 0;
+    if (ino >= sb->nb_inodes || !bit_test(p->inode_bitmap, ino))
+        return 0;
+    if (read_inode(p, ino, &inode) < 0)
+        return -1;
+    if (inode.type == FS_TYPE_FREE || inode.nb_extents == 0)
+        return 0;
+    disk_extent *ext = NULL;
+    int nb_ext = inode_get_extents(p, &inode, &ext);
+    if (nb_ext <= 0) {
+        free(ext);
+        return nb_ext;
+    }
+    *nb_avant = nb_ext;
+    uint32_t total = 0;
+    for (int i = 0; i < nb_ext; i++) {
+        total += ext[i].len;
+        for (uint32_t b = ext[i].start; p->ref_table && b < ext[i].start + ext[i].len; b++) {
+            if (ref_get(p, b)) {
+                free(ext);
+                return 0;
+            }
+        }
+    }
+    uint32_t limite = nb_ext == 1 ? ext[0].start : sb->nb_blocks;
+    uint32_t debut;
+    if (total > sb->free_blocks || !find_free_run(p, sb->data_start, limite, total, &debut)) {
+        free(ext);
+        return 0;
+    }
+    bitmap_set_range(p, p->block_bitmap, p->block_region_free, debut, total);
+    sb->free_blocks -= total;
+    disk_extent neuf = { debut, total };
+    char *tampon = malloc((size_t)FS_VERIFY_WINDOW * FS_BLOCK_SIZE);
+    uint32_t dest = debut;
+    for (int i = 0; i < nb_ext; i++) {
+        for (uint32_t k = 0; k < ext[i].len; ) {
+            uint32_t n = ext[i].len - k < FS_VERIFY_WINDOW ? ext[i].len - k : FS_VERIFY_WINDOW;
+            if (read_blocks(p, ext[i].start + k, n, tampon) < 0 || write_blocks(p, dest, n, tampon) < 0) {
+                //Le nouvel extent n'est reference par personne : rendu tout de suite
+                release_extent(p, &neuf);
+                free(tampon);
+                free(ext);
+                return -1;
+            }
+            k += n;
+            dest += n;
+        }
+    }
+    free(tampon);
+    uint32_t ancien_bloc = inode.extent_block;
+    inode.nb_extents = 0;
+    inode.extent_block = 0;
+    memset(inode.extents, 0, sizeof(inode.extents));
+    inode_set_extents(p, &inode, &neuf, 1);
+    if (write_inode(p, ino, &inode) < 0) {
+        release_extent(p, &neuf);
+        free(ext);
+        return -1;
+    }
+    for (int i = 0; i < nb_ext; i++)
+        free_extent(p, &ext[i]);
+    if (ancien_bloc) {
+        disk_extent bloc_ext = { ancien_bloc, 1 };
+        free_extent(p, &bloc_ext);
+    }
+    free(ext);
+    pcache_invalidate(p, ino);
+    //Les index retrouvent les blocs a leur nouvelle place
+    for (uint32_t b = debut; p->dedup.cases && b < debut + total; b++)
+        dedup_insert(p, csum_get(p, b), b);
+    if ((inode.flags & FS_INODE_CHUNKED) && (p->flags & FS_MOUNT_CDC))
+        index_chunks(p, &inode);
+    return total;
+}
+
+/*
+ * Reduire l'image juste apres son dernier bloc occupe, en gardant marge
+ * blocs libres pour les ecritures suivantes. Le journal est valide et vide
+ * d'abord : les liberations differees sont faites et le superbloc ecrit
+ * ensuite ne peut plus etre ecrase par un rejeu. *liberes recoit le nombre
+ * de blocs rendus. Impossible en mode mmap (la projection couvre l'image).
+ */
+int shrink_partition(filesystem *p, uint32_t marge, uint32_t *liberes) {
+    superblock *sb = &p->sb;
+    *liberes = 0;
+    if (p->map || (p->flags & FS_MOUNT_RDONLY)) {
+        printf("Reduction de l'image impossible en mode mmap ou en lecture seule.\n");
+        return -1;
+    }
+    if (p->journal.enabled && (journal_commit(p) < 0 || journal_checkpoint(p) < 0))
+        return -1;
+    uint32_t trous, plus_long, dernier;
+    free_space_layout(p, &trous, &plus_long, &dernier);
+    uint64_t nb = (uint64_t)dernier + 1 + marge;
+    if (nb < 64)
+        nb = 64;
+    if (nb >= sb->nb_blocks)
+        return 0;
+    *liberes = sb->nb_blocks - nb;
+    sb->nb_blocks = nb;
+    recount_free(p);
+    if (p->next_free_block >= sb->nb_blocks)
+        p->next_free_block = sb->data_start;
+    if (write_superblock(p) < 0 || flush_device(p) < 0)
+        return -1;
+    if (ftruncate(p->fd, (off_t)nb * FS_BLOCK_SIZE) == -1) {
+        perror("Erreur : impossible de reduire la partition");
+        return -1;
+    }
+    p->size = nb * FS_BLOCK_SIZE;
+    return 0;
+}
+
+static double bench_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * Comparer le mode read()/write() et le mode mmap sur une image formatee :
+ * temps de montage (superbloc, bitmaps, racine) et latence moyenne de lecture
+ * des inodes occupes et des blocs de repertoires. L'image n'est pas modifiee.
+ */
+void bench_mmap(const char *filename, int repetitions) {
+    const char *noms[2] = { "read()", "mmap" };
+    int modes[2] = { 0, FS_MOUNT_MMAP };
+    printf("%-8s %14s %14s %14s\n", "mode", "montage (us)", "inode (ns)", "repertoire (ns)");
+    for (int m = 0; m < 2; m++) {
+        filesystem b;
+        double t0 = bench_now();
+        if (mount_partition(&b, filename, FS_MOUNT_RDONLY | modes[m]) != 0) {
+            printf("Impossible de monter '%s' pour la mesure.\n", filename);
+            return;
+        }
+        disk_inode racine;
+        read_inode(&b, b.sb.root_inode, &racine);
+        char *donnees = malloc(racine.size + 1);
+        read_inode_data(&b, 0, &racine, donnees);
+        free(donnees);
+        double t1 = bench_now();
+
+        long nb_inodes = 0, nb_reps = 0;
+        double t_inodes = 0, t_reps = 0;
+        for (int r = 0; r < repetitions; r++) {
+            for (uint32_t ino = FS_ROOT_INODE; ino < b.sb.nb_inodes; ino++) {
+                if (!bit_test(b.inode_bitmap, ino))
+                    continue;
+                disk_inode di;
+                double a = bench_now();
+                read_inode(&b, ino, &di);
+                double c = bench_now();
+                t_inodes += c - a;
+                nb_inodes++;
+                if (di.type == FS_TYPE_DIR && di.size > 0) {
+                    char *entrees = malloc(di.size);
+                    a = bench_now();
+                    read_inode_data(&b, 0, &di, entrees);
+                    t_reps += bench_now() - a;
+                    nb_reps++;
+                    free(entrees);
+                }
+            }
+        }
+        printf("%-8s %14.1f %14.1f %14.1f\n", noms[m], (t1 - t0) * 1e6,
+               nb_inodes ? t_inodes / nb_inodes * 1e9 : 0.0,
+               nb_reps ? t_reps / nb_reps * 1e9 : 0.0);
+        unmount_partition(&b);
+    }
+}
+
+//Ancien allocateur (bit par bit, premier trou trouve), garde pour la mesure
+static uint32_t alloc_extent_lineaire(filesystem *p, uint32_t nb, disk_extent *out) {
+    superblock *sb = &p->sb;
+    uint32_t debut = p->next_free_block;
+    for (uint32_t tour = 0; tour < 2; tour++) {
+        for (uint32_t i = debut; i < sb->nb_blocks; i++) {
+            if (bit_test(p->block_bitmap, i))
+                continue;
+            uint32_t len = 0;
+            while (len < nb && i + len < sb->nb_blocks && !bit_test(p->block_bitmap, i + len)) {
+                bit_set(p->block_bitmap, i + len);
+                bitmap_dirty(p, p->block_bitmap, i + len);
+                p->block_region_free[(i + len) / FS_ALLOC_REGION_BITS]--;
+                len++;
+            }
+            out->start = i;
+            out->len = len;
+            sb->free_blocks -= len;
+            p->next_free_block = i + len;
+            return len;
+        }
+        debut = sb->data_start;
+    }
+    return 0;
+}
+
+/*
+ * Comparer l'ancien parcours bit par bit et la recherche par mots de 64 bits
+ * sur une bitmap en memoire de nb_blocs blocs, pleine a 95 % avec des trous
+ * epars. Chaque operation libere un bloc occupe au hasard puis alloue 1 bloc,
+ * ou toutes les 8 operations 256 blocs (1 Mio, en autant d'extents que
+ * necessaire, rendus ensuite). Derniere colonne : trouver l'unique bloc libre
+ * d'une partition pleine, en partant du debut.
+ */
+void bench_alloc(uint32_t nb_blocs, int nb_ops) {
+    const char *noms[2] = { "lineaire", "mots 64 bits" };
+    printf("%-13s %12s %12s %14s %16s\n", "allocateur", "1 bloc (ns)", "1 Mio (us)",
+           "extents/Mio", "dernier (us)");
+    for (int m = 0; m < 2; m++) {
+        filesystem b;
+        memset(&b, 0, sizeof(b));
+        b.fd = -1;
+        b.sb.nb_blocks = nb_blocs;
+        b.sb.data_start = 64;
+        b.sb.block_bitmap_blocks = (nb_blocs + FS_BLOCK_SIZE * 8 - 1) / (FS_BLOCK_SIZE * 8);
+        b.block_bitmap = calloc(b.sb.block_bitmap_blocks, FS_BLOCK_SIZE);
+        b.bitmap_blocks_dirty = calloc(b.sb.block_bitmap_blocks, 1);
+        //Meme remplissage pour les deux : les 95 premiers % occupes sauf de
+        //rares trous, la fin libre
+        srand(1234);
+        for (uint32_t i = 0; i < nb_blocs; i++) {
+            if (i < b.sb.data_start || ((uint64_t)i * 100 < (uint64_t)nb_blocs * 95 && rand() % 1000 < 995))
+                bit_set(b.block_bitmap, i);
+        }
+        recount_free(&b);
+        b.next_free_block = b.sb.data_start;
+
+        long nb_petites = 0, nb_grandes = 0, extents_grandes = 0;
+        double t_petites = 0, t_grandes = 0;
+        for (int op = 0; op < nb_ops; op++) {
+            //Liberer un bloc occupe : le point de depart de la recherche recule
+            for (int essai = 0; essai < 64; essai++) {
+                disk_extent libre = { b.sb.data_start + (uint32_t)rand() % (nb_blocs - b.sb.data_start), 1 };
+                if (bit_test(b.block_bitmap, libre.start)) {
+                    release_extent(&b, &libre);
+                    break;
+                }
+            }
+            uint32_t voulu = (op % 8 == 0) ? 256 : 1;
+            disk_extent ext[256];
+            uint32_t obtenus = 0, nb_ext = 0;
+            double a = bench_now();
+            while (obtenus < voulu) {
+                uint32_t len = m == 0 ? alloc_extent_lineaire(&b, voulu - obtenus, &ext[nb_ext])
+                                      : alloc_extent(&b, voulu - obtenus, &ext[nb_ext]);
+                if (len == 0)
+                    break;
+                obtenus += len;
+                nb_ext++;
+            }
+            double duree = bench_now() - a;
+            if (voulu > 1) {
+                t_grandes += duree;
+                nb_grandes++;
+                extents_grandes += nb_ext;
+                //Fichier temporaire : rendu aussitot, le remplissage reste stable
+                for (uint32_t i = 0; i < nb_ext; i++)
+                    release_extent(&b, &ext[i]);
+            } else {
+                t_petites += duree;
+                nb_petites++;
+            }
+        }
+
+        //Partition pleine sauf son dernier bloc
+        memset(b.block_bitmap, 0xff, (size_t)b.sb.block_bitmap_blocks * FS_BLOCK_SIZE);
+        bit_clear(b.block_bitmap, nb_blocs - 1);
+        recount_free(&b);
+        b.next_free_block = b.sb.data_start;
+        disk_extent dernier;
+        double a = bench_now();
+        if (m == 0)
+            alloc_extent_lineaire(&b, 1, &dernier);
+        else
+            alloc_extent(&b, 1, &dernier);
+        double t_dernier = bench_now() - a;
+
+        printf("%-13s %12.1f %12.2f %14.1f %16.1f\n", noms[m],
+               nb_petites ? t_petites / nb_petites * 1e9 : 0.0,
+               nb_grandes ? t_grandes / nb_grandes * 1e6 : 0.0,
+               nb_grandes ? (double)extents_grandes / nb_grandes : 0.0, t_dernier * 1e6);
+        free(b.block_bitmap);
+        free(b.bitmap_blocks_dirty);
+        free(b.inode_region_free);
+        free(b.block_region_free);
+    }
+}
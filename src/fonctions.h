@@ -8,4 +8,102 @@ void remove_entry(file_entry **dir, const char *name);
 
 void list_files(file_entry *dir);
 
-void display_help();
\ No newline at end of file
+void display_help();
+
+/* --- Partition sur disque --- */
+
+int read_blocks_raw(filesystem *p, uint32_t no, uint32_t nb, void *buf);
+
+int read_blocks(filesystem *p, uint32_t no, uint32_t nb, void *buf);
+
+int write_blocks(filesystem *p, uint32_t no, uint32_t nb, const void *buf);
+
+int lazy_init_step(filesystem *p);
+
+uint32_t lazy_init_remaining(filesystem *p);
+
+int read_block(filesystem *p, uint32_t no, void *buf);
+
+int write_block(filesystem *p, uint32_t no, const void *buf);
+
+uint8_t *bitmap_block_ptr(filesystem *p, uint32_t b);
+
+uint32_t csum_get(filesystem *p, uint32_t no);
+
+int csum_verify(filesystem *p, uint32_t no, const void *data);
+
+void csum_load_table(filesystem *p);
+
+int inode_csum_ok(filesystem *p, uint32_t ino, const disk_inode *in);
+
+int superblock_verify(const superblock *sb);
+
+uint8_t *csum_block_ptr(filesystem *p, uint32_t t);
+
+void csum_clean(filesystem *p, uint32_t t);
+
+void csum_seal_bitmaps(filesystem *p);
+
+void csum_stats(filesystem *p);
+
+void recount_free(filesystem *p);
+
+int flush_device(filesystem *p);
+
+int format_partition(filesystem *p, size_t size);
+
+int map_partition(filesystem *p);
+
+int mount_partition(filesystem *p, const char *filename, int flags);
+
+int write_superblock(filesystem *p);
+
+int sync_partition(filesystem *p);
+
+int unmount_partition(filesystem *p);
+
+int read_inode(filesystem *p, uint32_t ino, disk_inode *out);
+
+int read_inodes(filesystem *p, const uint32_t *inos, int nb, disk_inode *out);
+
+int write_inode(filesystem *p, uint32_t ino, const disk_inode *in);
+
+uint32_t alloc_inode(filesystem *p);
+
+void free_inode(filesystem *p, uint32_t ino);
+
+void inode_mark_used(filesystem *p, uint32_t ino);
+
+uint32_t alloc_extent(filesystem *p, uint32_t nb, disk_extent *out);
+
+void block_mark_used(filesystem *p, uint32_t no);
+
+void release_extent(filesystem *p, const disk_extent *ext);
+
+void free_extent(filesystem *p, const disk_extent *ext);
+
+int inode_get_extents(filesystem *p, const disk_inode *inode, disk_extent **out);
+
+void inode_free_blocks(filesystem *p, disk_inode *inode);
+
+int inode_alloc_blocks(filesystem *p, disk_inode *inode, uint32_t nb);
+
+int write_inode_data(filesystem *p, uint32_t ino, disk_inode *inode, const void *data, size_t size);
+
+void chunk_index_files(filesystem *p);
+
+int read_inode_data_batch(filesystem *p, const uint32_t *inos, const disk_inode *inodes, char **bufs, int nb);
+
+int read_inode_data(filesystem *p, uint32_t ino, const disk_inode *inode, void *buf);
+
+int read_inode_block(filesystem *p, const disk_inode *inode, uint32_t k, void *out);
+
+void free_space_layout(filesystem *p, uint32_t *trous, uint32_t *plus_long, uint32_t *dernier);
+
+int inode_relocate(filesystem *p, uint32_t ino, uint32_t *nb_avant);
+
+int shrink_partition(filesystem *p, uint32_t marge, uint32_t *liberes);
+
+void bench_mmap(const char *filename, int repetitions);
+
+void bench_alloc(uint32_t nb_blocs, int nb_ops);
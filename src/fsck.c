@@ -0,0 +1,794 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "structures.h"
+#include "fonctions.h"
+#include "journal.h"
+#include "dedup.h"
+#include "io.h"
+#include "fsck.h"
+
+/*
+ * Verification complete de la partition, sur les structures du disque.
+ *
+ * Les repertoires sont parcourus a partir de la racine par plusieurs
+ * threads qui se partagent une pile de repertoires a lire : chacun prend un
+ * repertoire, lit ses entrees et les inodes de ses enfants, puis empile les
+ * sous-repertoires. Le parcours est iteratif, la profondeur de l'arbre ne
+ * compte pas. Chaque thread lit par sa propre vue de la partition (E/S
+ * synchrones par pread, sans cache de pages, table des sommes chargee
+ * d'avance) : les lectures se font en parallele, seul l'etat des inodes
+ * passe sous le verrou etat_lock du contexte. Le decompte des proprietaires
+ * de blocs se fait lui aussi en parallele.
+ *
+ * Un inode occupe que le parcours n'a pas atteint est orphelin. Les
+ * repertoires orphelins sont parcourus a leur tour, si bien que seuls les
+ * sommets des sous-arbres perdus sont rattaches a /lost+found (sous le nom
+ * #<inode>) par la reparation. Viennent ensuite les liens symboliques, dont
+ * la cible est cherchee par son chemin, puis la comparaison des blocs
+ * reclames avec la bitmap et la table des references.
+ *
+ * L'appelant tient p->lock pendant tout fsck_run et a valide le journal :
+ * les liberations differees sont faites, la bitmap est a jour.
+ */
+
+#define FSCK_VU 1                  // Inode atteint (depuis la racine ou un orphelin)
+#define FSCK_ORPHELIN 2            // Atteint seulement par le balayage de la table
+#define FSCK_PARENT_OK 4           // Reference par le repertoire note comme son parent
+#define FSCK_LIBRE 8               // Marque libre dans la bitmap
+#define FSCK_CLONE 16              // Blocs a recopier (reclames deux fois)
+
+typedef struct fsck_entry_ref {
+    uint32_t dir, ino;
+} fsck_entry_ref;
+
+typedef struct fsck_symlink {
+    uint32_t ino;
+    int marque_mort;               // FS_INODE_DEAD_LINK enregistre
+    char *cible;
+} fsck_symlink;
+
+typedef struct fsck_ctx {
+    filesystem *p;
+    fsck_report *r;
+    pthread_mutex_t etat_lock;     // Etat des inodes ci-dessous
+    uint8_t *etat;                 // FSCK_*
+    uint32_t *refs;                // Entrees de repertoire vers l'inode
+    uint32_t *liens;               // Compteur de liens lu sur le disque
+    uint32_t *parent_vu;           // Premier repertoire qui le reference
+    fsck_entry_ref *invalides;
+    uint32_t nb_invalides, cap_invalides;
+    fsck_symlink *symlinks;
+    uint32_t nb_symlinks, cap_symlinks;
+    //Proprietaires de chaque bloc (compteurs atomiques) et reclamations en trop
+    uint16_t *proprietaires;
+    pthread_mutex_t lock;          // Pile de travail et conflits
+    pthread_cond_t cond;
+    uint32_t *pile;
+    uint32_t nb_pile, cap_pile;
+    int actifs;                    // Threads en train de traiter un repertoire
+    fsck_entry_ref *conflits;      // (bloc, inode) d'une reclamation apres la premiere
+    uint32_t nb_conflits, cap_conflits;
+} fsck_ctx;
+
+static void push_ref(fsck_entry_ref **tab, uint32_t *nb, uint32_t *cap, uint32_t dir, uint32_t ino) {
+    if (*nb == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *tab = realloc(*tab, *cap * sizeof(fsck_entry_ref));
+    }
+    (*tab)[*nb].dir = dir;
+    (*tab)[*nb].ino = ino;
+    (*nb)++;
+}
+
+//Empiler un repertoire a parcourir (c->lock tenu)
+static void push_dir(fsck_ctx *c, uint32_t ino) {
+    if (c->nb_pile == c->cap_pile) {
+        c->cap_pile = c->cap_pile ? c->cap_pile * 2 : 64;
+        c->pile = realloc(c->pile, c->cap_pile * sizeof(uint32_t));
+    }
+    c->pile[c->nb_pile++] = ino;
+}
+
+//Compter ino parmi les proprietaires des blocs de ses extents (sens : +1 ou -1)
+static void claim_blocks(fsck_ctx *c, uint32_t ino, const disk_extent *ext, int nb_ext, uint32_t extent_block, int sens) {
+    superblock *sb = &c->p->sb;
+    for (int i = 0; i <= nb_ext; i++) {
+        uint32_t debut = i < nb_ext ? ext[i].start : extent_block;
+        uint32_t len = i < nb_ext ? ext[i].len : (extent_block != 0);
+        for (uint32_t b = debut; b < debut + len; b++) {
+            if (b < sb->data_start || b >= sb->nb_blocks) {
+                if (sens > 0)
+                    __atomic_add_fetch(&c->r->blocs_hors_zone, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (sens < 0) {
+                __atomic_sub_fetch(&c->proprietaires[b], 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            uint16_t avant = __atomic_fetch_add(&c->proprietaires[b], 1, __ATOMIC_RELAXED);
+            if (avant >= 1) {
+                pthread_mutex_lock(&c->lock);
+                push_ref(&c->conflits, &c->nb_conflits, &c->cap_conflits, b, ino);
+                pthread_mutex_unlock(&c->lock);
+            }
+        }
+    }
+}
+
+//Premiere rencontre d'un inode (etat_lock tenu) : son etat est note
+static void first_visit(fsck_ctx *c, uint32_t ino, const disk_inode *di) {
+    c->etat[ino] |= FSCK_VU;
+    c->liens[ino] = di->links;
+}
+
+/*
+ * Lectures d'un inode rencontre pour la premiere fois (etat_lock non tenu) :
+ * ses extents, et la cible d'un lien symbolique, gardee. Retourne le nombre
+ * d'extents (*ext a liberer), -1 si illisible.
+ */
+static int read_visit(fsck_ctx *c, filesystem *vue, uint32_t ino, const disk_inode *di, disk_extent **ext) {
+    int nb_ext = inode_get_extents(vue, di, ext);
+    if (nb_ext < 0) {
+        __atomic_add_fetch(&c->r->erreurs, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (di->type == FS_TYPE_SYMLINK) {
+        char *cible = calloc(di->size + 1, 1);
+        if (read_inode_data(vue, ino, di, cible) < 0) {
+            __atomic_add_fetch(&c->r->erreurs, 1, __ATOMIC_RELAXED);
+            free(cible);
+            return nb_ext;
+        }
+        pthread_mutex_lock(&c->etat_lock);
+        if (c->nb_symlinks == c->cap_symlinks) {
+            c->cap_symlinks = c->cap_symlinks ? c->cap_symlinks * 2 : 16;
+            c->symlinks = realloc(c->symlinks, c->cap_symlinks * sizeof(fsck_symlink));
+        }
+        fsck_symlink *s = &c->symlinks[c->nb_symlinks++];
+        s->ino = ino;
+        s->marque_mort = (di->flags & FS_INODE_DEAD_LINK) != 0;
+        s->cible = cible;
+        pthread_mutex_unlock(&c->etat_lock);
+    }
+    return nb_ext;
+}
+
+static void count_type(fsck_ctx *c, uint16_t type) {
+    if (type == FS_TYPE_DIR)
+        __atomic_add_fetch(&c->r->repertoires, 1, __ATOMIC_RELAXED);
+    else if (type == FS_TYPE_SYMLINK)
+        __atomic_add_fetch(&c->r->liens_symboliques, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&c->r->fichiers, 1, __ATOMIC_RELAXED);
+}
+
+//Lire les entrees d'un repertoire (tableau a liberer), -1 si illisible
+static int read_dirents(filesystem *p, uint32_t dir, disk_inode *di, disk_dirent **out) {
+    *out = NULL;
+    if (read_inode(p, dir, di) < 0 || di->type != FS_TYPE_DIR)
+        return -1;
+    uint32_t nb = di->size / sizeof(disk_dirent);
+    *out = calloc(di->size / sizeof(disk_dirent) + 1, sizeof(disk_dirent));
+    if (di->size && read_inode_data(p, dir, di, *out) < 0) {
+        free(*out);
+        *out = NULL;
+        return -1;
+    }
+    return nb;
+}
+
+/*
+ * Vue de la partition propre a un thread : E/S synchrones (pread sur le
+ * descripteur commun), sans cache de pages ni file d'ecritures, compteurs
+ * des sommes a part. Les autres tables ne sont que lues pendant le parcours.
+ */
+static void worker_view(fsck_ctx *c, filesystem *vue) {
+    pthread_mutex_lock(&c->etat_lock);
+    *vue = *c->p;
+    pthread_mutex_unlock(&c->etat_lock);
+    memset(&vue->io, 0, sizeof(vue->io));
+    vue->io.type = IO_BACKEND_SYNC;
+    memset(&vue->pcache, 0, sizeof(vue->pcache));
+    vue->csum_verified = 0;
+    vue->csum_errors = 0;
+}
+
+//Reporter sur la partition les compteurs de sommes de la vue
+static void merge_view(fsck_ctx *c, const filesystem *vue) {
+    pthread_mutex_lock(&c->etat_lock);
+    c->p->csum_verified += vue->csum_verified;
+    c->p->csum_errors += vue->csum_errors;
+    pthread_mutex_unlock(&c->etat_lock);
+}
+
+//Traiter un repertoire : ses enfants sont comptes, verifies et les sous-repertoires empiles
+static void visit_dir(fsck_ctx *c, filesystem *vue, uint32_t d) {
+    disk_inode di;
+    disk_dirent *entrees;
+    int nb = read_dirents(vue, d, &di, &entrees);
+    if (nb < 0) {
+        __atomic_add_fetch(&c->r->erreurs, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    uint32_t *inos = malloc((nb ? nb : 1) * sizeof(uint32_t));
+    uint32_t *hors_table = malloc((nb ? nb : 1) * sizeof(uint32_t));
+    int n = 0, nb_hors = 0;
+    for (int i = 0; i < nb; i++) {
+        uint32_t ino = entrees[i].inode;
+        if (ino == 0)
+            continue;
+        if (ino <= FS_ROOT_INODE || ino >= vue->sb.nb_inodes)
+            hors_table[nb_hors++] = ino;
+        else
+            inos[n++] = ino;
+    }
+    free(entrees);
+    disk_inode *enfants = malloc((n ? n : 1) * sizeof(disk_inode));
+    if (n && read_inodes(vue, inos, n, enfants) < 0) {
+        //Un inode illisible ne doit pas cacher les autres
+        for (int k = 0; k < n; k++) {
+            if (read_inode(vue, inos[k], &enfants[k]) < 0) {
+                __atomic_add_fetch(&c->r->erreurs, 1, __ATOMIC_RELAXED);
+                memset(&enfants[k], 0, sizeof(disk_inode));
+                inos[k] = 0;
+            }
+        }
+    }
+    disk_extent **ext = calloc(n ? n : 1, sizeof(disk_extent *));
+    int *nb_ext = calloc(n ? n : 1, sizeof(int));
+    uint8_t *nouveau = calloc(n ? n : 1, 1);
+    pthread_mutex_lock(&c->etat_lock);
+    for (int k = 0; k < nb_hors; k++)
+        push_ref(&c->invalides, &c->nb_invalides, &c->cap_invalides, d, hors_table[k]);
+    for (int k = 0; k < n; k++) {
+        uint32_t ino = inos[k];
+        nb_ext[k] = -1;
+        if (ino == 0)
+            continue;
+        if (enfants[k].type == FS_TYPE_FREE) {
+            push_ref(&c->invalides, &c->nb_invalides, &c->cap_invalides, d, ino);
+            inos[k] = 0;
+            continue;
+        }
+        if (!c->etat[ino] && !((vue->inode_bitmap[ino / 8] >> (ino % 8)) & 1))
+            c->etat[ino] |= FSCK_LIBRE;
+        if (!(c->etat[ino] & FSCK_VU)) {
+            c->parent_vu[ino] = d;
+            first_visit(c, ino, &enfants[k]);
+            nouveau[k] = 1;
+        } else if (enfants[k].type == FS_TYPE_DIR && !(c->etat[ino] & FSCK_ORPHELIN)) {
+            //Un repertoire n'a qu'une entree : une seconde ferait un cycle
+            push_ref(&c->invalides, &c->nb_invalides, &c->cap_invalides, d, ino);
+            inos[k] = 0;
+            continue;
+        } else if (c->etat[ino] & FSCK_ORPHELIN) {
+            c->etat[ino] &= ~FSCK_ORPHELIN;
+            c->parent_vu[ino] = d;
+        }
+        if (enfants[k].parent == d)
+            c->etat[ino] |= FSCK_PARENT_OK;
+        c->refs[ino]++;
+    }
+    pthread_mutex_unlock(&c->etat_lock);
+
+    for (int k = 0; k < n; k++) {
+        if (!nouveau[k])
+            continue;
+        nb_ext[k] = read_visit(c, vue, inos[k], &enfants[k], &ext[k]);
+        if (nb_ext[k] < 0)
+            nb_ext[k] = 0;
+    }
+    for (int k = 0; k < n; k++) {
+        if (inos[k] == 0 || nb_ext[k] < 0)
+            continue;
+        claim_blocks(c, inos[k], ext[k], nb_ext[k], enfants[k].extent_block, 1);
+        count_type(c, enfants[k].type);
+        free(ext[k]);
+        if (enfants[k].type == FS_TYPE_DIR) {
+            pthread_mutex_lock(&c->lock);
+            push_dir(c, inos[k]);
+            pthread_cond_signal(&c->cond);
+            pthread_mutex_unlock(&c->lock);
+        }
+    }
+    free(nouveau);
+    free(ext);
+    free(nb_ext);
+    free(enfants);
+    free(hors_table);
+    free(inos);
+}
+
+static void *fsck_worker(void *arg) {
+    fsck_ctx *c = arg;
+    filesystem vue;
+    worker_view(c, &vue);
+    pthread_mutex_lock(&c->lock);
+    while (1) {
+        while (c->nb_pile == 0 && c->actifs > 0)
+            pthread_cond_wait(&c->cond, &c->lock);
+        if (c->nb_pile == 0)
+            break;
+        uint32_t d = c->pile[--c->nb_pile];
+        c->actifs++;
+        pthread_mutex_unlock(&c->lock);
+        visit_dir(c, &vue, d);
+        pthread_mutex_lock(&c->lock);
+        c->actifs--;
+        if (c->nb_pile == 0 && c->actifs == 0)
+            pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+    merge_view(c, &vue);
+    return NULL;
+}
+
+//Vider la pile avec nb_threads threads (le thread appelant compris)
+static void run_workers(fsck_ctx *c, int nb_threads) {
+    pthread_t threads[FSCK_MAX_THREADS];
+    int lances = 0;
+    for (int i = 1; i < nb_threads && i < FSCK_MAX_THREADS; i++) {
+        if (pthread_create(&threads[lances], NULL, fsck_worker, c) == 0)
+            lances++;
+    }
+    fsck_worker(c);
+    for (int i = 0; i < lances; i++)
+        pthread_join(threads[i], NULL);
+    if (lances + 1 > c->r->threads)
+        c->r->threads = lances + 1;
+}
+
+/*
+ * Balayer la table des inodes : les inodes occupes que le parcours n'a pas
+ * atteints sont notes orphelins et leurs blocs reclames ; les repertoires
+ * orphelins sont empiles pour que leurs enfants ne le soient pas aussi.
+ * Les inodes occupes jamais ecrits (type libre) sont comptes a part.
+ */
+static void scan_orphans(fsck_ctx *c, uint32_t **vides, uint32_t *nb_vides) {
+    filesystem *p = c->p;
+    uint32_t cap = 0;
+    *vides = NULL;
+    *nb_vides = 0;
+    for (uint32_t ino = FS_ROOT_INODE + 1; ino < p->sb.nb_inodes; ino++) {
+        if (!((p->inode_bitmap[ino / 8] >> (ino % 8)) & 1) || (c->etat[ino] & FSCK_VU))
+            continue;
+        disk_inode di;
+        if (read_inode(p, ino, &di) < 0) {
+            c->r->erreurs++;
+            continue;
+        }
+        if (di.type == FS_TYPE_FREE) {
+            if (*nb_vides == cap) {
+                cap = cap ? cap * 2 : 16;
+                *vides = realloc(*vides, cap * sizeof(uint32_t));
+            }
+            (*vides)[(*nb_vides)++] = ino;
+            continue;
+        }
+        disk_extent *ext = NULL;
+        first_visit(c, ino, &di);
+        int nb_ext = read_visit(c, p, ino, &di, &ext);
+        c->etat[ino] |= FSCK_ORPHELIN;
+        if (nb_ext >= 0)
+            claim_blocks(c, ino, ext, nb_ext, di.extent_block, 1);
+        free(ext);
+        count_type(c, di.type);
+        if (di.type == FS_TYPE_DIR)
+            push_dir(c, ino);
+    }
+}
+
+//Inode de l'entree nom du repertoire dir, 0 si absente
+static uint32_t lookup_entry(filesystem *p, uint32_t dir, const char *nom) {
+    disk_inode di;
+    disk_dirent *entrees;
+    int nb = read_dirents(p, dir, &di, &entrees);
+    uint32_t trouve = 0;
+    size_t len = strlen(nom);
+    for (int i = 0; i < nb && !trouve; i++) {
+        if (entrees[i].inode && entrees[i].name_len == len && memcmp(entrees[i].name, nom, len) == 0)
+            trouve = entrees[i].inode;
+    }
+    free(entrees);
+    return trouve;
+}
+
+//Inode designe par un chemin (absolu, comme les cibles des liens), 0 si introuvable
+static uint32_t lookup_path(filesystem *p, const char *chemin) {
+    char *copie = strdup(chemin), *reste = NULL;
+    uint32_t courant = FS_ROOT_INODE;
+    for (char *nom = strtok_r(copie, "/", &reste); nom && courant; nom = strtok_r(NULL, "/", &reste))
+        courant = lookup_entry(p, courant, nom);
+    free(copie);
+    return courant;
+}
+
+/*
+ * Remplacer le contenu d'un inode en tenant les proprietaires a jour : ses
+ * anciens blocs sont rendus (au commit du journal), les nouveaux reclames.
+ */
+static int rewrite_data(fsck_ctx *c, uint32_t ino, disk_inode *di, const void *data, size_t size) {
+    disk_extent *ext = NULL;
+    int nb_ext = inode_get_extents(c->p, di, &ext);
+    if (nb_ext >= 0)
+        claim_blocks(c, ino, ext, nb_ext, di->extent_block, -1);
+    free(ext);
+    int ret = write_inode_data(c->p, ino, di, data, size);
+    if (ret >= 0)
+        ret = write_inode(c->p, ino, di);
+    nb_ext = inode_get_extents(c->p, di, &ext);
+    if (nb_ext >= 0)
+        claim_blocks(c, ino, ext, nb_ext, di->extent_block, 1);
+    free(ext);
+    return ret < 0 ? -1 : 0;
+}
+
+//Reecrire un repertoire sans ses entrees listees dans invalides[]
+static int drop_entries(fsck_ctx *c, uint32_t dir, const fsck_entry_ref *invalides, uint32_t nb) {
+    filesystem *p = c->p;
+    disk_inode di;
+    disk_dirent *entrees;
+    int n = read_dirents(p, dir, &di, &entrees);
+    if (n < 0)
+        return -1;
+    int gardees = 0;
+    for (int i = 0; i < n; i++) {
+        int retirer = 0;
+        for (uint32_t k = 0; k < nb && !retirer; k++)
+            retirer = invalides[k].dir == dir && invalides[k].ino == entrees[i].inode;
+        if (entrees[i].inode && !retirer)
+            entrees[gardees++] = entrees[i];
+    }
+    int ret = rewrite_data(c, dir, &di, entrees, gardees * sizeof(disk_dirent));
+    free(entrees);
+    return ret;
+}
+
+//Ajouter des entrees a un repertoire
+static int add_entries(fsck_ctx *c, uint32_t dir, const disk_dirent *nouvelles, uint32_t nb) {
+    filesystem *p = c->p;
+    disk_inode di;
+    disk_dirent *entrees;
+    int n = read_dirents(p, dir, &di, &entrees);
+    if (n < 0)
+        return -1;
+    entrees = realloc(entrees, (n + nb) * sizeof(disk_dirent));
+    memcpy(entrees + n, nouvelles, nb * sizeof(disk_dirent));
+    int ret = rewrite_data(c, dir, &di, entrees, (n + nb) * sizeof(disk_dirent));
+    free(entrees);
+    return ret;
+}
+
+static void make_dirent(disk_dirent *e, uint32_t ino, uint8_t type, const char *nom) {
+    memset(e, 0, sizeof(*e));
+    e->inode = ino;
+    e->type = type;
+    e->name_len = strlen(nom);
+    memcpy(e->name, nom, e->name_len);
+}
+
+/*
+ * Rattacher les orphelins a /lost+found (cree au besoin) sous le nom
+ * #<inode>. Retourne le nombre d'inodes rattaches.
+ */
+static uint32_t attach_orphans(fsck_ctx *c, const uint32_t *orphelins, uint32_t nb) {
+    filesystem *p = c->p;
+    if (nb == 0)
+        return 0;
+    uint32_t lf = lookup_entry(p, FS_ROOT_INODE, "lost+found");
+    if (lf == 0) {
+        lf = alloc_inode(p);
+        if (lf == 0)
+            return 0;
+        disk_inode di;
+        memset(&di, 0, sizeof(di));
+        di.type = FS_TYPE_DIR;
+        di.perms = 7;
+        di.links = 1;
+        di.parent = FS_ROOT_INODE;
+        disk_dirent e;
+        make_dirent(&e, lf, FS_TYPE_DIR, "lost+found");
+        if (write_inode(p, lf, &di) < 0 || add_entries(c, FS_ROOT_INODE, &e, 1) < 0)
+            return 0;
+        c->r->repares++;
+    }
+    disk_dirent *entrees = malloc((nb ? nb : 1) * sizeof(disk_dirent));
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < nb; i++) {
+        disk_inode di;
+        if (orphelins[i] == lf || read_inode(p, orphelins[i], &di) < 0)
+            continue;
+        char nom[FS_NAME_MAX + 1];
+        snprintf(nom, sizeof(nom), "#%u", orphelins[i]);
+        make_dirent(&entrees[n++], orphelins[i], di.type, nom);
+        di.parent = lf;
+        di.links = 1;
+        write_inode(p, orphelins[i], &di);
+    }
+    uint32_t rattaches = n && add_entries(c, lf, entrees, n) == 0 ? n : 0;
+    free(entrees);
+    return rattaches;
+}
+
+/*
+ * Recopier le contenu d'un inode dont des blocs sont aussi reclames par un
+ * autre : les blocs en commun restent au premier proprietaire, l'inode
+ * recoit des blocs neufs. Ses anciens blocs non partages deviennent perdus
+ * et sont rendus par la comparaison avec la bitmap qui suit.
+ */
+static int clone_inode(fsck_ctx *c, uint32_t ino) {
+    filesystem *p = c->p;
+    disk_inode di;
+    if (read_inode(p, ino, &di) < 0)
+        return -1;
+    disk_extent *ext = NULL;
+    int nb_ext = inode_get_extents(p, &di, &ext);
+    char *data = malloc(di.size + 1);
+    if (nb_ext < 0 || read_inode_data(p, ino, &di, data) < 0) {
+        free(ext);
+        free(data);
+        return -1;
+    }
+    claim_blocks(c, ino, ext, nb_ext, di.extent_block, -1);
+    free(ext);
+    di.nb_extents = 0;
+    di.extent_block = 0;
+    memset(di.extents, 0, sizeof(di.extents));
+    int ret = rewrite_data(c, ino, &di, data, di.size);
+    free(data);
+    return ret;
+}
+
+//Comparer les blocs reclames avec la bitmap et la table des references
+static void check_blocks(fsck_ctx *c, int reparer) {
+    filesystem *p = c->p;
+    fsck_report *r = c->r;
+    for (uint32_t b = p->sb.data_start; b < p->sb.nb_blocks; b++) {
+        uint32_t n = c->proprietaires[b];
+        uint32_t refs = p->ref_table ? ref_get(p, b) : 0;
+        int occupe = (p->block_bitmap[b / 8] >> (b % 8)) & 1;
+        //Plus de references que de proprietaires : un compteur sature reste inconnu
+        uint32_t attendu = n ? n - 1 : 0;
+        if (refs > attendu && refs < FS_REF_MAX) {
+            r->refs_incoherentes++;
+            if (reparer) {
+                while (ref_get(p, b) > attendu && ref_drop(p, b))
+                    ;
+                r->repares++;
+            }
+        }
+        if (n == 0 && occupe) {
+            r->blocs_perdus++;
+            if (reparer) {
+                disk_extent ext = { b, 1 };
+                free_extent(p, &ext);
+                r->repares++;
+            }
+        } else if (n > 0 && !occupe) {
+            r->blocs_libres++;
+            if (reparer) {
+                block_mark_used(p, b);
+                r->repares++;
+            }
+        }
+    }
+}
+
+static int cmp_refs(const void *a, const void *b) {
+    const fsck_entry_ref *x = a, *y = b;
+    return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+int fsck_run(filesystem *p, int nb_threads, int reparer, fsck_report *r) {
+    struct timespec debut, fin;
+    clock_gettime(CLOCK_MONOTONIC, &debut);
+    memset(r, 0, sizeof(*r));
+    uint32_t nb_inodes = p->sb.nb_inodes;
+    fsck_ctx c;
+    memset(&c, 0, sizeof(c));
+    c.p = p;
+    c.r = r;
+    pthread_mutex_init(&c.etat_lock, NULL);
+    pthread_mutex_init(&c.lock, NULL);
+    pthread_cond_init(&c.cond, NULL);
+    c.etat = calloc(nb_inodes, 1);
+    c.refs = calloc(nb_inodes, sizeof(uint32_t));
+    c.liens = calloc(nb_inodes, sizeof(uint32_t));
+    c.parent_vu = calloc(nb_inodes, sizeof(uint32_t));
+    c.proprietaires = calloc(p->sb.nb_blocks, sizeof(uint16_t));
+    if (nb_threads < 1)
+        nb_threads = 1;
+    //Les vues des threads ne vident pas la file et ne chargent rien dans la table des sommes
+    if (p->io.nb_queue)
+        io_drain(p);
+    csum_load_table(p);
+
+    //La racine compte pour une reference et se reference elle-meme
+    disk_inode racine;
+    if (read_inode(p, FS_ROOT_INODE, &racine) < 0 || racine.type != FS_TYPE_DIR) {
+        printf("FSCK : racine illisible, verification impossible.\n");
+        r->erreurs++;
+    } else {
+        disk_extent *ext = NULL;
+        first_visit(&c, FS_ROOT_INODE, &racine);
+        int nb_ext = read_visit(&c, p, FS_ROOT_INODE, &racine, &ext);
+        if (nb_ext >= 0)
+            claim_blocks(&c, FS_ROOT_INODE, ext, nb_ext, racine.extent_block, 1);
+        free(ext);
+        c.refs[FS_ROOT_INODE] = 1;
+        c.parent_vu[FS_ROOT_INODE] = FS_ROOT_INODE;
+        if (racine.parent == FS_ROOT_INODE)
+            c.etat[FS_ROOT_INODE] |= FSCK_PARENT_OK;
+        count_type(&c, FS_TYPE_DIR);
+        push_dir(&c, FS_ROOT_INODE);
+        run_workers(&c, nb_threads);
+    }
+    uint32_t *vides, nb_vides;
+    scan_orphans(&c, &vides, &nb_vides);
+    run_workers(&c, nb_threads);
+
+    //Inodes : compteurs de liens, parents, orphelins
+    r->inodes_vides = nb_vides;
+    uint32_t *orphelins = malloc(nb_inodes * sizeof(uint32_t)), nb_orphelins = 0;
+    for (uint32_t ino = FS_ROOT_INODE; ino < nb_inodes; ino++) {
+        uint8_t e = c.etat[ino];
+        if (!(e & FSCK_VU))
+            continue;
+        if (e & FSCK_LIBRE) {
+            r->inodes_libres++;
+            if (reparer) {
+                inode_mark_used(p, ino);
+                r->repares++;
+            }
+        }
+        if (e & FSCK_ORPHELIN) {
+            orphelins[nb_orphelins++] = ino;
+            continue;
+        }
+        int liens_faux = c.liens[ino] != c.refs[ino];
+        int parent_faux = !(e & FSCK_PARENT_OK);
+        r->liens_faux += liens_faux;
+        r->parents_faux += parent_faux;
+        if (reparer && (liens_faux || parent_faux)) {
+            disk_inode di;
+            if (read_inode(p, ino, &di) == 0) {
+                di.links = c.refs[ino];
+                if (parent_faux)
+                    di.parent = c.parent_vu[ino];
+                write_inode(p, ino, &di);
+                r->repares++;
+            }
+        }
+    }
+    r->orphelins = nb_orphelins;
+    r->entrees_invalides = c.nb_invalides;
+    if (reparer) {
+        for (uint32_t i = 0; i < nb_vides; i++)
+            free_inode(p, vides[i]);
+        r->repares += nb_vides;
+        //Une reecriture par repertoire touche
+        for (uint32_t i = 0; i < c.nb_invalides; i++) {
+            uint32_t dir = c.invalides[i].dir;
+            int deja = 0;
+            for (uint32_t k = 0; k < i && !deja; k++)
+                deja = c.invalides[k].dir == dir;
+            if (!deja && drop_entries(&c, dir, c.invalides, c.nb_invalides) == 0)
+                r->repares++;
+        }
+        r->repares += attach_orphans(&c, orphelins, nb_orphelins);
+    }
+
+    //Liens symboliques : la cible est cherchee comme au chargement, par son chemin
+    for (uint32_t i = 0; i < c.nb_symlinks; i++) {
+        fsck_symlink *s = &c.symlinks[i];
+        int mort = lookup_path(p, s->cible) == 0;
+        r->liens_morts += mort;
+        if (mort != s->marque_mort) {
+            r->liens_mal_marques++;
+            disk_inode di;
+            if (reparer && read_inode(p, s->ino, &di) == 0) {
+                if (mort)
+                    di.flags |= FS_INODE_DEAD_LINK;
+                else
+                    di.flags &= ~FS_INODE_DEAD_LINK;
+                write_inode(p, s->ino, &di);
+                r->repares++;
+            }
+        }
+        free(s->cible);
+    }
+
+    //Blocs : les inodes qui en reclament un deja pris (sans partage) recoivent une copie
+    for (uint32_t b = p->sb.data_start; b < p->sb.nb_blocks; b++) {
+        if (c.proprietaires[b] > 1 + (p->ref_table ? ref_get(p, b) : 0))
+            r->blocs_doubles++;
+    }
+    if (c.nb_conflits)
+        qsort(c.conflits, c.nb_conflits, sizeof(fsck_entry_ref), cmp_refs);
+    for (uint32_t i = 0; reparer && i < c.nb_conflits; i++) {
+        uint32_t b = c.conflits[i].dir, ino = c.conflits[i].ino;
+        uint32_t refs = p->ref_table ? ref_get(p, b) : 0;
+        if ((c.etat[ino] & FSCK_CLONE) || c.proprietaires[b] <= 1 + refs)
+            continue;
+        c.etat[ino] |= FSCK_CLONE;
+        if (clone_inode(&c, ino) == 0)
+            r->repares++;
+    }
+    //Les blocs rendus par les reecritures ci-dessus sont liberes au commit
+    if (reparer && r->repares && p->journal.enabled)
+        journal_commit(p);
+    check_blocks(&c, reparer);
+    if (reparer && r->repares) {
+        recount_free(p);
+        if (p->journal.enabled)
+            journal_commit(p);
+        else
+            sync_partition(p);
+    }
+
+    free(orphelins);
+    free(vides);
+    free(c.etat);
+    free(c.refs);
+    free(c.liens);
+    free(c.parent_vu);
+    free(c.proprietaires);
+    free(c.invalides);
+    free(c.symlinks);
+    free(c.pile);
+    free(c.conflits);
+    pthread_mutex_destroy(&c.etat_lock);
+    pthread_mutex_destroy(&c.lock);
+    pthread_cond_destroy(&c.cond);
+    clock_gettime(CLOCK_MONOTONIC, &fin);
+    r->duree = (fin.tv_sec - debut.tv_sec) + (fin.tv_nsec - debut.tv_nsec) / 1e9;
+    return 0;
+}
+
+//Nombre d'anomalies relevees par un bilan
+uint32_t fsck_problems(const fsck_report *r) {
+    return r->liens_faux + r->parents_faux + r->orphelins + r->inodes_vides + r->inodes_libres +
+           r->entrees_invalides + r->blocs_doubles + r->blocs_perdus +
+           r->blocs_libres + r->blocs_hors_zone + r->refs_incoherentes + r->erreurs;
+}
+
+void fsck_print(const fsck_report *r, int reparer) {
+    printf("FSCK : Repertoires : %u, Fichiers : %u, Liens symboliques : %u (%d threads, %.2f ms)\n",
+           r->repertoires, r->fichiers, r->liens_symboliques, r->threads, r->duree * 1e3);
+    struct { uint32_t n; const char *texte; } lignes[] = {
+        { r->liens_faux, "compteurs de liens faux" },
+        { r->parents_faux, "inodes dont le parent ne les reference pas" },
+        { r->orphelins, "inodes orphelins" },
+        { r->inodes_vides, "inodes occupes jamais ecrits" },
+        { r->inodes_libres, "inodes utilises marques libres" },
+        { r->entrees_invalides, "entrees de repertoire invalides" },
+        { r->blocs_doubles, "blocs reclames deux fois" },
+        { r->blocs_perdus, "blocs occupes sans proprietaire" },
+        { r->blocs_libres, "blocs utilises marques libres" },
+        { r->blocs_hors_zone, "blocs hors de la zone de donnees" },
+        { r->refs_incoherentes, "compteurs de references faux" },
+        { r->erreurs, "lectures en echec" },
+    };
+    for (size_t i = 0; i < sizeof(lignes) / sizeof(lignes[0]); i++) {
+        if (lignes[i].n)
+            printf("FSCK : %u %s\n", lignes[i].n, lignes[i].texte);
+    }
+    //L'etat d'un lien n'est enregistre qu'a sa prochaine ecriture : un ecart n'est pas une incoherence
+    if (r->liens_morts)
+        printf("FSCK : %u liens symboliques morts\n", r->liens_morts);
+    if (r->liens_mal_marques)
+        printf("FSCK : %u liens symboliques dont l'etat enregistre est perime%s\n", r->liens_mal_marques,
+               reparer ? " (mis a jour)" : "");
+    uint32_t problemes = fsck_problems(r);
+    if (problemes == 0)
+        printf("FSCK : aucune incoherence.\n");
+    else if (reparer)
+        printf("FSCK : %u incoherences, %u reparations ecrites.\n", problemes, r->repares);
+    else
+        printf("FSCK : %u incoherences (fsck --repair pour les corriger).\n", problemes);
+}
@@ -0,0 +1,5 @@
+int fsck_run(filesystem *p, int nb_threads, int reparer, fsck_report *r);
+
+uint32_t fsck_problems(const fsck_report *r);
+
+void fsck_print(const fsck_report *r, int reparer);
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "structures.h"
+#include "fonctions.h"
+#include "io.h"
+
+/*
+ * Couche d'E/S de la partition. Les appelants decrivent un lot de requetes
+ * independantes (io_request) ; io_run les execute toutes et rend la main
+ * quand elles sont terminees. Avec io_uring, jusqu'a IO_RING_ENTRIES
+ * requetes sont en vol a la fois et un seul appel systeme soumet un lot et
+ * attend des completions. io_uring est utilise par appels systeme directs,
+ * sans liburing. Toutes les fonctions sont appelees avec p->lock tenu.
+ */
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+//Creer l'anneau ; 0 si io_uring est disponible
+static int uring_setup(io_backend *io) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = sys_io_uring_setup(IO_RING_ENTRIES, &params);
+    if (fd < 0)
+        return -1;
+    io->ring_fd = fd;
+    io->entries = params.sq_entries;
+    io->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int unique = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (unique && io->cq_size > io->sq_size)
+        io->sq_size = io->cq_size;
+    io->sq_ptr = mmap(NULL, io->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (io->sq_ptr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (unique) {
+        io->cq_ptr = io->sq_ptr;
+    } else {
+        io->cq_ptr = mmap(NULL, io->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (io->cq_ptr == MAP_FAILED) {
+            munmap(io->sq_ptr, io->sq_size);
+            close(fd);
+            return -1;
+        }
+    }
+    io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED) {
+        munmap(io->sq_ptr, io->sq_size);
+        if (io->cq_ptr != io->sq_ptr)
+            munmap(io->cq_ptr, io->cq_size);
+        close(fd);
+        return -1;
+    }
+    char *sq = io->sq_ptr, *cq = io->cq_ptr;
+    io->sq_head = (unsigned *)(sq + params.sq_off.head);
+    io->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    io->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    io->sq_array = (unsigned *)(sq + params.sq_off.array);
+    io->cq_head = (unsigned *)(cq + params.cq_off.head);
+    io->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    io->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * @brief Choisit l'implementation des E/S d'une partition ouverte.
+ *
+ * io_uring est demande par defaut ; s'il n'est pas disponible (noyau
+ * ancien, interdit par seccomp...), les E/S restent bloquantes.
+ *
+ * @return L'implementation retenue (IO_BACKEND_*).
+ */
+int io_init(filesystem *p, int type) {
+    io_backend *io = &p->io;
+    memset(io, 0, sizeof(io_backend));
+    io->ring_fd = -1;
+    io->type = IO_BACKEND_SYNC;
+    if (type == IO_BACKEND_URING) {
+        if (uring_setup(io) == 0)
+            io->type = IO_BACKEND_URING;
+        else
+            printf("io_uring indisponible (%s) : E/S bloquantes.\n", strerror(errno));
+    }
+    return io->type;
+}
+
+void io_close(filesystem *p) {
+    io_backend *io = &p->io;
+    io_drain(p);
+    if (io->type == IO_BACKEND_URING) {
+        munmap(io->sqes, io->sqes_size);
+        if (io->cq_ptr != io->sq_ptr)
+            munmap(io->cq_ptr, io->cq_size);
+        munmap(io->sq_ptr, io->sq_size);
+        close(io->ring_fd);
+    }
+    free(io->queue);
+    io->queue = NULL;
+    io->nb_queue = io->cap_queue = 0;
+    io->ring_fd = -1;
+    io->type = IO_BACKEND_SYNC;
+}
+
+static int run_sync(filesystem *p, io_request *reqs, int nb) {
+    for (int i = 0; i < nb; i++) {
+        io_request *r = &reqs[i];
+        while (r->done < r->len) {
+            char *buf = (char *)r->buf + r->done;
+            ssize_t n = r->write ? pwrite(p->fd, buf, r->len - r->done, r->offset + r->done)
+                                 : pread(p->fd, buf, r->len - r->done, r->offset + r->done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return -1;
+            if (n == 0) {
+                if (r->write)
+                    return -1;
+                //Au-dela de la fin de l'image : zeros
+                memset(buf, 0, r->len - r->done);
+                n = r->len - r->done;
+            }
+            r->done += n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Les requetes a (re)soumettre sont dans une file circulaire d'indices :
+ * une requete incomplete (transfert partiel) y est remise avec son reste.
+ */
+static int run_uring(filesystem *p, io_request *reqs, int nb) {
+    io_backend *io = &p->io;
+    int *todo = malloc(nb * sizeof(int));
+    int tete = 0, nb_todo = nb;
+    for (int i = 0; i < nb; i++)
+        todo[i] = i;
+    int termines = 0, en_vol = 0, ret = 0;
+    while (termines < nb) {
+        //Remplir l'anneau de soumission
+        unsigned tail = *io->sq_tail, mask = *io->sq_mask;
+        while (ret == 0 && nb_todo > 0 && (unsigned)en_vol < io->entries) {
+            io_request *r = &reqs[todo[tete]];
+            struct io_uring_sqe *sqe = &io->sqes[tail & mask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = p->fd;
+            sqe->addr = (uint64_t)(uintptr_t)((char *)r->buf + r->done);
+            sqe->len = r->len - r->done;
+            sqe->off = r->offset + r->done;
+            sqe->user_data = todo[tete];
+            io->sq_array[tail & mask] = tail & mask;
+            tail++;
+            tete = (tete + 1) % nb;
+            nb_todo--;
+            en_vol++;
+        }
+        __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+        //Entrees pas encore consommees par le noyau (y compris apres un EINTR)
+        unsigned a_soumettre = tail - __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE);
+        if ((uint64_t)en_vol > io->max_inflight)
+            io->max_inflight = en_vol;
+        //Un seul appel : soumission du lot et attente d'au moins une completion
+        int n = sys_io_uring_enter(io->ring_fd, a_soumettre, 1, IORING_ENTER_GETEVENTS);
+        io->enters++;
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            ret = -1;
+            break;
+        }
+        //Recolter toutes les completions disponibles
+        unsigned head = *io->cq_head;
+        while (head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+            int idx = (int)cqe->user_data;
+            int res = cqe->res;
+            head++;
+            en_vol--;
+            io_request *r = &reqs[idx];
+            if (res == -EINTR || res == -EAGAIN) {
+                res = 0;
+            } else if (res < 0) {
+                errno = -res;
+                ret = -1;
+                continue;
+            } else if (res == 0 && !r->write) {
+                memset((char *)r->buf + r->done, 0, r->len - r->done);
+                res = r->len - r->done;
+            }
+            r->done += res;
+            if (r->done < r->len) {
+                todo[(tete + nb_todo) % nb] = idx;
+                nb_todo++;
+            } else {
+                termines++;
+            }
+        }
+        __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+        if (ret < 0 && en_vol == 0)
+            break;
+    }
+    free(todo);
+    return ret;
+}
+
+/**
+ * @brief Execute un lot de requetes independantes et attend leur fin.
+ *
+ * Les ecritures en attente sont envoyees d'abord, pour qu'une lecture voie
+ * toujours les dernieres donnees.
+ *
+ * @return 0 si toutes les requetes ont abouti, -1 sinon.
+ */
+int io_run(filesystem *p, io_request *reqs, int nb) {
+    io_backend *io = &p->io;
+    if (nb <= 0)
+        return 0;
+    if (io->nb_queue && reqs != io->queue && io_drain(p) < 0)
+        return -1;
+    io->batches++;
+    io->requests += nb;
+    for (int i = 0; i < nb; i++) {
+        reqs[i].done = 0;
+        io->bytes += reqs[i].len;
+    }
+    int ret = io->type == IO_BACKEND_URING ? run_uring(p, reqs, nb) : run_sync(p, reqs, nb);
+    if (ret < 0)
+        perror("Erreur : E/S sur la partition");
+    return ret;
+}
+
+/**
+ * @brief Met une ecriture en file (le tampon est copie).
+ *
+ * Une ecriture qui chevauche une ecriture en attente vide d'abord la file :
+ * avec plusieurs requetes en vol, l'ordre entre elles n'est pas garanti.
+ */
+int io_queue_write(filesystem *p, uint64_t offset, const void *buf, size_t len) {
+    io_backend *io = &p->io;
+    if (io->nb_queue && offset < io->queue_hi && offset + len > io->queue_lo) {
+        for (uint32_t i = 0; i < io->nb_queue; i++) {
+            io_request *r = &io->queue[i];
+            if (offset < r->offset + r->len && offset + len > r->offset) {
+                if (io_drain(p) < 0)
+                    return -1;
+                break;
+            }
+        }
+    }
+    if (io->nb_queue == io->cap_queue) {
+        io->cap_queue = io->cap_queue ? io->cap_queue * 2 : 64;
+        io->queue = realloc(io->queue, io->cap_queue * sizeof(io_request));
+    }
+    io_request *r = &io->queue[io->nb_queue++];
+    r->write = 1;
+    r->buf = malloc(len);
+    memcpy(r->buf, buf, len);
+    r->len = len;
+    r->offset = offset;
+    r->done = 0;
+    if (io->nb_queue == 1 || offset < io->queue_lo)
+        io->queue_lo = offset;
+    if (io->nb_queue == 1 || offset + len > io->queue_hi)
+        io->queue_hi = offset + len;
+    io->queued_bytes += len;
+    if (io->nb_queue >= IO_QUEUE_MAX || io->queued_bytes >= IO_QUEUE_BYTES)
+        return io_drain(p);
+    return 0;
+}
+
+//Envoyer toutes les ecritures en attente en un lot
+int io_drain(filesystem *p) {
+    io_backend *io = &p->io;
+    if (io->nb_queue == 0)
+        return 0;
+    int ret = io_run(p, io->queue, io->nb_queue);
+    for (uint32_t i = 0; i < io->nb_queue; i++)
+        free(io->queue[i].buf);
+    io->nb_queue = 0;
+    io->queued_bytes = 0;
+    io->queue_lo = io->queue_hi = 0;
+    return ret;
+}
+
+void io_stats(filesystem *p) {
+    io_backend *io = &p->io;
+    if (p->map) {
+        printf("E/S : projection mmap\n");
+        return;
+    }
+    if (io->type == IO_BACKEND_URING)
+        printf("E/S : io_uring (%u entrees)", io->entries);
+    else
+        printf("E/S : pread/pwrite bloquants");
+    printf(", %llu lots, %llu requetes, %.1f Mio", (unsigned long long)io->batches,
+           (unsigned long long)io->requests, io->bytes / (1024.0 * 1024.0));
+    if (io->type == IO_BACKEND_URING)
+        printf(", %llu appels io_uring_enter, %llu requetes en vol au plus",
+               (unsigned long long)io->enters, (unsigned long long)io->max_inflight);
+    printf("\n");
+}
+
+static double io_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * Comparer les deux implementations : lectures de blocs de 4 Kio a des
+ * positions aleatoires de l'image, par lots de lot requetes. L'image n'est
+ * pas modifiee.
+ */
+void bench_io(const char *filename, int nb_lectures, int lot) {
+    const char *noms[2] = { "sync", "io_uring" };
+    int flags[2] = { FS_MOUNT_SYNC_IO, 0 };
+    if (lot < 1)
+        lot = 1;
+    printf("%-9s %10s %12s %10s %10s\n", "E/S", "lectures", "lecture/s", "Mio/s", "appels");
+    for (int m = 0; m < 2; m++) {
+        filesystem b;
+        if (mount_partition(&b, filename, FS_MOUNT_RDONLY | flags[m]) != 0) {
+            printf("Impossible de monter '%s' pour la mesure.\n", filename);
+            return;
+        }
+        if (m == 1 && b.io.type != IO_BACKEND_URING) {
+            unmount_partition(&b);
+            break;
+        }
+        io_request *reqs = malloc(lot * sizeof(io_request));
+        char *tampons = malloc((size_t)lot * FS_BLOCK_SIZE);
+        srand(42);
+        double t0 = io_now();
+        for (int fait = 0; fait < nb_lectures; fait += lot) {
+            int n = nb_lectures - fait < lot ? nb_lectures - fait : lot;
+            for (int i = 0; i < n; i++) {
+                reqs[i].write = 0;
+                reqs[i].buf = tampons + (size_t)i * FS_BLOCK_SIZE;
+                reqs[i].len = FS_BLOCK_SIZE;
+                reqs[i].offset = (uint64_t)(rand() % b.sb.nb_blocks) * FS_BLOCK_SIZE;
+            }
+            io_run(&b, reqs, n);
+        }
+        double duree = io_now() - t0;
+        if (duree <= 0)
+            duree = 1e-9;
+        uint64_t appels = b.io.type == IO_BACKEND_URING ? b.io.enters : b.io.requests;
+        printf("%-9s %10d %12.0f %10.1f %10llu\n", noms[m], nb_lectures, nb_lectures / duree,
+               nb_lectures * (double)FS_BLOCK_SIZE / duree / (1024.0 * 1024.0), (unsigned long long)appels);
+        free(reqs);
+        free(tampons);
+        unmount_partition(&b);
+    }
+}
@@ -0,0 +1,13 @@
+int io_init(filesystem *p, int type);
+
+void io_close(filesystem *p);
+
+int io_run(filesystem *p, io_request *reqs, int nb);
+
+int io_queue_write(filesystem *p, uint64_t offset, const void *buf, size_t len);
+
+int io_drain(filesystem *p);
+
+void io_stats(filesystem *p);
+
+void bench_io(const char *filename, int nb_lectures, int lot);
@@ -0,0 +1,549 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
+
+#include "structures.h"
+#include "fonctions.h"
+#include "journal.h"
+#include "crc32c.h"
+#include "dedup.h"
+
+/*
+ * Journal des metadonnees en ecriture anticipee (write-ahead log).
+ *
+ * Les mises a jour d'inodes sont gardees en memoire dans la transaction en
+ * cours (read_inode les y retrouve), puis validees par groupe : les
+ * enregistrements et un enregistrement de commit sont ecrits dans la zone du
+ * journal, un seul fsync est fait, puis seulement les inodes et les bitmaps
+ * sont recopies a leur place. Toutes les fonctions sont appelees avec
+ * p->lock tenu.
+ */
+
+static double journal_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * Somme enchainee sur tous les enregistrements d'une transaction : CRC32C
+ * sur les images qui ont les sommes de controle, FNV-1a sur les anciennes.
+ */
+static uint32_t journal_checksum(filesystem *p, uint32_t h, const void *data, size_t len) {
+    if (p->sb.features & FS_FEATURE_CSUM)
+        return crc32c(h, data, len);
+    const uint8_t *o = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= o[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint64_t journal_capacity(filesystem *p) {
+    return (uint64_t)(p->sb.journal_blocks - 1) * FS_BLOCK_SIZE;
+}
+
+static int journal_write_header(filesystem *p) {
+    char bloc[FS_BLOCK_SIZE];
+    memset(bloc, 0, sizeof(bloc));
+    journal_header h = { JOURNAL_MAGIC, 0, p->journal.seq };
+    memcpy(bloc, &h, sizeof(h));
+    return write_block(p, p->sb.journal_start, bloc);
+}
+
+//En-tete d'un journal vide (au formatage)
+int journal_format(filesystem *p) {
+    if (p->sb.journal_blocks == 0)
+        return 0;
+    p->journal.seq = 1;
+    p->journal.offset = 0;
+    return journal_write_header(p);
+}
+
+static void journal_hash_reset(journal_state *j) {
+    for (uint32_t i = 0; i < j->hash_cap; i++)
+        j->hash[i] = -1;
+}
+
+static void journal_hash_insert(journal_state *j, uint32_t ino, int32_t idx) {
+    uint32_t h = (ino * 2654435761u) & (j->hash_cap - 1);
+    while (j->hash[h] != -1 && j->inos[j->hash[h]] != ino)
+        h = (h + 1) & (j->hash_cap - 1);
+    j->hash[h] = idx;
+}
+
+static int32_t journal_hash_find(journal_state *j, uint32_t ino) {
+    if (j->hash_cap == 0)
+        return -1;
+    uint32_t h = (ino * 2654435761u) & (j->hash_cap - 1);
+    while (j->hash[h] != -1) {
+        if (j->inos[j->hash[h]] == ino)
+            return j->hash[h];
+        h = (h + 1) & (j->hash_cap - 1);
+    }
+    return -1;
+}
+
+//Derniere version d'un inode modifie dans la transaction en cours
+int journal_lookup_inode(filesystem *p, uint32_t ino, disk_inode *out) {
+    journal_state *j = &p->journal;
+    int32_t idx = journal_hash_find(j, ino);
+    if (idx < 0)
+        return 0;
+    memcpy(out, &j->inodes[idx], sizeof(disk_inode));
+    return 1;
+}
+
+static uint64_t journal_txn_size(filesystem *p, uint32_t nb_inodes) {
+    uint32_t nb_bitmaps = p->sb.inode_bitmap_blocks + p->sb.block_bitmap_blocks;
+    //Les bitmaps peuvent encore salir un bloc de la table des sommes
+    uint32_t nb_sommes = p->csum_table ? p->csum_nb_dirty + 1 : 0;
+    return (uint64_t)nb_inodes * (sizeof(journal_record) + sizeof(disk_inode))
+         + (uint64_t)(nb_bitmaps + nb_sommes + p->ref_nb_dirty) * (sizeof(journal_record) + FS_BLOCK_SIZE)
+         + sizeof(journal_record) + sizeof(journal_commit_rec);
+}
+
+int journal_log_inode(filesystem *p, uint32_t ino, const disk_inode *in) {
+    journal_state *j = &p->journal;
+    int32_t idx = journal_hash_find(j, ino);
+    if (idx >= 0) {
+        memcpy(&j->inodes[idx], in, sizeof(disk_inode));
+        return 0;
+    }
+    //Une operation plus grosse que le journal est validee en plusieurs fois
+    if (journal_txn_size(p, j->nb + 1) > journal_capacity(p) / 2 && journal_commit(p) < 0)
+        return -1;
+    if (j->nb == j->cap) {
+        j->cap = j->cap ? j->cap * 2 : 64;
+        j->inos = realloc(j->inos, j->cap * sizeof(uint32_t));
+        j->inodes = realloc(j->inodes, j->cap * sizeof(disk_inode));
+        free(j->hash);
+        j->hash_cap = j->cap * 2;
+        j->hash = malloc(j->hash_cap * sizeof(int32_t));
+        journal_hash_reset(j);
+        for (uint32_t i = 0; i < j->nb; i++)
+            journal_hash_insert(j, j->inos[i], i);
+    }
+    j->inos[j->nb] = ino;
+    memcpy(&j->inodes[j->nb], in, sizeof(disk_inode));
+    journal_hash_insert(j, ino, j->nb);
+    j->nb++;
+    if (j->first_op == 0)
+        j->first_op = journal_now();
+    return 0;
+}
+
+/*
+ * Les blocs liberes ne redeviennent libres qu'au commit : sinon une ecriture
+ * directe dans un bloc reutilise pourrait ecraser un contenu encore reference
+ * par l'etat valide si le systeme s'arrete avant le commit.
+ */
+void journal_defer_free(filesystem *p, const disk_extent *ext) {
+    journal_state *j = &p->journal;
+    if (j->nb_freed == j->cap_freed) {
+        j->cap_freed = j->cap_freed ? j->cap_freed * 2 : 64;
+        j->freed = realloc(j->freed, j->cap_freed * sizeof(disk_extent));
+    }
+    j->freed[j->nb_freed++] = *ext;
+    if (j->first_op == 0)
+        j->first_op = journal_now();
+}
+
+static void journal_clear_txn(filesystem *p) {
+    journal_state *j = &p->journal;
+    for (uint32_t i = 0; i < j->nb; i++) {
+        //On ne vide que les cases utilisees
+        uint32_t h = (j->inos[i] * 2654435761u) & (j->hash_cap - 1);
+        while (j->hash[h] != -1) {
+            j->hash[h] = -1;
+            h = (h + 1) & (j->hash_cap - 1);
+        }
+    }
+    j->nb = 0;
+    j->nb_freed = 0;
+    j->ops = 0;
+    j->first_op = 0;
+}
+
+//Abandonner la transaction en cours (formatage)
+void journal_discard(filesystem *p) {
+    journal_clear_txn(p);
+}
+
+static int journal_txn_empty(filesystem *p) {
+    journal_state *j = &p->journal;
+    return j->nb == 0 && j->nb_freed == 0 && !p->bitmaps_dirty && p->csum_nb_dirty == 0 &&
+           p->ref_nb_dirty == 0;
+}
+
+static int cmp_indices(const void *a, const void *b, void *arg) {
+    uint32_t *inos = arg;
+    uint32_t x = inos[*(const uint32_t *)a], y = inos[*(const uint32_t *)b];
+    return (x > y) - (x < y);
+}
+
+//Recopier les inodes de la transaction a leur place, un bloc de table a la fois
+static int journal_apply_inodes(filesystem *p, const uint32_t *inos, const disk_inode *inodes, uint32_t nb) {
+    uint32_t *ordre = malloc((nb ? nb : 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < nb; i++)
+        ordre[i] = i;
+    qsort_r(ordre, nb, sizeof(uint32_t), cmp_indices, (void *)inos);
+    char bloc[FS_BLOCK_SIZE];
+    int ret = 0;
+    uint32_t i = 0;
+    while (i < nb) {
+        uint32_t no = p->sb.inode_table_start + inos[ordre[i]] / FS_INODES_PER_BLOCK;
+        if (read_block(p, no, bloc) < 0) {
+            ret = -1;
+            break;
+        }
+        while (i < nb && p->sb.inode_table_start + inos[ordre[i]] / FS_INODES_PER_BLOCK == no) {
+            uint32_t ino = inos[ordre[i]];
+            memcpy(bloc + (ino % FS_INODES_PER_BLOCK) * sizeof(disk_inode), &inodes[ordre[i]], sizeof(disk_inode));
+            i++;
+        }
+        if (write_block(p, no, bloc) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    free(ordre);
+    return ret;
+}
+
+static void journal_put(filesystem *p, char *buf, uint64_t *pos, uint32_t *sum, uint16_t type, uint32_t key,
+                        const void *data, uint32_t len) {
+    journal_record r = { JOURNAL_MAGIC, type, 0, key, len };
+    memcpy(buf + *pos, &r, sizeof(r));
+    memcpy(buf + *pos + sizeof(r), data, len);
+    if (type != JREC_COMMIT)
+        *sum = journal_checksum(p, *sum, buf + *pos, sizeof(r) + len);
+    *pos += sizeof(r) + len;
+}
+
+/*
+ * Valider la transaction en cours : ecriture dans le journal, un fsync, puis
+ * recopie des inodes, des bitmaps et des blocs des tables des sommes et des
+ * references a leur place (sans fsync).
+ */
+int journal_commit(filesystem *p) {
+    journal_state *j = &p->journal;
+    if (!j->enabled || journal_txn_empty(p))
+        return 0;
+    //Les blocs liberes font partie de cette transaction
+    for (uint32_t i = 0; i < j->nb_freed; i++)
+        release_extent(p, &j->freed[i]);
+    j->nb_freed = 0;
+    csum_seal_bitmaps(p);
+
+    uint32_t nb_bitmaps = p->sb.inode_bitmap_blocks + p->sb.block_bitmap_blocks;
+    uint32_t sales = 0;
+    for (uint32_t b = 0; b < nb_bitmaps; b++)
+        sales += p->bitmap_blocks_dirty[b];
+    sales += p->csum_nb_dirty + p->ref_nb_dirty;
+    uint64_t taille = (uint64_t)j->nb * (sizeof(journal_record) + sizeof(disk_inode))
+                    + (uint64_t)sales * (sizeof(journal_record) + FS_BLOCK_SIZE)
+                    + sizeof(journal_record) + sizeof(journal_commit_rec);
+    uint64_t alignee = (taille + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE * FS_BLOCK_SIZE;
+    if (alignee > journal_capacity(p)) {
+        printf("Transaction trop grande pour le journal.\n");
+        return -1;
+    }
+    if (j->offset + alignee > journal_capacity(p) && journal_checkpoint(p) < 0)
+        return -1;
+
+    char *buf = calloc(1, alignee);
+    uint64_t pos = 0;
+    uint32_t sum = 2166136261u;
+    for (uint32_t i = 0; i < j->nb; i++)
+        journal_put(p, buf, &pos, &sum, JREC_INODE, j->inos[i], &j->inodes[i], sizeof(disk_inode));
+    for (uint32_t b = 0; b < nb_bitmaps; b++) {
+        if (p->bitmap_blocks_dirty[b])
+            journal_put(p, buf, &pos, &sum, JREC_BLOCK, p->sb.inode_bitmap_start + b, bitmap_block_ptr(p, b), FS_BLOCK_SIZE);
+    }
+    for (uint32_t t = 0; p->csum_nb_dirty && t < p->sb.csum_blocks; t++) {
+        if (p->csum_dirty[t])
+            journal_put(p, buf, &pos, &sum, JREC_BLOCK, p->sb.csum_start + t, csum_block_ptr(p, t), FS_BLOCK_SIZE);
+    }
+    for (uint32_t t = 0; p->ref_nb_dirty && t < p->sb.ref_blocks; t++) {
+        if (p->ref_dirty[t])
+            journal_put(p, buf, &pos, &sum, JREC_BLOCK, p->sb.ref_start + t, ref_block_ptr(p, t), FS_BLOCK_SIZE);
+    }
+    journal_commit_rec c = { j->seq, j->nb + sales, sum };
+    journal_put(p, buf, &pos, &sum, JREC_COMMIT, 0, &c, sizeof(c));
+
+    uint32_t debut = p->sb.journal_start + 1 + j->offset / FS_BLOCK_SIZE;
+    if (write_blocks(p, debut, alignee / FS_BLOCK_SIZE, buf) < 0) {
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    //Le seul fsync du groupe : rend durables le journal et les donnees ecrites avant
+    if (flush_device(p) < 0)
+        return -1;
+    j->fsyncs++;
+    //Coupure simulee (bench crash) : les operations de la transaction sont durables
+    if (p->crash && !p->crash->cut)
+        p->crash->durable_ops = p->crash->ops;
+
+    journal_apply_inodes(p, j->inos, j->inodes, j->nb);
+    for (uint32_t b = 0; b < nb_bitmaps; b++) {
+        if (p->bitmap_blocks_dirty[b]) {
+            write_block(p, p->sb.inode_bitmap_start + b, bitmap_block_ptr(p, b));
+            p->bitmap_blocks_dirty[b] = 0;
+        }
+    }
+    p->bitmaps_dirty = 0;
+    for (uint32_t t = 0; p->csum_nb_dirty && t < p->sb.csum_blocks; t++) {
+        if (p->csum_dirty[t]) {
+            write_block(p, p->sb.csum_start + t, csum_block_ptr(p, t));
+            csum_clean(p, t);
+        }
+    }
+    for (uint32_t t = 0; p->ref_nb_dirty && t < p->sb.ref_blocks; t++) {
+        if (p->ref_dirty[t]) {
+            write_block(p, p->sb.ref_start + t, ref_block_ptr(p, t));
+            ref_clean(p, t);
+        }
+    }
+
+    j->total_records += j->nb + sales;
+    j->total_ops += j->ops;
+    j->commits++;
+    j->seq++;
+    j->offset += alignee;
+    journal_clear_txn(p);
+    if (j->offset > journal_capacity(p) * 3 / 4)
+        return journal_checkpoint(p);
+    return 0;
+}
+
+/*
+ * Point de controle : les recopies deja faites sont rendues durables, puis le
+ * journal est vide en avancant la sequence attendue dans son en-tete.
+ */
+int journal_checkpoint(filesystem *p) {
+    journal_state *j = &p->journal;
+    if (write_superblock(p) < 0 || flush_device(p) < 0)
+        return -1;
+    j->offset = 0;
+    if (journal_write_header(p) < 0 || flush_device(p) < 0)
+        return -1;
+    j->fsyncs += 2;
+    j->checkpoints++;
+    return 0;
+}
+
+//Fin d'une operation (une commande) : validation selon le mode de durabilite
+int journal_end_op(filesystem *p) {
+    journal_state *j = &p->journal;
+    if (journal_txn_empty(p))
+        return 0;
+    j->ops++;
+    if (j->first_op == 0)
+        j->first_op = journal_now();
+    if (j->durability == DURABILITY_SYNC ||
+        (j->durability == DURABILITY_GROUP && j->ops >= JOURNAL_GROUP_OPS))
+        return journal_commit(p);
+    pthread_cond_signal(&j->cond);
+    return 0;
+}
+
+//Thread de validation : commit des que le delai du groupe est ecoule
+static void *journal_worker(void *arg) {
+    filesystem *p = arg;
+    journal_state *j = &p->journal;
+    pthread_mutex_lock(&p->lock);
+    while (!j->stop) {
+        if (journal_txn_empty(p)) {
+            pthread_cond_wait(&j->cond, &p->lock);
+            continue;
+        }
+        if (j->first_op == 0)
+            j->first_op = journal_now();
+        double delai = (j->durability == DURABILITY_ASYNC ? JOURNAL_ASYNC_US : JOURNAL_GROUP_US) / 1e6;
+        double echeance = j->first_op + delai;
+        if (journal_now() >= echeance) {
+            journal_commit(p);
+            continue;
+        }
+        struct timespec ts;
+        ts.tv_sec = (time_t)echeance;
+        ts.tv_nsec = (long)((echeance - ts.tv_sec) * 1e9);
+        pthread_cond_timedwait(&j->cond, &p->lock, &ts);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+//Activer le journal apres le montage (p->lock non tenu)
+int journal_start(filesystem *p, int durability) {
+    journal_state *j = &p->journal;
+    if (p->sb.journal_blocks == 0 || (p->flags & FS_MOUNT_RDONLY))
+        return 0;
+    j->durability = durability;
+    j->enabled = 1;
+    j->stop = 0;
+    pthread_cond_init(&j->cond, NULL);
+    if (durability != DURABILITY_SYNC) {
+        if (pthread_create(&j->thread, NULL, journal_worker, p) == 0)
+            j->thread_started = 1;
+        else
+            j->durability = DURABILITY_SYNC;
+    }
+    return 0;
+}
+
+//Tout valider, vider le journal et arreter le thread (p->lock non tenu)
+int journal_stop(filesystem *p) {
+    journal_state *j = &p->journal;
+    if (!j->enabled)
+        return 0;
+    pthread_mutex_lock(&p->lock);
+    j->stop = 1;
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&p->lock);
+    if (j->thread_started)
+        pthread_join(j->thread, NULL);
+    j->thread_started = 0;
+    pthread_mutex_lock(&p->lock);
+    int ret = journal_commit(p);
+    if (ret == 0)
+        ret = journal_checkpoint(p);
+    j->enabled = 0;
+    pthread_mutex_unlock(&p->lock);
+    free(j->inos);
+    free(j->inodes);
+    free(j->hash);
+    free(j->freed);
+    j->inos = NULL;
+    j->inodes = NULL;
+    j->hash = NULL;
+    j->freed = NULL;
+    j->nb = j->cap = j->hash_cap = 0;
+    j->nb_freed = j->cap_freed = 0;
+    return ret;
+}
+
+//Lire la zone du journal jusqu'a l'octet besoin (les blocs deja lus sont gardes)
+static int journal_fetch(filesystem *p, char *zone, uint64_t *lu, uint64_t besoin) {
+    if (besoin <= *lu)
+        return 0;
+    uint32_t debut = *lu / FS_BLOCK_SIZE;
+    uint32_t fin = (besoin + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    if (read_blocks(p, p->sb.journal_start + 1 + debut, fin - debut, zone + (uint64_t)debut * FS_BLOCK_SIZE) < 0)
+        return -1;
+    *lu = (uint64_t)fin * FS_BLOCK_SIZE;
+    return 0;
+}
+
+/*
+ * Rejouer les transactions validees apres un arret brutal (au montage, avant
+ * la lecture des bitmaps). Retourne le nombre de transactions rejouees.
+ */
+int journal_replay(filesystem *p) {
+    journal_state *j = &p->journal;
+    char bloc[FS_BLOCK_SIZE];
+    if (read_block(p, p->sb.journal_start, bloc) < 0)
+        return -1;
+    journal_header h;
+    memcpy(&h, bloc, sizeof(h));
+    if (h.magic != JOURNAL_MAGIC) {
+        printf("En-tete du journal invalide, journal reinitialise.\n");
+        j->seq = 1;
+        j->offset = 0;
+        return journal_write_header(p) < 0 ? -1 : 0;
+    }
+    uint64_t capacite = journal_capacity(p);
+    //Seuls les blocs couverts par des transactions sont lus : un journal vide coute un bloc
+    char *zone = malloc(capacite);
+    uint64_t lu = 0;
+    uint64_t attendue = h.seq, pos = 0;
+    int rejouees = 0;
+    uint32_t *inos = NULL;
+    disk_inode *inodes = NULL;
+    uint32_t cap = 0;
+    while (pos + sizeof(journal_record) <= capacite) {
+        //Premier passage : la transaction est-elle complete et intacte ?
+        uint64_t cur = pos;
+        uint32_t sum = 2166136261u, nb = 0;
+        int valide = 0;
+        while (cur + sizeof(journal_record) <= capacite) {
+            journal_record r;
+            if (journal_fetch(p, zone, &lu, cur + sizeof(r)) < 0)
+                break;
+            memcpy(&r, zone + cur, sizeof(r));
+            if (r.magic != JOURNAL_MAGIC || r.len > FS_BLOCK_SIZE || cur + sizeof(r) + r.len > capacite ||
+                journal_fetch(p, zone, &lu, cur + sizeof(r) + r.len) < 0)
+                break;
+            if (r.type == JREC_COMMIT) {
+                journal_commit_rec c;
+                memcpy(&c, zone + cur + sizeof(r), sizeof(c));
+                valide = c.seq == attendue && c.nb_records == nb && c.checksum == sum;
+                cur += sizeof(r) + r.len;
+                break;
+            }
+            sum = journal_checksum(p, sum, zone + cur, sizeof(r) + r.len);
+            nb++;
+            cur += sizeof(r) + r.len;
+        }
+        if (!valide)
+            break;
+        //Second passage : application
+        uint32_t nb_inodes = 0;
+        for (uint64_t q = pos; q < cur; ) {
+            journal_record r;
+            memcpy(&r, zone + q, sizeof(r));
+            if (r.type == JREC_INODE) {
+                if (nb_inodes == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    inos = realloc(inos, cap * sizeof(uint32_t));
+                    inodes = realloc(inodes, cap * sizeof(disk_inode));
+                }
+                inos[nb_inodes] = r.key;
+                memcpy(&inodes[nb_inodes], zone + q + sizeof(r), sizeof(disk_inode));
+                nb_inodes++;
+            } else if (r.type == JREC_BLOCK) {
+                write_block(p, r.key, zone + q + sizeof(r));
+            }
+            q += sizeof(r) + r.len;
+        }
+        journal_apply_inodes(p, inos, inodes, nb_inodes);
+        rejouees++;
+        attendue++;
+        pos = (cur + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE * FS_BLOCK_SIZE;
+    }
+    free(inos);
+    free(inodes);
+    free(zone);
+    j->seq = attendue;
+    j->offset = 0;
+    if (flush_device(p) < 0 || journal_write_header(p) < 0 || flush_device(p) < 0)
+        return -1;
+    return rejouees;
+}
+
+void journal_stats(filesystem *p) {
+    journal_state *j = &p->journal;
+    const char *modes[3] = { "sync", "group", "async" };
+    if (!j->enabled) {
+        printf("Journal : inactif\n");
+        return;
+    }
+    printf("Journal : mode %s, %u blocs, %llu/%llu octets utilises\n", modes[j->durability],
+           p->sb.journal_blocks, (unsigned long long)j->offset, (unsigned long long)journal_capacity(p));
+    printf("  commits %llu, operations %llu, enregistrements %llu, fsync %llu, points de controle %llu\n",
+           (unsigned long long)j->commits, (unsigned long long)j->total_ops,
+           (unsigned long long)j->total_records, (unsigned long long)j->fsyncs,
+           (unsigned long long)j->checkpoints);
+    if (j->commits)
+        printf("  %.1f operations par commit\n", (double)j->total_ops / j->commits);
+}
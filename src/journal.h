@@ -0,0 +1,23 @@
+int journal_format(filesystem *p);
+
+int journal_start(filesystem *p, int durability);
+
+int journal_stop(filesystem *p);
+
+int journal_lookup_inode(filesystem *p, uint32_t ino, disk_inode *out);
+
+int journal_log_inode(filesystem *p, uint32_t ino, const disk_inode *in);
+
+void journal_defer_free(filesystem *p, const disk_extent *ext);
+
+void journal_discard(filesystem *p);
+
+int journal_end_op(filesystem *p);
+
+int journal_commit(filesystem *p);
+
+int journal_checkpoint(filesystem *p);
+
+int journal_replay(filesystem *p);
+
+void journal_stats(filesystem *p);
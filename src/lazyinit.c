@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "structures.h"
+#include "fonctions.h"
+#include "lazyinit.h"
+
+/*
+ * Initialisation des tables en arriere-plan (FS_FEATURE_LAZY_INIT). Le
+ * formatage laisse les bitmaps et les tables des inodes, des sommes et des
+ * references a initialiser (voir lazy_mask dans fonctions.c) ; ce thread
+ * les met a zero LAZY_CHUNK blocs a la fois, p->lock tenu le temps d'une
+ * mise a zero. Il attend ensuite LAZY_WAIT_FACTOR fois ce qu'elle a dure :
+ * la partition reste disponible pour les autres E/S, et d'autant plus
+ * qu'elle est occupee. La progression est gardee dans le superbloc a
+ * chacune de ses ecritures : un nouveau montage reprend ou il en etait.
+ */
+
+static double lazyinit_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//Attendre jusqu'a l'echeance ou une demande d'arret (p->lock tenu, relache pendant l'attente)
+static void lazyinit_wait(filesystem *p, double echeance) {
+    lazyinit_state *l = &p->lazyinit;
+    while (!l->stop && lazyinit_now() < echeance) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)echeance;
+        ts.tv_nsec = (long)((echeance - ts.tv_sec) * 1e9);
+        pthread_cond_timedwait(&l->cond, &p->lock, &ts);
+    }
+}
+
+static void *lazyinit_worker(void *arg) {
+    filesystem *p = arg;
+    lazyinit_state *l = &p->lazyinit;
+    pthread_mutex_lock(&p->lock);
+    while (!l->stop) {
+        double debut = lazyinit_now();
+        int nb = lazy_init_step(p);
+        if (nb < 0) {
+            printf("Erreur : initialisation des tables interrompue.\n");
+            break;
+        }
+        if (nb == 0) {
+            //Fonctionnalite retiree du superbloc : plus aucune table a masquer
+            write_superblock(p);
+            break;
+        }
+        double duree = lazyinit_now() - debut;
+        l->blocs += nb;
+        l->duree += duree;
+        lazyinit_wait(p, lazyinit_now() + duree * LAZY_WAIT_FACTOR);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/*
+ * Demarrer le thread si des tables restent a initialiser (p->lock non tenu).
+ * Retourne 1 s'il a demarre, 0 s'il n'y a rien a faire ou s'il tourne deja.
+ */
+int lazyinit_start(filesystem *p) {
+    lazyinit_state *l = &p->lazyinit;
+    if (l->running || (p->flags & FS_MOUNT_RDONLY))
+        return 0;
+    pthread_mutex_lock(&p->lock);
+    int a_faire = lazy_init_remaining(p) > 0;
+    pthread_mutex_unlock(&p->lock);
+    if (!a_faire)
+        return 0;
+    l->stop = 0;
+    pthread_cond_init(&l->cond, NULL);
+    if (pthread_create(&l->thread, NULL, lazyinit_worker, p) != 0) {
+        pthread_cond_destroy(&l->cond);
+        return -1;
+    }
+    l->running = 1;
+    return 1;
+}
+
+//Arreter le thread (p->lock non tenu) ; le reste sera initialise au prochain montage
+void lazyinit_stop(filesystem *p) {
+    lazyinit_state *l = &p->lazyinit;
+    if (!l->running)
+        return;
+    pthread_mutex_lock(&p->lock);
+    l->stop = 1;
+    pthread_cond_signal(&l->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(l->thread, NULL);
+    pthread_cond_destroy(&l->cond);
+    l->running = 0;
+}
+
+//Progression (p->lock tenu)
+void lazyinit_stats(filesystem *p) {
+    lazyinit_state *l = &p->lazyinit;
+    superblock *sb = &p->sb;
+    uint32_t reste = lazy_init_remaining(p);
+    uint32_t total = sb->inode_bitmap_blocks + sb->block_bitmap_blocks + sb->inode_table_blocks +
+                     sb->csum_blocks + sb->ref_blocks;
+    if (reste == 0)
+        printf("Initialisation des tables : terminee");
+    else
+        printf("Initialisation des tables : %s, %u/%u blocs restants (%.1f %%)",
+               l->running ? "en cours" : "arretee", reste, total, total ? 100.0 * reste / total : 0);
+    if (l->blocs)
+        printf(", %llu blocs ecrits en %.2f s depuis le montage", (unsigned long long)l->blocs, l->duree);
+    printf("\n");
+}
@@ -0,0 +1,5 @@
+int lazyinit_start(filesystem *p);
+
+void lazyinit_stop(filesystem *p);
+
+void lazyinit_stats(filesystem *p);
@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "structures.h"
+#include "fonctions.h"
+#include "lz.h"
+
+/*
+ * Compresseur de la famille LZ77, au format des sequences de LZ4 : un jeton
+ * (4 bits de longueur de litteraux, 4 bits de longueur de correspondance - 4),
+ * les octets de longueur supplementaires (255 tant que ca continue), les
+ * litteraux, puis la distance sur 2 octets et le reste de la longueur de
+ * correspondance. La derniere sequence n'a que des litteraux. Les
+ * correspondances sont trouvees par une table de hachage des sequences de
+ * 4 octets, sans chaine : un seul candidat par position.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_LAST_LITERALS 5         // Derniers octets toujours en litteraux
+#define LZ_MF_LIMIT 12             // Pas de correspondance qui commence apres fin - 12
+#define LZ_MAX_DISTANCE 65535
+
+static uint32_t lz_read32(const uint8_t *o) {
+    uint32_t v;
+    memcpy(&v, o, 4);
+    return v;
+}
+
+static uint64_t lz_read64(const uint8_t *o) {
+    uint64_t v;
+    memcpy(&v, o, 8);
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+//Octets egaux a partir de a et b, sans depasser fin (8 a la fois)
+static size_t lz_count(const uint8_t *a, const uint8_t *b, const uint8_t *fin) {
+    const uint8_t *debut = a;
+    while (a + 8 <= fin) {
+        uint64_t x = lz_read64(a) ^ lz_read64(b);
+        if (x) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return a - debut + (__builtin_clzll(x) >> 3);
+#else
+            return a - debut + (__builtin_ctzll(x) >> 3);
+#endif
+        }
+        a += 8;
+        b += 8;
+    }
+    while (a < fin && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - debut;
+}
+
+//Copie par mots de 8 octets : peut ecrire jusqu'a 7 octets de trop (marge verifiee par l'appelant)
+static void lz_wild_copy(uint8_t *d, const uint8_t *s, size_t n) {
+    uint8_t *fin = d + n;
+    do {
+        memcpy(d, s, 8);
+        d += 8;
+        s += 8;
+    } while (d < fin);
+}
+
+static uint8_t *lz_put_len(uint8_t *o, size_t n) {
+    while (n >= 255) {
+        *o++ = 255;
+        n -= 255;
+    }
+    *o++ = (uint8_t)n;
+    return o;
+}
+
+//Taille d'une sequence de lit litteraux et d'une correspondance de m octets (0 : aucune)
+static size_t lz_seq_size(size_t lit, size_t m) {
+    size_t n = 1 + lit + (lit >= 15 ? (lit - 15) / 255 + 1 : 0);
+    if (m)
+        n += 2 + (m - LZ_MIN_MATCH >= 15 ? (m - LZ_MIN_MATCH - 15) / 255 + 1 : 0);
+    return n;
+}
+
+static uint8_t *lz_put_seq(uint8_t *op, const uint8_t *lit, size_t nb_lit, size_t dist, size_t m) {
+    uint8_t *jeton = op++;
+    *jeton = (uint8_t)((nb_lit < 15 ? nb_lit : 15) << 4);
+    if (nb_lit >= 15)
+        op = lz_put_len(op, nb_lit - 15);
+    memcpy(op, lit, nb_lit);
+    op += nb_lit;
+    if (m == 0)
+        return op;
+    *op++ = (uint8_t)dist;
+    *op++ = (uint8_t)(dist >> 8);
+    size_t reste = m - LZ_MIN_MATCH;
+    *jeton |= reste < 15 ? reste : 15;
+    if (reste >= 15)
+        op = lz_put_len(op, reste - 15);
+    return op;
+}
+
+/*
+ * Compresser len octets (65536 au plus) dans dst (cap octets au plus). Retourne la taille
+ * compressee, ou -1 si elle ne tient pas dans cap : l'appelant garde alors
+ * l'original.
+ */
+int lz_compress(const void *src_, int len, void *dst_, int cap) {
+    const uint8_t *src = src_, *ip = src, *anchor = src, *fin = src + len;
+    uint8_t *op = dst_, *op_fin = op + cap;
+    uint16_t table[1 << LZ_HASH_BITS]; // Positions : len <= 65536
+    memset(table, 0, sizeof(table));
+    if (len > LZ_MF_LIMIT) {
+        const uint8_t *limite = fin - LZ_MF_LIMIT;
+        const uint8_t *fin_match = fin - LZ_LAST_LITERALS;
+        ip++;
+        while (ip < limite) {
+            uint32_t h = lz_hash(lz_read32(ip));
+            const uint8_t *ref = src + table[h];
+            table[h] = ip - src;
+            if (ref >= ip || ip - ref > LZ_MAX_DISTANCE || lz_read32(ref) != lz_read32(ip)) {
+                //Les zones sans repetition sont parcourues de plus en plus vite
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            size_t m = LZ_MIN_MATCH + lz_count(ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH, fin_match);
+            size_t lit = ip - anchor;
+            if (op + lz_seq_size(lit, m) > op_fin)
+                return -1;
+            op = lz_put_seq(op, anchor, lit, ip - ref, m);
+            ip += m;
+            anchor = ip;
+            if (ip < limite)
+                table[lz_hash(lz_read32(ip - 2))] = ip - 2 - src;
+        }
+    }
+    size_t lit = fin - anchor;
+    if (op + lz_seq_size(lit, 0) > op_fin)
+        return -1;
+    op = lz_put_seq(op, anchor, lit, 0, 0);
+    return op - (uint8_t *)dst_;
+}
+
+/*
+ * Decompresser len octets de src en exactement out_len octets. Toutes les
+ * longueurs et distances sont verifiees : -1 si le flux est corrompu.
+ */
+int lz_decompress(const void *src_, int len, void *dst_, int out_len) {
+    const uint8_t *ip = src_, *ip_fin = ip + len;
+    uint8_t *dst = dst_, *op = dst, *op_fin = dst + out_len;
+    while (ip < ip_fin) {
+        uint8_t jeton = *ip++;
+        size_t lit = jeton >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= ip_fin)
+                    return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(ip_fin - ip) || lit > (size_t)(op_fin - op))
+            return -1;
+        //Cas courant (sequence courte loin des fins) : copie de taille fixe, sans boucle
+        if (lit <= 16 && ip_fin - ip >= 16 && op_fin - op >= 16)
+            memcpy(op, ip, 16);
+        else if (lit + 8 <= (size_t)(ip_fin - ip) && lit + 8 <= (size_t)(op_fin - op))
+            lz_wild_copy(op, ip, lit);
+        else
+            memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == ip_fin)
+            break;
+        if (ip_fin - ip < 2)
+            return -1;
+        size_t dist = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t m = jeton & 15;
+        if (m == 15) {
+            uint8_t b;
+            do {
+                if (ip >= ip_fin)
+                    return -1;
+                b = *ip++;
+                m += b;
+            } while (b == 255);
+        }
+        m += LZ_MIN_MATCH;
+        if (dist == 0 || dist > (size_t)(op - dst) || m > (size_t)(op_fin - op))
+            return -1;
+        const uint8_t *ref = op - dist;
+        if (m <= 16 && dist >= 16 && op_fin - op >= 16) {
+            memcpy(op, ref, 16);
+        } else if (dist >= 8 && m + 8 <= (size_t)(op_fin - op)) {
+            //Chaque mot lu est deja ecrit : distance d'au moins 8
+            lz_wild_copy(op, ref, m);
+        } else if (dist >= m) {
+            memcpy(op, ref, m);
+        } else {
+            //Recouvrement : la correspondance repete ses propres octets
+            for (size_t i = 0; i < m; i++)
+                op[i] = ref[i];
+        }
+        op += m;
+    }
+    return op == op_fin ? out_len : -1;
+}
+
+static double lz_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//Journal applicatif synthetique : lignes horodatees, peu de vocabulaire
+static void lz_fill_text(char *buf, size_t taille, uint32_t graine) {
+    static const char *niveaux[4] = { "INFO", "INFO", "WARN", "DEBUG" };
+    static const char *messages[6] = {
+        "connexion acceptee depuis 10.0.%u.%u",
+        "requete GET /api/v1/objets/%u traitee en %u ms",
+        "cache de sessions : %u entrees, %u expirees",
+        "ecriture du point de controle %u (%u Kio)",
+        "utilisateur %u authentifie, jeton %u renouvele",
+        "file de taches : %u en attente, %u en cours",
+    };
+    size_t pos = 0;
+    uint32_t x = graine ? graine : 1, t = 1700000000;
+    while (pos < taille) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        t += x % 3;
+        char ligne[160], corps[96];
+        snprintf(corps, sizeof(corps), messages[x % 6], (x >> 8) % 1000, (x >> 18) % 300);
+        int n = snprintf(ligne, sizeof(ligne), "%u.%03u [%s] srv-%u: %s\n", t, (x >> 4) % 1000,
+                         niveaux[(x >> 12) % 4], (x >> 20) % 8, corps);
+        size_t copie = (size_t)n < taille - pos ? (size_t)n : taille - pos;
+        memcpy(buf + pos, ligne, copie);
+        pos += copie;
+    }
+}
+
+/*
+ * Mesure : debit de compression et de decompression par morceaux de 4 Kio
+ * sur du texte (journal synthetique) et sur des octets aleatoires, puis
+ * lecture d'un fichier texte compresse de mio Mio sur une image temporaire :
+ * contenu entier, et blocs au hasard (un seul morceau decompresse par bloc).
+ */
+void bench_lz(int mio) {
+    if (mio < 1)
+        mio = 1;
+    size_t taille = (size_t)mio * 1024 * 1024;
+    char *donnees[2] = { malloc(taille), malloc(taille) };
+    char *comp = malloc(taille + taille / 16 + FS_BLOCK_SIZE);
+    char *sortie = malloc(taille);
+    memset(sortie, 0, taille); //Pages deja presentes : la mesure ne compte pas les defauts de page
+    int *longueurs = malloc((taille / FS_BLOCK_SIZE + 1) * sizeof(int));
+    lz_fill_text(donnees[0], taille, 42);
+    uint32_t x = 12345;
+    for (size_t i = 0; i < taille; i++) {
+        x = x * 1103515245u + 12345u;
+        donnees[1][i] = (char)(x >> 16);
+    }
+    const char *noms[2] = { "texte", "aleatoire" };
+    printf("%-10s %8s %14s %16s %8s\n", "donnees", "Mio", "ratio", "compression", "decomp.");
+    for (int d = 0; d < 2; d++) {
+        size_t total = 0, nb = 0;
+        double t0 = lz_now();
+        for (size_t off = 0; off < taille; off += FS_BLOCK_SIZE, nb++) {
+            int n = lz_compress(donnees[d] + off, FS_BLOCK_SIZE, comp + off, FS_BLOCK_SIZE - 1);
+            longueurs[nb] = n;
+            total += n < 0 ? FS_BLOCK_SIZE : (size_t)n;
+        }
+        double tc = lz_now() - t0;
+        int ok = 1;
+        t0 = lz_now();
+        for (size_t off = 0, k = 0; off < taille; off += FS_BLOCK_SIZE, k++) {
+            if (longueurs[k] < 0)
+                memcpy(sortie + off, donnees[d] + off, FS_BLOCK_SIZE);
+            else if (lz_decompress(comp + off, longueurs[k], sortie + off, FS_BLOCK_SIZE) != FS_BLOCK_SIZE)
+                ok = 0;
+        }
+        double td = lz_now() - t0;
+        ok = ok && memcmp(sortie, donnees[d], taille) == 0;
+        printf("%-10s %8d %13.2fx %11.0f Mio/s %6.0f Mio/s%s\n", noms[d], mio, (double)taille / total,
+               mio / (tc > 0 ? tc : 1e-9), mio / (td > 0 ? td : 1e-9), ok ? "" : "  (ERREUR)");
+    }
+
+    //Image temporaire contenant le texte, compresse
+    char chemin[] = "/tmp/hebcfs-lz-XXXXXX";
+    int fd = mkstemp(chemin);
+    if (fd == -1) {
+        perror("Erreur : image temporaire");
+    } else {
+        close(fd);
+        filesystem b;
+        disk_inode di;
+        memset(&di, 0, sizeof(di));
+        di.type = FS_TYPE_FILE;
+        di.perms = 6;
+        di.links = 1;
+        di.parent = FS_ROOT_INODE;
+        di.flags = FS_INODE_COMPRESSED;
+        uint32_t ino = 0;
+        if (mount_partition(&b, chemin, FS_MOUNT_SYNC_IO | FS_MOUNT_QUIET) < 0 ||
+            format_partition(&b, taille + taille / 4 + 16 * 1024 * 1024) < 0 ||
+            (ino = alloc_inode(&b)) == 0 || write_inode_data(&b, ino, &di, donnees[0], taille) < 0 ||
+            write_inode(&b, ino, &di) < 0) {
+            printf("Impossible de preparer l'image de mesure.\n");
+        } else {
+            pthread_mutex_lock(&b.lock);
+            unmount_partition(&b);
+            pthread_mutex_unlock(&b.lock);
+            if (mount_partition(&b, chemin, FS_MOUNT_RDONLY | FS_MOUNT_SYNC_IO | FS_MOUNT_QUIET) == 0) {
+                read_inode(&b, ino, &di);
+                double t0 = lz_now();
+                int ok = read_inode_data(&b, ino, &di, sortie) == 0 && memcmp(sortie, donnees[0], taille) == 0;
+                double tout = lz_now() - t0;
+                uint32_t nb_blocs = taille / FS_BLOCK_SIZE, lectures = nb_blocs < 2000 ? nb_blocs : 2000;
+                char bloc[FS_BLOCK_SIZE];
+                t0 = lz_now();
+                for (uint32_t i = 0; i < lectures && ok; i++) {
+                    x = x * 1103515245u + 12345u;
+                    uint32_t k = (x >> 8) % nb_blocs;
+                    ok = read_inode_block(&b, &di, k, bloc) == FS_BLOCK_SIZE &&
+                         memcmp(bloc, donnees[0] + (size_t)k * FS_BLOCK_SIZE, FS_BLOCK_SIZE) == 0;
+                }
+                double hasard = lz_now() - t0;
+                printf("Fichier compresse : %d Mio stockes en %.1f Mio (%s)\n", mio,
+                       (double)(di.flags & FS_INODE_COMPRESSED ? di.stored_size : taille) / (1024 * 1024),
+                       ok ? "contenu verifie" : "ERREUR de contenu");
+                printf("  lecture complete %.0f Mio/s, bloc au hasard %.1f us (%u lectures)\n",
+                       mio / (tout > 0 ? tout : 1e-9), hasard * 1e6 / (lectures ? lectures : 1), lectures);
+                pthread_mutex_lock(&b.lock);
+                unmount_partition(&b);
+                pthread_mutex_unlock(&b.lock);
+            }
+        }
+        unlink(chemin);
+    }
+    free(donnees[0]);
+    free(donnees[1]);
+    free(comp);
+    free(sortie);
+    free(longueurs);
+}
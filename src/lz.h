@@ -0,0 +1,5 @@
+int lz_compress(const void *src, int len, void *dst, int cap);
+
+int lz_decompress(const void *src, int len, void *dst, int out_len);
+
+void bench_lz(int mio);
@@ -2,10 +2,13 @@
  * @file main.c
  * @brief Systeme de fichiers simple en C.
  *
- * Ce programme simule un systeme de fichiers en memoire.
+ * Ce programme simule un systeme de fichiers en memoire. Lance avec le
+ * chemin d'une image (ex: ./main partition.fs), il la monte et y ecrit
+ * chaque modification : superbloc, bitmaps, table des inodes et blocs de
+ * repertoires (voir structures.h).
  * Il supporte les commandes de base suivantes :
  *   mkfs, read, write, lseek, mkdir, rmdir, cd, pwd, ls, ls -l,
- *   cat, create, chmod, link, ln, unlink, rm, mv, fsck, tree, help et exit.
+ *   cat, create, chmod, link, ln, unlink, rm, mv, cp, fsck, tree, help et exit.
  *
  * Les liens physiques partagent le meme inode, tandis que les liens symboliques
  * en reçoivent un nouveau et conservent un pointeur sur l’original.
@@ -15,9 +18,41 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "structures.h"
+#include "fonctions.h"
+#include "journal.h"
+#include "io.h"
+#include "pcache.h"
+#include "crash.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "dedup.h"
+#include "cdc.h"
+#include "fsck.h"
+#include "scrub.h"
+#include "lazyinit.h"
 
 /* --- Structures --- */
 
+/*
+ * Inode partage par les liens physiques d'un fichier presents en memoire :
+ * un seul compteur de liens, et les entrees qui le partagent voient le meme
+ * contenu (tampon et compteur reflink). Range dans inode_table par numero
+ * d'inode, pour que les liens charges depuis la partition le retrouvent.
+ */
+typedef struct SharedInode {
+    int inode;
+    int links;                // Liens physiques de l'inode
+    int nb, cap;              // Entrees en memoire qui le partagent
+    struct FileEntry **entries;
+    struct SharedInode *next; // Suivant dans le meme seau de inode_table
+} SharedInode;
+
 typedef struct FileEntry {
     int inode;
     int is_symbol;            // 1 si lien symbolique, 0 sinon
@@ -27,11 +62,25 @@ typedef struct FileEntry {
     int is_directory;         // 1 si repertoire, 0 si fichier
     int size;                 // Taille en octets (pour fichiers)
     char *content;            // Contenu (pour fichiers, NULL pour repertoires)
-    int link_count;           // Nombre de liens physiques
+    int *content_refs;        // Compteur partage du contenu (copie reflink), NULL si non partage
+    int link_count;           // Nombre de liens physiques (si shared est NULL)
+    struct SharedInode *shared; // Inode partage avec les autres liens physiques, NULL sinon
     int perms;                // 4 = lecture, 2 = ecriture, 1 = execution
     struct FileEntry *child;  // Premier enfant (pour repertoires)
     struct FileEntry *next;   // Element suivant dans le meme repertoire
     struct FileEntry *parent; // Repertoire parent (NULL pour la racine)
+    int dirty;                // Modifications a ecrire sur la partition (DIRTY_*)
+    struct FileEntry *dirty_next; // Suivant dans la liste des entrees modifiees
+    int loaded;               // Enfants (repertoire) ou contenu (fichier) presents en memoire
+    unsigned long last_use;   // Dernier acces (repertoires), pour l'eviction
+    unsigned long origin_gen; // Generation de l'arbre ou origin a ete resolu
+    int compress;             // Contenu a stocker compresse (commande compress)
+    uint32_t stored_size;     // Octets stockes au dernier ecrit si compresse, 0 sinon
+    unsigned long epoch;      // Epoque de creation ou de la derniere copie figee (instantanes)
+    struct FileEntry *older;  // Version figee precedente, NULL si aucune
+    struct FileEntry *source; // Vue d'instantane : entree d'origine, NULL hors des vues
+    unsigned long source_epoch; // Vue d'instantane : epoque de l'instantane
+    uint64_t hash;            // Empreinte du sous-arbre (diff), 0 si a recalculer
 } FileEntry;
 
 typedef struct FileSystem {
@@ -51,11 +100,250 @@ typedef struct OpenFile {
 FileSystem fs = { NULL, NULL };
 OpenFile *open_files = NULL;
 int next_inode = 1;
+#define INODE_TABLE_SIZE 1024
+SharedInode *inode_table[INODE_TABLE_SIZE]; // Inodes partages par des liens physiques
 int next_fd = 3; // Descripteurs reserves pour stdio
 const int DEFAULT_FILE_SIZE = 100; // Taille par defaut d'un fichier
 
+/* Mode disque : l'arbre en memoire sert de cache sur la partition */
+#define DEFAULT_PARTITION_SIZE (64 * 1024 * 1024)
+#define DIRTY_INODE 1   // Metadonnees de l'inode a reecrire
+#define DIRTY_DATA 2    // Contenu (ou entrees du repertoire) a reecrire
+filesystem part;
+int disk_mode = 0;
+int mount_flags = 0;            // FS_MOUNT_* passes par la ligne de commande
+int durability = DURABILITY_GROUP; // Validation du journal (--durability=)
+char *image_path = NULL;
+FileEntry *dirty_list = NULL;
+uint32_t *disk_releases = NULL; // Inodes ecrits a rendre avec la reecriture de leur parent
+int nb_disk_releases = 0, cap_disk_releases = 0;
+
+/* Cache des entrees chargees depuis la partition */
+#define CACHE_DEFAULT_BYTES (64 * 1024 * 1024)
+size_t cache_limit = CACHE_DEFAULT_BYTES; // Budget memoire (--cache=<Mio>)
+size_t cache_bytes = 0;         // Estimation de la memoire occupee par l'arbre
+unsigned long cache_tick = 0;   // Horloge des acces aux repertoires
+unsigned long tree_generation = 1; // Incrementee a chaque eviction
+unsigned long cache_loads = 0, cache_evictions = 0;
+size_t pcache_limit = (size_t)PCACHE_DEFAULT_MB * 1024 * 1024; // Cache de pages (--pagecache=<Mio>)
+
+/* Ecriture differee : les commandes modifient l'arbre, un thread l'ecrit */
+#define WB_DEFAULT_EXPIRE_MS 1000
+#define WB_INTERVAL_MS 100
+#define WB_DIRTY_RATIO 10       // % de cache_limit : le thread ecrit sans attendre l'age
+#define WB_DIRTY_HARD_RATIO 20  // % de cache_limit : la commande suivante attend l'ecriture
+#define WB_AGE 0
+#define WB_RATIO 1
+#define WB_EXPLICIT 2
+int wb_expire_ms = WB_DEFAULT_EXPIRE_MS; // Age maximal des modifications (--writeback=<ms>)
+int fsync_on_close = 0;         // --fsync-on-close : fs_close rend le fichier durable
+int compress_all = 0;           // --compress : tous les fichiers sont stockes compresses
+pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER; // Arbre : commande en cours ou ecriture
+pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
+pthread_t wb_thread;
+int wb_running = 0, wb_stop = 0;
+struct timespec dirty_since;    // Premiere modification non ecrite
+unsigned long wb_passes[3] = { 0, 0, 0 }; // Par raison (WB_*)
+unsigned long wb_entries = 0;   // Entrees ecrites par les passes
+
 /* --- Fonctions utilitaires --- */
 
+/**
+ * @brief Libere le contenu d'une entree en tenant compte du partage reflink.
+ *
+ * Le contenu n'est reellement libere que par le dernier proprietaire.
+ */
+void release_content(FileEntry *entry) {
+    if (entry->content_refs) {
+        //Atomique : le recuperateur de rm -r peut liberer en parallele
+        if (__atomic_sub_fetch(entry->content_refs, 1, __ATOMIC_ACQ_REL) > 0) {
+            entry->content = NULL;
+            entry->content_refs = NULL;
+            return;
+        }
+        free(entry->content_refs);
+        entry->content_refs = NULL;
+    }
+    if (entry->content)
+        free(entry->content);
+    entry->content = NULL;
+}
+
+/**
+ * @brief Cherche l'inode partage d'un numero d'inode, NULL s'il n'y en a pas.
+ */
+SharedInode* inode_lookup(int ino) {
+    for (SharedInode *s = inode_table[ino % INODE_TABLE_SIZE]; s; s = s->next) {
+        if (s->inode == ino)
+            return s;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Recopie l'etat de l'inode de e (contenu, taille, droits) vers les
+ * autres entrees qui le partagent.
+ *
+ * A appeler apres chaque modification de ces champs sur un lien physique.
+ */
+void inode_sync(FileEntry *e) {
+    SharedInode *s = e->shared;
+    if (!s)
+        return;
+    for (int i = 0; i < s->nb; i++) {
+        FileEntry *m = s->entries[i];
+        if (m == e)
+            continue;
+        m->content = e->content;
+        m->content_refs = e->content_refs;
+        m->size = e->size;
+        m->loaded = e->loaded;
+        m->perms = e->perms;
+        m->compress = e->compress;
+        m->stored_size = e->stored_size;
+        for (FileEntry *a = m; a; a = a->parent)
+            a->hash = 0;
+    }
+}
+
+/**
+ * @brief Ajoute e aux entrees de l'inode partage s.
+ *
+ * Si s a deja des entrees, e prend leur etat : le contenu en memoire peut
+ * etre plus recent que celui de la partition.
+ */
+void inode_join(SharedInode *s, FileEntry *e) {
+    if (s->nb == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4;
+        s->entries = realloc(s->entries, s->cap * sizeof(FileEntry *));
+    }
+    s->entries[s->nb++] = e;
+    e->shared = s;
+    if (s->nb > 1)
+        inode_sync(s->entries[0]);
+}
+
+/**
+ * @brief Inode partage de e, cree avec links liens s'il n'existe pas encore.
+ */
+SharedInode* inode_share(FileEntry *e, int links) {
+    if (e->shared)
+        return e->shared;
+    SharedInode *s = inode_lookup(e->inode);
+    if (!s) {
+        s = malloc(sizeof(SharedInode));
+        s->inode = e->inode;
+        s->links = links;
+        s->nb = s->cap = 0;
+        s->entries = NULL;
+        s->next = inode_table[e->inode % INODE_TABLE_SIZE];
+        inode_table[e->inode % INODE_TABLE_SIZE] = s;
+    }
+    inode_join(s, e);
+    return s;
+}
+
+/**
+ * @brief Retire e des entrees de son inode partage.
+ *
+ * Le dernier libere l'inode partage. Sinon e garde le contenu par une
+ * reference reflink : il peut encore etre lu (instantanes) ou libere par
+ * release_content sans toucher aux autres liens.
+ */
+void inode_leave(FileEntry *e) {
+    SharedInode *s = e->shared;
+    if (!s)
+        return;
+    if (s->nb > 1 && e->content) {
+        if (!e->content_refs) {
+            e->content_refs = malloc(sizeof(int));
+            *e->content_refs = 1;
+            inode_sync(e);
+        }
+        __atomic_add_fetch(e->content_refs, 1, __ATOMIC_ACQ_REL);
+    }
+    for (int i = 0; i < s->nb; i++) {
+        if (s->entries[i] == e) {
+            s->entries[i] = s->entries[--s->nb];
+            break;
+        }
+    }
+    e->shared = NULL;
+    e->link_count = s->links;
+    if (s->nb == 0) {
+        SharedInode **cur = &inode_table[s->inode % INODE_TABLE_SIZE];
+        while (*cur != s)
+            cur = &(*cur)->next;
+        *cur = s->next;
+        free(s->entries);
+        free(s);
+    }
+}
+
+/**
+ * @brief Rend le contenu d'un fichier prive avant une ecriture.
+ *
+ * Si le contenu est partage avec une copie reflink, il est duplique une
+ * seule fois ici (copie a l'ecriture) ; les ecritures suivantes sont directes.
+ * Les liens physiques du fichier gardent le meme contenu que lui.
+ */
+void unshare_content(FileEntry *file) {
+    if (!file->content_refs)
+        return;
+    //On copie avant de rendre sa reference : tant qu'on la tient, l'original reste valide
+    char *copie = malloc(file->size + 1);
+    memcpy(copie, file->content, file->size + 1);
+    if (__atomic_sub_fetch(file->content_refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        file->content = copie;
+    } else {
+        //Dernier proprietaire : l'original lui revient
+        free(copie);
+        free(file->content_refs);
+    }
+    file->content_refs = NULL;
+    inode_sync(file);
+}
+
+/**
+ * @brief Nombre de liens physiques de l'inode d'une entree.
+ */
+int entry_links(const FileEntry *e) {
+    if (e->shared)
+        return e->shared->links;
+    return e->link_count;
+}
+
+/**
+ * @brief Ajoute le lien physique lien a l'inode de file (ln).
+ *
+ * L'inode partage est cree au premier lien a partir du compteur de file.
+ */
+void link_share(FileEntry *file, FileEntry *lien) {
+    SharedInode *s = inode_share(file, file->link_count > 0 ? file->link_count : 1);
+    s->links++;
+    inode_join(s, lien);
+}
+
+/**
+ * @brief Retire de son inode le lien d'une entree supprimee.
+ *
+ * L'entree quitte l'inode partage et garde le nombre restant dans
+ * link_count ; un second appel est sans effet sur les autres liens.
+ *
+ * @return Le nombre de liens restants de l'inode.
+ */
+int link_drop(FileEntry *e) {
+    if (!e->shared) {
+        if (e->link_count > 0)
+            e->link_count--;
+        return e->link_count;
+    }
+    e->shared->links--;
+    inode_leave(e);
+    return e->link_count;
+}
+
 void free_file_entry(FileEntry *entry) {
     if (!entry)
         return;
@@ -68,956 +356,4226 @@ void free_file_entry(FileEntry *entry) {
         }
     }
     free(entry->name);
-    if (entry->content)
-        free(entry->content);
+    if (entry->is_symbol)
+        free(entry->nom_origin);
+    inode_leave(entry);
+    release_content(entry);
     free(entry);
 }
 
-FileEntry* find_entry(FileEntry *dir, const char *name) {
-    if (!dir || !dir->is_directory)
-        return NULL;
-    FileEntry *child = dir->child;
-    while (child) {
-        if (strcmp(child->name, name) == 0)
-            return child;
-        child = child->next;
+/* --- Persistance : suivi des modifications --- */
+
+static void mark_dirty_one(FileEntry *entry, int flags) {
+    if (!dirty_list)
+        clock_gettime(CLOCK_MONOTONIC, &dirty_since);
+    if (!entry->dirty) {
+        entry->dirty_next = dirty_list;
+        dirty_list = entry;
     }
-    return NULL;
+    entry->dirty |= flags;
 }
 
-void add_entry(FileEntry *dir, FileEntry *entry) {
-    if (!dir || !dir->is_directory)
+/**
+ * @brief Note qu'une entree doit etre reecrite sur la partition.
+ *
+ * Sans effet en mode memoire et sur les vues d'instantane (jamais
+ * persistees). Les entrees modifiees sont ecrites par le thread d'ecriture
+ * differee (ou par fs_flush() a un point de synchronisation). Tous les
+ * liens physiques en memoire d'un inode sont notes : la modification
+ * survit a la suppression de l'un d'eux, et fs_flush() n'ecrit l'inode
+ * qu'une fois.
+ */
+void mark_dirty(FileEntry *entry, int flags) {
+    if (!disk_mode || !entry || entry->source)
         return;
-    entry->next = dir->child;
-    dir->child = entry;
-    entry->parent = dir;
+    if (!entry->shared) {
+        mark_dirty_one(entry, flags);
+        return;
+    }
+    for (int i = 0; i < entry->shared->nb; i++)
+        mark_dirty_one(entry->shared->entries[i], flags);
 }
 
-char *build_path(FileEntry *entry) {
-    if (!entry->parent) {
-        char *chemin = malloc(2);
-        strcpy(chemin, "/");
-        return chemin;
+/**
+ * @brief Retire une entree de la liste des modifications avant sa liberation.
+ */
+void forget_dirty(FileEntry *entry) {
+    if (!entry->dirty)
+        return;
+    for (FileEntry **cur = &dirty_list; *cur; cur = &(*cur)->dirty_next) {
+        if (*cur == entry) {
+            *cur = entry->dirty_next;
+            break;
+        }
     }
-    char *chemin_parent = build_path(entry->parent);
-    int len = strlen(chemin_parent) + strlen(entry->name) + 2;
-    char *chemin_complet = malloc(len);
-    if (strcmp(chemin_parent, "/") == 0)
-        snprintf(chemin_complet, len, "/%s", entry->name);
-    else
-        snprintf(chemin_complet, len, "%s/%s", chemin_parent, entry->name);
-    free(chemin_parent);
-    return chemin_complet;
+    entry->dirty = 0;
+    entry->dirty_next = NULL;
 }
 
-FileEntry* resolve_path(const char *path, FileEntry **parentOut) {
-    FileEntry *courant = (path[0]=='/') ? fs.root : fs.current;
-    char *copie = strdup(path);
-    char *token = strtok(copie, "/");
-    FileEntry *parent = NULL;
-    while (token) {
-        parent = courant;
-        courant = find_entry(courant, token);
-        if (!courant) {
-            free(copie);
-            if (parentOut)
-                *parentOut = parent;
-            return NULL;
+/**
+ * @brief Retire de la liste des modifications les entrees d'un sous-arbre.
+ *
+ * Le sous-arbre va etre libere sans etre ecrit : release_entry_disk rend
+ * aussi les inodes pas encore ecrits. Un seul parcours de la liste, sans
+ * E/S, plutot qu'un fs_flush() de toutes les entrees modifiees.
+ */
+void forget_dirty_subtree(FileEntry *racine) {
+    FileEntry **cur = &dirty_list;
+    while (*cur) {
+        FileEntry *e = *cur;
+        FileEntry *a = e;
+        while (a && a != racine)
+            a = a->parent;
+        if (a) {
+            *cur = e->dirty_next;
+            e->dirty = 0;
+            e->dirty_next = NULL;
+        } else {
+            cur = &e->dirty_next;
         }
-        token = strtok(NULL, "/");
     }
-    free(copie);
-    if (parentOut)
-        *parentOut = parent;
-    return courant;
 }
 
-void print_tree(FileEntry *entry, int level, int show_inodes) {
-    if (!entry)
+//Modifications ou liberations en attente du thread d'ecriture differee
+int writeback_pending() {
+    return dirty_list || nb_disk_releases;
+}
+
+/**
+ * @brief Retire un lien vers l'inode d'une entree supprimee.
+ *
+ * Un inode deja ecrit n'est rendu que par fs_flush(), apres la reecriture
+ * du repertoire parent et dans la meme transaction du journal : apres une
+ * coupure, aucune entree de repertoire ne designe un inode libere. Au
+ * dernier lien, les blocs et l'inode sont liberes. L'appelant doit tenir
+ * part.lock.
+ */
+void release_entry_disk(FileEntry *entry) {
+    int restants = link_drop(entry);
+    if (!disk_mode || entry->inode <= FS_ROOT_INODE)
+        return;
+    disk_inode di;
+    if (read_inode(&part, entry->inode, &di) < 0)
+        return;
+    if (di.type == FS_TYPE_FREE) {
+        //Entree creee puis supprimee avant l'ecriture differee : seul l'inode est pris,
+        //et il reste a un autre lien physique tant qu'il en reste un en memoire
+        if (restants == 0)
+            free_inode(&part, entry->inode);
         return;
-    for (int i = 0; i < level; i++) {
-        printf("    ");
     }
-    if (show_inodes)
-        printf("[%d] ", entry->inode);
-    printf("%s", entry->name);
-    if (entry->is_directory)
-        printf("/");
-    printf("\n");
-    if (entry->is_directory) {
-        FileEntry *child = entry->child;
-        while (child) {
-            print_tree(child, level + 1, show_inodes);
-            child = child->next;
-        }
+    if (!writeback_pending())
+        clock_gettime(CLOCK_MONOTONIC, &dirty_since);
+    if (nb_disk_releases == cap_disk_releases) {
+        cap_disk_releases = cap_disk_releases ? cap_disk_releases * 2 : 64;
+        disk_releases = realloc(disk_releases, cap_disk_releases * sizeof(uint32_t));
+    }
+    disk_releases[nb_disk_releases++] = entry->inode;
+    //Le parent enregistre peut etre le repertoire du lien retire : un autre lien le reecrit
+    SharedInode *s = restants > 0 ? inode_lookup(entry->inode) : NULL;
+    if (s)
+        mark_dirty(s->entries[0], DIRTY_INODE);
+}
+
+//Rendre un lien d'un inode ecrit (fs_flush, part.lock tenu)
+static void release_inode_disk(uint32_t ino) {
+    disk_inode di;
+    if (read_inode(&part, ino, &di) < 0 || di.type == FS_TYPE_FREE)
+        return;
+    if (di.links > 1) {
+        di.links--;
+        write_inode(&part, ino, &di);
+        return;
     }
+    inode_free_blocks(&part, &di);
+    memset(&di, 0, sizeof(di));
+    write_inode(&part, ino, &di);
+    free_inode(&part, ino);
 }
 
 /**
- * @brief Affiche l'arborescence d'un dossier.
+ * @brief Donne un numero d'inode a une nouvelle entree.
  *
- * Si aucun argument n'est fourni, alors arborescence du repertoire courant.
- * Sinon, le chemin donne est resolu et son arborescence est affiche.
+ * En mode disque, l'inode est pris dans la bitmap de la partition ; 0 si
+ * elle est pleine (l'entree reste alors seulement en memoire).
+ */
+int new_inode_number() {
+    if (!disk_mode)
+        return next_inode++;
+    pthread_mutex_lock(&part.lock);
+    int ino = alloc_inode(&part);
+    pthread_mutex_unlock(&part.lock);
+    return ino;
+}
+
+/* --- Instantanes : versions figees de l'arbre --- */
+
+/*
+ * Un instantane ne copie rien : il note l'epoque courante, puis les
+ * modifications suivantes copient seulement les entrees qu'elles touchent.
+ * Avant sa premiere modification depuis le dernier instantane, une entree
+ * est dupliquee (snapshot_cow) : la copie garde l'etat vu par les
+ * instantanes et se chaine par older, de la plus recente a la plus
+ * ancienne. La version d'une entree a l'epoque s est la premiere de la
+ * chaine dont l'epoque ne depasse pas s. Les entrees supprimees sont
+ * gardees jusqu'a la suppression du dernier instantane. Les instantanes
+ * restent en memoire : ils ne survivent pas au demontage.
+ */
+typedef struct Snapshot {
+    char *name;
+    unsigned long epoch;        // Les versions d'epoque <= epoch lui appartiennent
+    FileEntry *root;
+    struct Snapshot *next;
+} Snapshot;
+
+Snapshot *snapshots = NULL;
+unsigned long snap_epoch = 1;   // Epoque des entrees modifiees depuis le dernier instantane
+FileEntry **snap_removed = NULL; // Entrees supprimees encore visibles dans un instantane
+int snap_nb_removed = 0, snap_cap_removed = 0;
+unsigned long snap_copies = 0;  // Versions figees en memoire
+
+/**
+ * @brief Version d'une entree a l'epoque d'un instantane.
  *
- * @param arg Chemin optionnel du repertoire à afficher.
+ * @return La version, ou NULL si l'entree a ete creee apres l'instantane.
  */
-void fs_tree(const char *arg, int indentation) {
-	//Définir répertoire
-    FileEntry *cible = NULL;
-    if (arg == NULL) {
-        cible = fs.current;
-    } else {
-        cible = resolve_path(arg, NULL);
-        if (!cible) {
-            printf("Repertoire introuvable : %s\n", arg);
-            return;
-        }
-        if (!cible->is_directory) {
-            printf("%s\n", cible->name);
-            return;
+FileEntry* snapshot_version(FileEntry *e, unsigned long epoch) {
+    while (e && e->epoch > epoch)
+        e = e->older;
+    return e;
+}
+
+/**
+ * @brief Cree l'entree d'une vue en lecture seule sur la version v de id.
+ *
+ * Les enfants (repertoire) et le contenu (fichier) sont recopies au premier
+ * acces, comme ceux d'une entree chargee depuis la partition.
+ */
+FileEntry* snapshot_view_entry(FileEntry *id, FileEntry *v, unsigned long epoch, const char *name) {
+    FileEntry *e = malloc(sizeof(FileEntry));
+    e->inode = 0;
+    e->is_symbol = v->is_symbol;
+    e->origin = v->origin;
+    e->nom_origin = v->is_symbol && v->nom_origin ? strdup(v->nom_origin) : NULL;
+    e->name = strdup(name);
+    e->is_directory = v->is_directory;
+    e->size = v->size;
+    e->content = NULL;
+    e->content_refs = NULL;
+    e->shared = NULL;
+    e->link_count = entry_links(v);
+    e->perms = v->perms;
+    e->child = NULL;
+    e->next = NULL;
+    e->parent = NULL;
+    e->dirty = 0;
+    e->dirty_next = NULL;
+    e->loaded = v->is_symbol != 0;
+    e->last_use = 0;
+    e->origin_gen = v->origin_gen;
+    e->compress = v->compress;
+    e->stored_size = 0;
+    e->epoch = snap_epoch;
+    e->older = NULL;
+    e->source = id;
+    e->source_epoch = epoch;
+    e->hash = v->is_directory && !v->is_symbol ? 0 : v->hash;
+    return e;
+}
+
+/**
+ * @brief Recopie les enfants d'un repertoire d'une vue depuis sa version.
+ *
+ * La version doit etre chargee. Les vues montees dans l'arbre ne font pas
+ * partie des instantanes et sont sautees.
+ */
+void snapshot_fill_dir(FileEntry *vue, FileEntry *version) {
+    if (vue->loaded)
+        return;
+    FileEntry *dernier = NULL;
+    FileEntry *c = version ? version->child : NULL;
+    while (c) {
+        FileEntry *v = snapshot_version(c, vue->source_epoch);
+        if (!v)
+            break;
+        if (!v->source) {
+            FileEntry *e = snapshot_view_entry(c, v, vue->source_epoch, v->name);
+            e->parent = vue;
+            if (dernier)
+                dernier->next = e;
+            else
+                vue->child = e;
+            dernier = e;
         }
+        c = v->next;
     }
-    //Indentation
-    int i;
-    for(i = 0; i<indentation; i++){
-		printf("    ");
-	}
-	//Afficher nom du dossier
-	printf("\033[1;34m%s\033[0m\n", cible->name);
+    vue->loaded = 1;
+}
 
-    //Afficher nom des sous éléments
-    FileEntry *child = cible->child;
-    while (child) {
-		//Lien symbolique (pas de récursion pour les dossiers symboliques)
-		if(child->is_symbol){
-			//Indentation + 1
-			for(i = 0; i<=indentation; i++){
-				printf("    ");
-			}
-			printf("\033[1;36m%s -> %s\033[0m\n", child->name, child->nom_origin);
-		}
-		else{
-			//Dossier = appel récursif
-			if(child->is_directory){
-				//MAJ du dossier courant, sinon ça bug !!!
-				fs.current = cible;
-				fs_tree(child->name, indentation+1);
-			}
-			//Fichier
-			else{
-				//Indentation + 1
-				for(i = 0; i<=indentation; i++){
-					printf("    ");
-				}
-				printf("\033[1;32m%s\033[0m\n", child->name);
-			}
-		}
-        child = child->next;
+/**
+ * @brief Recopie le contenu d'un fichier d'une vue depuis sa version.
+ *
+ * Le contenu est duplique plutot que partage : les liens physiques
+ * partagent leur tampon sans compteur de references.
+ */
+void snapshot_fill_file(FileEntry *vue, FileEntry *version) {
+    if (vue->loaded)
+        return;
+    if (version && version->content) {
+        vue->size = version->size;
+        vue->content = malloc(version->size + 1);
+        memcpy(vue->content, version->content, version->size);
+        vue->content[version->size] = '\0';
+    } else {
+        vue->size = 0;
+        vue->content = calloc(1, 1);
     }
-    //Dossier courant remis par défaut
-    fs.current = cible;
+    vue->loaded = 1;
 }
 
 /**
- * @brief Affiche l'arborescence d'un dossier avec les inodes.
+ * @brief Repere les vues a remplir parmi des entrees et leurs versions.
  *
- * Si aucun argument n'est fourni, alors arborescence du repertoire courant.
- * Sinon, le chemin donne est resolu et son arborescence est affiche.
- *
- * @param arg Chemin optionnel du repertoire à afficher.
+ * @return Le nombre de vues, rangees dans *vues et leurs versions dans *versions.
  */
-void fs_tree_i(const char *arg, int indentation) {
-	//Définir répertoire
-    FileEntry *cible = NULL;
-    if (arg == NULL) {
-        cible = fs.current;
-    } else {
-        cible = resolve_path(arg, NULL);
-        if (!cible) {
-            printf("Repertoire introuvable : %s\n", arg);
-            return;
-        }
-        if (!cible->is_directory) {
-            printf("%d %s\n", cible->inode, cible->name);
-            return;
+int snapshot_pending(FileEntry **entries, int nb, int repertoires, FileEntry ***vues, FileEntry ***versions) {
+    int n = 0;
+    *vues = *versions = NULL;
+    for (int i = 0; i < nb; i++) {
+        FileEntry *e = entries[i];
+        if (!e || !e->source || e->loaded || e->is_symbol || e->is_directory != repertoires)
+            continue;
+        if (!*vues) {
+            *vues = malloc(nb * sizeof(FileEntry *));
+            *versions = malloc(nb * sizeof(FileEntry *));
         }
+        (*vues)[n] = e;
+        (*versions)[n++] = snapshot_version(e->source, e->source_epoch);
     }
-    
-    //Indentation
-    int i;
-    for(i = 0; i<indentation; i++){
-		printf("    ");
-	}
-	//Afficher nom du dossier
-	printf("%d \033[1;34m%s\033[0m\n", cible->inode, cible->name);
+    return n;
+}
 
-    //Afficher nom des sous éléments
-    FileEntry *child = cible->child;
-    while (child) {
-        //Lien symbolique (pas de récursion pour les dossiers symboliques)
-		if(child->is_symbol == 1){
-			//Indentation + 1
-			for(i = 0; i<=indentation; i++){
-				printf("    ");
-			}
-			printf("%d \033[1;36m%s -> %s\033[0m\n", child->inode, child->name, child->nom_origin);
-		}
-		else if(child->is_symbol == 2){
-			//Indentation + 1
-			for(i = 0; i<=indentation; i++){
-				printf("    ");
-			}
-			printf("%d \033[1;31m%s -> %s\033[0m\n", child->inode, child->name, child->nom_origin);
-		}
-		else{
-			//Dossier = appel récursif
-			if(child->is_directory){
-				//MAJ du dossier courant, sinon ça bug !!!
-				fs.current = cible;
-				fs_tree_i(child->name, indentation+1);
-			}
-			//Fichier
-			else{
-				//Indentation + 1
-				for(i = 0; i<=indentation; i++){
-					printf("    ");
-				}
-				printf("%d \033[1;32m%s\033[0m\n", child->inode, child->name);
-			}
-		}
-		child = child->next;
+/* --- Chargement a la demande et eviction --- */
+
+/**
+ * @brief Construit une entree en memoire a partir d'un inode de la partition.
+ *
+ * Seul l'inode est utilise : les enfants d'un repertoire et le contenu d'un
+ * fichier sont charges au premier acces. Un fichier a plusieurs liens
+ * physiques partage l'inode (inode_table) de ceux deja en memoire, dont le
+ * contenu peut etre plus recent. L'appelant doit tenir part.lock.
+ */
+FileEntry* load_entry(uint32_t ino, const char *name, const disk_inode *di) {
+    if (di->type == FS_TYPE_FREE) {
+        printf("Attention : inode %u invalide pour '%s', entree ignoree.\n", ino, name);
+        return NULL;
     }
-    //Dossier courant remis par défaut
-    fs.current = cible;
+    FileEntry *e = malloc(sizeof(FileEntry));
+    e->inode = ino;
+    e->is_symbol = 0;
+    e->origin = NULL;
+    e->nom_origin = NULL;
+    e->name = strdup(name);
+    e->is_directory = di->type == FS_TYPE_DIR;
+    e->size = 0;
+    e->content = NULL;
+    e->content_refs = NULL;
+    e->shared = NULL;
+    e->link_count = di->links;
+    e->perms = di->perms;
+    e->child = NULL;
+    e->next = NULL;
+    e->parent = NULL;
+    e->dirty = 0;
+    e->dirty_next = NULL;
+    e->loaded = 0;
+    e->last_use = 0;
+    e->origin_gen = 0;
+    e->compress = (di->flags & FS_INODE_COMPRESS) != 0;
+    e->stored_size = (di->flags & FS_INODE_COMPRESSED) ? di->stored_size : 0;
+    e->epoch = 0;
+    e->older = NULL;
+    e->source = NULL;
+    e->source_epoch = 0;
+    e->hash = 0;
+    if (di->type == FS_TYPE_SYMLINK) {
+        e->is_symbol = (di->flags & FS_INODE_DEAD_LINK) ? 2 : 1;
+        e->is_directory = (di->flags & FS_INODE_SYMLINK_DIR) ? 1 : 0;
+        e->nom_origin = calloc(di->size + 1, 1);
+        read_inode_data(&part, ino, di, e->nom_origin);
+        e->loaded = 1;
+    } else if (di->type == FS_TYPE_FILE) {
+        e->size = di->size;
+        //Un autre lien physique deja en memoire : meme inode partage, meme contenu
+        SharedInode *s = inode_lookup(ino);
+        if (s) {
+            inode_join(s, e);
+            if (s->entries[0]->dirty)
+                mark_dirty(e, s->entries[0]->dirty);
+        } else if (di->links > 1) {
+            inode_share(e, di->links);
+        }
+    }
+    __atomic_add_fetch(&cache_bytes, sizeof(FileEntry) + strlen(name) + 1, __ATOMIC_RELAXED);
+    return e;
 }
 
-void get_perms_text(int perms, char *buf, size_t buf_size) {
-    buf[0] = '\0';
-    int appended = 0;
-    if (perms & 4) {
-        strncat(buf, "read", buf_size - strlen(buf) - 1);
-        appended = 1;
-    }
-    if (perms & 2) {
-        if (appended) strncat(buf, ", ", buf_size - strlen(buf) - 1);
-        strncat(buf, "write", buf_size - strlen(buf) - 1);
-        appended = 1;
+/**
+ * @brief Charge les enfants de plusieurs repertoires en trois lots d'E/S.
+ *
+ * Inodes des repertoires, puis leurs blocs d'entrees, puis les inodes de
+ * tous les enfants : chaque etape est un seul lot, pour que les lectures
+ * soient en vol ensemble (io_uring) au lieu d'une a la fois.
+ */
+void load_children_batch(FileEntry **dirs, int nb) {
+    //Vues d'instantane : leurs versions sont chargees par le meme chemin, puis recopiees
+    FileEntry **vues, **versions;
+    int nb_vues = snapshot_pending(dirs, nb, 1, &vues, &versions);
+    if (nb_vues) {
+        load_children_batch(versions, nb_vues);
+        for (int i = 0; i < nb_vues; i++)
+            snapshot_fill_dir(vues[i], versions[i]);
+        free(vues);
+        free(versions);
     }
-    if (perms & 1) {
-        if (appended) strncat(buf, ", ", buf_size - strlen(buf) - 1);
-        strncat(buf, "execute", buf_size - strlen(buf) - 1);
+    FileEntry **a_lire = malloc((nb ? nb : 1) * sizeof(FileEntry *));
+    int n = 0;
+    for (int i = 0; i < nb; i++) {
+        FileEntry *d = dirs[i];
+        if (!d || !d->is_directory || d->is_symbol)
+            continue;
+        d->last_use = __atomic_add_fetch(&cache_tick, 1, __ATOMIC_RELAXED);
+        if (!d->loaded && disk_mode)
+            a_lire[n++] = d;
     }
-    if (strlen(buf) == 0) {
-        strncpy(buf, "none", buf_size - 1);
-        buf[buf_size - 1] = '\0';
+    if (n == 0) {
+        free(a_lire);
+        return;
     }
-}
-
-/* --- Fonctions backend (non accessibles directement par l'utilisateur) --- */
-
-void mkfs() {
-    if (fs.root)
-        free_file_entry(fs.root);
-    fs.root = malloc(sizeof(FileEntry));
-    fs.root->inode = next_inode++;
-    fs.root->is_symbol = 0;
-    fs.root->origin = NULL;
-    fs.root->name = strdup("/");
-    fs.root->is_directory = 1;
-    fs.root->size = 0;
-    fs.root->content = NULL;
-    fs.root->link_count = 1;
-    fs.root->perms = 7; // rwx
-    fs.root->child = NULL;
-    fs.root->next = NULL;
-    fs.root->parent = NULL;
-    fs.current = fs.root;
-    while (open_files) {
-        OpenFile *tmp = open_files;
-        open_files = open_files->next;
-        free(tmp);
+    uint32_t *inos = malloc(n * sizeof(uint32_t));
+    disk_inode *di = malloc(n * sizeof(disk_inode));
+    char **donnees = malloc(n * sizeof(char *));
+    for (int i = 0; i < n; i++)
+        inos[i] = a_lire[i]->inode;
+    pthread_mutex_lock(&part.lock);
+    int ok = read_inodes(&part, inos, n, di) == 0;
+    int nb_enfants = 0;
+    for (int i = 0; i < n; i++) {
+        if (!ok || di[i].type != FS_TYPE_DIR)
+            di[i].size = 0;
+        donnees[i] = malloc(di[i].size ? di[i].size : 1);
+        nb_enfants += di[i].size / sizeof(disk_dirent);
     }
-    next_fd = 3;
-    printf("Systeme de fichiers formate.\n");
-}
-
-int fs_open(const char *filename, int flag) {
-    FileEntry *entry = find_entry(fs.current, filename);
-    if (!entry) {
-        // Ne cree pas le fichier ici; il doit être créé via fs_touch
-        printf("Fichier introuvable.\n");
-        return -1;
-    } else if (entry->is_directory) {
-        printf("Impossible d'ouvrir un repertoire.\n");
-        return -1;
+    if (ok && read_inode_data_batch(&part, inos, di, donnees, n) < 0) {
+        for (int i = 0; i < n; i++)
+            di[i].size = 0;
+        nb_enfants = 0;
     }
-
-    // Vérification des permissions
-    if (flag == 1 || flag == 3) {  // Lecture
-        if (!(entry->perms & 4)) {
-            printf("Permission refusee : lecture interdite.\n");
-            return -1;
+    uint32_t *inos_enfants = malloc((nb_enfants ? nb_enfants : 1) * sizeof(uint32_t));
+    disk_inode *di_enfants = malloc((nb_enfants ? nb_enfants : 1) * sizeof(disk_inode));
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        disk_dirent *entrees = (disk_dirent *)donnees[i];
+        for (size_t j = 0; j < di[i].size / sizeof(disk_dirent); j++) {
+            if (entrees[j].inode != 0)
+                inos_enfants[k++] = entrees[j].inode;
         }
     }
-    if (flag == 2 || flag == 3) {  // Ecriture
-        if (!(entry->perms & 2)) {
-            printf("Permission refusee : ecriture interdite.\n");
-            return -1;
+    if (read_inodes(&part, inos_enfants, k, di_enfants) < 0)
+        k = -1;
+    int c = 0;
+    for (int i = 0; i < n; i++) {
+        FileEntry *dir = a_lire[i];
+        disk_dirent *entrees = (disk_dirent *)donnees[i];
+        FileEntry *dernier = NULL;
+        for (size_t j = 0; k >= 0 && j < di[i].size / sizeof(disk_dirent); j++) {
+            if (entrees[j].inode == 0)
+                continue;
+            char nom[FS_NAME_MAX + 1];
+            memcpy(nom, entrees[j].name, entrees[j].name_len);
+            nom[entrees[j].name_len] = '\0';
+            FileEntry *e = load_entry(entrees[j].inode, nom, &di_enfants[c++]);
+            if (!e)
+                continue;
+            //Ajout en queue pour conserver l'ordre enregistre
+            e->parent = dir;
+            if (dernier)
+                dernier->next = e;
+            else
+                dir->child = e;
+            dernier = e;
         }
+        dir->loaded = 1;
+        free(donnees[i]);
     }
+    pthread_mutex_unlock(&part.lock);
+    __atomic_add_fetch(&cache_loads, n, __ATOMIC_RELAXED);
+    free(inos_enfants);
+    free(di_enfants);
+    free(donnees);
+    free(di);
+    free(inos);
+    free(a_lire);
+}
 
-    OpenFile *of = malloc(sizeof(OpenFile));
-    of->fd = next_fd++;
-    of->file = entry;
-    of->flags = flag;
-    of->offset = 0;
-    of->next = open_files;
-    open_files = of;
-    return of->fd;
+/**
+ * @brief Charge les enfants d'un repertoire au premier acces.
+ *
+ * Sans effet en mode memoire ou si le repertoire est deja charge. Aussi
+ * appele par le recuperateur sur les sous-arbres detaches.
+ */
+void load_children(FileEntry *dir) {
+    load_children_batch(&dir, 1);
 }
 
-ssize_t fs_write(int fd, const char *data) {
-    OpenFile *of = open_files;
-    while (of) {
-        if (of->fd == fd)
-            break;
-        of = of->next;
+/**
+ * @brief Lit le contenu de plusieurs fichiers en un lot d'E/S.
+ */
+void load_contents(FileEntry **files, int nb) {
+    FileEntry **vues, **versions;
+    int nb_vues = snapshot_pending(files, nb, 0, &vues, &versions);
+    if (nb_vues) {
+        load_contents(versions, nb_vues);
+        for (int i = 0; i < nb_vues; i++)
+            snapshot_fill_file(vues[i], versions[i]);
+        free(vues);
+        free(versions);
     }
-    if (!of) {
-        printf("Descripteur invalide.\n");
-        return -1;
+    FileEntry **a_lire = malloc((nb ? nb : 1) * sizeof(FileEntry *));
+    int n = 0;
+    for (int i = 0; i < nb; i++) {
+        FileEntry *f = files[i];
+        if (f && !f->loaded && !f->is_directory && !f->is_symbol && disk_mode)
+            a_lire[n++] = f;
     }
-    if (!(of->flags == 2 || of->flags == 3)) {
-        printf("Fichier non ouvert en ecriture.\n");
-        return -1;
+    if (n == 0) {
+        free(a_lire);
+        return;
     }
-    if (!(of->file->perms & 2)) {
-        printf("Permission refusee : ecriture interdite.\n");
-        return -1;
+    uint32_t *inos = malloc(n * sizeof(uint32_t));
+    disk_inode *di = malloc(n * sizeof(disk_inode));
+    char **bufs = malloc(n * sizeof(char *));
+    for (int i = 0; i < n; i++)
+        inos[i] = a_lire[i]->inode;
+    pthread_mutex_lock(&part.lock);
+    if (read_inodes(&part, inos, n, di) < 0) {
+        for (int i = 0; i < n; i++)
+            di[i].size = 0;
     }
-    FileEntry *file = of->file;
-    int data_len = strlen(data);
-    int new_size = of->offset + data_len;
-    if (new_size > file->size) {
-        file->content = realloc(file->content, new_size + 1);
-        memset(file->content + file->size, 0, new_size - file->size);
-        file->size = new_size;
+    for (int i = 0; i < n; i++)
+        bufs[i] = calloc(di[i].size + 1, 1);
+    read_inode_data_batch(&part, inos, di, bufs, n);
+    for (int i = 0; i < n; i++) {
+        //Lien physique deja rempli par un autre lien du meme lot
+        if (a_lire[i]->loaded) {
+            free(bufs[i]);
+            continue;
+        }
+        a_lire[i]->size = di[i].size;
+        a_lire[i]->content = bufs[i];
+        a_lire[i]->loaded = 1;
+        inode_sync(a_lire[i]);
+        __atomic_add_fetch(&cache_bytes, di[i].size + 1, __ATOMIC_RELAXED);
     }
-    memcpy(file->content + of->offset, data, data_len);
-    of->offset += data_len;
-    file->content[file->size] = '\0';
-    return data_len;
+    pthread_mutex_unlock(&part.lock);
+    free(bufs);
+    free(di);
+    free(inos);
+    free(a_lire);
 }
 
-off_t fs_lseek(int fd, int offset) {
-    OpenFile *of = open_files;
-    while (of) {
-        if (of->fd == fd)
-            break;
-        of = of->next;
-    }
-    if (!of) {
-        printf("Descripteur invalide.\n");
-        return -1;
-    }
-    if (offset < 0 || offset > of->file->size) {
-        printf("Offset invalide.\n");
-        return -1;
+/**
+ * @brief Lit le contenu d'un fichier au premier acces.
+ */
+void load_content(FileEntry *file) {
+    load_contents(&file, 1);
+}
+
+typedef struct CacheVictim {
+    FileEntry *dir;
+    unsigned long last_use;     // Acces le plus recent dans le sous-arbre
+    int depth;
+    size_t bytes;               // Memoire liberee en dechargeant les enfants
+} CacheVictim;
+
+typedef struct CacheScan {
+    CacheVictim *victims;
+    int nb, cap;
+} CacheScan;
+
+static int entry_is_open(FileEntry *e) {
+    for (OpenFile *of = open_files; of; of = of->next) {
+        if (of->file == e)
+            return 1;
     }
-    of->offset = offset;
-    return offset;
+    return 0;
 }
 
-int fs_close(int fd) {
-    OpenFile **prev = &open_files;
-    OpenFile *of = open_files;
-    while (of) {
-        if (of->fd == fd) {
-            *prev = of->next;
-            free(of);
-            return 0;
+/**
+ * @brief Parcourt les entrees chargees et note les repertoires dechargeables.
+ *
+ * Un sous-arbre est epingle s'il contient une entree modifiee, sans inode,
+ * ouverte ou le repertoire courant.
+ *
+ * @return 1 si le sous-arbre de e est epingle.
+ */
+static int cache_scan(FileEntry *e, int depth, CacheScan *scan, unsigned long *last_use, size_t *bytes) {
+    int epingle = e->dirty || e->inode == 0 || e == fs.current || entry_is_open(e);
+    unsigned long recent = e->last_use;
+    size_t total = sizeof(FileEntry) + strlen(e->name) + 1;
+    if (!e->is_directory && e->content && !e->content_refs)
+        total += e->size + 1;
+    size_t enfants = 0;
+    if (e->is_directory && !e->is_symbol && e->loaded) {
+        for (FileEntry *c = e->child; c; c = c->next) {
+            unsigned long lu = 0;
+            size_t b = 0;
+            epingle |= cache_scan(c, depth + 1, scan, &lu, &b);
+            if (lu > recent)
+                recent = lu;
+            enfants += b;
+        }
+        if (!epingle && e->parent && e->child) {
+            if (scan->nb == scan->cap) {
+                scan->cap = scan->cap ? scan->cap * 2 : 64;
+                scan->victims = realloc(scan->victims, scan->cap * sizeof(CacheVictim));
+            }
+            CacheVictim v = { e, recent, depth, enfants };
+            scan->victims[scan->nb++] = v;
         }
-        prev = &of->next;
-        of = of->next;
     }
-    printf("Descripteur invalide.\n");
-    return -1;
+    *last_use = recent;
+    *bytes = total + enfants;
+    return epingle;
 }
 
-/* --- Fonctions pour manipuler le systeme de fichiers via l'interface utilisateur --- */
+static int cmp_victims(const void *a, const void *b) {
+    const CacheVictim *x = a, *y = b;
+    if (x->last_use != y->last_use)
+        return x->last_use < y->last_use ? -1 : 1;
+    //A egalite, les plus profonds d'abord : un descendant passe avant son ancetre
+    return y->depth - x->depth;
+}
 
-void fs_mkdir(const char *dirname) {
-    if (find_entry(fs.current, dirname)) {
-        printf("Un repertoire ou fichier portant ce nom existe deja.\n");
+/**
+ * @brief Decharge les repertoires les moins recemment utilises.
+ *
+ * Appele entre deux commandes. Les entrees modifiees non encore ecrites
+ * sont epinglees ; les autres sont identiques a leur version sur la
+ * partition et peuvent etre relues.
+ * La memoire est ramenee aux trois quarts du budget. Un repertoire a
+ * toujours un acces aussi recent que ses descendants, qui sont donc
+ * decharges avant lui. Rien n'est decharge tant qu'un instantane existe :
+ * ses versions figees designent les entrees de l'arbre.
+ */
+void cache_trim() {
+    if (!disk_mode || __atomic_load_n(&cache_bytes, __ATOMIC_RELAXED) <= cache_limit || snapshots)
         return;
+    CacheScan scan = { NULL, 0, 0 };
+    unsigned long lu;
+    size_t total;
+    cache_scan(fs.root, 0, &scan, &lu, &total);
+    qsort(scan.victims, scan.nb, sizeof(CacheVictim), cmp_victims);
+    size_t objectif = cache_limit / 4 * 3;
+    for (int i = 0; i < scan.nb && total > objectif; i++) {
+        FileEntry *d = scan.victims[i].dir;
+        if (!d->loaded)
+            continue;
+        //Les enfants deja decharges ont ete deduits de total
+        size_t liberes = 0;
+        FileEntry *c = d->child;
+        while (c) {
+            FileEntry *suivant = c->next;
+            liberes += sizeof(FileEntry) + strlen(c->name) + 1;
+            if (!c->is_directory && c->content && !c->content_refs)
+                liberes += c->size + 1;
+            free_file_entry(c);
+            c = suivant;
+        }
+        d->child = NULL;
+        d->loaded = 0;
+        total -= liberes;
+        cache_evictions++;
     }
-    FileEntry *dir = malloc(sizeof(FileEntry));
-    dir->inode = next_inode++;
-    dir->is_symbol = 0;
-    dir->origin = NULL;
-    dir->name = strdup(dirname);
-    dir->is_directory = 1;
-    dir->size = 0;
-    dir->content = NULL;
-    dir->link_count = 1;
-    dir->perms = 7; // rwx par defaut
-    dir->child = NULL;
-    dir->next = NULL;
-    add_entry(fs.current, dir);
-    printf("Repertoire '%s' cree.\n", dirname);
+    free(scan.victims);
+    __atomic_store_n(&cache_bytes, total, __ATOMIC_RELAXED);
+    tree_generation++;
 }
 
-void fs_rmdir(const char *dirname) {
-    FileEntry *dir = resolve_path(dirname, NULL);
-    if (!dir || !dir->is_directory) {
-        printf("Repertoire introuvable.\n");
-        return;
-    }
-    if (dir->child != NULL) {
+/* --- Recuperation en arriere-plan des sous-arbres supprimes (rm -r) --- */
+
+#define RECLAIM_BUDGET 4096     // Entrees liberees au plus par tour
+#define RECLAIM_PAUSE_US 1000   // Pause entre deux tours
+
+pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+FileEntry *reclaim_queue = NULL; // Entrees detachees a liberer, chainees par next
+FileEntry *reclaim_work = NULL; // Entrees prises dans la file, pas encore liberees (tree_lock)
+int reclaim_started = 0;
+
+/**
+ * @brief Libere au plus budget entrees des sous-arbres detaches (tree_lock tenu).
+ *
+ * Les enfants d'un repertoire sont raccroches a la liste de travail au lieu
+ * d'une recursion. Un budget negatif libere tout.
+ *
+ * @return 1 s'il reste des entrees a liberer.
+ */
+static int reclaim_round(int budget) {
+    pthread_mutex_lock(&reclaim_lock);
+    while (reclaim_queue) {
+        FileEntry *e = reclaim_queue;
+        reclaim_queue = e->next;
+        e->next = reclaim_work;
+        reclaim_work = e;
+    }
+    pthread_mutex_unlock(&reclaim_lock);
+    while (reclaim_work && budget-- != 0) {
+        FileEntry *e = reclaim_work;
+        reclaim_work = e->next;
+        //Les enfants jamais charges doivent etre lus pour liberer leurs inodes
+        if (e->is_directory && !e->is_symbol)
+            load_children(e);
+        if (e->is_directory && e->child) {
+            //Les enfants survivent a e : un lien physique encore vivant peut les atteindre
+            FileEntry *dernier = e->child;
+            dernier->parent = NULL;
+            while (dernier->next) {
+                dernier = dernier->next;
+                dernier->parent = NULL;
+            }
+            dernier->next = reclaim_work;
+            reclaim_work = e->child;
+        }
+        forget_dirty(e);
+        if (disk_mode) {
+            pthread_mutex_lock(&part.lock);
+            release_entry_disk(e);
+            pthread_mutex_unlock(&part.lock);
+        }
+        free(e->name);
+        if (e->is_symbol)
+            free(e->nom_origin);
+        link_drop(e);
+        release_content(e);
+        free(e);
+    }
+    return reclaim_work != NULL;
+}
+
+/**
+ * @brief Boucle du thread recuperateur.
+ *
+ * Chaque tour libere au plus RECLAIM_BUDGET entrees sous tree_lock, comme
+ * une commande : le chargement des enfants et les compteurs du cache sont
+ * ceux de l'arbre. Le verrou est rendu entre deux tours.
+ */
+void *reclaim_worker(void *arg) {
+    (void)arg;
+    int reste = 0;
+    while (1) {
+        pthread_mutex_lock(&reclaim_lock);
+        while (!reste && !reclaim_queue)
+            pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+        pthread_mutex_unlock(&reclaim_lock);
+        pthread_mutex_lock(&tree_lock);
+        reste = reclaim_round(RECLAIM_BUDGET);
+        pthread_mutex_unlock(&tree_lock);
+        if (reste)
+            usleep(RECLAIM_PAUSE_US);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Confie un sous-arbre deja detache de l'arbre au recuperateur.
+ *
+ * Repli sur une liberation synchrone si le thread ne peut pas demarrer.
+ */
+void reclaim_subtree(FileEntry *entry) {
+    //Detache : ses liens physiques ne designent plus son ancien parent (link_parent)
+    entry->parent = NULL;
+    pthread_mutex_lock(&reclaim_lock);
+    entry->next = reclaim_queue;
+    reclaim_queue = entry;
+    if (!reclaim_started) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, reclaim_worker, NULL) != 0) {
+            pthread_mutex_unlock(&reclaim_lock);
+            reclaim_round(-1);
+            return;
+        }
+        pthread_detach(thread);
+        reclaim_started = 1;
+    }
+    pthread_cond_broadcast(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+/**
+ * @brief Libere tout de suite ce qui reste confie au recuperateur.
+ *
+ * L'appelant tient tree_lock : le thread est alors entre deux tours, et
+ * le reste de son travail est fait ici.
+ */
+void reclaim_drain() {
+    reclaim_round(-1);
+}
+
+/* --- Defragmentation en ligne --- */
+
+#define DEFRAG_DEFAULT_RATE 16   // Debit de recopie par defaut (Mio/s)
+#define DEFRAG_SHRINK_MARGIN 64  // Blocs libres gardes a la fin de l'image reduite
+#define DEFRAG_REPORT_LINES 20   // Fichiers detailles par le bilan
+#define DEFRAG_PASSES 4          // Passes au plus : les trous liberes par une passe servent a la suivante
+
+typedef struct DefragLayout {
+    uint32_t inodes;        // Inodes ayant des blocs
+    uint32_t fragmentes;    // Dont en plusieurs extents
+    uint32_t extents;
+    uint32_t trous, plus_long, dernier;
+} DefragLayout;
+
+typedef struct DefragMove {
+    uint32_t ino, passe;
+    uint32_t avant, apres;  // Extents avant et apres
+    uint32_t blocs;         // Blocs recopies, 0 si l'inode est reste en place
+} DefragMove;
+
+typedef struct DefragItem {
+    uint32_t ino, debut;
+} DefragItem;
+
+pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t defrag_cond = PTHREAD_COND_INITIALIZER;
+pthread_t defrag_thread;
+int defrag_running = 0;      // Thread lance, pas encore rejoint
+int defrag_stop_req = 0;
+int defrag_finished = 0;     // Passe terminee, bilan pas encore affiche
+double defrag_rate = 0;      // Mio/s, 0 : sans limite
+int defrag_shrink = 0;
+//Progression et bilan de la derniere passe (defrag_lock)
+uint32_t defrag_total = 0, defrag_vus = 0, defrag_erreurs = 0, defrag_rendus = 0;
+uint64_t defrag_blocs = 0;
+double defrag_debut = 0, defrag_duree = 0;
+DefragLayout defrag_avant, defrag_apres;
+DefragMove *defrag_moves = NULL;
+int defrag_nb_moves = 0, defrag_cap_moves = 0;
+
+double defrag_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int cmp_defrag_items(const void *a, const void *b) {
+    uint32_t x = ((const DefragItem *)a)->debut, y = ((const DefragItem *)b)->debut;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Releve la fragmentation des inodes et de l'espace libre (part.lock tenu).
+ *
+ * @param items Si non NULL, recoit les inodes ayant des blocs, tries par
+ *              premier bloc (tableau a liberer) ; leur nombre est retourne.
+ */
+int defrag_survey(DefragLayout *l, DefragItem **items) {
+    memset(l, 0, sizeof(*l));
+    free_space_layout(&part, &l->trous, &l->plus_long, &l->dernier);
+    int nb = 0, cap = 64;
+    DefragItem *liste = items ? malloc(cap * sizeof(DefragItem)) : NULL;
+    uint32_t lot[256];
+    disk_inode di[256];
+    uint32_t ino = FS_ROOT_INODE;
+    while (ino < part.sb.nb_inodes) {
+        int n = 0;
+        for (; ino < part.sb.nb_inodes && n < 256; ino++) {
+            if ((part.inode_bitmap[ino / 8] >> (ino % 8)) & 1)
+                lot[n++] = ino;
+        }
+        if (n == 0 || read_inodes(&part, lot, n, di) < 0)
+            continue;
+        for (int i = 0; i < n; i++) {
+            if (di[i].type == FS_TYPE_FREE || di[i].nb_extents == 0)
+                continue;
+            l->inodes++;
+            l->extents += di[i].nb_extents;
+            if (di[i].nb_extents > 1)
+                l->fragmentes++;
+            if (!liste)
+                continue;
+            if (nb == cap) {
+                cap *= 2;
+                liste = realloc(liste, cap * sizeof(DefragItem));
+            }
+            liste[nb].ino = lot[i];
+            liste[nb].debut = di[i].extents[0].start;
+            nb++;
+        }
+    }
+    if (liste)
+        qsort(liste, nb, sizeof(DefragItem), cmp_defrag_items);
+    if (items)
+        *items = liste;
+    return nb;
+}
+
+/**
+ * @brief Thread de defragmentation.
+ *
+ * Les inodes sont traites dans l'ordre de leur premier bloc : chacun est
+ * regroupe en un extent dans le premier trou assez long, si bien que les
+ * donnees se tassent vers le debut et l'espace libre vers la fin. Seul
+ * part.lock est pris, le temps d'un inode : l'arbre et les contenus deja
+ * charges restent accessibles. Le debit est limite par une pause apres
+ * chaque inode, et chaque deplacement est valide avant le suivant (les
+ * blocs liberes deviennent reutilisables).
+ */
+void *defrag_worker(void *arg) {
+    (void)arg;
+    int deplaces = 1;
+    for (int passe = 1; passe <= DEFRAG_PASSES && deplaces; passe++) {
+        DefragItem *items = NULL;
+        DefragLayout avant;
+        pthread_mutex_lock(&part.lock);
+        int nb = defrag_survey(&avant, &items);
+        pthread_mutex_unlock(&part.lock);
+        pthread_mutex_lock(&defrag_lock);
+        if (passe == 1)
+            defrag_avant = avant;
+        defrag_total += nb;
+        pthread_mutex_unlock(&defrag_lock);
+
+        deplaces = 0;
+        for (int i = 0; i < nb; i++) {
+            pthread_mutex_lock(&defrag_lock);
+            int arret = defrag_stop_req;
+            pthread_mutex_unlock(&defrag_lock);
+            if (arret)
+                break;
+            double t0 = defrag_now();
+            uint32_t nb_avant;
+            pthread_mutex_lock(&part.lock);
+            int blocs = inode_relocate(&part, items[i].ino, &nb_avant);
+            if (blocs > 0) {
+                if (part.journal.enabled)
+                    journal_commit(&part);
+                else
+                    sync_partition(&part);
+            }
+            pthread_mutex_unlock(&part.lock);
+
+            pthread_mutex_lock(&defrag_lock);
+            defrag_vus++;
+            if (blocs < 0)
+                defrag_erreurs++;
+            //Un inode laisse fragmente n'est signale qu'a la premiere passe
+            if (blocs > 0 || (nb_avant > 1 && passe == 1)) {
+                if (defrag_nb_moves == defrag_cap_moves) {
+                    defrag_cap_moves = defrag_cap_moves ? defrag_cap_moves * 2 : 64;
+                    defrag_moves = realloc(defrag_moves, defrag_cap_moves * sizeof(DefragMove));
+                }
+                DefragMove *m = &defrag_moves[defrag_nb_moves++];
+                m->ino = items[i].ino;
+                m->passe = passe;
+                m->avant = nb_avant;
+                m->apres = blocs > 0 ? 1 : nb_avant;
+                m->blocs = blocs > 0 ? blocs : 0;
+            }
+            if (blocs > 0) {
+                deplaces++;
+                defrag_blocs += blocs;
+                //Pause pour ne pas depasser defrag_rate (reveillee par defrag stop)
+                double attente = defrag_rate > 0 ? (double)blocs * FS_BLOCK_SIZE / (defrag_rate * 1024 * 1024)
+                                                     - (defrag_now() - t0) : 0;
+                if (attente > 0 && !defrag_stop_req) {
+                    struct timespec t;
+                    clock_gettime(CLOCK_REALTIME, &t);
+                    long ns = t.tv_nsec + (long)((attente - (long)attente) * 1e9);
+                    t.tv_sec += (long)attente + ns / 1000000000L;
+                    t.tv_nsec = ns % 1000000000L;
+                    pthread_cond_timedwait(&defrag_cond, &defrag_lock, &t);
+                }
+            }
+            pthread_mutex_unlock(&defrag_lock);
+        }
+        free(items);
+    }
+
+    DefragLayout apres;
+    uint32_t rendus = 0;
+    pthread_mutex_lock(&defrag_lock);
+    int reduire = defrag_shrink && !defrag_stop_req;
+    pthread_mutex_unlock(&defrag_lock);
+    pthread_mutex_lock(&part.lock);
+    if (reduire)
+        shrink_partition(&part, DEFRAG_SHRINK_MARGIN, &rendus);
+    defrag_survey(&apres, NULL);
+    pthread_mutex_unlock(&part.lock);
+    pthread_mutex_lock(&defrag_lock);
+    defrag_apres = apres;
+    defrag_rendus = rendus;
+    defrag_duree = defrag_now() - defrag_debut;
+    defrag_finished = 1;
+    pthread_mutex_unlock(&defrag_lock);
+    return NULL;
+}
+
+/**
+ * @brief Affiche le bilan de la derniere passe (fichiers deplaces et etat
+ * de l'espace libre avant/apres).
+ */
+void defrag_report() {
+    pthread_mutex_lock(&defrag_lock);
+    int deplaces = 0;
+    for (int i = 0; i < defrag_nb_moves; i++) {
+        DefragMove *m = &defrag_moves[i];
+        if (m->blocs)
+            deplaces++;
+        if (i < DEFRAG_REPORT_LINES) {
+            if (m->blocs)
+                printf("  passe %u, inode %u : %u extents -> %u (%u blocs recopies)\n", m->passe, m->ino,
+                       m->avant, m->apres, m->blocs);
+            else
+                printf("  passe %u, inode %u : %u extents -> %u (blocs partages ou pas de trou assez long)\n",
+                       m->passe, m->ino, m->avant, m->apres);
+        }
+    }
+    if (defrag_nb_moves > DEFRAG_REPORT_LINES)
+        printf("  ... et %d autres inodes\n", defrag_nb_moves - DEFRAG_REPORT_LINES);
+    printf("Defragmentation : %d deplacements, %llu blocs recopies (%.1f Mio) en %.2f s, %u erreurs%s\n",
+           deplaces, (unsigned long long)defrag_blocs, defrag_blocs * FS_BLOCK_SIZE / (1024.0 * 1024.0),
+           defrag_duree, defrag_erreurs, defrag_stop_req ? ", interrompue" : "");
+    DefragLayout *l[2] = { &defrag_avant, &defrag_apres };
+    const char *noms[2] = { "Avant", "Apres" };
+    for (int k = 0; k < 2; k++)
+        printf("%s : %u/%u inodes fragmentes, %u extents, %u trous libres (le plus long %u blocs), "
+               "dernier bloc occupe %u\n", noms[k], l[k]->fragmentes, l[k]->inodes, l[k]->extents,
+               l[k]->trous, l[k]->plus_long, l[k]->dernier);
+    if (defrag_rendus)
+        printf("Image reduite de %u blocs (%.1f Mio).\n", defrag_rendus,
+               defrag_rendus * FS_BLOCK_SIZE / (1024.0 * 1024.0));
+    pthread_mutex_unlock(&defrag_lock);
+}
+
+/**
+ * @brief Rejoint un thread de defragmentation termine et affiche son bilan.
+ *
+ * @return 1 si le bilan a ete affiche.
+ */
+int defrag_poll() {
+    pthread_mutex_lock(&defrag_lock);
+    int fini = defrag_running && defrag_finished;
+    pthread_mutex_unlock(&defrag_lock);
+    if (!fini)
+        return 0;
+    pthread_join(defrag_thread, NULL);
+    defrag_running = 0;
+    defrag_report();
+    return 1;
+}
+
+/**
+ * @brief Interrompt la defragmentation en cours (avant un formatage ou le
+ * demontage) ; l'inode en cours de deplacement est termine.
+ */
+void defrag_stop() {
+    if (!defrag_running)
+        return;
+    pthread_mutex_lock(&defrag_lock);
+    defrag_stop_req = 1;
+    pthread_cond_broadcast(&defrag_cond);
+    pthread_mutex_unlock(&defrag_lock);
+    pthread_join(defrag_thread, NULL);
+    defrag_running = 0;
+}
+
+/* --- Instantanes : copie a l'ecriture --- */
+
+/**
+ * @brief Fige l'etat d'une entree avant sa premiere modification depuis le
+ * dernier instantane.
+ *
+ * Les enfants ou le contenu sont charges d'abord : la copie doit decrire
+ * l'entree telle que les instantanes la voient. Sans effet sans instantane
+ * ou si l'entree a deja ete copiee depuis le dernier.
+ */
+void snapshot_cow(FileEntry *e) {
+    if (!snapshots || !e || e->epoch >= snap_epoch)
+        return;
+    if (e->is_directory && !e->is_symbol)
+        load_children(e);
+    else if (!e->is_symbol)
+        load_content(e);
+    FileEntry *v = malloc(sizeof(FileEntry));
+    *v = *e;
+    v->name = strdup(e->name);
+    v->nom_origin = e->is_symbol && e->nom_origin ? strdup(e->nom_origin) : NULL;
+    //Contenu duplique : les liens physiques partagent leur tampon sans compteur
+    v->content = NULL;
+    v->content_refs = NULL;
+    v->shared = NULL;
+    v->link_count = entry_links(e);
+    if (e->content) {
+        v->content = malloc(e->size + 1);
+        memcpy(v->content, e->content, e->size);
+        v->content[e->size] = '\0';
+    }
+    v->dirty = 0;
+    v->dirty_next = NULL;
+    e->older = v;
+    e->epoch = snap_epoch;
+    snap_copies++;
+}
+
+/**
+ * @brief Garde une entree supprimee tant qu'un instantane peut la voir.
+ *
+ * Ses inodes et ses blocs sont rendus a la partition comme pour une
+ * suppression ordinaire, mais le sous-arbre est d'abord charge en memoire
+ * puis conserve jusqu'a la suppression du dernier instantane. Les vues
+ * montees dessous n'ont rien sur la partition.
+ */
+void snapshot_keep(FileEntry *entry) {
+    int cap = 16, nb = 0;
+    FileEntry **pile = malloc(cap * sizeof(FileEntry *));
+    pile[nb++] = entry;
+    while (nb > 0) {
+        FileEntry *e = pile[--nb];
+        if (e->source)
+            continue;
+        if (e->is_directory && !e->is_symbol)
+            load_children(e);
+        else if (!e->is_symbol)
+            load_content(e);
+        forget_dirty(e);
+        pthread_mutex_lock(&part.lock);
+        release_entry_disk(e);
+        pthread_mutex_unlock(&part.lock);
+        for (FileEntry *c = e->is_symbol ? NULL : e->child; c; c = c->next) {
+            if (nb == cap) {
+                cap *= 2;
+                pile = realloc(pile, cap * sizeof(FileEntry *));
+            }
+            pile[nb++] = c;
+        }
+    }
+    free(pile);
+    if (snap_nb_removed == snap_cap_removed) {
+        snap_cap_removed = snap_cap_removed ? snap_cap_removed * 2 : 16;
+        snap_removed = realloc(snap_removed, snap_cap_removed * sizeof(FileEntry *));
+    }
+    snap_removed[snap_nb_removed++] = entry;
+}
+
+/**
+ * @brief Libere les versions figees d'un sous-arbre (parcours iteratif).
+ */
+static void snapshot_free_versions(FileEntry *racine) {
+    int cap = 16, nb = 0;
+    FileEntry **pile = malloc(cap * sizeof(FileEntry *));
+    pile[nb++] = racine;
+    while (nb > 0) {
+        FileEntry *e = pile[--nb];
+        while (e->older) {
+            FileEntry *v = e->older;
+            e->older = v->older;
+            free(v->name);
+            if (v->is_symbol)
+                free(v->nom_origin);
+            release_content(v);
+            free(v);
+        }
+        for (FileEntry *c = e->is_symbol ? NULL : e->child; c; c = c->next) {
+            if (nb == cap) {
+                cap *= 2;
+                pile = realloc(pile, cap * sizeof(FileEntry *));
+            }
+            pile[nb++] = c;
+        }
+    }
+    free(pile);
+}
+
+/**
+ * @brief Libere tout ce que gardaient les instantanes, une fois le dernier supprime.
+ *
+ * Aucune vue ne peut plus atteindre les versions figees ni les entrees
+ * supprimees.
+ */
+void snapshot_release() {
+    if (fs.root)
+        snapshot_free_versions(fs.root);
+    for (int i = 0; i < snap_nb_removed; i++) {
+        snapshot_free_versions(snap_removed[i]);
+        free_file_entry(snap_removed[i]);
+    }
+    free(snap_removed);
+    snap_removed = NULL;
+    snap_nb_removed = snap_cap_removed = 0;
+    snap_copies = 0;
+}
+
+/**
+ * @brief Supprime tous les instantanes (formatage ou nouveau montage).
+ */
+void snapshot_drop_all() {
+    while (snapshots) {
+        Snapshot *s = snapshots;
+        snapshots = s->next;
+        free(s->name);
+        free(s);
+    }
+    snapshot_release();
+}
+
+/**
+ * @brief Refuse une modification dans une vue d'instantane.
+ *
+ * @return 1 (avec un message) si e appartient a une vue, 0 sinon.
+ */
+int snapshot_readonly(FileEntry *e) {
+    if (!e || !e->source)
+        return 0;
+    printf("Instantane en lecture seule : modification refusee.\n");
+    return 1;
+}
+
+/* --- Empreintes des sous-arbres (arbre de Merkle) --- */
+
+/*
+ * Chaque entree garde une empreinte de 64 bits de son sous-arbre : type,
+ * permissions et contenu pour un fichier, cible pour un lien symbolique, et
+ * pour un repertoire la somme des empreintes de ses enfants melangees a
+ * leur nom (independante de l'ordre des entrees). Une modification remet a
+ * 0 l'empreinte de l'entree et de ses ancetres ; le calcul est fait a la
+ * demande (diff) et ne reparcourt que les chemins modifies. L'inode, le
+ * nombre de liens et le mode de stockage n'y entrent pas : une copie a la
+ * meme empreinte que sa source. Les empreintes restent en memoire.
+ */
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+//FNV-1a sur 64 bits
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+//Finaliseur de splitmix64 : les bits sont repartis avant la somme des enfants
+static uint64_t hash_mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * @brief Note qu'une entree et tous ses ancetres ont change.
+ *
+ * On remonte jusqu'a la racine sans s'arreter a une empreinte deja nulle :
+ * les enfants recharges depuis la partition n'en ont pas encore, alors que
+ * leurs ancetres gardent la leur.
+ */
+void hash_invalidate(FileEntry *e) {
+    for (; e; e = e->parent)
+        e->hash = 0;
+}
+
+/**
+ * @brief Empreinte d'une entree, calculee si besoin.
+ *
+ * Les enfants d'un repertoire et le contenu des fichiers a hacher sont
+ * charges a la demande, les contenus en un seul lot par repertoire.
+ */
+uint64_t entry_hash(FileEntry *e) {
+    if (e->hash)
+        return e->hash;
+    int type = e->is_symbol ? FS_TYPE_SYMLINK : (e->is_directory ? FS_TYPE_DIR : FS_TYPE_FILE);
+    uint64_t h = hash_bytes(HASH_SEED, &type, sizeof(type));
+    if (e->is_symbol) {
+        h = hash_bytes(h, &e->is_directory, sizeof(e->is_directory));
+        if (e->nom_origin)
+            h = hash_bytes(h, e->nom_origin, strlen(e->nom_origin));
+    } else if (e->is_directory) {
+        h = hash_bytes(h, &e->perms, sizeof(e->perms));
+        load_children(e);
+        int nb = 0;
+        for (FileEntry *c = e->child; c; c = c->next)
+            nb++;
+        FileEntry **fichiers = malloc((nb ? nb : 1) * sizeof(FileEntry *));
+        int n = 0;
+        for (FileEntry *c = e->child; c; c = c->next) {
+            if (!c->hash && !c->is_directory && !c->is_symbol)
+                fichiers[n++] = c;
+        }
+        load_contents(fichiers, n);
+        free(fichiers);
+        uint64_t somme = 0;
+        for (FileEntry *c = e->child; c; c = c->next)
+            somme += hash_mix(hash_bytes(HASH_SEED, c->name, strlen(c->name)) ^ entry_hash(c));
+        h ^= somme;
+    } else {
+        h = hash_bytes(h, &e->perms, sizeof(e->perms));
+        load_content(e);
+        h = hash_bytes(h, &e->size, sizeof(e->size));
+        if (e->content)
+            h = hash_bytes(h, e->content, e->size);
+    }
+    h = hash_mix(h);
+    e->hash = h ? h : 1;
+    return e->hash;
+}
+
+FileEntry* find_entry(FileEntry *dir, const char *name) {
+    if (!dir || !dir->is_directory)
+        return NULL;
+    load_children(dir);
+    FileEntry *child = dir->child;
+    while (child) {
+        if (strcmp(child->name, name) == 0)
+            return child;
+        child = child->next;
+    }
+    return NULL;
+}
+
+void add_entry(FileEntry *dir, FileEntry *entry) {
+    if (!dir || !dir->is_directory)
+        return;
+    load_children(dir);
+    snapshot_cow(dir);
+    snapshot_cow(entry);
+    entry->next = dir->child;
+    dir->child = entry;
+    entry->parent = dir;
+    hash_invalidate(dir);
+}
+
+/**
+ * @brief Lien de la liste des enfants qui designe entry.
+ *
+ * Son proprietaire (le parent ou le frere precedent) est fige avant que
+ * l'appelant ne le modifie, et l'empreinte du parent est invalidee.
+ *
+ * @return Le lien, ou NULL si entry n'est pas un enfant de parent.
+ */
+FileEntry** child_link(FileEntry *parent, FileEntry *entry) {
+    FileEntry *prec = NULL;
+    for (FileEntry *c = parent->child; c; prec = c, c = c->next) {
+        if (c == entry) {
+            snapshot_cow(prec ? prec : parent);
+            hash_invalidate(parent);
+            return prec ? &prec->next : &parent->child;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Retire une entree de la liste des enfants de son parent.
+ *
+ * @return 1 si l'entree a ete trouvee et retiree, 0 sinon.
+ */
+int unlink_child(FileEntry *parent, FileEntry *entry) {
+    FileEntry **cur = child_link(parent, entry);
+    if (!cur)
+        return 0;
+    snapshot_cow(entry);
+    *cur = entry->next;
+    entry->next = NULL;
+    return 1;
+}
+
+char *build_path(FileEntry *entry) {
+    if (!entry->parent) {
+        char *chemin = malloc(2);
+        strcpy(chemin, "/");
+        return chemin;
+    }
+    char *chemin_parent = build_path(entry->parent);
+    int len = strlen(chemin_parent) + strlen(entry->name) + 2;
+    char *chemin_complet = malloc(len);
+    if (strcmp(chemin_parent, "/") == 0)
+        snprintf(chemin_complet, len, "/%s", entry->name);
+    else
+        snprintf(chemin_complet, len, "%s/%s", chemin_parent, entry->name);
+    free(chemin_parent);
+    return chemin_complet;
+}
+
+FileEntry* resolve_path(const char *path, FileEntry **parentOut) {
+    FileEntry *courant = (path[0]=='/') ? fs.root : fs.current;
+    char *copie = strdup(path);
+    char *token = strtok(copie, "/");
+    FileEntry *parent = NULL;
+    while (token) {
+        parent = courant;
+        courant = find_entry(courant, token);
+        if (!courant) {
+            free(copie);
+            if (parentOut)
+                *parentOut = parent;
+            return NULL;
+        }
+        token = strtok(NULL, "/");
+    }
+    free(copie);
+    if (parentOut)
+        *parentOut = parent;
+    return courant;
+}
+
+/**
+ * @brief Cible d'un lien symbolique.
+ *
+ * En mode disque, la cible est retrouvee par son chemin au premier acces,
+ * puis apres chaque eviction (l'entree pointee a pu etre liberee).
+ *
+ * @return L'entree d'origine, ou NULL si elle n'existe plus.
+ */
+FileEntry* symlink_origin(FileEntry *link) {
+    if (disk_mode && link->origin_gen != tree_generation) {
+        link->origin = NULL;
+        link->origin_gen = tree_generation;
+        if (link->nom_origin) {
+            //Le chemin est absolu : le repertoire courant n'intervient pas
+            link->origin = resolve_path(link->nom_origin, NULL);
+        }
+        if (!link->origin)
+            link->is_symbol = 2;
+    }
+    return link->origin;
+}
+
+/**
+ * @brief Decoupe un chemin de destination en repertoire parent et nom final.
+ *
+ * @param dest Chemin de destination (ex: "a/b/nom" ou "nom").
+ * @param copie Recoit la copie de travail du chemin, a liberer par l'appelant.
+ * @param parentOut Recoit le repertoire parent resolu (NULL si invalide).
+ * @return Le nom final, qui pointe dans *copie.
+ */
+char *split_dest(const char *dest, char **copie, FileEntry **parentOut) {
+    *copie = strdup(dest);
+    char *last_slash = strrchr(*copie, '/');
+    if (!last_slash) {
+        *parentOut = fs.current;
+        return *copie;
+    }
+    *last_slash = '\0';
+    if (last_slash == *copie)
+        *parentOut = fs.root;
+    else
+        *parentOut = resolve_path(*copie, NULL);
+    return last_slash + 1;
+}
+
+void print_tree(FileEntry *entry, int level, int show_inodes) {
+    if (!entry)
+        return;
+    for (int i = 0; i < level; i++) {
+        printf("    ");
+    }
+    if (show_inodes)
+        printf("[%d] ", entry->inode);
+    printf("%s", entry->name);
+    if (entry->is_directory)
+        printf("/");
+    printf("\n");
+    if (entry->is_directory) {
+        load_children(entry);
+        FileEntry *child = entry->child;
+        while (child) {
+            print_tree(child, level + 1, show_inodes);
+            child = child->next;
+        }
+    }
+}
+
+/**
+ * @brief Affiche l'arborescence d'un dossier.
+ *
+ * Si aucun argument n'est fourni, alors arborescence du repertoire courant.
+ * Sinon, le chemin donne est resolu et son arborescence est affiche.
+ *
+ * @param arg Chemin optionnel du repertoire à afficher.
+ */
+void fs_tree(const char *arg, int indentation) {
+	//Définir répertoire
+    FileEntry *cible = NULL;
+    if (arg == NULL) {
+        cible = fs.current;
+    } else {
+        cible = resolve_path(arg, NULL);
+        if (!cible) {
+            printf("Repertoire introuvable : %s\n", arg);
+            return;
+        }
+        if (!cible->is_directory) {
+            printf("%s\n", cible->name);
+            return;
+        }
+    }
+    //Indentation
+    int i;
+    for(i = 0; i<indentation; i++){
+		printf("    ");
+	}
+	//Afficher nom du dossier
+	printf("\033[1;34m%s\033[0m\n", cible->name);
+
+    //Afficher nom des sous éléments
+    load_children(cible);
+    FileEntry *child = cible->child;
+    while (child) {
+		//Lien symbolique (pas de récursion pour les dossiers symboliques)
+		if(child->is_symbol){
+			//Indentation + 1
+			for(i = 0; i<=indentation; i++){
+				printf("    ");
+			}
+			printf("\033[1;36m%s -> %s\033[0m\n", child->name, child->nom_origin);
+		}
+		else{
+			//Dossier = appel récursif
+			if(child->is_directory){
+				//MAJ du dossier courant, sinon ça bug !!!
+				fs.current = cible;
+				fs_tree(child->name, indentation+1);
+			}
+			//Fichier
+			else{
+				//Indentation + 1
+				for(i = 0; i<=indentation; i++){
+					printf("    ");
+				}
+				printf("\033[1;32m%s\033[0m\n", child->name);
+			}
+		}
+        child = child->next;
+    }
+    //Dossier courant remis par défaut
+    fs.current = cible;
+}
+
+/**
+ * @brief Affiche l'arborescence d'un dossier avec les inodes.
+ *
+ * Si aucun argument n'est fourni, alors arborescence du repertoire courant.
+ * Sinon, le chemin donne est resolu et son arborescence est affiche.
+ *
+ * @param arg Chemin optionnel du repertoire à afficher.
+ */
+void fs_tree_i(const char *arg, int indentation) {
+	//Définir répertoire
+    FileEntry *cible = NULL;
+    if (arg == NULL) {
+        cible = fs.current;
+    } else {
+        cible = resolve_path(arg, NULL);
+        if (!cible) {
+            printf("Repertoire introuvable : %s\n", arg);
+            return;
+        }
+        if (!cible->is_directory) {
+            printf("%d %s\n", cible->inode, cible->name);
+            return;
+        }
+    }
+    
+    //Indentation
+    int i;
+    for(i = 0; i<indentation; i++){
+		printf("    ");
+	}
+	//Afficher nom du dossier
+	printf("%d \033[1;34m%s\033[0m\n", cible->inode, cible->name);
+
+    //Afficher nom des sous éléments
+    load_children(cible);
+    FileEntry *child = cible->child;
+    while (child) {
+        //Lien symbolique (pas de récursion pour les dossiers symboliques)
+		if(child->is_symbol == 1){
+			//Indentation + 1
+			for(i = 0; i<=indentation; i++){
+				printf("    ");
+			}
+			printf("%d \033[1;36m%s -> %s\033[0m\n", child->inode, child->name, child->nom_origin);
+		}
+		else if(child->is_symbol == 2){
+			//Indentation + 1
+			for(i = 0; i<=indentation; i++){
+				printf("    ");
+			}
+			printf("%d \033[1;31m%s -> %s\033[0m\n", child->inode, child->name, child->nom_origin);
+		}
+		else{
+			//Dossier = appel récursif
+			if(child->is_directory){
+				//MAJ du dossier courant, sinon ça bug !!!
+				fs.current = cible;
+				fs_tree_i(child->name, indentation+1);
+			}
+			//Fichier
+			else{
+				//Indentation + 1
+				for(i = 0; i<=indentation; i++){
+					printf("    ");
+				}
+				printf("%d \033[1;32m%s\033[0m\n", child->inode, child->name);
+			}
+		}
+		child = child->next;
+    }
+    //Dossier courant remis par défaut
+    fs.current = cible;
+}
+
+void get_perms_text(int perms, char *buf, size_t buf_size) {
+    buf[0] = '\0';
+    int appended = 0;
+    if (perms & 4) {
+        strncat(buf, "read", buf_size - strlen(buf) - 1);
+        appended = 1;
+    }
+    if (perms & 2) {
+        if (appended) strncat(buf, ", ", buf_size - strlen(buf) - 1);
+        strncat(buf, "write", buf_size - strlen(buf) - 1);
+        appended = 1;
+    }
+    if (perms & 1) {
+        if (appended) strncat(buf, ", ", buf_size - strlen(buf) - 1);
+        strncat(buf, "execute", buf_size - strlen(buf) - 1);
+    }
+    if (strlen(buf) == 0) {
+        strncpy(buf, "none", buf_size - 1);
+        buf[buf_size - 1] = '\0';
+    }
+}
+
+/* --- Fonctions backend (non accessibles directement par l'utilisateur) --- */
+
+/**
+ * @brief Remplace l'arbre en memoire par une racine vide.
+ *
+ * Les instantanes de l'ancien arbre sont supprimes.
+ *
+ * @param root_inode Numero d'inode de la nouvelle racine.
+ */
+void mkfs_tree(int root_inode) {
+    dirty_list = NULL;
+    nb_disk_releases = 0;
+    snapshot_drop_all();
+    if (fs.root)
+        free_file_entry(fs.root);
+    fs.root = malloc(sizeof(FileEntry));
+    fs.root->inode = root_inode;
+    fs.root->is_symbol = 0;
+    fs.root->origin = NULL;
+    fs.root->name = strdup("/");
+    fs.root->is_directory = 1;
+    fs.root->size = 0;
+    fs.root->content = NULL;
+    fs.root->content_refs = NULL;
+    fs.root->shared = NULL;
+    fs.root->link_count = 1;
+    fs.root->perms = 7; // rwx
+    fs.root->child = NULL;
+    fs.root->next = NULL;
+    fs.root->dirty = 0;
+    fs.root->dirty_next = NULL;
+    fs.root->loaded = 1;
+    fs.root->last_use = 0;
+    fs.root->origin_gen = 0;
+    fs.root->compress = 0;
+    fs.root->stored_size = 0;
+    fs.root->epoch = snap_epoch;
+    fs.root->older = NULL;
+    fs.root->source = NULL;
+    fs.root->source_epoch = 0;
+    fs.root->hash = 0;
+    fs.root->parent = NULL;
+    __atomic_store_n(&cache_bytes, 0, __ATOMIC_RELAXED);
+    tree_generation++;
+    fs.current = fs.root;
+    while (open_files) {
+        OpenFile *tmp = open_files;
+        open_files = open_files->next;
+        free(tmp);
+    }
+    next_fd = 3;
+}
+
+void mkfs() {
+    if (disk_mode) {
+        //Le recuperateur, la defragmentation, la verification et l'initialisation ne doivent plus toucher a l'ancienne partition
+        reclaim_drain();
+        defrag_stop();
+        scrub_stop(&part, 1);
+        lazyinit_stop(&part);
+        pthread_mutex_lock(&part.lock);
+        int ret = format_partition(&part, part.size);
+        pthread_mutex_unlock(&part.lock);
+        if (ret < 0) {
+            printf("Echec du formatage de la partition.\n");
+            return;
+        }
+        mkfs_tree(FS_ROOT_INODE);
+        lazyinit_start(&part);
+    } else {
+        mkfs_tree(next_inode++);
+    }
+    printf("Systeme de fichiers formate.\n");
+}
+
+/* --- Persistance : chargement et ecriture de l'arbre --- */
+
+//1 si le repertoire dir contient une entree vers ino sur la partition, et n'est pas a rendre
+static int dir_has_inode(uint32_t dir, uint32_t ino) {
+    for (int i = 0; i < nb_disk_releases; i++) {
+        if (disk_releases[i] == dir)
+            return 0;
+    }
+    disk_inode di;
+    if (read_inode(&part, dir, &di) < 0 || di.type != FS_TYPE_DIR)
+        return 0;
+    disk_dirent *entrees = malloc(di.size ? di.size : 1);
+    int trouve = 0;
+    if (read_inode_data(&part, dir, &di, entrees) >= 0) {
+        for (size_t j = 0; j < di.size / sizeof(disk_dirent) && !trouve; j++)
+            trouve = entrees[j].inode == ino;
+    }
+    free(entrees);
+    return trouve;
+}
+
+/**
+ * @brief Repertoire a enregistrer comme parent d'un inode a liens physiques.
+ *
+ * Celui deja enregistre est garde s'il contient encore un lien : rattache
+ * a l'arbre en memoire, ou sur la partition (les repertoires sont ecrits
+ * avant les liens physiques par fs_flush()). Sinon le repertoire d'un
+ * autre lien rattache est pris.
+ */
+static uint32_t link_parent(FileEntry *e, uint32_t actuel) {
+    uint32_t choisi = 0;
+    for (int i = 0; i < e->shared->nb; i++) {
+        FileEntry *p = e->shared->entries[i]->parent;
+        FileEntry *a = p;
+        while (a && a != fs.root)
+            a = a->parent;
+        //Lien detache, en attente du recuperateur
+        if (!a)
+            continue;
+        if ((uint32_t)p->inode == actuel)
+            return actuel;
+        if (!choisi)
+            choisi = p->inode;
+    }
+    if (actuel && dir_has_inode(actuel, e->inode))
+        return actuel;
+    return choisi ? choisi : (e->parent ? (uint32_t)e->parent->inode : FS_ROOT_INODE);
+}
+
+/**
+ * @brief Ecrit une entree modifiee sur la partition (part.lock tenu).
+ *
+ * Les repertoires sont reecrits en entier sous forme de tableau de
+ * disk_dirent ; les liens symboliques stockent le chemin de leur cible.
+ */
+int flush_entry(FileEntry *e) {
+    if (e->inode == 0) {
+        printf("Attention : '%s' n'a pas d'inode sur la partition et n'est pas persiste.\n", e->name);
+        return -1;
+    }
+    disk_inode di;
+    if (read_inode(&part, e->inode, &di) < 0)
+        return -1;
+    if (di.type == FS_TYPE_FREE) {
+        //Premiere ecriture : ensuite ln et rm tiennent le compteur de liens sur la partition
+        memset(&di, 0, sizeof(di));
+        di.links = entry_links(e) > 0 ? entry_links(e) : 1;
+    }
+    di.type = e->is_symbol ? FS_TYPE_SYMLINK : (e->is_directory ? FS_TYPE_DIR : FS_TYPE_FILE);
+    di.perms = e->perms;
+    di.parent = e->shared ? link_parent(e, di.parent) : (e->parent ? e->parent->inode : FS_ROOT_INODE);
+    //Le contenu deja stocke garde son format s'il n'est pas reecrit
+    di.flags &= FS_INODE_COMPRESSED | FS_INODE_CHUNKED;
+    if (e->is_symbol && e->is_directory)
+        di.flags |= FS_INODE_SYMLINK_DIR;
+    if (e->is_symbol == 2)
+        di.flags |= FS_INODE_DEAD_LINK;
+    if (e->compress)
+        di.flags |= FS_INODE_COMPRESS;
+    //Un repertoire ou fichier non charge est deja a jour sur la partition
+    if ((e->dirty & DIRTY_DATA) && (e->loaded || e->is_symbol)) {
+        di.flags &= ~FS_INODE_COMPRESSED;
+        if (!e->is_symbol && !e->is_directory && (e->compress || compress_all))
+            di.flags |= FS_INODE_COMPRESSED;
+        int ret = 0;
+        if (e->is_symbol) {
+            const char *cible = e->nom_origin ? e->nom_origin : "";
+            ret = write_inode_data(&part, e->inode, &di, cible, strlen(cible));
+        } else if (e->is_directory) {
+            int nb = 0;
+            for (FileEntry *c = e->child; c; c = c->next)
+                nb++;
+            disk_dirent *entrees = calloc(nb ? nb : 1, sizeof(disk_dirent));
+            int i = 0;
+            for (FileEntry *c = e->child; c; c = c->next) {
+                if (c->inode == 0)
+                    continue;
+                size_t len = strlen(c->name);
+                if (len > FS_NAME_MAX) {
+                    printf("Attention : nom tronque sur la partition : %s\n", c->name);
+                    len = FS_NAME_MAX;
+                }
+                entrees[i].inode = c->inode;
+                entrees[i].type = c->is_symbol ? FS_TYPE_SYMLINK : (c->is_directory ? FS_TYPE_DIR : FS_TYPE_FILE);
+                entrees[i].name_len = len;
+                memcpy(entrees[i].name, c->name, len);
+                i++;
+            }
+            ret = write_inode_data(&part, e->inode, &di, entrees, i * sizeof(disk_dirent));
+            free(entrees);
+        } else {
+            ret = write_inode_data(&part, e->inode, &di, e->content, e->content ? e->size : 0);
+            e->stored_size = (di.flags & FS_INODE_COMPRESSED) ? di.stored_size : 0;
+            inode_sync(e);
+        }
+        if (ret < 0)
+            return -1;
+    }
+    return write_inode(&part, e->inode, &di);
+}
+
+/**
+ * @brief Ecrit toutes les entrees modifiees, puis les bitmaps et le superbloc.
+ */
+void fs_flush() {
+    if (!disk_mode)
+        return;
+    pthread_mutex_lock(&part.lock);
+    //Les liens physiques en second : link_parent lit les repertoires a jour
+    FileEntry *liens = NULL;
+    for (int passe = 0; passe < 2; passe++) {
+        while (dirty_list) {
+            FileEntry *e = dirty_list;
+            dirty_list = e->dirty_next;
+            if (e->shared && passe == 0) {
+                e->dirty_next = liens;
+                liens = e;
+                continue;
+            }
+            //Lien physique dont l'inode a deja ete ecrit par un autre lien
+            if (e->dirty) {
+                flush_entry(e);
+                wb_entries++;
+            }
+            for (int i = 0; e->shared && i < e->shared->nb; i++)
+                e->shared->entries[i]->dirty = 0;
+            e->dirty = 0;
+            e->dirty_next = NULL;
+        }
+        dirty_list = liens;
+        liens = NULL;
+    }
+    //Les repertoires qui les designaient sont reecrits : les inodes supprimes peuvent etre rendus
+    for (int i = 0; i < nb_disk_releases; i++)
+        release_inode_disk(disk_releases[i]);
+    nb_disk_releases = 0;
+    sync_partition(&part);
+    pthread_mutex_unlock(&part.lock);
+}
+
+//1 si e est dans le sous-arbre de racine
+static int in_subtree(FileEntry *e, FileEntry *racine) {
+    while (e && e != racine)
+        e = e->parent;
+    return e != NULL;
+}
+
+/**
+ * @brief Ecrit les modifications avant la suppression du sous-arbre racine
+ * si l'une d'elles n'est portee que par des liens physiques qui vont
+ * disparaitre, alors que d'autres liens de l'inode restent sur la partition.
+ */
+void flush_removed_links(FileEntry *racine) {
+    for (FileEntry *e = dirty_list; e; e = e->dirty_next) {
+        if (!e->shared || !in_subtree(e, racine))
+            continue;
+        int dedans = 0;
+        for (int i = 0; i < e->shared->nb; i++)
+            dedans += in_subtree(e->shared->entries[i], racine);
+        if (dedans == e->shared->nb && e->shared->links > dedans) {
+            fs_flush();
+            return;
+        }
+    }
+}
+
+/* --- Ecriture differee --- */
+
+//Octets a ecrire (contenus des fichiers modifies et leurs inodes), estimation
+size_t dirty_bytes() {
+    size_t total = 0;
+    for (FileEntry *e = dirty_list; e; e = e->dirty_next) {
+        total += sizeof(disk_inode);
+        if (!e->is_directory && !e->is_symbol && e->loaded)
+            total += e->size;
+    }
+    return total;
+}
+
+double dirty_age_ms() {
+    if (!writeback_pending())
+        return 0;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - dirty_since.tv_sec) * 1e3 + (t.tv_nsec - dirty_since.tv_nsec) / 1e6;
+}
+
+/**
+ * @brief Thread d'ecriture differee.
+ *
+ * Toutes les WB_INTERVAL_MS, les modifications sont ecrites si la plus
+ * ancienne a plus de wb_expire_ms ou si elles depassent WB_DIRTY_RATIO % du
+ * budget memoire. Une passe ecrit toute la liste en une transaction du
+ * journal : l'image reste coherente, et l'allocation des blocs n'a lieu
+ * qu'ici, si bien que les ajouts successifs a un fichier forment un seul
+ * extent.
+ */
+void *writeback_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&wb_lock);
+    while (!wb_stop) {
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_nsec += WB_INTERVAL_MS * 1000000L;
+        if (t.tv_nsec >= 1000000000L) {
+            t.tv_sec++;
+            t.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wb_cond, &wb_lock, &t);
+        if (wb_stop)
+            break;
+        pthread_mutex_unlock(&wb_lock);
+        pthread_mutex_lock(&tree_lock);
+        if (writeback_pending()) {
+            int raison = -1;
+            if (dirty_age_ms() >= wb_expire_ms)
+                raison = WB_AGE;
+            else if (dirty_bytes() >= cache_limit / 100 * WB_DIRTY_RATIO)
+                raison = WB_RATIO;
+            if (raison >= 0) {
+                fs_flush();
+                wb_passes[raison]++;
+            }
+        }
+        pthread_mutex_unlock(&tree_lock);
+        pthread_mutex_lock(&wb_lock);
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return NULL;
+}
+
+void writeback_start() {
+    if (wb_expire_ms <= 0 || wb_running)
+        return;
+    wb_stop = 0;
+    if (pthread_create(&wb_thread, NULL, writeback_worker, NULL) != 0) {
+        printf("Thread d'ecriture differee indisponible : ecriture apres chaque commande.\n");
+        wb_expire_ms = 0;
+        return;
+    }
+    wb_running = 1;
+}
+
+//Arreter le thread (l'appelant ne doit pas tenir tree_lock)
+void writeback_stop() {
+    if (!wb_running)
+        return;
+    pthread_mutex_lock(&wb_lock);
+    wb_stop = 1;
+    pthread_cond_broadcast(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+    pthread_join(wb_thread, NULL);
+    wb_running = 0;
+}
+
+/**
+ * @brief Appele avant chaque invite : ecriture immediate sans thread, ou
+ * quand les modifications depassent WB_DIRTY_HARD_RATIO % du budget.
+ */
+void writeback_throttle() {
+    if (!writeback_pending())
+        return;
+    if (!wb_running) {
+        fs_flush();
+    } else if (dirty_bytes() >= cache_limit / 100 * WB_DIRTY_HARD_RATIO) {
+        fs_flush();
+        wb_passes[WB_RATIO]++;
+    }
+}
+
+/**
+ * @brief Point de durabilite : tout est ecrit et valide (fsync) au retour.
+ */
+void fs_sync() {
+    if (!disk_mode)
+        return;
+    fs_flush();
+    wb_passes[WB_EXPLICIT]++;
+    pthread_mutex_lock(&part.lock);
+    if (part.journal.enabled)
+        journal_commit(&part);
+    pthread_mutex_unlock(&part.lock);
+}
+
+/**
+ * @brief Monte une image de partition et charge sa racine.
+ *
+ * Une image absente ou non formatee est formatee avec au moins
+ * DEFAULT_PARTITION_SIZE octets.
+ *
+ * @param image Chemin de l'image (ex: partition.fs).
+ * @return 0 si la partition est montee, -1 sinon.
+ */
+int fs_mount(const char *image) {
+    struct timespec debut, fin;
+    clock_gettime(CLOCK_MONOTONIC, &debut);
+    int ret = mount_partition(&part, image, mount_flags);
+    if (ret < 0)
+        return -1;
+    disk_mode = 1;
+    if (ret == 1) {
+        size_t taille = part.size > DEFAULT_PARTITION_SIZE ? part.size : DEFAULT_PARTITION_SIZE;
+        printf("Partition '%s' non formatee : formatage (%zu octets).\n", image, taille);
+        if (format_partition(&part, taille) < 0) {
+            disk_mode = 0;
+            return -1;
+        }
+    }
+    pcache_init(&part, pcache_limit);
+    //Seule la racine est lue : le reste de l'arbre est charge a la demande
+    mkfs_tree(FS_ROOT_INODE);
+    fs.root->loaded = 0;
+    load_children(fs.root);
+    journal_start(&part, durability);
+    writeback_start();
+    clock_gettime(CLOCK_MONOTONIC, &fin);
+    printf("Partition '%s' montee%s en %.2f ms : %u/%u blocs libres, %u/%u inodes libres.\n", image,
+           part.map ? " (mmap)" : "",
+           (fin.tv_sec - debut.tv_sec) * 1e3 + (fin.tv_nsec - debut.tv_nsec) / 1e6,
+           part.sb.free_blocks, part.sb.nb_blocks, part.sb.free_inodes, part.sb.nb_inodes);
+    //La verification continue reprend ou elle s'etait arretee
+    uint32_t reprise = part.sb.scrub_cursor;
+    if (part.sb.scrub_active && scrub_start(&part, part.sb.scrub_rate / 1024.0, part.sb.scrub_iops) == 0)
+        printf("Verification continue reprise au bloc %u/%u.\n", reprise, part.sb.nb_blocks);
+    //Tables laissees a initialiser par le formatage : mises a zero en arriere-plan
+    lazyinit_start(&part);
+    return 0;
+}
+
+/**
+ * @brief Ecrit les dernieres modifications et demonte la partition.
+ */
+void fs_umount() {
+    if (!disk_mode)
+        return;
+    defrag_stop();
+    //Reprise au prochain montage : la position est gardee dans le superbloc
+    scrub_stop(&part, 0);
+    lazyinit_stop(&part);
+    writeback_stop();
+    //Les inodes rendus par le recuperateur sont ecrits avec le reste
+    pthread_mutex_lock(&tree_lock);
+    reclaim_drain();
+    pthread_mutex_unlock(&tree_lock);
+    fs_flush();
+    //Le thread du journal prend part.lock pour son dernier commit
+    journal_stop(&part);
+    pthread_mutex_lock(&part.lock);
+    unmount_partition(&part);
+    pthread_mutex_unlock(&part.lock);
+    disk_mode = 0;
+}
+
+int fs_open(const char *filename, int flag) {
+    FileEntry *entry = find_entry(fs.current, filename);
+    if (!entry) {
+        // Ne cree pas le fichier ici; il doit être créé via fs_touch
+        printf("Fichier introuvable.\n");
+        return -1;
+    } else if (entry->is_directory) {
+        printf("Impossible d'ouvrir un repertoire.\n");
+        return -1;
+    }
+
+    // Vérification des permissions
+    if (flag == 1 || flag == 3) {  // Lecture
+        if (!(entry->perms & 4)) {
+            printf("Permission refusee : lecture interdite.\n");
+            return -1;
+        }
+    }
+    if (flag == 2 || flag == 3) {  // Ecriture
+        if (!(entry->perms & 2)) {
+            printf("Permission refusee : ecriture interdite.\n");
+            return -1;
+        }
+        if (snapshot_readonly(entry))
+            return -1;
+    }
+
+    load_content(entry);
+    OpenFile *of = malloc(sizeof(OpenFile));
+    of->fd = next_fd++;
+    of->file = entry;
+    of->flags = flag;
+    of->offset = 0;
+    of->next = open_files;
+    open_files = of;
+    return of->fd;
+}
+
+ssize_t fs_write(int fd, const char *data) {
+    OpenFile *of = open_files;
+    while (of) {
+        if (of->fd == fd)
+            break;
+        of = of->next;
+    }
+    if (!of) {
+        printf("Descripteur invalide.\n");
+        return -1;
+    }
+    if (!(of->flags == 2 || of->flags == 3)) {
+        printf("Fichier non ouvert en ecriture.\n");
+        return -1;
+    }
+    if (!(of->file->perms & 2)) {
+        printf("Permission refusee : ecriture interdite.\n");
+        return -1;
+    }
+    FileEntry *file = of->file;
+    snapshot_cow(file);
+    unshare_content(file);
+    int data_len = strlen(data);
+    int new_size = of->offset + data_len;
+    if (new_size > file->size) {
+        file->content = realloc(file->content, new_size + 1);
+        memset(file->content + file->size, 0, new_size - file->size);
+        file->size = new_size;
+    }
+    memcpy(file->content + of->offset, data, data_len);
+    of->offset += data_len;
+    file->content[file->size] = '\0';
+    inode_sync(file);
+    hash_invalidate(file);
+    mark_dirty(file, DIRTY_INODE | DIRTY_DATA);
+    return data_len;
+}
+
+off_t fs_lseek(int fd, int offset) {
+    OpenFile *of = open_files;
+    while (of) {
+        if (of->fd == fd)
+            break;
+        of = of->next;
+    }
+    if (!of) {
+        printf("Descripteur invalide.\n");
+        return -1;
+    }
+    if (offset < 0 || offset > of->file->size) {
+        printf("Offset invalide.\n");
+        return -1;
+    }
+    of->offset = offset;
+    return offset;
+}
+
+int fs_close(int fd) {
+    OpenFile **prev = &open_files;
+    OpenFile *of = open_files;
+    while (of) {
+        if (of->fd == fd) {
+            *prev = of->next;
+            if (fsync_on_close && of->file->dirty)
+                fs_sync();
+            free(of);
+            return 0;
+        }
+        prev = &of->next;
+        of = of->next;
+    }
+    printf("Descripteur invalide.\n");
+    return -1;
+}
+
+/* --- Fonctions pour manipuler le systeme de fichiers via l'interface utilisateur --- */
+
+FileEntry* new_directory(FileEntry *parent, const char *dirname) {
+    FileEntry *dir = malloc(sizeof(FileEntry));
+    dir->inode = new_inode_number();
+    dir->is_symbol = 0;
+    dir->origin = NULL;
+    dir->name = strdup(dirname);
+    dir->is_directory = 1;
+    dir->size = 0;
+    dir->content = NULL;
+    dir->content_refs = NULL;
+    dir->shared = NULL;
+    dir->link_count = 1;
+    dir->perms = 7; // rwx par defaut
+    dir->child = NULL;
+    dir->next = NULL;
+    dir->dirty = 0;
+    dir->dirty_next = NULL;
+    dir->loaded = 1;
+    dir->last_use = 0;
+    dir->origin_gen = tree_generation;
+    dir->compress = 0;
+    dir->stored_size = 0;
+    dir->epoch = snap_epoch;
+    dir->older = NULL;
+    dir->source = NULL;
+    dir->source_epoch = 0;
+    dir->hash = 0;
+    add_entry(parent, dir);
+    mark_dirty(dir, DIRTY_INODE | DIRTY_DATA);
+    mark_dirty(parent, DIRTY_DATA);
+    return dir;
+}
+
+void fs_mkdir(const char *dirname) {
+    if (snapshot_readonly(fs.current))
+        return;
+    if (find_entry(fs.current, dirname)) {
+        printf("Un repertoire ou fichier portant ce nom existe deja.\n");
+        return;
+    }
+    new_directory(fs.current, dirname);
+    printf("Repertoire '%s' cree.\n", dirname);
+}
+
+#define MKDIR_P_MAX_DEPTH 128
+
+/**
+ * @brief Cree des chemins de repertoires avec leurs parents (mkdir -p).
+ *
+ * Chaque chemin est parcouru une seule fois : les composants existants sont
+ * suivis, puis la fin manquante est creee directement sans nouvelle
+ * recherche, sauf apres un . ou un .. qui peut ramener dans un repertoire
+ * existant. Le prefixe commun avec le chemin precedent n'est pas reparcouru.
+ *
+ * @param paths Chemins a creer.
+ * @param nb Nombre de chemins.
+ */
+void fs_mkdir_p(char **paths, int nb) {
+    char *noms_prec[MKDIR_P_MAX_DEPTH];
+    FileEntry *noeuds_prec[MKDIR_P_MAX_DEPTH];
+    int prof_prec = 0;
+    FileEntry *depart_prec = NULL;
+
+    for (int i = 0; i < nb; i++) {
+        FileEntry *courant = (paths[i][0] == '/') ? fs.root : fs.current;
+        if (courant != depart_prec) {
+            for (int k = 0; k < prof_prec; k++)
+                free(noms_prec[k]);
+            prof_prec = 0;
+        }
+        char *copie = strdup(paths[i]);
+        char *noms[MKDIR_P_MAX_DEPTH];
+        FileEntry *noeuds[MKDIR_P_MAX_DEPTH];
+        int prof = 0, partage = 1, crees = 0, frais = 0, erreur = 0;
+        char *reste = NULL;
+        //strtok_r : resolve_path (cible d'un lien) decoupe aussi avec strtok
+        char *token = strtok_r(copie, "/", &reste);
+        while (token) {
+            if (prof == MKDIR_P_MAX_DEPTH) {
+                printf("Chemin trop profond : %s\n", paths[i]);
+                erreur = 1;
+                break;
+            }
+            //Prefixe commun avec le chemin precedent : deja resolu
+            if (partage && prof < prof_prec && strcmp(noms_prec[prof], token) == 0) {
+                courant = noeuds_prec[prof];
+            } else {
+                partage = 0;
+                FileEntry *suivant = NULL;
+                int cree = 0;
+                if (strcmp(token, ".") == 0)
+                    suivant = courant;
+                else if (strcmp(token, "..") == 0)
+                    suivant = courant->parent ? courant->parent : courant;
+                else if (!frais)
+                    suivant = find_entry(courant, token);
+                if (suivant && suivant->is_symbol == 1 && suivant->is_directory) {
+                    //Cible relue par son chemin (absolu) : origin peut viser une entree supprimee
+                    FileEntry *cible = suivant->nom_origin ? resolve_path(suivant->nom_origin, NULL) : NULL;
+                    if (cible && cible->is_directory) {
+                        suivant = cible;
+                    } else {
+                        //Lien mort, refuse plus bas comme par cd
+                        suivant->is_symbol = 2;
+                        mark_dirty(suivant, DIRTY_INODE);
+                    }
+                }
+                if (!suivant && snapshot_readonly(courant)) {
+                    erreur = 1;
+                    break;
+                }
+                if (!suivant) {
+                    suivant = new_directory(courant, token);
+                    crees++;
+                    cree = 1;
+                } else if (suivant->is_symbol == 2) {
+                    printf("'%s' est un lien symbolique mort.\n", token);
+                    erreur = 1;
+                    break;
+                } else if (!suivant->is_directory) {
+                    printf("'%s' existe et n'est pas un repertoire.\n", token);
+                    erreur = 1;
+                    break;
+                }
+                //Dans un repertoire cree a l'instant, le composant suivant ne peut pas exister ;
+                //apres . ou .., on peut etre revenu dans un repertoire qui a deja des enfants
+                frais = cree;
+                courant = suivant;
+            }
+            noms[prof] = token;
+            noeuds[prof] = courant;
+            prof++;
+            token = strtok_r(NULL, "/", &reste);
+        }
+        for (int k = 0; k < prof_prec; k++)
+            free(noms_prec[k]);
+        prof_prec = 0;
+        if (!erreur) {
+            for (int k = 0; k < prof; k++) {
+                noms_prec[k] = strdup(noms[k]);
+                noeuds_prec[k] = noeuds[k];
+            }
+            prof_prec = prof;
+            depart_prec = (paths[i][0] == '/') ? fs.root : fs.current;
+            if (crees)
+                printf("Repertoire '%s' cree.\n", paths[i]);
+        }
+        free(copie);
+    }
+    for (int k = 0; k < prof_prec; k++)
+        free(noms_prec[k]);
+}
+
+void fs_rmdir(const char *dirname) {
+    FileEntry *dir = resolve_path(dirname, NULL);
+    if (!dir || !dir->is_directory) {
+        printf("Repertoire introuvable.\n");
+        return;
+    }
+    load_children(dir);
+    if (dir->child != NULL) {
         printf("Le repertoire n'est pas vide.\n");
         return;
     }
-    if (!dir->parent) {
+    if (!dir->parent) {
+        printf("Impossible de supprimer la racine.\n");
+        return;
+    }
+    if (snapshot_readonly(dir->parent))
+        return;
+    FileEntry *parent = dir->parent;
+    if (unlink_child(parent, dir)) {
+        mark_dirty(parent, DIRTY_DATA);
+        if (snapshots) {
+            snapshot_keep(dir);
+        } else {
+            forget_dirty(dir);
+            pthread_mutex_lock(&part.lock);
+            release_entry_disk(dir);
+            pthread_mutex_unlock(&part.lock);
+            free(dir->name);
+            free(dir);
+        }
+        printf("Repertoire '%s' supprime.\n", dirname);
+    }
+}
+
+void fs_cd(const char *dirname) {
+    FileEntry* copie = fs.current;
+    if (strcmp(dirname, "..") == 0) {
+        if (fs.current->parent)
+            fs.current = fs.current->parent;
+        else
+            fs.current = fs.root;
+        char *chemin = build_path(fs.current);
+        printf("Repertoire courant change vers '%s'.\n", chemin);
+        free(chemin);
+        return;
+    }
+    FileEntry *dir = resolve_path(dirname, NULL);
+    if (!dir || !dir->is_directory) {
+        printf("Repertoire introuvable.\n");
+        return;
+    }
+    
+    if(dir->is_symbol){
+		fs.current = symlink_origin(dir);
+		if (!dir->origin || resolve_path(dir->origin->name, NULL) == NULL){
+			printf("Le répertoire d'origine n'existe plus.\n");
+			dir->is_symbol = 2;
+			mark_dirty(dir, DIRTY_INODE);
+			fs.current = copie;
+			return;
+		}
+		else {
+			fs.current = dir->origin;
+		}
+	}
+	else{
+		fs.current = dir;
+	}
+    char *chemin = build_path(fs.current);
+    printf("Repertoire courant change vers '%s'.\n", chemin);
+    free(chemin);
+}
+
+void fs_pwd() {
+    char *chemin = build_path(fs.current);
+    printf("%s\n", chemin);
+    free(chemin);
+}
+
+void fs_ls(const char *arg) {
+    FileEntry *cible = NULL;
+    if (arg == NULL)
+        cible = fs.current;
+    else {
+        cible = resolve_path(arg, NULL);
+        if (!cible) {
+            printf("Repertoire introuvable : %s\n", arg);
+            return;
+        }
+        if (!cible->is_directory) {
+            printf("%s\n", cible->name);
+            return;
+        }
+    }
+    load_children(cible);
+    FileEntry *child = cible->child;
+    while (child) {
+        if (child->is_symbol == 1){
+            printf("\033[1;36m%s\033[0m  ", child->name);
+        }
+        else if(child->is_symbol == 2){
+			printf("\033[1;31m%s\033[0m  ", child->name);
+		}
+        else if (child->is_directory){
+            printf("\033[1;34m%s\033[0m  ", child->name);
+		}
+		else{
+            printf("\033[1;32m%s\033[0m  ", child->name);
+        }
+        child = child->next;
+    }
+    printf("\n");
+}
+
+void fs_ls_l(const char *arg) {
+    FileEntry *cible = NULL;
+    if (arg == NULL)
+        cible = fs.current;
+    else {
+        cible = resolve_path(arg, NULL);
+        if (!cible) {
+            printf("Repertoire introuvable : %s\n", arg);
+            return;
+        }
+        if (!cible->is_directory) {
+            char perms_text[50];
+            get_perms_text(cible->perms, perms_text, sizeof(perms_text));
+            printf("%c%c%c %-5d %-20s %-5d %s%s",
+                   (cible->perms & 4) ? 'r' : '-',
+                   (cible->perms & 2) ? 'w' : '-',
+                   (cible->perms & 1) ? 'x' : '-',
+                   cible->inode, perms_text, cible->size,
+                   cible->name, cible->is_directory ? "/" : "");
+            if (cible->stored_size)
+                printf(" (%u octets compresses)", cible->stored_size);
+            printf("\n");
+            return;
+        }
+    }
+    load_children(cible);
+    FileEntry *child = cible->child;
+    while (child) {
+		char perms_text[50];
+		get_perms_text(child->perms, perms_text, sizeof(perms_text));
+        //Lien symbolique mort
+        if(child->is_symbol == 2){
+			printf("lrwx %d %d \033[1;31m%s->%s\033[0m\n", entry_links(child), child->size, child->name, child->nom_origin);
+        }
+        //Lien symbolique vivant
+        else if (child->is_symbol == 1){
+			printf("lrwx %d %d \033[1;36m%s->%s\033[0m\n", entry_links(child), child->size, child->name, child->nom_origin);
+		}
+		//Dossier
+		else if (child->is_directory){
+			printf("d%c%c%c %d %d \033[1;34m%s\033[0m\n", 
+				(child->perms & 4) ? 'r' : '-',
+                (child->perms & 2) ? 'w' : '-',
+                (child->perms & 1) ? 'x' : '-',
+                entry_links(child), child->size, child->name);
+		}
+		//Fichier compresse : taille logique, puis taille stockee
+		else if (child->stored_size) {
+			printf("-%c%c%c %d %d (%u compresse) \033[1;32m%s\033[0m\n",
+				(child->perms & 4) ? 'r' : '-',
+                (child->perms & 2) ? 'w' : '-',
+                (child->perms & 1) ? 'x' : '-',
+                entry_links(child), child->size, child->stored_size, child->name);
+		}
+		//Fichier
+		else {
+			printf("-%c%c%c %d %d \033[1;32m%s\033[0m\n",
+				(child->perms & 4) ? 'r' : '-',
+                (child->perms & 2) ? 'w' : '-',
+                (child->perms & 1) ? 'x' : '-',
+                entry_links(child), child->size, child->name);
+		}
+        child = child->next;
+    }
+}
+
+/*void fs_ls_l(const char *arg) {
+    FileEntry *cible = NULL;
+    if (arg == NULL)
+        cible = fs.current;
+    else {
+        cible = resolve_path(arg, NULL);
+        if (!cible) {
+            printf("Repertoire introuvable : %s\n", arg);
+            return;
+        }
+        if (!cible->is_directory) {
+            char perms_text[50];
+            get_perms_text(cible->perms, perms_text, sizeof(perms_text));
+            printf("%c%c%c %-5d %-20s %-5d %s%s\n",
+                   (cible->perms & 4) ? 'r' : '-',
+                   (cible->perms & 2) ? 'w' : '-',
+                   (cible->perms & 1) ? 'x' : '-',
+                   cible->inode, perms_text, cible->size,
+                   cible->name, cible->is_directory ? "/" : "");
+            return;
+        }
+    }
+    load_children(cible);
+    FileEntry *child = cible->child;
+    while (child) {
+        char perms_text[50];
+        get_perms_text(child->perms, perms_text, sizeof(perms_text));
+        printf("%c%c%c %-5d %-20s %-5d %s%s\n",
+               (child->perms & 4) ? 'r' : '-',
+               (child->perms & 2) ? 'w' : '-',
+               (child->perms & 1) ? 'x' : '-',
+               child->inode, perms_text, child->size,
+               child->name, child->is_directory ? "/" : "");
+        child = child->next;
+    }
+}*/
+
+/**
+ * @brief Liste le contenu d'un repertoire avec les inodes.
+ *
+ * Si aucun argument n'est fourni, le repertoire courant est liste.
+ * Sinon, le chemin donne est resolu et son contenu est affiche.
+ *
+ * @param arg Chemin optionnel du repertoire a lister.
+ */
+void fs_ls_i(const char *arg) {
+    FileEntry *cible = NULL;
+    if (arg == NULL) {
+        cible = fs.current;
+    } else {
+        cible = resolve_path(arg, NULL);
+        if (!cible) {
+            printf("Repertoire introuvable : %s\n", arg);
+            return;
+        }
+        if (!cible->is_directory) {
+            printf("%d %s\n", cible->inode, cible->name);
+            return;
+        }
+    }
+    load_children(cible);
+    FileEntry *child = cible->child;
+    while (child) {
+		if (child->is_symbol == 1){
+			printf("%d \033[1;36m%s\033[0m  ", child->inode, child->name);
+		}
+		else if (child->is_symbol == 2){
+			printf("%d \033[1;31m%s\033[0m  ", child->inode, child->name);
+		}
+		else if (child->is_directory){
+			printf("%d \033[1;34m%s\033[0m  ", child->inode, child->name);
+		}
+		else{
+			printf("%d \033[1;32m%s\033[0m  ", child->inode, child->name);
+		}
+        child = child->next;
+    }
+    printf("\n");
+}
+
+void fs_cat(const char *filename) {
+	FileEntry* copie = fs.current;
+    FileEntry *file = resolve_path(filename, NULL);
+    //Inexistant ou répertoire = dehors
+    if (!file || file->is_directory) {
+        printf("Fichier introuvable ou ce n'est pas un fichier.\n");
+        return;
+    }
+    //Lien symbolique
+    if (file->is_symbol) {
+		//Lien dont la cible n'a pas pu etre retrouvee par son chemin
+		if (!symlink_origin(file)) {
+			printf("Le fichier d'origine n'existe plus.\n");
+			return;
+		}
+		fs.current = file->origin->parent; //Sert à vérifier que le fichier d'origine existe
+		//Lien mort
+        if (resolve_path(file->origin->name, NULL) == NULL){
+			printf("Le fichier d'origine n'existe plus.\n");
+			file->is_symbol = 2;
+			fs.current = copie;
+			return;
+		}
+		//Lien vivant
+		else{
+			load_content(file->origin);
+			if (file->origin->content){
+				printf("%s\n", file->origin->content);
+			}
+			file->is_symbol = 1;
+			fs.current = copie;
+			return;
+		}
+    }
+    //Fichier
+    else{
+		load_content(file);
+		if (file->content){
+			printf("%s\n", file->content);
+		}
+	}
+}
+
+/* 
+ * Modification de fs_create : création d'un fichier avec taille par defaut, 
+ * sans besoin de fournir la taille par l'utilisateur.
+ */
+void fs_touch(const char *filename) {
+    if (snapshot_readonly(fs.current))
+        return;
+    if (find_entry(fs.current, filename)) {
+        printf("Le fichier existe deja.\n");
+        return;
+    }
+    FileEntry *file = malloc(sizeof(FileEntry));
+    file->inode = new_inode_number();
+    file->is_symbol = 0;
+    file->origin = NULL;
+    file->name = strdup(filename);
+    file->is_directory = 0;
+    file->size = DEFAULT_FILE_SIZE;
+    file->link_count = 1;
+    file->perms = 6;  // rw par defaut
+    file->child = NULL;
+    file->next = NULL;
+    file->dirty = 0;
+    file->dirty_next = NULL;
+    file->loaded = 1;
+    file->last_use = 0;
+    file->origin_gen = tree_generation;
+    file->compress = 0;
+    file->stored_size = 0;
+    file->epoch = snap_epoch;
+    file->older = NULL;
+    file->source = NULL;
+    file->source_epoch = 0;
+    file->hash = 0;
+    file->content = calloc(DEFAULT_FILE_SIZE + 1, sizeof(char));
+    file->content_refs = NULL;
+    file->shared = NULL;
+    add_entry(fs.current, file);
+    mark_dirty(file, DIRTY_INODE | DIRTY_DATA);
+    mark_dirty(fs.current, DIRTY_DATA);
+    printf("Fichier '%s' cree avec une taille par defaut de %d octets.\n", filename, DEFAULT_FILE_SIZE);
+}
+
+/*
+ * Commande write modifiee : prend en argument le nom du fichier et le texte.
+ * Elle ouvre le fichier en ecriture, écrit le texte et ferme le fichier automatiquement.
+ * Avec ajout, le texte est ecrit a la fin du fichier (commande append).
+ */
+void fs_write_cmd(const char *filename, const char *texte, int ajout) {
+	FileEntry* copie = fs.current;
+	FileEntry* file = resolve_path(filename, NULL);
+	int fd;
+	//Lien symbolique
+	if(file && file->is_symbol){
+		if (!symlink_origin(file)) {
+			printf("Le fichier d'origine n'existe plus.\n");
+			return;
+		}
+		fs.current = file->origin->parent; //On se déplace dans le dossier du fichier d'origine sinon ça ne marche pas
+		//Lien mort
+		if (resolve_path(file->origin->name, NULL) == NULL){
+			printf("Le fichier d'origine n'existe plus.\n");
+			file->is_symbol = 2;
+			fs.current = copie;
+			return;
+		}
+		//Lien vivant
+		else{
+			fd = fs_open(file->origin->name, 2);
+			file->is_symbol = 1;
+		}
+	}
+	//Pas un lien symbolique
+	else{
+		fd = fs_open(filename, 2);
+	}
+	//Traitement
+    if (fd < 0) {
+        printf("Ecriture impossible, fichier introuvable ou permissions insuffisantes.\n");
+        return;
+    }
+    //fs_open place le nouveau descripteur en tete de la liste
+    if (ajout)
+        fs_lseek(fd, open_files->file->size);
+    int written = fs_write(fd, texte);
+    if (written >= 0)
+        printf("Ecriture de %d octets dans '%s'.\n", written, filename);
+    fs_close(fd);
+    fs.current = copie;
+}
+
+/*
+ * Commande mv, chmod, link, ln, unlink, rm, fsck restent identiques.
+ */
+
+void fs_chmod(const char *perm_str, const char *path) {
+    int perm = atoi(perm_str);
+    FileEntry *entry = resolve_path(path, NULL);
+    if (!entry) {
+        printf("Entree introuvable : %s\n", path);
+        return;
+    }
+    //Lien symbolique = dehors
+    if(entry->is_symbol == 1|| entry->is_symbol == 2){ //Pas d'espace entre le 1 et la barre, sinon ça compile pas
+		printf("Interdiction de modifier les droits d'un lien symbolique\n");
+	}
+	//Fichier
+	else{
+		//Permission entre 0 et 7 = impossible de mettre 777777777
+		if(perm > -1 && perm < 8){
+			if (snapshot_readonly(entry))
+				return;
+			snapshot_cow(entry);
+			entry->perms = perm;
+			inode_sync(entry);
+			hash_invalidate(entry);
+			mark_dirty(entry, DIRTY_INODE);
+			printf("Les permissions de '%s' sont definies a %d.\n", entry->name, perm);
+		}
+		else{
+			printf("%d n'est pas compris entre 0 et 7.\n", perm);
+		}
+	}
+}
+
+/**
+ * @brief Active ou desactive la compression du contenu d'un fichier.
+ *
+ * Le contenu est reecrit sur la partition au prochain passage de l'ecriture
+ * differee, compresse par morceaux de la taille d'un bloc.
+ */
+void fs_compress(const char *path, const char *mode) {
+    FileEntry *file = resolve_path(path, NULL);
+    if (!file || file->is_directory || file->is_symbol) {
+        printf("Fichier introuvable ou ce n'est pas un fichier.\n");
+        return;
+    }
+    int actif = !mode || strcmp(mode, "on") == 0;
+    if (mode && !actif && strcmp(mode, "off") != 0) {
+        printf("Usage : compress <fichier> [on|off]\n");
+        return;
+    }
+    if (snapshot_readonly(file))
+        return;
+    if (file->compress != actif) {
+        load_content(file);
+        snapshot_cow(file);
+        file->compress = actif;
+        inode_sync(file);
+        mark_dirty(file, DIRTY_INODE | DIRTY_DATA);
+    }
+    printf("Compression %s pour '%s'.\n", actif ? "activee" : "desactivee", file->name);
+}
+
+void fs_ln(const char *src, const char *dest) {
+    FileEntry *file = resolve_path(src, NULL);
+    if (!file || file->is_directory) {
+        printf("Fichier source introuvable ou ce n'est pas un fichier.\n");
+        return;
+    }
+    if (snapshot_readonly(fs.current) || snapshot_readonly(file))
+        return;
+    if (find_entry(fs.current, dest)) {
+        printf("Le nom de destination existe deja.\n");
+        return;
+    }
+    load_content(file);
+    snapshot_cow(file);
+    //Inode deja ecrit : son compteur de liens est tenu sur la partition
+    if (disk_mode && file->inode) {
+        disk_inode di;
+        pthread_mutex_lock(&part.lock);
+        if (read_inode(&part, file->inode, &di) == 0 && di.type != FS_TYPE_FREE) {
+            di.links++;
+            write_inode(&part, file->inode, &di);
+        }
+        pthread_mutex_unlock(&part.lock);
+    }
+    FileEntry *nouveau_lien = malloc(sizeof(FileEntry));
+    nouveau_lien->inode = file->inode; // même inode pour lien physique
+    nouveau_lien->is_symbol = 0;
+    nouveau_lien->origin = NULL;
+    nouveau_lien->name = strdup(dest);
+    nouveau_lien->is_directory = 0;
+    nouveau_lien->size = file->size;
+    nouveau_lien->content = NULL;
+    nouveau_lien->content_refs = NULL;
+    nouveau_lien->shared = NULL;
+    nouveau_lien->link_count = 1;
+    nouveau_lien->perms = file->perms;
+    nouveau_lien->child = NULL;
+    nouveau_lien->next = NULL;
+    nouveau_lien->parent = NULL;
+    nouveau_lien->dirty = 0;
+    nouveau_lien->dirty_next = NULL;
+    nouveau_lien->loaded = 1;
+    nouveau_lien->last_use = 0;
+    nouveau_lien->origin_gen = tree_generation;
+    nouveau_lien->compress = file->compress;
+    nouveau_lien->stored_size = 0;
+    nouveau_lien->epoch = snap_epoch;
+    nouveau_lien->older = NULL;
+    nouveau_lien->source = NULL;
+    nouveau_lien->source_epoch = 0;
+    nouveau_lien->hash = file->hash;
+    //Le nouveau lien prend le contenu et les modifications en attente de l'inode
+    link_share(file, nouveau_lien);
+    add_entry(fs.current, nouveau_lien);
+    mark_dirty(file, file->dirty | DIRTY_INODE);
+    mark_dirty(fs.current, DIRTY_DATA);
+    printf("Lien physique '%s' cree pour '%s'.\n", dest, src);
+}
+
+void fs_ln_s(const char *src, const char *dest) {
+    FileEntry *file = resolve_path(src, NULL);
+    if (!file) {
+        printf("Source introuvable.\n");
+        return;
+    }
+    if (snapshot_readonly(fs.current))
+        return;
+    if (find_entry(fs.current, dest)) {
+        printf("Le nom de destination existe deja.\n");
+        return;
+    }
+    FileEntry *nouveau_lien = malloc(sizeof(FileEntry));
+    nouveau_lien->inode = new_inode_number();
+    nouveau_lien->is_symbol = 1;
+    nouveau_lien->origin = file;
+    nouveau_lien->nom_origin = build_path(nouveau_lien->origin);
+    nouveau_lien->name = strdup(dest);
+    nouveau_lien->is_directory = file->is_directory;
+    nouveau_lien->size = file->size;
+    nouveau_lien->content = NULL;
+    nouveau_lien->content_refs = NULL;
+    nouveau_lien->shared = NULL;
+    nouveau_lien->link_count = 1;
+    nouveau_lien->perms = 7;
+    nouveau_lien->child = NULL;
+    nouveau_lien->next = NULL;
+    nouveau_lien->dirty = 0;
+    nouveau_lien->dirty_next = NULL;
+    nouveau_lien->loaded = 1;
+    nouveau_lien->last_use = 0;
+    nouveau_lien->origin_gen = tree_generation;
+    nouveau_lien->compress = 0;
+    nouveau_lien->stored_size = 0;
+    nouveau_lien->epoch = snap_epoch;
+    nouveau_lien->older = NULL;
+    nouveau_lien->source = NULL;
+    nouveau_lien->source_epoch = 0;
+    nouveau_lien->hash = 0;
+    nouveau_lien->parent = fs.current;
+    add_entry(fs.current, nouveau_lien);
+    mark_dirty(nouveau_lien, DIRTY_INODE | DIRTY_DATA);
+    mark_dirty(fs.current, DIRTY_DATA);
+    printf("Lien symbolique '%s' cree pour '%s'.\n", dest, src);
+}
+
+/*void fs_unlink(const char *filename) {
+    FileEntry *file = resolve_path(filename, NULL);
+    if (!file || file->is_directory) {
+        printf("Fichier introuvable ou ce n'est pas un fichier.\n");
+        return;
+    }
+    if (!file->parent) {
         printf("Impossible de supprimer la racine.\n");
         return;
     }
-    FileEntry **courant = &dir->parent->child;
+    FileEntry **courant = &file->parent->child;
     while (*courant) {
-        if (*courant == dir) {
-            *courant = dir->next;
-            free(dir->name);
-            free(dir);
-            printf("Repertoire '%s' supprime.\n", dirname);
+        if (*courant == file) {
+            *courant = file->next;
+            file->link_count--;
+            if (file->link_count == 0) {
+                free(file->name);
+                if (file->content)
+                    free(file->content);
+                free(file);
+            }
+            printf("Lien supprime pour '%s'.\n", filename);
             return;
         }
         courant = &(*courant)->next;
     }
+}*/
+
+void fs_rm(const char *path) {
+    FileEntry *parent = NULL;
+    FileEntry *entry = resolve_path(path, &parent);
+    if (!entry) {
+        printf("Entree introuvable : %s\n", path);
+        return;
+    }
+    if (!parent) {
+        printf("Impossible de supprimer la racine.\n");
+        return;
+    }
+    if (snapshot_readonly(parent))
+        return;
+    load_children(entry);
+    if (entry->is_directory && entry->child != NULL) {
+        printf("Le repertoire n'est pas vide : %s\n", path);
+        return;
+    }
+    flush_removed_links(entry);
+    if (unlink_child(parent, entry)) {
+        mark_dirty(parent, DIRTY_DATA);
+        if (snapshots) {
+            snapshot_keep(entry);
+        } else {
+            forget_dirty(entry);
+            pthread_mutex_lock(&part.lock);
+            release_entry_disk(entry);
+            pthread_mutex_unlock(&part.lock);
+            free(entry->name);
+            release_content(entry);
+            free(entry);
+        }
+        printf("Supprime : %s\n", path);
+    }
 }
 
-void fs_cd(const char *dirname) {
-    FileEntry* copie = fs.current;
-    if (strcmp(dirname, "..") == 0) {
-        if (fs.current->parent)
-            fs.current = fs.current->parent;
-        else
-            fs.current = fs.root;
-        char *chemin = build_path(fs.current);
-        printf("Repertoire courant change vers '%s'.\n", chemin);
-        free(chemin);
+/**
+ * @brief Supprime recursivement une entree (rm -r).
+ *
+ * Le sous-arbre est seulement detache de son parent ici ; sa liberation
+ * est confiee au thread recuperateur pour que l'invite reste reactive.
+ * Tant qu'un instantane existe, il est garde en memoire (snapshot_keep).
+ *
+ * @param path Chemin de l'entree a supprimer.
+ */
+void fs_rm_r(const char *path) {
+    FileEntry *parent = NULL;
+    FileEntry *entry = resolve_path(path, &parent);
+    if (!entry) {
+        printf("Entree introuvable : %s\n", path);
         return;
     }
-    FileEntry *dir = resolve_path(dirname, NULL);
-    if (!dir || !dir->is_directory) {
-        printf("Repertoire introuvable.\n");
+    if (!parent || !entry->parent) {
+        printf("Impossible de supprimer la racine.\n");
         return;
     }
-    
-    if(dir->is_symbol){
-		fs.current = dir->origin;
-		if (resolve_path(dir->origin->name, NULL) == NULL){
-			printf("Le répertoire d'origine n'existe plus.\n");
-			dir->is_symbol = 2;
-			fs.current = copie;
-			return;
-		}
-		else {
-			fs.current = dir->origin;
-		}
-	}
-	else{
-		fs.current = dir;
-	}
-    char *chemin = build_path(fs.current);
-    printf("Repertoire courant change vers '%s'.\n", chemin);
-    free(chemin);
+    //Le point de montage d'une vue peut etre retire, pas son contenu
+    if (snapshot_readonly(entry->parent))
+        return;
+    //Le repertoire courant ne doit pas disparaitre avec le sous-arbre
+    for (FileEntry *p = fs.current; p; p = p->parent) {
+        if (p == entry) {
+            fs.current = entry->parent;
+            break;
+        }
+    }
+    //Le sous-arbre ne doit plus rien avoir a ecrire quand il est confie au recuperateur
+    flush_removed_links(entry);
+    forget_dirty_subtree(entry);
+    if (unlink_child(entry->parent, entry)) {
+        mark_dirty(entry->parent, DIRTY_DATA);
+        if (snapshots)
+            snapshot_keep(entry);
+        else
+            reclaim_subtree(entry);
+        printf("Supprime : %s\n", path);
+    }
 }
 
-void fs_pwd() {
-    char *chemin = build_path(fs.current);
-    printf("%s\n", chemin);
-    free(chemin);
+/**
+ * @brief Fait viser nouveau aux liens symboliques charges qui designent ancien.
+ */
+static void symlinks_retarget(FileEntry *dir, FileEntry *ancien, FileEntry *nouveau) {
+    for (FileEntry *c = dir->child; c; c = c->next) {
+        if (c->is_symbol && c->origin == ancien)
+            c->origin = nouveau;
+        else if (c->is_directory && !c->is_symbol && c->loaded)
+            symlinks_retarget(c, ancien, nouveau);
+    }
 }
 
-void fs_ls(const char *arg) {
-    FileEntry *cible = NULL;
-    if (arg == NULL)
-        cible = fs.current;
-    else {
-        cible = resolve_path(arg, NULL);
-        if (!cible) {
-            printf("Repertoire introuvable : %s\n", arg);
-            return;
-        }
-        if (!cible->is_directory) {
-            printf("%s\n", cible->name);
+/**
+ * @brief Deplace ou renomme une entree, eventuellement entre repertoires.
+ *
+ * Toutes les verifications sont faites avant de toucher a l'arbre. Un
+ * repertoire ne peut pas etre deplace dans l'un de ses descendants : on
+ * remonte les pointeurs parent depuis la destination seulement, en
+ * O(profondeur). Si la destination est un repertoire existant, l'entree y
+ * est deplacee sous son nom. Si elle est un fichier (ou un repertoire vide
+ * pour un repertoire), elle est remplacee en une seule operation, ce qui
+ * permet d'ecrire dans un fichier temporaire puis de le renommer.
+ *
+ * @param src Chemin de l'entree a deplacer.
+ * @param dest Chemin de destination.
+ */
+void fs_mv(const char *src, const char *dest) {
+    FileEntry *parent = NULL;
+    FileEntry *entry = resolve_path(src, &parent);
+    if (!entry) {
+        printf("Source introuvable : %s\n", src);
+        return;
+    }
+    if (!entry->parent) {
+        printf("Impossible de deplacer la racine.\n");
+        return;
+    }
+    char *dest_copy = NULL;
+    FileEntry *new_parent = NULL;
+    char *new_name = NULL;
+    FileEntry *cible = resolve_path(dest, NULL);
+    if (cible && cible->is_directory && !cible->is_symbol && cible != entry) {
+        //Deplacement dans un repertoire existant, sous le meme nom
+        new_parent = cible;
+        dest_copy = strdup(entry->name);
+        new_name = dest_copy;
+    } else {
+        new_name = split_dest(dest, &dest_copy, &new_parent);
+    }
+    if (!new_parent || !new_parent->is_directory || new_name[0] == '\0') {
+        printf("Destination invalide : %s\n", dest);
+        free(dest_copy);
+        return;
+    }
+    //Detection de cycle : la destination ne doit pas descendre de la source
+    for (FileEntry *p = new_parent; p; p = p->parent) {
+        if (p == entry) {
+            printf("Impossible de deplacer '%s' dans lui-meme.\n", src);
+            free(dest_copy);
             return;
         }
     }
-    FileEntry *child = cible->child;
-    while (child) {
-        if (child->is_symbol == 1){
-            printf("\033[1;36m%s\033[0m  ", child->name);
+    FileEntry *remplace = find_entry(new_parent, new_name);
+    //Meme entree, ou autre lien physique du meme inode : rien a deplacer
+    if (remplace && (remplace == entry || (remplace->shared && remplace->shared == entry->shared))) {
+        printf("'%s' et '%s' designent le meme fichier.\n", src, dest);
+        free(dest_copy);
+        return;
+    }
+    if (remplace) {
+        if (entry_is_open(remplace)) {
+            printf("Impossible de remplacer '%s' : fichier ouvert.\n", new_name);
+            free(dest_copy);
+            return;
         }
-        else if(child->is_symbol == 2){
-			printf("\033[1;31m%s\033[0m  ", child->name);
-		}
-        else if (child->is_directory){
-            printf("\033[1;34m%s\033[0m  ", child->name);
-		}
-		else{
-            printf("\033[1;32m%s\033[0m  ", child->name);
+        if (entry->is_directory && !remplace->is_directory) {
+            printf("Impossible de remplacer le fichier '%s' par un repertoire.\n", new_name);
+            free(dest_copy);
+            return;
         }
-        child = child->next;
-    }
-    printf("\n");
-}
-
-void fs_ls_l(const char *arg) {
-    FileEntry *cible = NULL;
-    if (arg == NULL)
-        cible = fs.current;
-    else {
-        cible = resolve_path(arg, NULL);
-        if (!cible) {
-            printf("Repertoire introuvable : %s\n", arg);
+        if (!entry->is_directory && remplace->is_directory) {
+            printf("Impossible de remplacer le repertoire '%s' par un fichier.\n", new_name);
+            free(dest_copy);
             return;
         }
-        if (!cible->is_directory) {
-            char perms_text[50];
-            get_perms_text(cible->perms, perms_text, sizeof(perms_text));
-            printf("%c%c%c %-5d %-20s %-5d %s%s\n",
-                   (cible->perms & 4) ? 'r' : '-',
-                   (cible->perms & 2) ? 'w' : '-',
-                   (cible->perms & 1) ? 'x' : '-',
-                   cible->inode, perms_text, cible->size,
-                   cible->name, cible->is_directory ? "/" : "");
+        load_children(remplace);
+        if (remplace->is_directory && remplace->child) {
+            printf("Le repertoire n'est pas vide : %s\n", new_name);
+            free(dest_copy);
             return;
         }
     }
-    FileEntry *child = cible->child;
-    while (child) {
-		char perms_text[50];
-		get_perms_text(child->perms, perms_text, sizeof(perms_text));
-        //Lien symbolique mort
-        if(child->is_symbol == 2){
-			printf("lrwx %d %d \033[1;31m%s->%s\033[0m\n", child->link_count, child->size, child->name, child->nom_origin);
+    if (snapshot_readonly(entry->parent) || snapshot_readonly(new_parent)) {
+        free(dest_copy);
+        return;
+    }
+
+    if (remplace)
+        flush_removed_links(remplace);
+    //Plus aucune erreur possible : modification de l'arbre
+    mark_dirty(entry->parent, DIRTY_DATA);
+    mark_dirty(new_parent, DIRTY_DATA);
+    mark_dirty(entry, DIRTY_INODE);
+    unlink_child(entry->parent, entry);
+    free(entry->name);
+    entry->name = strdup(new_name);
+    entry->parent = new_parent;
+    if (remplace) {
+        //L'entree prend directement la place de l'ancienne
+        FileEntry **cur = child_link(new_parent, remplace);
+        snapshot_cow(remplace);
+        entry->next = remplace->next;
+        *cur = entry;
+        remplace->next = NULL;
+        if (fs.current == remplace)
+            fs.current = entry;
+        if (snapshots) {
+            snapshot_keep(remplace);
+        } else {
+            //Les liens symboliques vers l'ancienne entree visent son remplacant, au meme chemin
+            symlinks_retarget(fs.root, remplace, entry);
+            forget_dirty(remplace);
+            pthread_mutex_lock(&part.lock);
+            release_entry_disk(remplace);
+            pthread_mutex_unlock(&part.lock);
+            free_file_entry(remplace);
         }
-        //Lien symbolique vivant
-        else if (child->is_symbol == 1){
-			printf("lrwx %d %d \033[1;36m%s->%s\033[0m\n", child->link_count, child->size, child->name, child->nom_origin);
-		}
-		//Dossier
-		else if (child->is_directory){
-			printf("d%c%c%c %d %d \033[1;34m%s\033[0m\n", 
-				(child->perms & 4) ? 'r' : '-',
-                (child->perms & 2) ? 'w' : '-',
-                (child->perms & 1) ? 'x' : '-',
-                child->link_count, child->size, child->name);
-		}
-		//Fichier
-		else {
-			printf("-%c%c%c %d %d \033[1;32m%s\033[0m\n",
-				(child->perms & 4) ? 'r' : '-',
-                (child->perms & 2) ? 'w' : '-',
-                (child->perms & 1) ? 'x' : '-',
-                child->link_count, child->size, child->name);
-		}
-        child = child->next;
+    } else {
+        add_entry(new_parent, entry);
     }
+    printf("Deplace '%s' vers '%s'.\n", src, dest);
+    free(dest_copy);
 }
 
-/*void fs_ls_l(const char *arg) {
-    FileEntry *cible = NULL;
-    if (arg == NULL)
-        cible = fs.current;
-    else {
-        cible = resolve_path(arg, NULL);
-        if (!cible) {
-            printf("Repertoire introuvable : %s\n", arg);
-            return;
+/**
+ * @brief Copie un fichier sans dupliquer son contenu (reflink).
+ *
+ * La nouvelle entree recoit son propre inode mais partage le contenu de la
+ * source via un compteur de references. Le contenu n'est duplique qu'a la
+ * premiere ecriture sur l'une des deux copies (voir unshare_content).
+ *
+ * @param src Chemin du fichier source.
+ * @param dest Chemin de destination (ou repertoire existant).
+ * @return La nouvelle entree, ou NULL en cas d'erreur.
+ */
+FileEntry* fs_clone_file(const char *src, const char *dest) {
+    FileEntry *file = resolve_path(src, NULL);
+    if (!file || file->is_directory) {
+        printf("Fichier source introuvable ou ce n'est pas un fichier : %s\n", src);
+        return NULL;
+    }
+    if (file->is_symbol) {
+        file = symlink_origin(file);
+        if (!file) {
+            printf("Le fichier d'origine n'existe plus.\n");
+            return NULL;
         }
-        if (!cible->is_directory) {
-            char perms_text[50];
-            get_perms_text(cible->perms, perms_text, sizeof(perms_text));
-            printf("%c%c%c %-5d %-20s %-5d %s%s\n",
-                   (cible->perms & 4) ? 'r' : '-',
-                   (cible->perms & 2) ? 'w' : '-',
-                   (cible->perms & 1) ? 'x' : '-',
-                   cible->inode, perms_text, cible->size,
-                   cible->name, cible->is_directory ? "/" : "");
-            return;
+    }
+    load_content(file);
+    char *copie = NULL;
+    FileEntry *new_parent = NULL;
+    char *new_name = NULL;
+    FileEntry *cible = resolve_path(dest, NULL);
+    if (cible && cible->is_directory) {
+        //Copie dans un repertoire existant avec le meme nom
+        new_parent = cible;
+        copie = strdup(file->name);
+        new_name = copie;
+    } else {
+        new_name = split_dest(dest, &copie, &new_parent);
+    }
+    if (!new_parent || !new_parent->is_directory || new_name[0] == '\0') {
+        printf("Destination invalide : %s\n", dest);
+        free(copie);
+        return NULL;
+    }
+    if (snapshot_readonly(new_parent)) {
+        free(copie);
+        return NULL;
+    }
+    if (find_entry(new_parent, new_name)) {
+        printf("Le nom de destination existe deja.\n");
+        free(copie);
+        return NULL;
+    }
+    FileEntry *clone = malloc(sizeof(FileEntry));
+    clone->inode = new_inode_number();
+    clone->is_symbol = 0;
+    clone->origin = NULL;
+    clone->nom_origin = NULL;
+    clone->name = strdup(new_name);
+    clone->is_directory = 0;
+    clone->size = file->size;
+    clone->content = file->content;
+    clone->content_refs = NULL;
+    clone->shared = NULL;
+    if (file->content) {
+        if (!file->content_refs) {
+            file->content_refs = malloc(sizeof(int));
+            *file->content_refs = 1;
         }
+        __atomic_add_fetch(file->content_refs, 1, __ATOMIC_ACQ_REL);
+        clone->content_refs = file->content_refs;
+        inode_sync(file);
     }
-    FileEntry *child = cible->child;
-    while (child) {
-        char perms_text[50];
-        get_perms_text(child->perms, perms_text, sizeof(perms_text));
-        printf("%c%c%c %-5d %-20s %-5d %s%s\n",
-               (child->perms & 4) ? 'r' : '-',
-               (child->perms & 2) ? 'w' : '-',
-               (child->perms & 1) ? 'x' : '-',
-               child->inode, perms_text, child->size,
-               child->name, child->is_directory ? "/" : "");
-        child = child->next;
+    clone->link_count = 1;
+    clone->perms = file->perms;
+    clone->child = NULL;
+    clone->next = NULL;
+    clone->dirty = 0;
+    clone->dirty_next = NULL;
+    clone->loaded = 1;
+    clone->last_use = 0;
+    clone->origin_gen = tree_generation;
+    clone->compress = file->compress;
+    clone->stored_size = 0;
+    clone->epoch = snap_epoch;
+    clone->older = NULL;
+    clone->source = NULL;
+    clone->source_epoch = 0;
+    clone->hash = file->hash;
+    add_entry(new_parent, clone);
+    mark_dirty(clone, DIRTY_INODE | DIRTY_DATA);
+    mark_dirty(new_parent, DIRTY_DATA);
+    free(copie);
+    return clone;
+}
+
+void fs_cp(const char *src, const char *dest) {
+    if (fs_clone_file(src, dest))
+        printf("Copie '%s' vers '%s'.\n", src, dest);
+}
+
+/* --- Copie recursive parallele (cp -r) --- */
+
+#define CP_MAX_THREADS 8
+
+typedef struct CopyJob {
+    FileEntry *src;
+    FileEntry *dst;
+} CopyJob;
+
+typedef struct CopyPool {
+    CopyJob *jobs;
+    int nb_jobs;
+    int prochain;       // Index du prochain travail a prendre (atomique)
+} CopyPool;
+
+/**
+ * @brief Cree une entree vide portant les metadonnees de src.
+ *
+ * Le contenu n'est pas copie : c'est le travail des threads de copie.
+ */
+FileEntry* copy_entry_meta(FileEntry *src, const char *name) {
+    FileEntry *e = malloc(sizeof(FileEntry));
+    e->inode = new_inode_number();
+    e->is_symbol = src->is_symbol;
+    e->origin = src->origin;
+    e->nom_origin = src->is_symbol ? strdup(src->nom_origin) : NULL;
+    e->name = strdup(name);
+    e->is_directory = src->is_directory;
+    e->size = src->size;
+    e->content = NULL;
+    e->content_refs = NULL;
+    e->shared = NULL;
+    e->link_count = 1;
+    e->perms = src->perms;
+    e->child = NULL;
+    e->next = NULL;
+    e->dirty = 0;
+    e->dirty_next = NULL;
+    e->loaded = 1;
+    e->last_use = 0;
+    e->origin_gen = src->origin_gen;
+    e->compress = src->compress;
+    e->stored_size = 0;
+    e->epoch = snap_epoch;
+    e->older = NULL;
+    e->source = NULL;
+    e->source_epoch = 0;
+    e->hash = src->is_directory && !src->is_symbol ? 0 : src->hash;
+    e->parent = NULL;
+    mark_dirty(e, DIRTY_INODE | DIRTY_DATA);
+    return e;
+}
+
+void *copy_worker(void *arg) {
+    CopyPool *pool = arg;
+    while (1) {
+        int i = __atomic_fetch_add(&pool->prochain, 1, __ATOMIC_RELAXED);
+        if (i >= pool->nb_jobs)
+            break;
+        FileEntry *src = pool->jobs[i].src;
+        FileEntry *dst = pool->jobs[i].dst;
+        if (!src->content)
+            continue;
+        char *data = malloc(src->size + 1);
+        memcpy(data, src->content, src->size);
+        data[src->size] = '\0';
+        dst->content = data;
     }
-}*/
+    return NULL;
+}
 
 /**
- * @brief Liste le contenu d'un repertoire avec les inodes.
+ * @brief Copie recursivement un sous-arbre avec un pool de threads.
  *
- * Si aucun argument n'est fourni, le repertoire courant est liste.
- * Sinon, le chemin donne est resolu et son contenu est affiche.
+ * Les repertoires sont crees niveau par niveau par le thread principal (seul
+ * a modifier l'arbre), puis les contenus des fichiers sont copies en
+ * parallele par les threads du pool.
  *
- * @param arg Chemin optionnel du repertoire a lister.
+ * @param src Chemin du repertoire source.
+ * @param dest Chemin de destination (ou repertoire existant).
  */
-void fs_ls_i(const char *arg) {
-    FileEntry *cible = NULL;
-    if (arg == NULL) {
-        cible = fs.current;
+void fs_cp_r(const char *src, const char *dest) {
+    FileEntry *racine = resolve_path(src, NULL);
+    if (!racine) {
+        printf("Source introuvable : %s\n", src);
+        return;
+    }
+    if (!racine->is_directory || racine->is_symbol) {
+        fs_cp(src, dest);
+        return;
+    }
+    char *copie = NULL;
+    FileEntry *new_parent = NULL;
+    char *new_name = NULL;
+    FileEntry *cible = resolve_path(dest, NULL);
+    if (cible && cible->is_directory) {
+        new_parent = cible;
+        copie = strdup(racine->name);
+        new_name = copie;
     } else {
-        cible = resolve_path(arg, NULL);
-        if (!cible) {
-            printf("Repertoire introuvable : %s\n", arg);
+        new_name = split_dest(dest, &copie, &new_parent);
+    }
+    if (!new_parent || !new_parent->is_directory || new_name[0] == '\0') {
+        printf("Destination invalide : %s\n", dest);
+        free(copie);
+        return;
+    }
+    if (snapshot_readonly(new_parent)) {
+        free(copie);
+        return;
+    }
+    if (find_entry(new_parent, new_name)) {
+        printf("Le nom de destination existe deja.\n");
+        free(copie);
+        return;
+    }
+    //Copier un repertoire dans lui-meme ne terminerait jamais
+    for (FileEntry *p = new_parent; p; p = p->parent) {
+        if (p == racine) {
+            printf("Impossible de copier '%s' dans lui-meme.\n", src);
+            free(copie);
             return;
         }
-        if (!cible->is_directory) {
-            printf("%d %s\n", cible->inode, cible->name);
-            return;
+    }
+
+    struct timespec debut, fin;
+    clock_gettime(CLOCK_MONOTONIC, &debut);
+
+    CopyPool pool = { NULL, 0, 0 };
+    int cap_jobs = 0;
+    long nb_fichiers = 0, nb_repertoires = 1;
+    long long octets = 0;
+
+    FileEntry *dst_racine = copy_entry_meta(racine, new_name);
+    add_entry(new_parent, dst_racine);
+    mark_dirty(new_parent, DIRTY_DATA);
+    free(copie);
+
+    //Parcours en largeur : un niveau = un lot de creations de repertoires
+    int cap = 16, nb = 1;
+    CopyJob *niveau = malloc(cap * sizeof(CopyJob));
+    niveau[0].src = racine;
+    niveau[0].dst = dst_racine;
+    while (nb > 0) {
+        int cap_suivant = 16, nb_suivant = 0;
+        CopyJob *suivant = malloc(cap_suivant * sizeof(CopyJob));
+        FileEntry **sources = malloc(nb * sizeof(FileEntry *));
+        for (int i = 0; i < nb; i++)
+            sources[i] = niveau[i].src;
+        load_children_batch(sources, nb);
+        free(sources);
+        for (int i = 0; i < nb; i++) {
+            FileEntry *child = niveau[i].src->child;
+            FileEntry *dernier = NULL;
+            while (child) {
+                //Ajout en queue pour conserver l'ordre de la source
+                FileEntry *e = copy_entry_meta(child, child->name);
+                e->parent = niveau[i].dst;
+                if (dernier)
+                    dernier->next = e;
+                else
+                    niveau[i].dst->child = e;
+                dernier = e;
+                if (child->is_symbol) {
+                    //Le lien est recopie tel quel, sans suivre la cible
+                } else if (child->is_directory) {
+                    nb_repertoires++;
+                    if (nb_suivant == cap_suivant) {
+                        cap_suivant *= 2;
+                        suivant = realloc(suivant, cap_suivant * sizeof(CopyJob));
+                    }
+                    suivant[nb_suivant].src = child;
+                    suivant[nb_suivant].dst = e;
+                    nb_suivant++;
+                } else {
+                    nb_fichiers++;
+                    octets += child->size;
+                    if (pool.nb_jobs == cap_jobs) {
+                        cap_jobs = cap_jobs ? cap_jobs * 2 : 64;
+                        pool.jobs = realloc(pool.jobs, cap_jobs * sizeof(CopyJob));
+                    }
+                    pool.jobs[pool.nb_jobs].src = child;
+                    pool.jobs[pool.nb_jobs].dst = e;
+                    pool.nb_jobs++;
+                }
+                child = child->next;
+            }
         }
+        free(niveau);
+        niveau = suivant;
+        nb = nb_suivant;
     }
-    FileEntry *child = cible->child;
-    while (child) {
-		if (child->is_symbol == 1){
-			printf("%d \033[1;36m%s\033[0m  ", child->inode, child->name);
-		}
-		else if (child->is_symbol == 2){
-			printf("%d \033[1;31m%s\033[0m  ", child->inode, child->name);
-		}
-		else if (child->is_directory){
-			printf("%d \033[1;34m%s\033[0m  ", child->inode, child->name);
-		}
-		else{
-			printf("%d \033[1;32m%s\033[0m  ", child->inode, child->name);
-		}
-        child = child->next;
+    free(niveau);
+
+    //Les threads de copie ne lisent pas la partition : contenus lus en un lot
+    FileEntry **fichiers = malloc((pool.nb_jobs ? pool.nb_jobs : 1) * sizeof(FileEntry *));
+    for (int i = 0; i < pool.nb_jobs; i++)
+        fichiers[i] = pool.jobs[i].src;
+    load_contents(fichiers, pool.nb_jobs);
+    free(fichiers);
+
+    //Copie des contenus en parallele
+    int nb_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_threads < 1)
+        nb_threads = 1;
+    if (nb_threads > CP_MAX_THREADS)
+        nb_threads = CP_MAX_THREADS;
+    if (nb_threads > pool.nb_jobs)
+        nb_threads = pool.nb_jobs;
+    pthread_t threads[CP_MAX_THREADS];
+    int lances = 0;
+    for (int i = 0; i < nb_threads; i++) {
+        if (pthread_create(&threads[lances], NULL, copy_worker, &pool) == 0)
+            lances++;
     }
-    printf("\n");
+    //Le thread principal participe aussi (et termine seul si aucun thread n'a demarre)
+    copy_worker(&pool);
+    for (int i = 0; i < lances; i++)
+        pthread_join(threads[i], NULL);
+    free(pool.jobs);
+
+    clock_gettime(CLOCK_MONOTONIC, &fin);
+    double secondes = (fin.tv_sec - debut.tv_sec) + (fin.tv_nsec - debut.tv_nsec) / 1e9;
+    if (secondes <= 0)
+        secondes = 1e-9;
+    printf("Copie recursive '%s' vers '%s' : %ld repertoires, %ld fichiers, %lld octets.\n",
+           src, dest, nb_repertoires, nb_fichiers, octets);
+    printf("Debit : %.0f fichiers/s, %.2f Mo/s (%d threads, %.3f ms)\n",
+           (nb_fichiers + nb_repertoires) / secondes, octets / secondes / (1024.0 * 1024.0),
+           lances + 1, secondes * 1000.0);
 }
 
-void fs_cat(const char *filename) {
-	FileEntry* copie = fs.current;
-    FileEntry *file = resolve_path(filename, NULL);
-    //Inexistant ou répertoire = dehors
-    if (!file || file->is_directory) {
-        printf("Fichier introuvable ou ce n'est pas un fichier.\n");
+/* --- Comparaison de sous-arbres (diff) --- */
+
+typedef struct DiffStats {
+    int differences;
+    int comparees;      // Paires d'entrees comparees
+    int identiques;     // Sous-arbres sautes grace a leur empreinte
+} DiffStats;
+
+static int cmp_entry_names(const void *a, const void *b) {
+    return strcmp((*(FileEntry * const *)a)->name, (*(FileEntry * const *)b)->name);
+}
+
+//Enfants d'un repertoire tries par nom
+static FileEntry **sorted_children(FileEntry *d, int *nb) {
+    load_children(d);
+    *nb = 0;
+    for (FileEntry *c = d->child; c; c = c->next)
+        (*nb)++;
+    FileEntry **t = malloc((*nb ? *nb : 1) * sizeof(FileEntry *));
+    int i = 0;
+    for (FileEntry *c = d->child; c; c = c->next)
+        t[i++] = c;
+    qsort(t, *nb, sizeof(FileEntry *), cmp_entry_names);
+    return t;
+}
+
+static char *diff_path(const char *chemin, const char *nom) {
+    size_t len = strlen(chemin) + strlen(nom) + 2;
+    char *s = malloc(len);
+    snprintf(s, len, "%s/%s", chemin, nom);
+    return s;
+}
+
+/**
+ * @brief Compare deux entrees de meme nom et affiche leurs differences.
+ *
+ * Des empreintes egales terminent la comparaison : seuls les chemins qui
+ * different sont parcourus. Les enfants sont apparies par une fusion des
+ * listes triees par nom.
+ */
+static void diff_entries(FileEntry *a, FileEntry *b, const char *chemin, DiffStats *st) {
+    st->comparees++;
+    if (entry_hash(a) == entry_hash(b)) {
+        st->identiques++;
         return;
     }
-    //Lien symbolique
-    if (file->is_symbol) {
-		fs.current = file->origin->parent; //Sert à vérifier que le fichier d'origine existe
-		//Lien mort
-        if (resolve_path(file->origin->name, NULL) == NULL){
-			printf("Le fichier d'origine n'existe plus.\n");
-			file->is_symbol = 2;
-			fs.current = copie;
-			return;
-		}
-		//Lien vivant
-		else{
-			if (file->origin->content){
-				printf("%s\n", file->origin->content);
-			}
-			file->is_symbol = 1;
-			fs.current = copie;
-			return;
-		}
+    if (!a->is_directory || a->is_symbol || !b->is_directory || b->is_symbol) {
+        printf("M %s\n", chemin);
+        st->differences++;
+        return;
     }
-    //Fichier
-    else{
-		if (file->content){
-			printf("%s\n", file->content);
-		}
-	}
+    if (a->perms != b->perms) {
+        printf("M %s (permissions)\n", chemin);
+        st->differences++;
+    }
+    int na, nb;
+    FileEntry **ta = sorted_children(a, &na);
+    FileEntry **tb = sorted_children(b, &nb);
+    int i = 0, j = 0;
+    while (i < na || j < nb) {
+        int cmp = i == na ? 1 : (j == nb ? -1 : strcmp(ta[i]->name, tb[j]->name));
+        char *sous = diff_path(chemin, cmp <= 0 ? ta[i]->name : tb[j]->name);
+        if (cmp < 0) {
+            printf("- %s\n", sous);
+            st->differences++;
+            i++;
+        } else if (cmp > 0) {
+            printf("+ %s\n", sous);
+            st->differences++;
+            j++;
+        } else {
+            diff_entries(ta[i++], tb[j++], sous, st);
+        }
+        free(sous);
+    }
+    free(ta);
+    free(tb);
 }
 
-/* 
- * Modification de fs_create : création d'un fichier avec taille par defaut, 
- * sans besoin de fournir la taille par l'utilisateur.
+/**
+ * @brief Affiche les differences entre deux sous-arbres (diff).
+ *
+ * - : seulement dans le premier, + : seulement dans le second, M : modifie.
+ * Le premier diff calcule les empreintes de tout ce qu'il visite ; les
+ * suivants ne recalculent que les chemins modifies entre-temps.
  */
-void fs_touch(const char *filename) {
-    if (find_entry(fs.current, filename)) {
-        printf("Le fichier existe deja.\n");
+void fs_diff(const char *pa, const char *pb) {
+    FileEntry *a = resolve_path(pa, NULL);
+    FileEntry *b = resolve_path(pb, NULL);
+    if (!a || !b) {
+        printf("Entree introuvable : %s\n", a ? pb : pa);
         return;
     }
-    FileEntry *file = malloc(sizeof(FileEntry));
-    file->inode = next_inode++;
-    file->is_symbol = 0;
-    file->origin = NULL;
-    file->name = strdup(filename);
-    file->is_directory = 0;
-    file->size = DEFAULT_FILE_SIZE;
-    file->link_count = 1;
-    file->perms = 6;  // rw par defaut
-    file->child = NULL;
-    file->next = NULL;
-    file->content = calloc(DEFAULT_FILE_SIZE + 1, sizeof(char));
-    add_entry(fs.current, file);
-    printf("Fichier '%s' cree avec une taille par defaut de %d octets.\n", filename, DEFAULT_FILE_SIZE);
+    DiffStats st = { 0, 0, 0 };
+    diff_entries(a, b, ".", &st);
+    printf("%d differences, %d paires comparees, %d sous-arbres identiques sautes.\n",
+           st.differences, st.comparees, st.identiques);
 }
 
-/*
- * Commande write modifiee : prend en argument le nom du fichier et le texte.
- * Elle ouvre le fichier en ecriture, écrit le texte et ferme le fichier automatiquement.
+/* --- Instantanes : commandes --- */
+
+Snapshot* snapshot_find(const char *name) {
+    for (Snapshot *s = snapshots; s; s = s->next) {
+        if (strcmp(s->name, name) == 0)
+            return s;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Fige tout l'arbre en temps constant (snapshot create).
+ *
+ * Seule l'epoque courante est notee : les entrees sont copiees plus tard,
+ * par les modifications qui les touchent.
  */
-void fs_write_cmd(const char *filename, const char *texte) {
-	FileEntry* copie = fs.current;
-	FileEntry* file = resolve_path(filename, NULL);
-	int fd;
-	//Lien symbolique
-	if(file->is_symbol){
-		fs.current = file->origin->parent; //On se déplace dans le dossier du fichier d'origine sinon ça ne marche pas
-		//Lien mort
-		if (resolve_path(file->origin->name, NULL) == NULL){
-			printf("Le fichier d'origine n'existe plus.\n");
-			file->is_symbol = 2;
-			fs.current = copie;
-			return;
-		}
-		//Lien vivant
-		else{
-			fd = fs_open(file->origin->name, 2);
-			file->is_symbol = 1;
-		}
-	}
-	//Pas un lien symbolique
-	else{
-		fd = fs_open(filename, 2);
-	}
-	//Traitement
-    if (fd < 0) {
-        printf("Ecriture impossible, fichier introuvable ou permissions insuffisantes.\n");
+void fs_snapshot_create(const char *name) {
+    if (snapshot_find(name)) {
+        printf("Un instantane porte deja ce nom : %s\n", name);
         return;
     }
-    int written = fs_write(fd, texte);
-    if (written >= 0)
-        printf("Ecriture de %d octets dans '%s'.\n", written, filename);
-    fs_close(fd);
-    fs.current = copie;
+    Snapshot *s = malloc(sizeof(Snapshot));
+    s->name = strdup(name);
+    s->epoch = snap_epoch++;
+    s->root = fs.root;
+    s->next = snapshots;
+    snapshots = s;
+    printf("Instantane '%s' cree.\n", name);
 }
 
-/*
- * Commande mv, chmod, link, ln, unlink, rm, fsck restent identiques.
+/**
+ * @brief Expose un instantane en lecture seule sous un chemin (snapshot mount).
+ *
+ * Seule la racine de la vue est creee ; le reste est recopie au premier
+ * acces depuis les versions de l'instantane. La vue n'est pas persistee et
+ * se demonte avec rm -r.
  */
-
-void fs_chmod(const char *perm_str, const char *path) {
-    int perm = atoi(perm_str);
-    FileEntry *entry = resolve_path(path, NULL);
-    if (!entry) {
-        printf("Entree introuvable : %s\n", path);
+void fs_snapshot_mount(const char *name, const char *path) {
+    Snapshot *s = snapshot_find(name);
+    if (!s) {
+        printf("Instantane introuvable : %s\n", name);
         return;
     }
-    //Lien symbolique = dehors
-    if(entry->is_symbol == 1|| entry->is_symbol == 2){ //Pas d'espace entre le 1 et la barre, sinon ça compile pas
-		printf("Interdiction de modifier les droits d'un lien symbolique\n");
-	}
-	//Fichier
-	else{
-		//Permission entre 0 et 7 = impossible de mettre 777777777
-		if(perm > -1 && perm < 8){
-			entry->perms = perm;
-			printf("Les permissions de '%s' sont definies a %d.\n", entry->name, perm);
-		}
-		else{
-			printf("%d n'est pas compris entre 0 et 7.\n", perm);
-		}
-	}
+    char *copie = NULL;
+    FileEntry *parent = NULL;
+    char *nom = split_dest(path, &copie, &parent);
+    if (!parent || !parent->is_directory || parent->is_symbol || nom[0] == '\0') {
+        printf("Destination invalide : %s\n", path);
+        free(copie);
+        return;
+    }
+    if (snapshot_readonly(parent)) {
+        free(copie);
+        return;
+    }
+    if (find_entry(parent, nom)) {
+        printf("Le nom de destination existe deja.\n");
+        free(copie);
+        return;
+    }
+    add_entry(parent, snapshot_view_entry(s->root, s->root, s->epoch, nom));
+    printf("Instantane '%s' monte en lecture seule sur '%s'.\n", name, path);
+    free(copie);
 }
 
-void fs_ln(const char *src, const char *dest) {
-    FileEntry *file = resolve_path(src, NULL);
-    if (!file || file->is_directory) {
-        printf("Fichier source introuvable ou ce n'est pas un fichier.\n");
+//Une vue de l'instantane d'epoque epoch est-elle montee sous e ?
+static int snapshot_mounted(FileEntry *e, unsigned long epoch) {
+    for (FileEntry *c = e->is_symbol ? NULL : e->child; c; c = c->next) {
+        if (c->source ? c->source_epoch == epoch : snapshot_mounted(c, epoch))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Supprime un instantane (snapshot delete).
+ *
+ * Les versions figees ne sont liberees qu'avec le dernier instantane : une
+ * version peut servir a plusieurs.
+ */
+void fs_snapshot_delete(const char *name) {
+    Snapshot **cur = &snapshots;
+    while (*cur && strcmp((*cur)->name, name) != 0)
+        cur = &(*cur)->next;
+    if (!*cur) {
+        printf("Instantane introuvable : %s\n", name);
         return;
     }
-    if (find_entry(fs.current, dest)) {
-        printf("Le nom de destination existe deja.\n");
+    Snapshot *s = *cur;
+    if (snapshot_mounted(fs.root, s->epoch)) {
+        printf("Instantane '%s' monte : retirez d'abord sa vue (rm -r).\n", name);
         return;
     }
-    file->link_count++;
-    FileEntry *nouveau_lien = malloc(sizeof(FileEntry));
-    nouveau_lien->inode = file->inode; // même inode pour lien physique
-    nouveau_lien->is_symbol = 0;
-    nouveau_lien->origin = NULL;
-    nouveau_lien->name = strdup(dest);
-    nouveau_lien->is_directory = 0;
-    nouveau_lien->size = file->size;
-    nouveau_lien->content = file->content;
-    nouveau_lien->link_count = file->link_count;
-    nouveau_lien->perms = file->perms;
-    nouveau_lien->child = NULL;
-    nouveau_lien->next = NULL;
-    add_entry(fs.current, nouveau_lien);
-    printf("Lien physique '%s' cree pour '%s'.\n", dest, src);
+    *cur = s->next;
+    free(s->name);
+    free(s);
+    if (!snapshots)
+        snapshot_release();
+    printf("Instantane '%s' supprime.\n", name);
+}
+
+void fs_snapshot_list() {
+    if (!snapshots)
+        printf("Aucun instantane.\n");
+    for (Snapshot *s = snapshots; s; s = s->next)
+        printf("%s (epoque %lu)\n", s->name, s->epoch);
+    printf("%lu versions figees, %d entrees supprimees conservees.\n", snap_copies, snap_nb_removed);
+}
+
+#define FSCK_DEFAULT_THREADS 8   // Sans argument : un thread par coeur, 8 au plus
+
+/**
+ * @brief Verifie la partition montee avec nb_threads threads (fsck.c) :
+ * compteurs de liens, parents, orphelins, liens symboliques et blocs. Avec
+ * reparer, les incoherences sont corrigees et l'arbre est recharge.
+ */
+void fs_fsck_disk(int reparer, int nb_threads) {
+    if (reparer && (part.flags & FS_MOUNT_RDONLY)) {
+        printf("Partition montee en lecture seule : reparation impossible.\n");
+        return;
+    }
+    //Tout ce que l'arbre retient encore est ecrit avant de relire le disque
+    defrag_stop();
+    reclaim_drain();
+    fs_flush();
+    pthread_mutex_lock(&part.lock);
+    if (part.journal.enabled)
+        journal_commit(&part);
+    fsck_report r;
+    fsck_run(&part, nb_threads, reparer, &r);
+    fsck_print(&r, reparer);
+    if (part.sb.features & FS_FEATURE_DEDUP) {
+        //Toute la table des references est relue : un compteur sur un bloc libre est incoherent
+        uint32_t partages, incoherents;
+        uint64_t refs = dedup_count(&part, &partages, &incoherents), economises;
+        double taux = dedup_ratio(&part, &economises);
+        printf("FSCK : Deduplication : %u blocs partages, %llu references en plus, taux %.2f, %llu octets economises\n",
+               partages, (unsigned long long)refs, taux, (unsigned long long)economises * FS_BLOCK_SIZE);
+        if (incoherents)
+            printf("FSCK : %u blocs libres ont encore des references\n", incoherents);
+    }
+    pthread_mutex_unlock(&part.lock);
+    if (reparer && r.repares) {
+        //Les entrees chargees peuvent designer des inodes deplaces ou retires
+        mkfs_tree(FS_ROOT_INODE);
+        fs.root->loaded = 0;
+        load_children(fs.root);
+        printf("FSCK : arborescence rechargee depuis la partition.\n");
+    }
 }
 
-void fs_ln_s(const char *src, const char *dest) {
-    FileEntry *file = resolve_path(src, NULL);
-    if (!file) {
-        printf("Source introuvable.\n");
+/**
+ * @brief Verifie le systeme de fichiers : sur une partition, verification
+ * complete (fs_fsck_disk) ; en memoire, decompte des fichiers et repertoires.
+ */
+void fs_fsck(int reparer, int nb_threads) {
+    if (disk_mode) {
+        fs_fsck_disk(reparer, nb_threads);
         return;
     }
-    if (find_entry(fs.current, dest)) {
-        printf("Le nom de destination existe deja.\n");
+    int fichiers = 0, repertoires = 0;
+    //Parcours en largeur : les repertoires d'un niveau sont charges en un lot
+    int cap = 16, nb = 1;
+    FileEntry **niveau = malloc(cap * sizeof(FileEntry *));
+    niveau[0] = fs.root;
+    while (nb > 0) {
+        load_children_batch(niveau, nb);
+        int cap_suivant = 16, nb_suivant = 0;
+        FileEntry **suivant = malloc(cap_suivant * sizeof(FileEntry *));
+        for (int i = 0; i < nb; i++) {
+            repertoires++;
+            for (FileEntry *child = niveau[i]->child; child; child = child->next) {
+                //Les vues d'instantane ne sont pas sur la partition
+                if (child->source)
+                    continue;
+                if (!child->is_directory) {
+                    fichiers++;
+                    continue;
+                }
+                if (nb_suivant == cap_suivant) {
+                    cap_suivant *= 2;
+                    suivant = realloc(suivant, cap_suivant * sizeof(FileEntry *));
+                }
+                suivant[nb_suivant++] = child;
+            }
+        }
+        free(niveau);
+        niveau = suivant;
+        nb = nb_suivant;
+    }
+    free(niveau);
+    printf("FSCK : Repertoires : %d, Fichiers : %d\n", repertoires, fichiers);
+    if (reparer)
+        printf("FSCK : arbre en memoire, rien a reparer.\n");
+}
+
+/**
+ * @brief Affiche l'occupation de la partition et le gain de la deduplication.
+ */
+void fs_df() {
+    if (!disk_mode) {
+        printf("df disponible seulement avec une partition montee.\n");
         return;
     }
-    FileEntry *nouveau_lien = malloc(sizeof(FileEntry));
-    nouveau_lien->inode = next_inode++;
-    nouveau_lien->is_symbol = 1;
-    nouveau_lien->origin = file;
-    nouveau_lien->nom_origin = build_path(nouveau_lien->origin);
-    nouveau_lien->name = strdup(dest);
-    nouveau_lien->is_directory = file->is_directory;
-    nouveau_lien->size = file->size;
-    nouveau_lien->content = NULL;
-    nouveau_lien->link_count = 1;
-    nouveau_lien->perms = 7;
-    nouveau_lien->child = NULL;
-    nouveau_lien->next = NULL;
-    nouveau_lien->parent = fs.current;
-    add_entry(fs.current, nouveau_lien);
-    printf("Lien symbolique '%s' cree pour '%s'.\n", dest, src);
+    fs_flush();
+    pthread_mutex_lock(&part.lock);
+    superblock *sb = &part.sb;
+    uint32_t donnees = sb->nb_blocks - sb->data_start;
+    uint32_t utilises = donnees - sb->free_blocks;
+    printf("Blocs de donnees : %u utilises, %u libres sur %u (%.0f %%), %d Kio par bloc\n", utilises,
+           sb->free_blocks, donnees, donnees ? 100.0 * utilises / donnees : 0.0, FS_BLOCK_SIZE / 1024);
+    printf("Inodes : %u utilises, %u libres sur %u\n", sb->nb_inodes - sb->free_inodes, sb->free_inodes,
+           sb->nb_inodes);
+    if (sb->features & FS_FEATURE_DEDUP) {
+        uint64_t economises;
+        double taux = dedup_ratio(&part, &economises);
+        printf("Deduplication : %s, taux %.2f, %llu octets economises (%.1f Mio)\n",
+               part.dedup.cases ? "active" : "inactive (--dedup)", taux,
+               (unsigned long long)economises * FS_BLOCK_SIZE, economises * FS_BLOCK_SIZE / (1024.0 * 1024.0));
+    }
+    else
+        printf("Deduplication : indisponible (image formatee avant la table des references)\n");
+    pthread_mutex_unlock(&part.lock);
 }
 
-/*void fs_unlink(const char *filename) {
-    FileEntry *file = resolve_path(filename, NULL);
-    if (!file || file->is_directory) {
-        printf("Fichier introuvable ou ce n'est pas un fichier.\n");
+/**
+ * @brief Lance la defragmentation en arriere-plan.
+ *
+ * @param rate   Debit maximal de recopie en Mio/s (0 : sans limite).
+ * @param shrink 1 pour reduire l'image a la fin de la passe.
+ */
+void fs_defrag(double rate, int shrink) {
+    if (!disk_mode) {
+        printf("defrag disponible seulement avec une partition montee.\n");
         return;
     }
-    if (!file->parent) {
-        printf("Impossible de supprimer la racine.\n");
+    if (defrag_running) {
+        printf("Une defragmentation est deja en cours (defrag status, defrag stop).\n");
         return;
     }
-    FileEntry **courant = &file->parent->child;
-    while (*courant) {
-        if (*courant == file) {
-            *courant = file->next;
-            file->link_count--;
-            if (file->link_count == 0) {
-                free(file->name);
-                if (file->content)
-                    free(file->content);
-                free(file);
-            }
-            printf("Lien supprime pour '%s'.\n", filename);
-            return;
-        }
-        courant = &(*courant)->next;
+    if (shrink && part.map) {
+        printf("Reduction de l'image impossible en mode mmap.\n");
+        return;
     }
-}*/
-
-void fs_rm(const char *path) {
-    FileEntry *parent = NULL;
-    FileEntry *entry = resolve_path(path, &parent);
-    if (!entry) {
-        printf("Entree introuvable : %s\n", path);
+    //Les modifications en attente sont ecrites pour etre defragmentees aussi
+    fs_flush();
+    pthread_mutex_lock(&defrag_lock);
+    defrag_rate = rate;
+    defrag_shrink = shrink;
+    defrag_stop_req = defrag_finished = 0;
+    defrag_total = defrag_vus = defrag_erreurs = defrag_rendus = 0;
+    defrag_blocs = 0;
+    defrag_nb_moves = 0;
+    memset(&defrag_avant, 0, sizeof(defrag_avant));
+    memset(&defrag_apres, 0, sizeof(defrag_apres));
+    defrag_debut = defrag_now();
+    pthread_mutex_unlock(&defrag_lock);
+    if (pthread_create(&defrag_thread, NULL, defrag_worker, NULL) != 0) {
+        printf("Thread de defragmentation indisponible.\n");
         return;
     }
-    if (!parent) {
-        printf("Impossible de supprimer la racine.\n");
+    defrag_running = 1;
+    if (rate > 0)
+        printf("Defragmentation lancee en arriere-plan (%.1f Mio/s%s).\n", rate, shrink ? ", reduction de l'image" : "");
+    else
+        printf("Defragmentation lancee en arriere-plan (sans limite de debit%s).\n",
+               shrink ? ", reduction de l'image" : "");
+}
+
+void fs_defrag_status() {
+    if (defrag_poll())
+        return;
+    if (!defrag_running) {
+        if (defrag_debut == 0)
+            printf("Aucune defragmentation lancee.\n");
+        else
+            defrag_report();
         return;
     }
-    if (entry->is_directory && entry->child != NULL) {
-        printf("Le repertoire n'est pas vide : %s\n", path);
+    pthread_mutex_lock(&defrag_lock);
+    printf("Defragmentation en cours : %u/%u inodes examines, %llu blocs recopies en %.2f s\n",
+           defrag_vus, defrag_total, (unsigned long long)defrag_blocs, defrag_now() - defrag_debut);
+    pthread_mutex_unlock(&defrag_lock);
+}
+
+/* --- Verification continue --- */
+
+#define SCRUB_DEFAULT_RATE 8     // Debit par defaut (Mio/s)
+#define SCRUB_DEFAULT_IOPS 256   // Lectures par seconde par defaut
+
+/**
+ * @brief Lance (ou reregle) la verification continue de la partition
+ * montee, avec un budget de rate Mio/s et iops lectures par seconde (0 :
+ * sans limite). Elle reprend a la position gardee dans le superbloc.
+ */
+void fs_scrub(double rate, uint32_t iops) {
+    if (!disk_mode) {
+        printf("scrub disponible seulement avec une partition montee.\n");
         return;
     }
-    FileEntry **courant = &parent->child;
-    while (*courant) {
-        if (*courant == entry) {
-            *courant = entry->next;
-            free(entry->name);
-            if (entry->content)
-                free(entry->content);
-            free(entry);
-            printf("Supprime : %s\n", path);
-            return;
-        }
-        courant = &(*courant)->next;
+    pthread_mutex_lock(&part.lock);
+    uint32_t debut = part.sb.scrub_cursor < part.sb.nb_blocks ? part.sb.scrub_cursor : 0;
+    pthread_mutex_unlock(&part.lock);
+    int ret = scrub_start(&part, rate, iops);
+    if (ret < 0) {
+        printf("Thread de verification indisponible.\n");
+        return;
     }
+    char limite[64] = "sans limite";
+    if (rate > 0 || iops > 0)
+        snprintf(limite, sizeof(limite), "%.1f Mio/s, %u lectures/s", rate, iops);
+    if (ret == 1)
+        printf("Verification continue deja active : budget change (%s).\n", limite);
+    else
+        printf("Verification continue lancee au bloc %u/%u (%s).\n", debut, part.sb.nb_blocks, limite);
 }
 
-void fs_mv(const char *src, const char *dest) {
-    FileEntry *parent = NULL;
-    FileEntry *entry = resolve_path(src, &parent);
-    if (!entry) {
-        printf("Source introuvable : %s\n", src);
+/**
+ * @brief Affiche la progression et les erreurs de la verification continue.
+ */
+void fs_scrub_status() {
+    if (!disk_mode) {
+        printf("scrub disponible seulement avec une partition montee.\n");
         return;
     }
-    char *dest_copy = strdup(dest);
-    char *last_slash = strrchr(dest_copy, '/');
-    FileEntry *new_parent = NULL;
-    char *new_name = NULL;
-    if (last_slash) {
-        *last_slash = '\0';
-        new_name = last_slash + 1;
-        new_parent = resolve_path(dest_copy, NULL);
-        if (!new_parent || !new_parent->is_directory) {
-            printf("Destination invalide : %s\n", dest_copy);
-            free(dest_copy);
-            return;
+    pthread_mutex_lock(&part.lock);
+    scrub_stats(&part);
+    pthread_mutex_unlock(&part.lock);
+}
+
+/* --- Point de controle par fork (mode memoire) --- */
+
+#define CHECKPOINT_DEFAULT_IMAGE "checkpoint.fs"
+
+typedef struct CheckpointResult {
+    int status;             // 0 si l'image a ete ecrite
+    double duree;           // Duree de l'ecriture dans le fils (s)
+    long cow_kb;            // Memoire privee modifiee du fils depuis le fork
+    long entrees;
+    long long octets;
+} CheckpointResult;
+
+pid_t checkpoint_pid = 0;   // Fils en cours, 0 si aucun
+int checkpoint_fd = -1;     // Lecture du resultat envoye par le fils
+double checkpoint_debut = 0;
+double checkpoint_pause = 0; // Duree du fork() vue par le pere
+char checkpoint_image[256];
+
+static double checkpoint_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Memoire privee modifiee du processus (Private_Dirty, en Kio).
+ *
+ * Juste apres le fork, toutes les pages sont partagees avec le pere : ce
+ * qui devient prive ensuite a ete copie a l'ecriture (par le pere ou le fils)
+ * ou alloue par le fils.
+ */
+static long private_dirty_kb() {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f)
+        f = fopen("/proc/self/smaps", "r");
+    if (!f)
+        return 0;
+    char ligne[256];
+    long total = 0, kb;
+    while (fgets(ligne, sizeof(ligne), f)) {
+        if (sscanf(ligne, "Private_Dirty: %ld kB", &kb) == 1)
+            total += kb;
+    }
+    fclose(f);
+    return total;
+}
+
+static void checkpoint_count(FileEntry *e, long *entrees, long long *octets) {
+    (*entrees)++;
+    if (e->is_symbol)
+        *octets += e->nom_origin ? strlen(e->nom_origin) : 0;
+    else if (e->is_directory) {
+        for (FileEntry *c = e->child; c; c = c->next) {
+            if (c->source)
+                continue;
+            *octets += sizeof(disk_dirent);
+            checkpoint_count(c, entrees, octets);
+        }
+    } else
+        *octets += e->size;
+}
+
+//Inode de l'image pour un inode de l'arbre (les liens physiques partagent le meme)
+static uint32_t checkpoint_inode(filesystem *ck, uint32_t *map, FileEntry *e) {
+    if (!map[e->inode])
+        map[e->inode] = alloc_inode(ck);
+    return map[e->inode];
+}
+
+/**
+ * @brief Ecrit une entree et ses descendants dans l'image du point de controle.
+ *
+ * L'arbre n'est jamais modifie : le fils ne copie ainsi que les pages
+ * touchees par le pere pendant l'ecriture. Les vues d'instantane montees
+ * sont sautees. Un inode a plusieurs liens physiques n'est ecrit qu'une
+ * fois : ecrits garde un bit par inode de l'arbre deja ecrit.
+ */
+static int checkpoint_entry(filesystem *ck, uint32_t *map, uint8_t *ecrits, FileEntry *e, uint32_t parent) {
+    if (ecrits[e->inode / 8] & (1 << (e->inode % 8)))
+        return 0;
+    ecrits[e->inode / 8] |= 1 << (e->inode % 8);
+    uint32_t ino = map[e->inode];
+    disk_inode di;
+    memset(&di, 0, sizeof(di));
+    di.type = e->is_symbol ? FS_TYPE_SYMLINK : (e->is_directory ? FS_TYPE_DIR : FS_TYPE_FILE);
+    di.perms = e->perms;
+    di.links = entry_links(e) > 0 ? entry_links(e) : 1;
+    di.parent = parent;
+    if (e->is_symbol && e->is_directory)
+        di.flags |= FS_INODE_SYMLINK_DIR;
+    if (e->is_symbol == 2)
+        di.flags |= FS_INODE_DEAD_LINK;
+    if (!e->is_symbol && !e->is_directory && e->compress)
+        di.flags |= FS_INODE_COMPRESS | FS_INODE_COMPRESSED;
+    int ret = 0;
+    if (e->is_symbol) {
+        const char *cible = e->nom_origin ? e->nom_origin : "";
+        ret = write_inode_data(ck, ino, &di, cible, strlen(cible));
+    } else if (e->is_directory) {
+        int nb = 0;
+        for (FileEntry *c = e->child; c; c = c->next)
+            nb++;
+        disk_dirent *entrees = calloc(nb ? nb : 1, sizeof(disk_dirent));
+        int i = 0;
+        for (FileEntry *c = e->child; c; c = c->next) {
+            if (c->source)
+                continue;
+            uint32_t ino_enfant = checkpoint_inode(ck, map, c);
+            if (ino_enfant == 0) {
+                ret = -1;
+                break;
+            }
+            size_t len = strlen(c->name);
+            if (len > FS_NAME_MAX)
+                len = FS_NAME_MAX;
+            entrees[i].inode = ino_enfant;
+            entrees[i].type = c->is_symbol ? FS_TYPE_SYMLINK : (c->is_directory ? FS_TYPE_DIR : FS_TYPE_FILE);
+            entrees[i].name_len = len;
+            memcpy(entrees[i].name, c->name, len);
+            i++;
         }
+        if (ret == 0)
+            ret = write_inode_data(ck, ino, &di, entrees, i * sizeof(disk_dirent));
+        free(entrees);
     } else {
-        new_parent = parent;
-        new_name = dest_copy;
+        ret = write_inode_data(ck, ino, &di, e->content, e->content ? e->size : 0);
     }
-    FileEntry **cur = &parent->child;
-    while (*cur) {
-        if (*cur == entry) {
-            *cur = entry->next;
-            break;
+    if (ret < 0 || write_inode(ck, ino, &di) < 0)
+        return -1;
+    if (e->is_directory && !e->is_symbol) {
+        for (FileEntry *c = e->child; c; c = c->next) {
+            if (!c->source && checkpoint_entry(ck, map, ecrits, c, ino) < 0)
+                return -1;
         }
-        cur = &(*cur)->next;
     }
-    free(entry->name);
-    entry->name = strdup(new_name);
-    entry->parent = new_parent;
-    add_entry(new_parent, entry);
-    printf("Deplace '%s' vers '%s'.\n", src, dest);
-    free(dest_copy);
+    return 0;
 }
 
-void fs_fsck() {
-    int fichiers = 0, repertoires = 0;
-    void fsck_helper(FileEntry *entry) {
-        if (!entry) return;
-        if (entry->is_directory) {
-            repertoires++;
-            FileEntry *child = entry->child;
-            while (child) {
-                fsck_helper(child);
-                child = child->next;
-            }
-        } else {
-            fichiers++;
-        }
+/**
+ * @brief Travail du fils : ecrit l'arbre fige dans une image de partition.
+ *
+ * L'image est ecrite a cote puis renommee, pour qu'un point de controle
+ * interrompu ne remplace jamais le precedent. Elle se monte ensuite avec
+ * ./main <image>. La memoire copiee est mesuree apres les allocations du
+ * fils (image, table des inodes), et avant le demontage : les tampons
+ * d'ecriture liberes en route sont reutilises et ne comptent presque pas.
+ */
+static void checkpoint_child(const char *image, int fd) {
+    CheckpointResult res = { -1, 0, 0, 0, 0 };
+    double debut = checkpoint_now();
+    checkpoint_count(fs.root, &res.entrees, &res.octets);
+    //Quatre blocs par inode (ratio du formatage), plus les donnees et les repertoires
+    size_t blocs = 4 * (res.entrees + 1) + 2 * (res.octets / FS_BLOCK_SIZE + res.entrees) + 1024;
+    size_t taille = blocs * FS_BLOCK_SIZE;
+    if (taille < DEFAULT_PARTITION_SIZE)
+        taille = DEFAULT_PARTITION_SIZE;
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", image);
+    unlink(tmp);
+    filesystem ck;
+    uint32_t *map = calloc(next_inode + 1, sizeof(uint32_t));
+    uint8_t *ecrits = calloc(next_inode / 8 + 1, 1);
+    if (mount_partition(&ck, tmp, 0) == 1 && format_partition(&ck, taille) == 0) {
+        map[fs.root->inode] = FS_ROOT_INODE;
+        long base = private_dirty_kb();
+        int ret = checkpoint_entry(&ck, map, ecrits, fs.root, FS_ROOT_INODE);
+        res.cow_kb = private_dirty_kb() - base;
+        if (unmount_partition(&ck) == 0 && ret == 0 && rename(tmp, image) == 0)
+            res.status = 0;
     }
-    fsck_helper(fs.root);
-    printf("FSCK : Repertoires : %d, Fichiers : %d\n", repertoires, fichiers);
+    free(ecrits);
+    free(map);
+    res.duree = checkpoint_now() - debut;
+    if (write(fd, &res, sizeof(res)) != sizeof(res))
+        res.status = -1;
+    close(fd);
+}
+
+/**
+ * @brief Lance un point de controle en arriere-plan (comme BGSAVE de Redis).
+ *
+ * Le fils herite d'une copie figee de l'arbre grace a la copie a l'ecriture
+ * du noyau ; le pere ne s'arrete que le temps du fork() et continue a
+ * traiter les commandes. Le resultat est affiche par checkpoint_poll().
+ *
+ * @param image Chemin de l'image a ecrire (checkpoint.fs par defaut).
+ */
+void fs_checkpoint(const char *image) {
+    if (disk_mode) {
+        printf("Point de controle reserve au mode memoire : la partition est deja persistante.\n");
+        return;
+    }
+    if (checkpoint_pid) {
+        printf("Un point de controle est deja en cours (pid %d).\n", (int)checkpoint_pid);
+        return;
+    }
+    if (!image)
+        image = CHECKPOINT_DEFAULT_IMAGE;
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("Erreur : pipe");
+        return;
+    }
+    //Sinon le tampon de stdout serait aussi vide par le fils
+    fflush(stdout);
+    double debut = checkpoint_now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        //Le fils ne doit pas ecrire au milieu de l'invite du pere
+        int nul = open("/dev/null", O_WRONLY);
+        if (nul >= 0)
+            dup2(nul, STDOUT_FILENO);
+        checkpoint_child(image, fds[1]);
+        _exit(0);
+    }
+    double fin = checkpoint_now();
+    close(fds[1]);
+    if (pid < 0) {
+        perror("Erreur : fork");
+        close(fds[0]);
+        return;
+    }
+    checkpoint_pid = pid;
+    checkpoint_fd = fds[0];
+    checkpoint_debut = debut;
+    checkpoint_pause = fin - debut;
+    snprintf(checkpoint_image, sizeof(checkpoint_image), "%s", image);
+    printf("Point de controle vers '%s' en arriere-plan (pid %d), pause %.3f ms.\n",
+           image, (int)pid, checkpoint_pause * 1000.0);
+}
+
+/**
+ * @brief Recupere le fils d'un point de controle termine et affiche le bilan.
+ *
+ * @param bloquant 1 pour attendre la fin du fils (a la sortie du programme).
+ */
+void checkpoint_poll(int bloquant) {
+    if (!checkpoint_pid)
+        return;
+    int statut;
+    if (waitpid(checkpoint_pid, &statut, bloquant ? 0 : WNOHANG) <= 0)
+        return;
+    CheckpointResult res;
+    if (read(checkpoint_fd, &res, sizeof(res)) != sizeof(res))
+        res.status = -1;
+    close(checkpoint_fd);
+    checkpoint_pid = 0;
+    checkpoint_fd = -1;
+    if (res.status < 0) {
+        printf("Echec du point de controle vers '%s'.\n", checkpoint_image);
+        return;
+    }
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    printf("Point de controle '%s' termine : %ld entrees, %lld octets, ecriture %.1f ms "
+           "(total %.1f ms), pause %.3f ms, %ld pages copiees a l'ecriture (%ld Kio).\n",
+           checkpoint_image, res.entrees, res.octets, res.duree * 1000.0,
+           (checkpoint_now() - checkpoint_debut) * 1000.0, checkpoint_pause * 1000.0,
+           res.cow_kb / (page_kb ? page_kb : 4), res.cow_kb);
 }
 
 /* --- Boucle principale --- */
 
-int main() {
+int main(int argc, char *argv[]) {
     char commande[512];
-    mkfs();  // Formatage initial
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0)
+            mount_flags |= FS_MOUNT_MMAP;
+        else if (strncmp(argv[i], "--cache=", 8) == 0)
+            cache_limit = (size_t)atol(argv[i] + 8) * 1024 * 1024;
+        else if (strncmp(argv[i], "--pagecache=", 12) == 0)
+            pcache_limit = (size_t)atol(argv[i] + 12) * 1024 * 1024;
+        else if (strncmp(argv[i], "--writeback=", 12) == 0)
+            wb_expire_ms = atoi(argv[i] + 12);
+        else if (strcmp(argv[i], "--fsync-on-close") == 0)
+            fsync_on_close = 1;
+        else if (strcmp(argv[i], "--no-csum") == 0)
+            mount_flags |= FS_MOUNT_NO_CSUM;
+        else if (strcmp(argv[i], "--compress") == 0)
+            compress_all = 1;
+        else if (strcmp(argv[i], "--dedup") == 0)
+            mount_flags |= FS_MOUNT_DEDUP;
+        else if (strcmp(argv[i], "--cdc") == 0)
+            mount_flags |= FS_MOUNT_CDC;
+        else if (strncmp(argv[i], "--io=", 5) == 0) {
+            const char *mode = argv[i] + 5;
+            if (strcmp(mode, "sync") == 0)
+                mount_flags |= FS_MOUNT_SYNC_IO;
+            else if (strcmp(mode, "uring") == 0)
+                mount_flags &= ~FS_MOUNT_SYNC_IO;
+            else {
+                printf("Backend d'E/S inconnu : %s (sync ou uring)\n", mode);
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--durability=", 13) == 0) {
+            const char *mode = argv[i] + 13;
+            if (strcmp(mode, "sync") == 0)
+                durability = DURABILITY_SYNC;
+            else if (strcmp(mode, "group") == 0)
+                durability = DURABILITY_GROUP;
+            else if (strcmp(mode, "async") == 0)
+                durability = DURABILITY_ASYNC;
+            else {
+                printf("Mode de durabilite inconnu : %s (sync, group ou async)\n", mode);
+                return 1;
+            }
+        }
+        else
+            image_path = argv[i];
+    }
+    if (image_path) {
+        //Mode disque : l'image donnee est montee (et formatee si besoin)
+        if (fs_mount(image_path) < 0) {
+            printf("Impossible de monter la partition '%s'.\n", image_path);
+            return 1;
+        }
+    } else {
+        mkfs();  // Formatage initial
+    }
 
     printf("Systeme de fichiers simple. Tapez 'help' pour la liste des commandes.\n");
+    pthread_mutex_lock(&tree_lock);
     while (1) {
+        //Les modifications sont ecrites par le thread d'ecriture differee
+        writeback_throttle();
+        cache_trim();
+        checkpoint_poll(0);
+        defrag_poll();
         char *chemin = build_path(fs.current);
         printf("\033[1;32mhebcfs\033[0m:\033[1;34m%s\033[0m> ", chemin);
         free(chemin);
 
-        if (!fgets(commande, sizeof(commande), stdin))
+        //Le thread d'ecriture differee travaille pendant l'attente de la saisie
+        fflush(stdout);
+        pthread_mutex_unlock(&tree_lock);
+        char *lu = fgets(commande, sizeof(commande), stdin);
+        pthread_mutex_lock(&tree_lock);
+        if (!lu)
             break;
         commande[strcspn(commande, "\n")] = 0;
         char *token = strtok(commande, " ");
@@ -1043,7 +4601,23 @@ int main() {
                 printf("Usage : write <fichier> <texte>\n");
                 continue;
             }
-            fs_write_cmd(fichier, texte);
+            fs_write_cmd(fichier, texte, 0);
+        }
+        else if (strcmp(token, "append") == 0) {
+            char *fichier = strtok(NULL, " ");
+            char *texte = strtok(NULL, "");
+            if (!fichier || !texte) {
+                printf("Usage : append <fichier> <texte>\n");
+                continue;
+            }
+            fs_write_cmd(fichier, texte, 1);
+        }
+        else if (strcmp(token, "sync") == 0) {
+            if (!disk_mode) {
+                printf("Aucune partition montee.\n");
+                continue;
+            }
+            fs_sync();
         }
         else if (strcmp(token, "lseek") == 0) {
             // Optionnel : peut rester accessible si besoin de repositionner le curseur via un script backend.
@@ -1059,8 +4633,20 @@ int main() {
         }
         else if (strcmp(token, "mkdir") == 0) {
             char *dir = strtok(NULL, " ");
+            if (dir && strcmp(dir, "-p") == 0) {
+                char *chemins[sizeof(commande) / 2];
+                int nb = 0;
+                while ((dir = strtok(NULL, " ")) != NULL)
+                    chemins[nb++] = dir;
+                if (nb == 0) {
+                    printf("Usage : mkdir -p <chemin> [<chemin> ...]\n");
+                    continue;
+                }
+                fs_mkdir_p(chemins, nb);
+                continue;
+            }
             if (!dir) {
-                printf("Usage : mkdir <repertoire>\n");
+                printf("Usage : mkdir [-p] <repertoire>\n");
                 continue;
             }
             fs_mkdir(dir);
@@ -1115,6 +4701,14 @@ int main() {
             }
             fs_chmod(perm_str, cheminArg);
         }
+        else if (strcmp(token, "compress") == 0) {
+            char *cheminArg = strtok(NULL, " ");
+            if (!cheminArg) {
+                printf("Usage : compress <fichier> [on|off]\n");
+                continue;
+            }
+            fs_compress(cheminArg, strtok(NULL, " "));
+        }
         else if (strcmp(token, "ln") == 0) {
 			int symbolique = 0;
 			char *arg = strtok(NULL, " ");
@@ -1150,12 +4744,20 @@ int main() {
             fs_unlink(fichier);
         }*/
         else if (strcmp(token, "rm") == 0) {
+            int recursif = 0;
             char *cheminArg = strtok(NULL, " ");
+            if (cheminArg && strcmp(cheminArg, "-r") == 0) {
+                recursif = 1;
+                cheminArg = strtok(NULL, " ");
+            }
             if (!cheminArg) {
-                printf("Usage : rm <chemin>\n");
+                printf("Usage : rm [-r] <chemin>\n");
                 continue;
             }
-            fs_rm(cheminArg);
+            if (recursif)
+                fs_rm_r(cheminArg);
+            else
+                fs_rm(cheminArg);
         }
         else if (strcmp(token, "mv") == 0) {
             char *src = strtok(NULL, " ");
@@ -1166,8 +4768,98 @@ int main() {
             }
             fs_mv(src, dest);
         }
+        else if (strcmp(token, "cp") == 0) {
+            int recursif = 0;
+            char *src = strtok(NULL, " ");
+            if (src && strcmp(src, "-r") == 0) {
+                recursif = 1;
+                src = strtok(NULL, " ");
+            }
+            char *dest = strtok(NULL, " ");
+            if (!src || !dest) {
+                printf("Usage : cp [-r] <source> <destination>\n");
+                continue;
+            }
+            if (recursif)
+                fs_cp_r(src, dest);
+            else
+                fs_cp(src, dest);
+        }
         else if (strcmp(token, "fsck") == 0) {
-            fs_fsck();
+            int reparer = 0, valide = 1;
+            int nb_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if (nb_threads > FSCK_DEFAULT_THREADS)
+                nb_threads = FSCK_DEFAULT_THREADS;
+            for (char *arg = strtok(NULL, " "); arg && valide; arg = strtok(NULL, " ")) {
+                char *fin;
+                long n = strtol(arg, &fin, 10);
+                if (strcmp(arg, "--repair") == 0)
+                    reparer = 1;
+                else if (*fin == '\0' && n >= 1 && n <= FSCK_MAX_THREADS)
+                    nb_threads = n;
+                else
+                    valide = 0;
+            }
+            if (!valide) {
+                printf("Usage : fsck [--repair] [<threads> (1 a %d)]\n", FSCK_MAX_THREADS);
+                continue;
+            }
+            fs_fsck(reparer, nb_threads);
+        }
+        else if (strcmp(token, "df") == 0) {
+            fs_df();
+        }
+        else if (strcmp(token, "defrag") == 0) {
+            double debit = DEFRAG_DEFAULT_RATE;
+            int reduire = 0, valide = 1;
+            char *arg = strtok(NULL, " ");
+            if (arg && strcmp(arg, "status") == 0) {
+                fs_defrag_status();
+                continue;
+            }
+            if (arg && strcmp(arg, "stop") == 0) {
+                defrag_stop();
+                fs_defrag_status();
+                continue;
+            }
+            for (; arg; arg = strtok(NULL, " ")) {
+                char *fin;
+                if (strcmp(arg, "--shrink") == 0)
+                    reduire = 1;
+                else if ((debit = strtod(arg, &fin)) < 0 || *fin)
+                    valide = 0;
+            }
+            if (!valide) {
+                printf("Usage : defrag [<Mio/s>] [--shrink] | defrag status | defrag stop\n");
+                continue;
+            }
+            fs_defrag(debit, reduire);
+        }
+        else if (strcmp(token, "scrub") == 0) {
+            double debit = SCRUB_DEFAULT_RATE;
+            long iops = SCRUB_DEFAULT_IOPS;
+            char *arg = strtok(NULL, " ");
+            if (arg && strcmp(arg, "status") == 0) {
+                fs_scrub_status();
+                continue;
+            }
+            if (arg && strcmp(arg, "stop") == 0) {
+                if (disk_mode)
+                    scrub_stop(&part, 1);
+                fs_scrub_status();
+                continue;
+            }
+            char *iops_arg = arg ? strtok(NULL, " ") : NULL;
+            char *fin1 = "", *fin2 = "";
+            if (arg)
+                debit = strtod(arg, &fin1);
+            if (iops_arg)
+                iops = strtol(iops_arg, &fin2, 10);
+            if (*fin1 || *fin2 || debit < 0 || iops < 0 || strtok(NULL, " ")) {
+                printf("Usage : scrub [<Mio/s>] [<lectures/s>] | scrub status | scrub stop\n");
+                continue;
+            }
+            fs_scrub(debit, (uint32_t)iops);
         }
         else if (strcmp(token, "tree") == 0) {
             int show_inodes = 0;
@@ -1186,22 +4878,158 @@ int main() {
 				fs_tree_i(arg, 0);
 			}
         }
+        else if (strcmp(token, "bench") == 0) {
+            char *quoi = strtok(NULL, " ");
+            char *rep_str = strtok(NULL, " ");
+            int repetitions = rep_str ? atoi(rep_str) : 10;
+            if (!quoi) {
+                printf("Usage : bench mmap [<repetitions>] | bench io [<lectures>] | bench alloc [<operations>]\n"
+                       "        bench crash [<essais>] [<graine>] | bench replay [<inodes max>] | bench csum [<Mio>]\n"
+                       "        bench lz [<Mio>] | bench cdc [<Mio>]\n");
+                continue;
+            }
+            if (strcmp(quoi, "crash") == 0) {
+                //Images temporaires independantes de la partition montee
+                char *graine_str = strtok(NULL, " ");
+                bench_crash(rep_str && repetitions > 0 ? repetitions : 30,
+                            graine_str ? (uint32_t)strtoul(graine_str, NULL, 10) : (uint32_t)time(NULL));
+                continue;
+            }
+            if (strcmp(quoi, "replay") == 0) {
+                long max = rep_str ? atol(rep_str) : 10000000;
+                bench_replay(max >= 1000 && max <= 100000000 ? (uint32_t)max : 10000000);
+                continue;
+            }
+            if (strcmp(quoi, "csum") == 0) {
+                bench_csum(rep_str && repetitions > 0 && repetitions <= 4096 ? repetitions : 256);
+                continue;
+            }
+            if (strcmp(quoi, "lz") == 0) {
+                bench_lz(rep_str && repetitions > 0 && repetitions <= 4096 ? repetitions : 64);
+                continue;
+            }
+            if (strcmp(quoi, "cdc") == 0) {
+                bench_cdc(rep_str && repetitions > 0 && repetitions <= 1024 ? repetitions : 16);
+                continue;
+            }
+            if (strcmp(quoi, "alloc") == 0) {
+                //Bitmap en memoire de 16 Mi blocs (image de 64 Gio)
+                bench_alloc(16u << 20, rep_str && repetitions > 0 ? repetitions : 20000);
+                continue;
+            }
+            if (strcmp(quoi, "mmap") == 0 || strcmp(quoi, "io") == 0) {
+                if (!disk_mode) {
+                    printf("Mesure disponible seulement avec une partition montee.\n");
+                    continue;
+                }
+                fs_flush();
+                //La mesure relit l'image : la transaction en cours doit y etre
+                pthread_mutex_lock(&part.lock);
+                journal_commit(&part);
+                pthread_mutex_unlock(&part.lock);
+                if (strcmp(quoi, "mmap") == 0)
+                    bench_mmap(image_path, repetitions > 0 ? repetitions : 1);
+                else
+                    bench_io(image_path, rep_str && repetitions > 0 ? repetitions : 20000, 64);
+            }
+            else {
+                printf("Mesure inconnue : %s\n", quoi);
+            }
+        }
+        else if (strcmp(token, "checkpoint") == 0) {
+            fs_checkpoint(strtok(NULL, " "));
+        }
+        else if (strcmp(token, "diff") == 0) {
+            char *a = strtok(NULL, " ");
+            char *b = strtok(NULL, " ");
+            if (!a || !b) {
+                printf("Usage : diff <cheminA> <cheminB>\n");
+                continue;
+            }
+            fs_diff(a, b);
+        }
+        else if (strcmp(token, "snapshot") == 0) {
+            char *action = strtok(NULL, " ");
+            char *nom = strtok(NULL, " ");
+            char *chemin = strtok(NULL, " ");
+            if (action && strcmp(action, "list") == 0)
+                fs_snapshot_list();
+            else if (action && nom && strcmp(action, "create") == 0)
+                fs_snapshot_create(nom);
+            else if (action && nom && strcmp(action, "delete") == 0)
+                fs_snapshot_delete(nom);
+            else if (action && nom && chemin && strcmp(action, "mount") == 0)
+                fs_snapshot_mount(nom, chemin);
+            else
+                printf("Usage : snapshot create <nom> | snapshot mount <nom> <chemin> | snapshot delete <nom> | snapshot list\n");
+        }
+        else if (strcmp(token, "stats") == 0) {
+            if (!disk_mode) {
+                printf("Statistiques disponibles seulement avec une partition montee.\n");
+                continue;
+            }
+            pthread_mutex_lock(&part.lock);
+            journal_stats(&part);
+            io_stats(&part);
+            pcache_stats(&part);
+            csum_stats(&part);
+            dedup_stats(&part);
+            chunk_stats(&part);
+            scrub_stats(&part);
+            lazyinit_stats(&part);
+            pthread_mutex_unlock(&part.lock);
+            printf("Cache : %zu/%zu Kio, %lu repertoires charges, %lu dechargements\n",
+                   __atomic_load_n(&cache_bytes, __ATOMIC_RELAXED) / 1024, cache_limit / 1024, cache_loads, cache_evictions);
+            int nb_sales = 0;
+            for (FileEntry *e = dirty_list; e; e = e->dirty_next)
+                nb_sales++;
+            printf("Ecriture differee : %s, %d entrees sales (%zu Kio, %.0f ms), "
+                   "passes %lu age / %lu seuil / %lu sync, %lu entrees ecrites\n",
+                   wb_running ? "active" : "apres chaque commande", nb_sales, dirty_bytes() / 1024,
+                   dirty_age_ms(), wb_passes[WB_AGE], wb_passes[WB_RATIO], wb_passes[WB_EXPLICIT], wb_entries);
+        }
         else if (strcmp(token, "help") == 0) {
             printf("Commandes disponibles :\n");
+            printf("  append <fichier> <texte>  : Ecrit a la fin d'un fichier\n");
+            printf("  bench alloc [<n>]         : Compare les allocateurs de blocs\n");
+            printf("  bench cdc [<Mio>]         : Decoupage par le contenu, blocs d'une nouvelle version\n");
+            printf("  bench crash [<n>] [<g>]   : Coupures de courant simulees, rejeu et verification\n");
+            printf("  bench csum [<Mio>]        : Debit CRC32C et surcout de la verification en lecture\n");
+            printf("  bench io [<n>]            : Compare pread et io_uring (lectures 4 Kio)\n");
+            printf("  bench lz [<Mio>]          : Debit et taux du compresseur, lectures d'un fichier compresse\n");
+            printf("  bench mmap [<n>]          : Compare les modes read() et mmap\n");
+            printf("  bench replay [<inodes>]   : Duree du rejeu du journal selon la taille de l'image\n");
             printf("  cat <fichier>             : Affiche le contenu d'un fichier\n");
             printf("  cd <repertoire>           : Change le repertoire courant\n");
+            printf("  checkpoint [<image>]      : Sauvegarde l'arbre en arriere-plan (fork)\n");
             printf("  chmod <perm> <chemin>     : Modifie les permissions\n");
+            printf("  compress <f> [on|off]     : Stocke le contenu d'un fichier compresse\n");
+            printf("  cp <source> <dest>        : Copie un fichier (reflink)\n");
+            printf("  cp -r <source> <dest>     : Copie un repertoire en parallele\n");
+            printf("  defrag [<Mio/s>] [--shrink] : Regroupe les extents en arriere-plan, reduit l'image\n");
+            printf("  defrag status|stop        : Progression et bilan, ou interruption\n");
+            printf("  df                        : Occupation et gain de la deduplication\n");
+            printf("  diff <a> <b>              : Differences entre deux sous-arbres (empreintes)\n");
             printf("  touch <fichier>           : Cree un fichier avec taille par defaut\n");
             printf("  exit                      : Quitte le programme\n");
-            printf("  fsck                      : Affiche des statistiques\n");
+            printf("  fsck [--repair] [<n>]     : Verifie la partition (liens, orphelins, blocs) sur n threads\n");
             printf("  help                      : Affiche ce message\n");
             printf("  ln <src> <dest>           : Cree un lien physique\n");
             printf("  ln -s <src> <dest>        : Cree un lien symbolique\n");
             printf("  ls [<chemin> | -l [<chemin>]] : Liste le contenu\n");
             printf("  mkdir <repertoire>        : Cree un repertoire\n");
+            printf("  mkdir -p <chemin>...      : Cree des chemins et leurs parents\n");
             printf("  mkfs                      : Formate le systeme\n");
             printf("  mv <source> <dest>        : Deplace ou renomme\n");
             printf("  pwd                       : Affiche le chemin courant\n");
+            printf("  rm [-r] <chemin>          : Supprime (recursivement avec -r)\n");
+            printf("  scrub [<Mio/s>] [<n/s>]   : Verification continue en arriere-plan (sommes, invariants)\n");
+            printf("  scrub status|stop         : Progression et erreurs, ou arret\n");
+            printf("  snapshot create <nom>     : Fige tout l'arbre (copie a l'ecriture)\n");
+            printf("  snapshot mount <nom> <c>  : Expose un instantane en lecture seule\n");
+            printf("  snapshot delete|list      : Supprime ou liste les instantanes\n");
+            printf("  stats                     : Statistiques du journal et du cache\n");
+            printf("  sync                      : Ecrit et valide toutes les modifications\n");
             printf("  tree [--inodes] [<chemin>] : Affiche l'arborescence\n");
             //printf("  unlink <fichier>          : Supprime un lien\n");
             printf("  write <fichier> <texte>   : Ecrit dans un fichier\n");
@@ -1210,5 +5038,8 @@ int main() {
             printf("Commande inconnue. Tapez 'help' pour afficher la liste des commandes.\n");
         }
     }
+    pthread_mutex_unlock(&tree_lock);
+    checkpoint_poll(1);
+    fs_umount();
     return 0;
 }
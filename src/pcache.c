@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "structures.h"
+#include "fonctions.h"
+#include "pcache.h"
+
+/*
+ * Cache de pages de la partition en mode fichier. Une page est identifiee
+ * par (inode, bloc logique) et garde le bloc physique d'ou elle vient : elle
+ * n'est valide que si l'inode n'a pas ete reecrit depuis (epoque) et si le
+ * fichier pointe toujours sur ce bloc. Toutes les fonctions sont appelees
+ * avec p->lock tenu.
+ */
+
+static uint32_t pcache_hash(const page_cache *c, uint32_t ino, uint32_t lblk) {
+    uint64_t h = ((uint64_t)ino << 32 | lblk) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32) & (c->nb_buckets - 1);
+}
+
+static char *page_data(page_cache *c, uint32_t i) {
+    return c->data + (size_t)i * FS_BLOCK_SIZE;
+}
+
+//Retirer la page i de sa case de hachage et la rendre libre
+static void pcache_drop(page_cache *c, uint32_t i) {
+    pcache_page *pg = &c->pages[i];
+    int32_t *lien = &c->buckets[pcache_hash(c, pg->ino, pg->lblk)];
+    while (*lien != -1 && *lien != (int32_t)i)
+        lien = &c->pages[*lien].next;
+    if (*lien == (int32_t)i)
+        *lien = pg->next;
+    if (pg->state == PCACHE_HOT)
+        c->nb_hot--;
+    if (pg->dirty)
+        c->nb_dirty--;
+    pg->state = PCACHE_FREE;
+    pg->ref = 0;
+    pg->dirty = 0;
+    pg->next = c->free_head;
+    c->free_head = i;
+    c->nb_used--;
+}
+
+static int page_stale(const page_cache *c, const pcache_page *pg) {
+    return pg->ino >= c->nb_epochs || pg->epoch != c->epochs[pg->ino];
+}
+
+/*
+ * Aiguille chaude : les pages chaudes non relues depuis son dernier passage
+ * redeviennent froides, jusqu'a ce que les froides fassent au moins
+ * PCACHE_COLD_MIN % du cache.
+ */
+static void hot_hand_run(page_cache *c) {
+    uint32_t max_chaudes = c->nb_pages - (c->nb_pages * PCACHE_COLD_MIN + 99) / 100;
+    for (uint32_t pas = 0; c->nb_hot > max_chaudes && pas < 2 * c->nb_pages; pas++) {
+        pcache_page *pg = &c->pages[c->hot_hand];
+        if (pg->state == PCACHE_HOT) {
+            if (pg->ref) {
+                pg->ref = 0;
+            } else {
+                pg->state = PCACHE_COLD;
+                c->nb_hot--;
+            }
+        }
+        c->hot_hand = (c->hot_hand + 1) % c->nb_pages;
+    }
+}
+
+/*
+ * Aiguille froide : liberer une page. Une page froide relue devient chaude ;
+ * une page froide non relue (ou perimee) est evincee. Les pages sales
+ * restent en place. 0 si une page a ete liberee, -1 sinon.
+ */
+static int cold_hand_run(page_cache *c) {
+    for (uint32_t pas = 0; pas < 3 * c->nb_pages; pas++) {
+        uint32_t i = c->cold_hand;
+        pcache_page *pg = &c->pages[i];
+        c->cold_hand = (c->cold_hand + 1) % c->nb_pages;
+        if (pg->state == PCACHE_FREE || pg->dirty)
+            continue;
+        if (page_stale(c, pg)) {
+            pcache_drop(c, i);
+            return 0;
+        }
+        if (pg->state != PCACHE_COLD)
+            continue;
+        if (pg->ref) {
+            pg->ref = 0;
+            pg->state = PCACHE_HOT;
+            c->nb_hot++;
+            hot_hand_run(c);
+            continue;
+        }
+        pcache_drop(c, i);
+        c->evictions++;
+        return 0;
+    }
+    return -1;
+}
+
+//Reserver la memoire du cache (budget en octets, 0 pour le desactiver)
+int pcache_init(filesystem *p, size_t budget) {
+    page_cache *c = &p->pcache;
+    memset(c, 0, sizeof(page_cache));
+    uint32_t nb = budget / FS_BLOCK_SIZE;
+    if (nb < 2 || p->map)
+        return 0;
+    c->data = malloc((size_t)nb * FS_BLOCK_SIZE);
+    c->pages = calloc(nb, sizeof(pcache_page));
+    c->nb_buckets = 1;
+    while (c->nb_buckets < nb)
+        c->nb_buckets <<= 1;
+    c->buckets = malloc(c->nb_buckets * sizeof(int32_t));
+    c->nb_epochs = p->sb.nb_inodes;
+    c->epochs = calloc(c->nb_epochs ? c->nb_epochs : 1, sizeof(uint32_t));
+    if (!c->data || !c->pages || !c->buckets || !c->epochs) {
+        printf("Memoire insuffisante pour le cache de pages (%zu octets).\n", budget);
+        pcache_close(p);
+        return -1;
+    }
+    for (uint32_t i = 0; i < c->nb_buckets; i++)
+        c->buckets[i] = -1;
+    //Toutes les pages sont libres, chainees par next
+    for (uint32_t i = 0; i < nb; i++)
+        c->pages[i].next = i + 1 < nb ? (int32_t)i + 1 : -1;
+    c->free_head = 0;
+    c->nb_pages = nb;
+    return 0;
+}
+
+void pcache_close(filesystem *p) {
+    page_cache *c = &p->pcache;
+    free(c->data);
+    free(c->pages);
+    free(c->buckets);
+    free(c->epochs);
+    memset(c, 0, sizeof(page_cache));
+}
+
+//Oublier toutes les pages (apres un formatage)
+void pcache_reset(filesystem *p) {
+    page_cache *c = &p->pcache;
+    if (c->nb_pages == 0)
+        return;
+    size_t budget = (size_t)c->nb_pages * FS_BLOCK_SIZE;
+    pcache_close(p);
+    pcache_init(p, budget);
+}
+
+/*
+ * Copier les len premiers octets du bloc lblk de l'inode s'il est en cache
+ * et toujours stocke dans le bloc phys. Retourne 1 si trouve, 0 sinon.
+ */
+int pcache_read(filesystem *p, uint32_t ino, uint32_t lblk, uint32_t phys, void *buf, size_t len) {
+    page_cache *c = &p->pcache;
+    if (c->nb_pages == 0)
+        return 0;
+    for (int32_t i = c->buckets[pcache_hash(c, ino, lblk)]; i != -1; i = c->pages[i].next) {
+        pcache_page *pg = &c->pages[i];
+        if (pg->ino != ino || pg->lblk != lblk)
+            continue;
+        if (page_stale(c, pg) || pg->phys != phys) {
+            if (!pg->dirty)
+                pcache_drop(c, i);
+            break;
+        }
+        pg->ref = 1;
+        memcpy(buf, page_data(c, i), len);
+        c->hits++;
+        return 1;
+    }
+    c->misses++;
+    return 0;
+}
+
+//Ajouter (ou remplacer) le bloc lblk de l'inode, lu depuis le bloc phys
+void pcache_insert(filesystem *p, uint32_t ino, uint32_t lblk, uint32_t phys, const void *data) {
+    page_cache *c = &p->pcache;
+    if (c->nb_pages == 0 || ino >= c->nb_epochs)
+        return;
+    int32_t i = c->buckets[pcache_hash(c, ino, lblk)];
+    while (i != -1 && (c->pages[i].ino != ino || c->pages[i].lblk != lblk))
+        i = c->pages[i].next;
+    if (i == -1) {
+        if (c->free_head == -1 && cold_hand_run(c) < 0)
+            return;
+        i = c->free_head;
+        c->free_head = c->pages[i].next;
+        pcache_page *pg = &c->pages[i];
+        pg->ino = ino;
+        pg->lblk = lblk;
+        pg->state = PCACHE_COLD;
+        pg->ref = 0;
+        pg->dirty = 0;
+        uint32_t h = pcache_hash(c, ino, lblk);
+        pg->next = c->buckets[h];
+        c->buckets[h] = i;
+        c->nb_used++;
+    }
+    c->pages[i].phys = phys;
+    c->pages[i].epoch = c->epochs[ino];
+    memcpy(page_data(c, i), data, FS_BLOCK_SIZE);
+}
+
+//Rendre perimees toutes les pages d'un inode (reecrit ou libere)
+void pcache_invalidate(filesystem *p, uint32_t ino) {
+    page_cache *c = &p->pcache;
+    if (c->nb_pages && ino < c->nb_epochs)
+        c->epochs[ino]++;
+}
+
+void pcache_stats(filesystem *p) {
+    page_cache *c = &p->pcache;
+    if (c->nb_pages == 0) {
+        printf("Cache de pages : desactive\n");
+        return;
+    }
+    uint64_t acces = c->hits + c->misses;
+    printf("Cache de pages : %u/%u pages (%u Kio max), %u chaudes, %u sales\n",
+           c->nb_used, c->nb_pages, c->nb_pages * (FS_BLOCK_SIZE / 1024), c->nb_hot, c->nb_dirty);
+    printf("  succes %.1f %% (%llu/%llu), %llu evictions\n", acces ? 100.0 * c->hits / acces : 0.0,
+           (unsigned long long)c->hits, (unsigned long long)acces, (unsigned long long)c->evictions);
+}
@@ -0,0 +1,13 @@
+int pcache_init(filesystem *p, size_t budget);
+
+void pcache_close(filesystem *p);
+
+void pcache_reset(filesystem *p);
+
+int pcache_read(filesystem *p, uint32_t ino, uint32_t lblk, uint32_t phys, void *buf, size_t len);
+
+void pcache_insert(filesystem *p, uint32_t ino, uint32_t lblk, uint32_t phys, const void *data);
+
+void pcache_invalidate(filesystem *p, uint32_t ino);
+
+void pcache_stats(filesystem *p);
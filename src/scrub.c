@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "structures.h"
+#include "fonctions.h"
+#include "journal.h"
+#include "crc32c.h"
+#include "scrub.h"
+
+/*
+ * Verification continue de la partition montee (scrub). Un thread la
+ * parcourt dans l'ordre des blocs et verifie chaque zone :
+ *  - superbloc : signature et somme ;
+ *  - bitmaps : copie du disque identique a la memoire (hors blocs modifies
+ *    pas encore ecrits) et somme ;
+ *  - table des inodes : somme de chaque inode, puis pour les inodes occupes
+ *    type, liens, parent, extents dans la zone de donnees et marques
+ *    occupes, blocs suffisants pour la taille ;
+ *  - tables des sommes et des references : sceau de chaque bloc ;
+ *  - zone de donnees : somme de chaque bloc occupe qui en a une.
+ * Le journal est saute (ses transactions portent leur propre somme).
+ *
+ * Les blocs sont lus sans passer par le cache des pages, SCRUB_BATCH au plus
+ * par lecture, p->lock tenu le temps d'une lecture et de sa verification :
+ * le disque est alors coherent avec les bitmaps et la transaction en cours
+ * (dont les inodes sont sautes). Entre deux lectures, le thread attend ce
+ * qu'il faut pour rester sous le debit et le nombre de lectures par seconde
+ * demandes. Sa position est ecrite dans le superbloc toutes les SCRUB_SAVE_S
+ * secondes et a l'arret : un nouveau montage la reprend ou elle en etait.
+ */
+
+static double scrub_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int bit_used(const uint8_t *bitmap, uint32_t i) {
+    return (bitmap[i / 8] >> (i % 8)) & 1;
+}
+
+//Noter une erreur (p->lock tenu)
+static void scrub_report(filesystem *p, int type, uint32_t no, uint32_t ino, const char *quoi) {
+    scrub_state *s = &p->scrub;
+    s->erreurs[type]++;
+    s->dernieres[s->nb_erreurs % SCRUB_LOG] = (scrub_error){ no, ino, quoi };
+    s->nb_erreurs++;
+    p->sb.scrub_errors++;
+}
+
+//Ecrire la progression dans le superbloc (p->lock tenu)
+static void scrub_save(filesystem *p) {
+    if (p->flags & FS_MOUNT_RDONLY)
+        return;
+    p->sb.features |= FS_FEATURE_SCRUB;
+    write_superblock(p);
+    p->scrub.sauvegarde = scrub_now();
+}
+
+//Attendre jusqu'a l'echeance ou une demande d'arret (p->lock tenu, relache pendant l'attente)
+static void scrub_wait(filesystem *p, double echeance) {
+    scrub_state *s = &p->scrub;
+    double debut = scrub_now();
+    while (!s->stop && scrub_now() < echeance) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)echeance;
+        ts.tv_nsec = (long)((echeance - ts.tv_sec) * 1e9);
+        pthread_cond_timedwait(&s->cond, &p->lock, &ts);
+    }
+    s->attente += scrub_now() - debut;
+}
+
+//1 si le bloc de table (sceau CRC32C a l'octet sceau) est intact ou vierge
+static int table_sealed(const uint8_t *bloc, size_t sceau) {
+    uint32_t somme;
+    memcpy(&somme, bloc + sceau, 4);
+    if (somme == crc32c(0, bloc, sceau))
+        return 1;
+    for (size_t i = 0; i < sceau + 4; i++) {
+        if (bloc[i])
+            return 0;
+    }
+    return 1;
+}
+
+//Invariants d'un inode occupe, NULL s'ils tiennent
+static const char *inode_invariant(filesystem *p, const disk_inode *in) {
+    superblock *sb = &p->sb;
+    if (in->type != FS_TYPE_FILE && in->type != FS_TYPE_DIR && in->type != FS_TYPE_SYMLINK)
+        return "type inconnu";
+    if (in->links == 0)
+        return "aucun lien";
+    if (in->parent == 0 || in->parent >= sb->nb_inodes || !bit_used(p->inode_bitmap, in->parent))
+        return "parent invalide ou libre";
+    if (in->type == FS_TYPE_DIR && in->size % sizeof(disk_dirent))
+        return "taille de repertoire invalide";
+    if (in->nb_extents > FS_INLINE_EXTENTS + FS_EXTENTS_PER_BLOCK)
+        return "trop d'extents";
+    if ((in->nb_extents > FS_INLINE_EXTENTS) != (in->extent_block != 0))
+        return "bloc d'extents incoherent";
+    if (in->extent_block && (in->extent_block < sb->data_start || in->extent_block >= sb->nb_blocks ||
+                             !bit_used(p->block_bitmap, in->extent_block)))
+        return "bloc d'extents hors zone ou libre";
+    //Les extents du bloc d'extents sont verifies par sa somme, avec les donnees
+    uint32_t inline_nb = in->nb_extents < FS_INLINE_EXTENTS ? in->nb_extents : FS_INLINE_EXTENTS;
+    uint64_t blocs = 0;
+    for (uint32_t i = 0; i < inline_nb; i++) {
+        const disk_extent *e = &in->extents[i];
+        if (e->len == 0 || e->start < sb->data_start || e->start >= sb->nb_blocks || e->len > sb->nb_blocks - e->start)
+            return "extent hors de la zone de donnees";
+        for (uint32_t b = e->start; b < e->start + e->len; b++) {
+            if (!bit_used(p->block_bitmap, b))
+                return "extent sur un bloc libre";
+        }
+        blocs += e->len;
+    }
+    uint64_t stocke = (in->flags & (FS_INODE_COMPRESSED | FS_INODE_CHUNKED)) ? in->stored_size : in->size;
+    if (in->nb_extents <= FS_INLINE_EXTENTS && blocs * FS_BLOCK_SIZE < stocke)
+        return "taille au-dela des blocs";
+    return NULL;
+}
+
+//Verifier les inodes d'un bloc de la table
+static void scrub_inodes(filesystem *p, uint32_t no, const char *bloc) {
+    uint32_t base = (no - p->sb.inode_table_start) * FS_INODES_PER_BLOCK;
+    for (uint32_t i = 0; i < FS_INODES_PER_BLOCK; i++) {
+        uint32_t ino = base + i;
+        if (ino == 0 || ino >= p->sb.nb_inodes)
+            continue;
+        disk_inode in, recent;
+        //Modifie dans la transaction en cours : la copie du disque est perimee
+        if (p->journal.enabled && journal_lookup_inode(p, ino, &recent))
+            continue;
+        memcpy(&in, bloc + i * sizeof(disk_inode), sizeof(disk_inode));
+        p->scrub.inodes++;
+        if (!inode_csum_ok(p, ino, &in)) {
+            scrub_report(p, SCRUB_ERR_INODE, no, ino, "somme de l'inode invalide");
+            continue;
+        }
+        //Un inode libre garde son ancien contenu ; alloue mais pas encore ecrit, il est vide
+        if (!bit_used(p->inode_bitmap, ino) || in.type == FS_TYPE_FREE)
+            continue;
+        const char *quoi = inode_invariant(p, &in);
+        if (quoi)
+            scrub_report(p, SCRUB_ERR_STRUCT, no, ino, quoi);
+    }
+}
+
+/*
+ * Verifier les nb blocs lus a partir de no, tous dans la meme zone.
+ */
+static void scrub_check(filesystem *p, uint32_t no, uint32_t nb, const char *buf) {
+    superblock *sb = &p->sb;
+    for (uint32_t i = 0; i < nb; i++) {
+        uint32_t b = no + i;
+        const char *bloc = buf + (size_t)i * FS_BLOCK_SIZE;
+        if (b == 0) {
+            superblock lu;
+            memcpy(&lu, bloc, sizeof(lu));
+            if (superblock_verify(&lu) < 0)
+                scrub_report(p, SCRUB_ERR_META, b, 0, "superbloc corrompu");
+        } else if (b < sb->inode_table_start) {
+            uint32_t t = b - sb->inode_bitmap_start;
+            if (p->bitmap_blocks_dirty[t])
+                continue;
+            uint32_t somme = csum_get(p, b);
+            if (memcmp(bloc, bitmap_block_ptr(p, t), FS_BLOCK_SIZE) != 0)
+                scrub_report(p, SCRUB_ERR_META, b, 0, "bitmap differente de la copie en memoire");
+            else if (somme && somme != crc32c(0, bloc, FS_BLOCK_SIZE))
+                scrub_report(p, SCRUB_ERR_META, b, 0, "somme de la bitmap invalide");
+        } else if (b < sb->inode_table_start + sb->inode_table_blocks) {
+            scrub_inodes(p, b, bloc);
+        } else if (b < sb->csum_start + sb->csum_blocks) {
+            if (!table_sealed((const uint8_t *)bloc, FS_CSUMS_PER_BLOCK * 4))
+                scrub_report(p, SCRUB_ERR_META, b, 0, "bloc de la table des sommes corrompu");
+        } else if (b < sb->ref_start + sb->ref_blocks) {
+            if (!table_sealed((const uint8_t *)bloc, FS_REFS_PER_BLOCK * 2))
+                scrub_report(p, SCRUB_ERR_META, b, 0, "bloc de la table des references corrompu");
+        } else {
+            p->csum_verified++;
+            if (crc32c(0, bloc, FS_BLOCK_SIZE) != csum_get(p, b)) {
+                p->csum_errors++;
+                scrub_report(p, SCRUB_ERR_DATA, b, 0, "somme du bloc de donnees invalide");
+            }
+        }
+    }
+}
+
+//Bloc de donnees a lire : occupe et de somme connue
+static int data_to_check(filesystem *p, uint32_t b) {
+    return bit_used(p->block_bitmap, b) && csum_get(p, b) != 0;
+}
+
+/*
+ * Avancer d'un pas depuis sb.scrub_cursor : les blocs sans rien a verifier
+ * sont sautes, puis au plus SCRUB_BATCH blocs d'une meme zone sont lus et
+ * verifies. Retourne le nombre de blocs lus (0 si seulement sautes).
+ */
+static uint32_t scrub_step(filesystem *p, char *buf) {
+    superblock *sb = &p->sb;
+    uint32_t no = sb->scrub_cursor, fin;
+    //Les tables sont contigues : superbloc, bitmaps, inodes, sommes, references, puis journal
+    uint32_t bornes[] = { 1, sb->inode_table_start, sb->inode_table_start + sb->inode_table_blocks,
+                          sb->csum_start + sb->csum_blocks, sb->ref_start + sb->ref_blocks };
+    if (sb->csum_blocks == 0)
+        bornes[3] = bornes[2];
+    if (sb->ref_blocks == 0)
+        bornes[4] = bornes[3];
+    uint32_t nb_bornes = sizeof(bornes) / sizeof(bornes[0]);
+    if (no >= bornes[nb_bornes - 1] && no < sb->data_start)
+        no = sb->data_start;
+    if (no < sb->data_start) {
+        fin = sb->data_start;
+        for (uint32_t k = 0; k < nb_bornes; k++) {
+            if (no < bornes[k]) {
+                fin = bornes[k];
+                break;
+            }
+        }
+    } else {
+        uint32_t limite = no + SCRUB_SKIP_MAX < sb->nb_blocks ? no + SCRUB_SKIP_MAX : sb->nb_blocks;
+        while (no < limite && !data_to_check(p, no))
+            no++;
+        fin = no;
+        while (fin < sb->nb_blocks && fin - no < SCRUB_BATCH && data_to_check(p, fin))
+            fin++;
+    }
+    if (fin - no > SCRUB_BATCH)
+        fin = no + SCRUB_BATCH;
+    uint32_t nb = fin - no;
+    if (nb > 0) {
+        if (read_blocks_raw(p, no, nb, buf) < 0)
+            scrub_report(p, SCRUB_ERR_IO, no, 0, "lecture en echec");
+        else
+            scrub_check(p, no, nb, buf);
+        p->scrub.blocs += nb;
+    }
+    sb->scrub_cursor = fin;
+    return nb;
+}
+
+//Respecter le budget apres une lecture de nb blocs (p->lock tenu)
+static void scrub_throttle(filesystem *p, uint32_t nb) {
+    scrub_state *s = &p->scrub;
+    s->octets += (uint64_t)nb * FS_BLOCK_SIZE;
+    s->lectures++;
+    s->fen_octets += (uint64_t)nb * FS_BLOCK_SIZE;
+    s->fen_lectures++;
+    double duree = 0;
+    if (s->rate > 0)
+        duree = s->fen_octets / (s->rate * 1024 * 1024);
+    if (s->iops > 0 && (double)s->fen_lectures / s->iops > duree)
+        duree = (double)s->fen_lectures / s->iops;
+    double echeance = s->fen_debut + duree, maintenant = scrub_now();
+    if (echeance > maintenant) {
+        scrub_wait(p, echeance);
+    } else if (maintenant - echeance > 1) {
+        //En retard (partition occupee par ailleurs) : pas de rattrapage en rafale
+        s->fen_debut = maintenant;
+        s->fen_octets = s->fen_lectures = 0;
+    }
+}
+
+static void *scrub_worker(void *arg) {
+    filesystem *p = arg;
+    scrub_state *s = &p->scrub;
+    char *buf = malloc((size_t)SCRUB_BATCH * FS_BLOCK_SIZE);
+    pthread_mutex_lock(&p->lock);
+    s->fen_debut = s->sauvegarde = scrub_now();
+    s->fen_octets = s->fen_lectures = 0;
+    while (!s->stop) {
+        superblock *sb = &p->sb;
+        if (sb->scrub_cursor >= sb->nb_blocks) {
+            sb->scrub_passes++;
+            sb->scrub_last_errors = sb->scrub_errors;
+            sb->scrub_errors = 0;
+            sb->scrub_cursor = 0;
+            sb->scrub_last_end = (uint32_t)time(NULL);
+            scrub_save(p);
+            scrub_wait(p, scrub_now() + SCRUB_PASS_PAUSE_S);
+            s->fen_debut = scrub_now();
+            s->fen_octets = s->fen_lectures = 0;
+            continue;
+        }
+        uint32_t nb = scrub_step(p, buf);
+        if (scrub_now() - s->sauvegarde >= SCRUB_SAVE_S)
+            scrub_save(p);
+        if (nb)
+            scrub_throttle(p, nb);
+        //Sans budget, le verrou est tout de meme rendu entre deux lectures
+        pthread_mutex_unlock(&p->lock);
+        sched_yield();
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Demarrer la verification continue (p->lock non tenu) avec un budget de
+ * rate Mio/s et iops lectures par seconde (0 : sans limite). Si elle tourne
+ * deja, seul le budget change. Retourne 1 si elle tournait deja.
+ */
+int scrub_start(filesystem *p, double rate, uint32_t iops) {
+    scrub_state *s = &p->scrub;
+    pthread_mutex_lock(&p->lock);
+    s->rate = rate;
+    s->iops = iops;
+    s->fen_debut = scrub_now();
+    s->fen_octets = s->fen_lectures = 0;
+    p->sb.scrub_active = 1;
+    p->sb.scrub_rate = (uint32_t)(rate * 1024);
+    p->sb.scrub_iops = iops;
+    if (p->sb.scrub_cursor >= p->sb.nb_blocks)
+        p->sb.scrub_cursor = 0;
+    scrub_save(p);
+    int deja = s->running;
+    if (deja)
+        pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&p->lock);
+    if (deja)
+        return 1;
+    s->stop = 0;
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->thread, NULL, scrub_worker, p) != 0) {
+        pthread_cond_destroy(&s->cond);
+        return -1;
+    }
+    s->running = 1;
+    return 0;
+}
+
+/*
+ * Arreter le thread et ecrire sa position (p->lock non tenu). Avec oublier,
+ * la verification n'est plus reprise au prochain montage.
+ */
+void scrub_stop(filesystem *p, int oublier) {
+    scrub_state *s = &p->scrub;
+    if (s->running) {
+        pthread_mutex_lock(&p->lock);
+        s->stop = 1;
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(s->thread, NULL);
+        pthread_cond_destroy(&s->cond);
+        s->running = 0;
+    }
+    pthread_mutex_lock(&p->lock);
+    if (oublier)
+        p->sb.scrub_active = 0;
+    if (p->sb.magic == FS_MAGIC)
+        scrub_save(p);
+    pthread_mutex_unlock(&p->lock);
+}
+
+//Progression et erreurs (p->lock tenu)
+void scrub_stats(filesystem *p) {
+    scrub_state *s = &p->scrub;
+    superblock *sb = &p->sb;
+    char budget[64] = "sans limite";
+    if (s->rate > 0 && s->iops > 0)
+        snprintf(budget, sizeof(budget), "%.1f Mio/s, %u lectures/s", s->rate, s->iops);
+    else if (s->rate > 0)
+        snprintf(budget, sizeof(budget), "%.1f Mio/s", s->rate);
+    else if (s->iops > 0)
+        snprintf(budget, sizeof(budget), "%u lectures/s", s->iops);
+    printf("Verification continue : %s, bloc %u/%u (%.1f %%), passe %u, %u erreurs dans la passe, "
+           "%u dans la precedente\n", s->running ? "active" : (sb->scrub_active ? "a reprendre" : "arretee"),
+           sb->scrub_cursor, sb->nb_blocks, sb->nb_blocks ? 100.0 * sb->scrub_cursor / sb->nb_blocks : 0,
+           sb->scrub_passes + 1, sb->scrub_errors, sb->scrub_last_errors);
+    if (s->running || s->lectures)
+        printf("  budget %s : %llu blocs verifies (%llu inodes), %llu lectures, %.1f Mio, %.2f s d'attente\n",
+               budget, (unsigned long long)s->blocs, (unsigned long long)s->inodes,
+               (unsigned long long)s->lectures, s->octets / (1024.0 * 1024), s->attente);
+    if (sb->scrub_last_end) {
+        time_t fin = sb->scrub_last_end;
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&fin));
+        printf("  derniere passe terminee le %s\n", date);
+    }
+    if (s->nb_erreurs == 0)
+        return;
+    printf("  erreurs depuis le montage : %u sommes de donnees, %u sommes d'inodes, %u invariants, "
+           "%u metadonnees, %u lectures\n", s->erreurs[SCRUB_ERR_DATA], s->erreurs[SCRUB_ERR_INODE],
+           s->erreurs[SCRUB_ERR_STRUCT], s->erreurs[SCRUB_ERR_META], s->erreurs[SCRUB_ERR_IO]);
+    uint32_t nb = s->nb_erreurs < SCRUB_LOG ? s->nb_erreurs : SCRUB_LOG;
+    for (uint32_t k = s->nb_erreurs - nb; k < s->nb_erreurs; k++) {
+        scrub_error *e = &s->dernieres[k % SCRUB_LOG];
+        if (e->ino)
+            printf("  bloc %u, inode %u : %s\n", e->no, e->ino, e->quoi);
+        else
+            printf("  bloc %u : %s\n", e->no, e->quoi);
+    }
+}
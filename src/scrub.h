@@ -0,0 +1,5 @@
+int scrub_start(filesystem *p, double rate, uint32_t iops);
+
+void scrub_stop(filesystem *p, int oublier);
+
+void scrub_stats(filesystem *p);
@@ -5,6 +5,8 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdint.h>
+#include <pthread.h>
 
 //La structure de donnée d'un fichier et du système de gestion de fichier (un tableau de fichier)
 typedef struct file_entry {
@@ -15,8 +17,469 @@ typedef struct file_entry {
     struct file_entry *next;
 } file_entry;
 
+/* --- Format sur disque de la partition ---
+ *
+ * Bloc 0           : superbloc
+ * Blocs suivants   : bitmap des inodes, bitmap des blocs, table des inodes
+ * Puis             : journal des metadonnees (absent si journal_blocks == 0)
+ * Reste            : blocs de donnees (contenus, entrees de repertoires)
+ */
+
+#define FS_MAGIC 0x48454243        // "HEBC"
+#define FS_VERSION 1
+#define FS_BLOCK_SIZE 4096
+#define FS_ROOT_INODE 1            // L'inode 0 n'est jamais utilise
+#define FS_INLINE_EXTENTS 8        // Extents stockes directement dans l'inode
+#define FS_NAME_MAX 57
+#define FS_ALLOC_REGION_BITS 4096  // Bits par region de l'allocateur (compteur de libres)
+#define FS_INODES_PER_BLOCK (FS_BLOCK_SIZE / sizeof(disk_inode))
+#define FS_DIRENTS_PER_BLOCK (FS_BLOCK_SIZE / sizeof(disk_dirent))
+#define FS_EXTENTS_PER_BLOCK (FS_BLOCK_SIZE / sizeof(disk_extent))
+#define FS_CSUMS_PER_BLOCK (FS_BLOCK_SIZE / 4 - 1) // La derniere case protege le bloc de la table
+#define FS_REFS_PER_BLOCK ((FS_BLOCK_SIZE - 4) / 2) // Compteurs de 16 bits, puis le CRC32C du bloc
+#define FS_REF_MAX 0xFFFF          // Compteur sature : le bloc n'est plus partage davantage
+#define FS_VERIFY_WINDOW 256       // Blocs lus puis verifies ensemble (tiennent dans le cache L2)
+
+#define FS_TYPE_FREE 0
+#define FS_TYPE_FILE 1
+#define FS_TYPE_DIR 2
+#define FS_TYPE_SYMLINK 3
+
+#define FS_STATE_CLEAN 0
+#define FS_STATE_MOUNTED 1         // Demonte proprement si remis a CLEAN
+
+#define FS_MOUNT_MMAP 1            // Image projetee en memoire (mmap)
+#define FS_MOUNT_RDONLY 2          // Lecture seule, le superbloc n'est pas modifie
+#define FS_MOUNT_SYNC_IO 4         // E/S bloquantes (pread/pwrite) au lieu d'io_uring
+#define FS_MOUNT_QUIET 8           // Pas de message au montage (bancs d'essai)
+#define FS_MOUNT_NO_CSUM 16        // Sommes de controle mises a jour mais pas verifiees
+#define FS_MOUNT_DEDUP 32          // Blocs des fichiers dedupliques a l'ecriture
+#define FS_MOUNT_CDC 64            // Fichiers stockes en morceaux definis par le contenu
+
+#define FS_FEATURE_CSUM 1          // CRC32C des blocs (table), des inodes et du superbloc
+#define FS_FEATURE_DEDUP 2         // Table des references des blocs partages
+#define FS_FEATURE_SCRUB 4         // Progression de la verification continue dans le superbloc
+#define FS_FEATURE_LAZY_INIT 8     // Tables pas encore toutes initialisees (voir lazy_done)
+
+#define LAZY_BITMAPS 0             // Tables initialisees a la demande (indices de lazy_done)
+#define LAZY_INODES 1
+#define LAZY_CSUMS 2
+#define LAZY_REFS 3
+#define LAZY_NB_TABLES 4
+
+#define FS_INODE_SYMLINK_DIR 1     // Lien symbolique vers un repertoire
+#define FS_INODE_DEAD_LINK 2       // Lien symbolique mort (is_symbol == 2)
+#define FS_INODE_COMPRESSED 4      // Contenu stocke compresse (voir write_inode_data)
+#define FS_INODE_COMPRESS 8        // Compression demandee (gardee si elle ne gagne rien)
+#define FS_INODE_CHUNKED 16        // Contenu stocke en morceaux (voir write_inode_chunks)
+
+typedef struct superblock {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t nb_blocks;
+    uint32_t nb_inodes;
+    uint32_t inode_bitmap_start;
+    uint32_t inode_bitmap_blocks;
+    uint32_t block_bitmap_start;
+    uint32_t block_bitmap_blocks;
+    uint32_t inode_table_start;
+    uint32_t inode_table_blocks;
+    uint32_t data_start;
+    uint32_t root_inode;
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+    uint32_t state;
+    uint32_t mount_count;
+    uint32_t journal_start;        // Bloc d'en-tete du journal
+    uint32_t journal_blocks;       // En-tete compris
+    //Champs a 0 sur les images formatees avant leur ajout
+    uint32_t features;             // FS_FEATURE_*
+    uint32_t csum_start;           // Table des CRC32C des blocs (0 : pas de somme connue)
+    uint32_t csum_blocks;
+    uint32_t checksum;             // CRC32C du superbloc, ce champ a 0
+    //Champs suivants comptes dans la somme seulement avec FS_FEATURE_DEDUP
+    uint32_t ref_start;            // Table des references en plus par bloc (0 : un seul proprietaire)
+    uint32_t ref_blocks;
+    //Champs suivants comptes dans la somme seulement avec FS_FEATURE_SCRUB
+    uint32_t scrub_cursor;         // Prochain bloc a verifier
+    uint32_t scrub_passes;         // Passes completes
+    uint32_t scrub_errors;         // Erreurs de la passe en cours
+    uint32_t scrub_last_errors;    // Erreurs de la derniere passe complete
+    uint32_t scrub_last_end;       // Fin de la derniere passe (secondes depuis 1970)
+    uint32_t scrub_active;         // Verification a reprendre au montage
+    uint32_t scrub_rate;           // Debit en Kio/s (0 : sans limite)
+    uint32_t scrub_iops;           // Lectures par seconde (0 : sans limite)
+    //Champs suivants comptes dans la somme seulement avec FS_FEATURE_LAZY_INIT
+    uint32_t lazy_done[LAZY_NB_TABLES]; // Blocs initialises au debut de chaque table, les suivants sont lus nuls
+} superblock;
+
+typedef struct disk_extent {
+    uint32_t start;                // Premier bloc physique
+    uint32_t len;                  // Nombre de blocs contigus
+} disk_extent;
+
+typedef struct disk_inode {        // 128 octets
+    uint16_t type;                 // FS_TYPE_*
+    uint16_t perms;                // 4 = lecture, 2 = ecriture, 1 = execution
+    uint32_t links;
+    uint64_t size;                 // Taille logique en octets
+    uint32_t parent;               // Inode du repertoire parent
+    uint32_t flags;                // FS_INODE_*
+    uint32_t nb_extents;
+    uint32_t extent_block;         // Bloc d'extents supplementaires (0 si aucun)
+    disk_extent extents[FS_INLINE_EXTENTS];
+    uint32_t checksum;             // CRC32C du numero et de l'inode (ce champ a 0)
+    uint32_t stored_size;          // Octets stockes si FS_INODE_COMPRESSED ou FS_INODE_CHUNKED
+    uint8_t reserved[24];
+} disk_inode;
+
+typedef struct disk_dirent {       // 64 octets
+    uint32_t inode;                // 0 = entree libre
+    uint8_t type;
+    uint8_t name_len;
+    char name[FS_NAME_MAX + 1];
+} disk_dirent;
+
+/* --- Journal des metadonnees ---
+ *
+ * Seules les mises a jour en place passent par le journal : inodes (en
+ * enregistrements compacts) et blocs de bitmaps. Contenus et repertoires sont
+ * toujours ecrits dans des blocs fraichement alloues, ecrits avant le commit.
+ */
+
+#define JOURNAL_MAGIC 0x4A524E4C   // "JRNL"
+#define JREC_INODE 1               // cle = inode, charge = disk_inode
+#define JREC_BLOCK 2               // cle = bloc, charge = FS_BLOCK_SIZE octets
+#define JREC_COMMIT 3              // charge = journal_commit
+
+#define DURABILITY_SYNC 0          // Un commit (et un fsync) par operation
+#define DURABILITY_GROUP 1         // Commit apres JOURNAL_GROUP_OPS ops ou JOURNAL_GROUP_US us
+#define DURABILITY_ASYNC 2         // Commit periodique (JOURNAL_ASYNC_US)
+
+#define JOURNAL_GROUP_OPS 32
+#define JOURNAL_GROUP_US 2000
+#define JOURNAL_ASYNC_US 1000000
+
+typedef struct journal_header {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t seq;                  // Sequence attendue pour la premiere transaction
+} journal_header;
+
+typedef struct journal_record {    // En-tete d'un enregistrement (16 octets)
+    uint32_t magic;
+    uint16_t type;                 // JREC_*
+    uint16_t reserved;
+    uint32_t key;
+    uint32_t len;                  // Taille de la charge qui suit
+} journal_record;
+
+typedef struct journal_commit {
+    uint64_t seq;
+    uint32_t nb_records;
+    uint32_t checksum;             // Sur tous les enregistrements de la transaction
+} journal_commit_rec;
+
+typedef struct journal_state {
+    int enabled;
+    int durability;                // DURABILITY_*
+    uint64_t seq;                  // Sequence de la prochaine transaction
+    uint64_t offset;               // Octets utilises dans la zone du journal
+    //Transaction en cours : derniere version de chaque inode modifie
+    uint32_t *inos;
+    disk_inode *inodes;
+    uint32_t nb, cap;
+    int32_t *hash;                 // ino -> indice dans inodes, -1 si vide
+    uint32_t hash_cap;
+    disk_extent *freed;            // Blocs liberes, reutilisables apres le commit
+    uint32_t nb_freed, cap_freed;
+    uint32_t ops;                  // Operations dans la transaction en cours
+    double first_op;               // Instant de la premiere operation non validee
+    //Validation en arriere-plan (modes group et async)
+    pthread_t thread;
+    pthread_cond_t cond;
+    int thread_started, stop;
+    //Statistiques
+    uint64_t commits, total_ops, total_records, fsyncs, checkpoints;
+    int replayed;                  // Transactions rejouees au montage
+    double replay_time;            // Duree du rejeu (secondes)
+} journal_state;
+
+/*
+ * E/S sur l'image (mode fichier, hors mmap). Deux implementations : appels
+ * bloquants pread/pwrite, ou io_uring qui garde de nombreuses requetes en vol
+ * et les soumet par lots. Les ecritures sont mises en file et envoyees
+ * ensemble avant une lecture, un fsync, ou quand la file est pleine.
+ */
+
+#define IO_BACKEND_SYNC 0
+#define IO_BACKEND_URING 1
+
+#define IO_RING_ENTRIES 256        // Requetes en vol au plus
+#define IO_QUEUE_MAX 1024          // Ecritures en attente au plus
+#define IO_QUEUE_BYTES (16 * 1024 * 1024)
+
+typedef struct io_request {
+    int write;                     // 1 = ecriture, 0 = lecture
+    void *buf;
+    size_t len;
+    uint64_t offset;
+    size_t done;                   // Octets deja transferes
+} io_request;
+
+typedef struct io_backend {
+    int type;                      // IO_BACKEND_*
+    //Anneaux io_uring projetes depuis le noyau
+    int ring_fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+    struct io_uring_sqe *sqes;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+    //Ecritures en attente (tampons copies)
+    io_request *queue;
+    uint32_t nb_queue, cap_queue;
+    size_t queued_bytes;
+    uint64_t queue_lo, queue_hi;   // Plage couverte par la file
+    //Statistiques
+    uint64_t batches, requests, bytes, enters, max_inflight;
+} io_backend;
+
+/*
+ * Cache des blocs de donnees et de repertoires (mode fichier), indexe par
+ * (inode, numero de bloc dans le fichier). Eviction CLOCK a deux aiguilles
+ * inspiree de CLOCK-Pro : une page entre froide, ne devient chaude que si
+ * elle est relue avant le passage de l'aiguille froide, et seules les pages
+ * froides sont evincees. Un parcours lu une seule fois ne chasse donc pas
+ * les pages chaudes.
+ */
+
+#define PCACHE_FREE 0
+#define PCACHE_COLD 1
+#define PCACHE_HOT 2
+
+#define PCACHE_DEFAULT_MB 32
+#define PCACHE_COLD_MIN 10         // Pourcentage minimal de pages froides
+
+typedef struct pcache_page {
+    uint32_t ino;
+    uint32_t lblk;                 // Numero du bloc dans le fichier
+    uint32_t phys;                 // Bloc de la partition qui le contient
+    uint32_t epoch;                // Epoque de l'inode lors du chargement
+    int32_t next;                  // Suivante dans la case de hachage (ou libre)
+    uint8_t state;                 // PCACHE_*
+    uint8_t ref;                   // Relue depuis le passage d'une aiguille
+    uint8_t dirty;                 // Plus recente que la partition
+} pcache_page;
+
+typedef struct page_cache {
+    uint32_t nb_pages;             // 0 : cache desactive
+    pcache_page *pages;
+    char *data;                    // nb_pages * FS_BLOCK_SIZE
+    int32_t *buckets;
+    uint32_t nb_buckets;           // Puissance de 2
+    int32_t free_head;             // Pages libres, chainees par next
+    uint32_t *epochs;              // Par inode : incrementee a chaque reecriture
+    uint32_t nb_epochs;
+    uint32_t cold_hand, hot_hand;
+    uint32_t nb_used, nb_hot, nb_dirty;
+    //Statistiques
+    uint64_t hits, misses, evictions;
+} page_cache;
+
+/*
+ * Coupures de courant simulees (bench crash). Les blocs ecrits depuis le
+ * dernier fsync sont dans le cache volatil du disque : leur ancien contenu
+ * est garde pour pouvoir les perdre. A la coupure, les ecritures suivantes
+ * sont ignorees ; crash_power_off garde ou annule ensuite chaque bloc en
+ * attente au hasard, comme un disque qui reordonne ses ecritures.
+ */
+
+typedef struct crash_sim {
+    uint64_t writes;               // Blocs ecrits depuis l'activation
+    uint64_t cut_at;               // Coupure au bloc numero cut_at (0 : a la fin)
+    int cut;                       // Courant coupe : plus aucune E/S
+    uint32_t *undo_blocks;         // Blocs ecrits depuis le dernier fsync
+    char *undo_data;               // Leur contenu precedent
+    uint32_t nb_undo, cap_undo;
+    uint64_t ops;                  // Operations commencees (tenu par l'appelant)
+    uint64_t durable_ops;          // Operations validees par un commit avant la coupure
+    uint64_t flushes;
+} crash_sim;
+
+/*
+ * Index de deduplication : CRC32C d'un bloc de donnees vers son numero, en
+ * adressage ouvert. Plusieurs blocs peuvent avoir la meme somme, chaque
+ * candidat est confirme par comparaison des octets.
+ */
+
+#define DEDUP_TOMB 0xFFFFFFFFu     // Case liberee (la recherche continue apres)
+
+typedef struct dedup_entry {
+    uint32_t crc;
+    uint32_t block;                // 0 : case vide, DEDUP_TOMB : case liberee
+} dedup_entry;
+
+typedef struct dedup_index {
+    dedup_entry *cases;            // NULL : deduplication inactive
+    uint32_t cap;                  // Puissance de 2
+    uint32_t nb, tombes;
+    int64_t shared;                // References en plus au total, -1 si pas encore compte
+    //Statistiques
+    uint64_t hits, compares, collisions, written;
+} dedup_index;
+
+/*
+ * Table des morceaux (stockage FS_MOUNT_CDC) : un morceau deja stocke
+ * d'un seul tenant est retrouve par sa somme et sa longueur. Deux tables
+ * d'adressage ouvert pointent sur les entrees : par somme, et par bloc
+ * (chaque bloc du morceau) pour oublier le morceau des qu'un de ses blocs
+ * est libere.
+ */
+
+#define CDC_MIN 2048               // Taille minimale d'un morceau
+#define CDC_AVG 8192               // Taille visee
+#define CDC_MAX 65536              // Taille maximale
+
+typedef struct chunk_entry {
+    uint32_t crc;                  // CRC32C du contenu
+    uint32_t len;                  // Octets (0 : entree libre)
+    uint32_t start;                // Premier bloc, les suivants sont contigus
+} chunk_entry;
+
+typedef struct chunk_map {
+    uint32_t *keys;
+    int32_t *vals;                 // Indice d'entree, -1 : case vide
+    uint32_t cap, nb;              // cap : puissance de 2
+} chunk_map;
+
+typedef struct chunk_table {
+    chunk_entry *entries;
+    uint32_t nb_entries, cap_entries;
+    uint32_t *libres;              // Entrees liberees, a reutiliser
+    uint32_t nb_libres;
+    chunk_map by_crc, by_block;
+    //Statistiques
+    uint64_t chunks, reused, bytes, bytes_reused, compares, collisions;
+} chunk_table;
+
+/*
+ * Verification continue (scrub.c) : un thread parcourt la partition dans
+ * l'ordre des blocs, une lecture de SCRUB_BATCH blocs au plus a la fois, en
+ * respectant un budget de debit et de lectures par seconde. Sa position est
+ * gardee dans le superbloc.
+ */
+
+#define SCRUB_BATCH 32             // Blocs lus ensemble au plus
+#define SCRUB_SKIP_MAX 65536       // Blocs sans lecture sautes d'un coup au plus
+#define SCRUB_SAVE_S 5             // Progression ecrite dans le superbloc au moins tous les 5 s
+#define SCRUB_PASS_PAUSE_S 60      // Pause entre deux passes
+#define SCRUB_LOG 8                // Dernieres erreurs gardees
+
+#define SCRUB_ERR_DATA 0           // Somme d'un bloc de donnees
+#define SCRUB_ERR_INODE 1          // Somme d'un inode
+#define SCRUB_ERR_STRUCT 2         // Invariant d'un inode (type, extents, parent...)
+#define SCRUB_ERR_META 3           // Superbloc, bitmaps, tables des sommes et des references
+#define SCRUB_ERR_IO 4             // Lecture en echec
+#define SCRUB_NB_ERR 5
+
+typedef struct scrub_error {
+    uint32_t no;                   // Bloc
+    uint32_t ino;                  // Inode concerne (0 : aucun)
+    const char *quoi;
+} scrub_error;
+
+typedef struct scrub_state {
+    pthread_t thread;
+    pthread_cond_t cond;           // Attentes du thread (avec p->lock)
+    int running, stop;
+    double rate;                   // Mio/s (0 : sans limite)
+    uint32_t iops;                 // (0 : sans limite)
+    //Fenetre du budget : remise a zero apres une attente ou un retard
+    double fen_debut;
+    uint64_t fen_octets, fen_lectures;
+    double sauvegarde;             // Derniere ecriture de la progression
+    //Statistiques depuis le montage
+    uint64_t octets, lectures, blocs, inodes;
+    double attente;                // Secondes passees a respecter le budget
+    uint32_t erreurs[SCRUB_NB_ERR];
+    scrub_error dernieres[SCRUB_LOG];
+    uint32_t nb_erreurs;           // Total (indice suivant dans dernieres modulo SCRUB_LOG)
+} scrub_state;
+
+#define LAZY_CHUNK 64              // Blocs mis a zero d'un coup (puis rendus durables)
+#define LAZY_WAIT_FACTOR 10        // Pause du thread : autant de fois la duree d'une mise a zero
+
+typedef struct lazyinit_state {
+    pthread_t thread;
+    pthread_cond_t cond;           // Attentes du thread (avec p->lock)
+    int running, stop;
+    uint64_t blocs;                // Blocs mis a zero par le thread depuis le montage
+    double duree;                  // Secondes passees a les ecrire
+} lazyinit_state;
+
 typedef struct filesystem {
     int fd;
     size_t size;
     file_entry *root_dir;
+    superblock sb;
+    uint8_t *inode_bitmap;         // Copies en memoire des bitmaps
+    uint8_t *block_bitmap;
+    int bitmaps_dirty;
+    uint8_t *bitmap_blocks_dirty;  // Par bloc des bitmaps (inodes puis blocs)
+    uint32_t next_free_block;      // Indice de depart de la recherche
+    uint32_t *inode_region_free;   // Bits libres par region de FS_ALLOC_REGION_BITS
+    uint32_t *block_region_free;   // (les regions pleines sont sautees)
+    uint32_t run_echec;            // Trou de cette longueur introuvable (0 : inconnu)
+    pthread_mutex_t lock;          // Pris par les appelants autour des E/S
+    int flags;                     // FS_MOUNT_*
+    char *map;                     // Projection de l'image (mode mmap), NULL sinon
+    size_t dirty_lo, dirty_hi;     // Plage modifiee a synchroniser par msync
+    journal_state journal;
+    io_backend io;
+    page_cache pcache;
+    crash_sim *crash;              // Simulation de coupure, NULL sinon
+    //Sommes de controle (FS_FEATURE_CSUM) : blocs de la table lus a la demande
+    uint32_t **csum_table;         // Par bloc de la table, NULL si pas encore lu
+    uint8_t *csum_dirty;           // Par bloc de la table
+    uint32_t csum_nb_dirty;
+    uint64_t csum_verified, csum_errors;
+    //Deduplication (FS_FEATURE_DEDUP) : compteurs de references lus a la demande
+    uint16_t **ref_table;          // Par bloc de la table, NULL si pas encore lu
+    uint8_t *ref_dirty;
+    uint32_t ref_nb_dirty;
+    dedup_index dedup;
+    chunk_table chunks;
+    scrub_state scrub;
+    lazyinit_state lazyinit;
 } filesystem;
+
+#define FSCK_MAX_THREADS 16        // Threads de parcours au plus
+
+/*
+ * Bilan d'une verification complete (fsck.c). Chaque compteur d'anomalie
+ * est remis en etat avec la reparation ; repares compte les ecritures.
+ */
+typedef struct fsck_report {
+    uint32_t repertoires, fichiers, liens_symboliques;
+    uint32_t liens_faux;           // Compteur de liens different des entrees qui pointent l'inode
+    uint32_t parents_faux;         // Parent de l'inode qui ne le reference pas
+    uint32_t orphelins;            // Inodes utilises qu'aucun repertoire ne reference
+    uint32_t inodes_vides;         // Marques occupes mais jamais ecrits
+    uint32_t inodes_libres;        // References mais marques libres dans la bitmap
+    uint32_t entrees_invalides;    // Entrees vers un inode libre, hors table ou repertoire deja lie
+    uint32_t liens_morts;          // Liens symboliques dont la cible n'existe pas
+    uint32_t liens_mal_marques;    // Dont l'etat enregistre (mort ou vivant) est perime
+    uint32_t blocs_doubles;        // Blocs reclames par plus de proprietaires que de references
+    uint32_t blocs_perdus;         // Occupes sans proprietaire
+    uint32_t blocs_libres;         // Utilises mais marques libres
+    uint32_t blocs_hors_zone;      // Extents hors de la zone de donnees
+    uint32_t refs_incoherentes;    // Compteurs de la table des references faux
+    uint32_t erreurs;              // Lectures en echec (sommes de controle)
+    uint32_t repares;
+    int threads;
+    double duree;
+} fsck_report;